@@ -0,0 +1,1140 @@
+// Benchmark for the allocators in this collection: tlsf_allocator.c, buddy_allocator.c,
+// bitmap_buddy_allocator.c, the small object allocator in slab_allocator.c, stack_allocator.c and
+// bistack_allocator.c, next to the C library's malloc. All of them get included into this one
+// file, with their global names renamed so they don't clash, and replay the same allocation traces:
+//
+// - producer/consumer: messages get freed in the order they were allocated, by a queue.
+// - game frame: long lived level data with some churn, and per frame temporaries freed in reverse.
+// - server request: a few requests in flight at once, each allocating a burst of blocks and a
+//   growing buffer, and freeing all of them when it finishes.
+// - random lifetimes: sizes and lifetimes all over the place, the worst case for fragmentation.
+// - trace files given on the command line, one event per line: "a <id> <size>" allocates block
+//   id, "r <id> <size>" reallocates it and "f <id>" frees it. Ids can be reused after a free.
+// - logs recorded with malloc_trace.c, also given on the command line. The calls of all threads
+//   get replayed in time order on one thread, alignments are ignored, and frees of blocks that
+//   were allocated before recording started are skipped.
+//
+// Each reports ns/op, the peak footprint (memory the allocator took from its arena or the
+// system), internal fragmentation (bytes lost to rounding up and headers) and external
+// fragmentation (bytes of the footprint not in any block), both measured when the most bytes are
+// live. Cache misses per op come from perf_event_open on Linux, and show up as n/a elsewhere or
+// when perf events aren't allowed.
+//
+// The fixed size allocators get an arena 4 times the peak live bytes of the trace, rounded up to
+// a power of 2 for buddy_allocator.c. Its arena heap maps 1 MB arenas as it needs them instead,
+// and keeps up to 4 MB of empty ones. stack_allocator.c can only free the last block, and frees
+// anything else when the blocks above it are gone, so on traces that don't free in reverse it
+// runs out of memory, which is also worth knowing. bistack_allocator.c puts the game frame's
+// temporaries on the right, and everything else on the left.
+//
+// Build with optimizations, and pass the number of events per synthetic trace and trace files:
+//   cc -O2 -fms-extensions allocator_benchmark.c -lpthread && ./a.out 1000000 app.trace
+// -fms-extensions is for the named anonymous structs in buddy_allocator.c. stack_allocator.c uses
+// int sizes, so arenas are limited to 1 GB.
+
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS in tlsf_allocator.c, has to come before any include.
+#include <stdlib.h> // malloc, calloc, free, atoi, aligned_alloc
+#include <string.h> // memset
+#include <stdint.h> // uint64_t
+#include <stdio.h> // printf, fopen
+#include <time.h> // timespec_get
+#include <threads.h> // Included by tlsf_allocator.c, has to come before the renaming.
+#include <stdatomic.h> // Same.
+#if defined(__GLIBC__)
+#include <malloc.h> // malloc_usable_size, mallinfo2, malloc_trim
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h> // perf_event_attr
+#include <sys/ioctl.h> // ioctl
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <unistd.h> // syscall, close
+#endif
+
+// tlsf_allocator.c
+
+#define heap tlsf_heap
+#define initialize tlsf_initialize
+#define grow tlsf_grow
+#define add tlsf_add
+#define remove tlsf_remove
+#define trim tlsf_trim
+#define allocate tlsf_allocate
+#define deallocate tlsf_deallocate
+#define reallocate tlsf_reallocate
+#define verify tlsf_verify
+#define equal tlsf_equal
+#define fill tlsf_fill
+#define check tlsf_check
+#define main tlsf_main
+#include "tlsf_allocator.c"
+#undef heap
+#undef initialize
+#undef grow
+#undef add
+#undef remove
+#undef trim
+#undef allocate
+#undef deallocate
+#undef reallocate
+#undef verify
+#undef equal
+#undef fill
+#undef check
+#undef main
+#undef NUM_SIZE_CLASSES
+#undef NUM_TEST_THREADS
+
+// buddy_allocator.c
+
+#define node buddy_node
+#define heap buddy_heap
+#define ceillog2 buddy_ceillog2
+#define initialize buddy_initialize
+#define allocate buddy_allocate
+#define deallocate buddy_deallocate
+#define reallocate buddy_reallocate
+#define main buddy_main
+#include "buddy_allocator.c"
+#undef node
+#undef heap
+#undef ceillog2
+#undef initialize
+#undef allocate
+#undef deallocate
+#undef reallocate
+#undef main
+
+// bitmap_buddy_allocator.c
+
+#define ceillog2 bitmap_ceillog2
+#define initialize bitmap_initialize
+#define allocate bitmap_allocate
+#define deallocate bitmap_deallocate
+#define block_size bitmap_block_size
+#define main bitmap_main
+#include "bitmap_buddy_allocator.c"
+#undef ceillog2
+#undef initialize
+#undef allocate
+#undef deallocate
+#undef block_size
+#undef main
+
+// stack_allocator.c
+
+#define allocator stack_allocator
+#define allocate stack_allocate
+#define deallocate stack_deallocate
+#define reallocate stack_reallocate
+#define mark stack_mark
+#define release stack_release
+#define main stack_main
+#include "stack_allocator.c"
+#undef allocator
+#undef allocate
+#undef deallocate
+#undef reallocate
+#undef mark
+#undef release
+#undef FRAME
+#undef main
+
+// bistack_allocator.c
+
+#define allocator bistack_allocator
+#define allocate_left bistack_allocate_left
+#define allocate_right bistack_allocate_right
+#define deallocate_left bistack_deallocate_left
+#define deallocate_right bistack_deallocate_right
+#define reallocate_left bistack_reallocate_left
+#define reallocate_right bistack_reallocate_right
+#define main bistack_main
+#include "bistack_allocator.c"
+#undef allocator
+#undef allocate_left
+#undef allocate_right
+#undef deallocate_left
+#undef deallocate_right
+#undef reallocate_left
+#undef reallocate_right
+#undef main
+
+// slab_allocator.c
+
+#define allocator slab_allocator
+#define slab slab_slab
+#define allocate slab_allocate
+#define deallocate slab_deallocate
+#define reallocate slab_reallocate
+#define reset slab_reset
+#define trim slab_trim
+#define destroy slab_destroy
+#define mark slab_mark
+#define release slab_release
+#define main slab_main
+#include "slab_allocator.c"
+#undef allocator
+#undef slab
+#undef allocate
+#undef deallocate
+#undef reallocate
+#undef reset
+#undef trim
+#undef destroy
+#undef mark
+#undef release
+#undef FRAME
+#undef main
+
+// malloc_trace.c, just the log reader, without the malloc hooks.
+
+#define MALLOC_TRACE_READER_ONLY
+#include "malloc_trace.c"
+
+// Allocators
+
+// hint is 1 for blocks the trace knows are short lived, and the size is what was asked for when
+// the block was allocated or last reallocated, for the allocators that don't keep it themselves.
+struct candidate {
+	const char *name;
+	void *(*create)(size_t capacity); // Arena size for the fixed size allocators.
+	void *(*allocate)(void *state, size_t size, int hint);
+	void (*deallocate)(void *state, void *block, size_t size, int hint);
+	void *(*reallocate)(void *state, void *block, size_t old_size, size_t new_size, int hint);
+	size_t (*block_size)(void *state, void *block, size_t size); // Usable bytes of the block.
+	size_t (*footprint)(void *state); // Bytes currently taken from the arena or the system.
+	void (*destroy)(void *state);
+};
+
+// Fixed size allocators take everything below the highest block end ever handed out.
+struct arena {
+	char *memory;
+	size_t capacity;
+	size_t high_water;
+};
+void *track_high_water(struct arena *arena, void *block, size_t size) {
+	if (block) {
+		size_t end = (size_t)((char *)block - arena->memory) + size;
+		if (end > arena->high_water)
+			arena->high_water = end;
+	}
+	return block;
+}
+
+// mallinfo2 counts the whole process, so the footprint is how much more malloc holds than when
+// the run started. Earlier runs leave free memory behind, which malloc can reuse without getting
+// more, so it's at least the bytes in use since the start, chunk headers included.
+struct malloc_usage {
+	size_t held;
+	size_t in_use;
+};
+struct malloc_usage malloc_usage(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	return (struct malloc_usage){ info.arena + info.hblkhd, info.uordblks + info.hblkhd };
+#else
+	return (struct malloc_usage){ 0, 0 };
+#endif
+}
+void *malloc_create(size_t capacity) {
+	struct malloc_usage *baseline = malloc(sizeof(struct malloc_usage));
+#if defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+	*baseline = malloc_usage();
+	return baseline;
+}
+void *malloc_allocate(void *state, size_t size, int hint) {
+	return malloc(size);
+}
+void malloc_deallocate(void *state, void *block, size_t size, int hint) {
+	free(block);
+}
+void *malloc_reallocate(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	return realloc(block, new_size);
+}
+size_t malloc_block_size(void *state, void *block, size_t size) {
+#if defined(__GLIBC__)
+	return malloc_usable_size(block);
+#else
+	return size;
+#endif
+}
+size_t malloc_footprint(void *state) {
+	struct malloc_usage usage = malloc_usage(), *baseline = state;
+	size_t held = usage.held > baseline->held ? usage.held - baseline->held : 0;
+	size_t in_use = usage.in_use > baseline->in_use ? usage.in_use - baseline->in_use : 0;
+	return held > in_use ? held : in_use;
+}
+void malloc_destroy(void *state) {
+	free(state);
+}
+
+struct tlsf_state {
+	struct arena arena;
+	struct tlsf_heap heap;
+};
+void *tlsf_create(size_t capacity) {
+	struct tlsf_state *state = malloc(sizeof(struct tlsf_state));
+	state->arena = (struct arena){ aligned_alloc(ALIGNMENT, capacity), capacity, 0 };
+	tlsf_initialize(&state->heap);
+	tlsf_grow(&state->heap, state->arena.memory, capacity);
+	return state;
+}
+void *tlsf_allocate_block(void *state, size_t size, int hint) {
+	struct tlsf_state *tlsf = state;
+	return track_high_water(&tlsf->arena, tlsf_allocate(&tlsf->heap, size), size);
+}
+void tlsf_deallocate_block(void *state, void *block, size_t size, int hint) {
+	tlsf_deallocate(&((struct tlsf_state *)state)->heap, block);
+}
+void *tlsf_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	struct tlsf_state *tlsf = state;
+	return track_high_water(&tlsf->arena, tlsf_reallocate(&tlsf->heap, block, new_size), new_size);
+}
+size_t tlsf_block_size(void *state, void *block, size_t size) {
+	return (block2node(block)->size & SIZE_MASK) - ALIGNMENT;
+}
+size_t tlsf_footprint(void *state) {
+	return ((struct tlsf_state *)state)->arena.high_water;
+}
+void tlsf_destroy(void *state) {
+	free(((struct tlsf_state *)state)->arena.memory);
+	free(state);
+}
+
+struct buddy_state {
+	struct arena arena;
+	struct buddy_heap heap;
+};
+void *buddy_create(size_t capacity) {
+	struct buddy_state *state = malloc(sizeof(struct buddy_state));
+	size_t pow2 = 1;
+	while (pow2 < capacity)
+		pow2 *= 2;
+	state->arena = (struct arena){ aligned_alloc(16, pow2), pow2, 0 };
+	buddy_initialize(&state->heap, state->arena.memory, pow2);
+	return state;
+}
+void *buddy_allocate_block(void *state, size_t size, int hint) {
+	struct buddy_state *buddy = state;
+	return track_high_water(&buddy->arena, buddy_allocate(&buddy->heap, size), size);
+}
+void buddy_deallocate_block(void *state, void *block, size_t size, int hint) {
+	buddy_deallocate(&((struct buddy_state *)state)->heap, block);
+}
+void *buddy_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	struct buddy_state *buddy = state;
+	return track_high_water(&buddy->arena, buddy_reallocate(&buddy->heap, block, new_size), new_size);
+}
+size_t buddy_block_size(void *state, void *block, size_t size) {
+	union buddy_node *node = (union buddy_node *)((char *)block - sizeof(union buddy_node));
+	return (size_t)node->size - sizeof(union buddy_node);
+}
+size_t buddy_footprint(void *state) {
+	return ((struct buddy_state *)state)->arena.high_water;
+}
+void buddy_destroy(void *state) {
+	free(((struct buddy_state *)state)->arena.memory);
+	free(state);
+}
+
+void *buddy_arenas_create(size_t capacity) {
+	struct arena_heap *arenas = malloc(sizeof(struct arena_heap));
+	initialize_arena_heap(arenas, 1 << 20, 4 << 20);
+	return arenas;
+}
+void *buddy_arenas_allocate_block(void *state, size_t size, int hint) {
+	return arena_allocate(state, size);
+}
+void buddy_arenas_deallocate_block(void *state, void *block, size_t size, int hint) {
+	arena_deallocate(state, block);
+}
+void *buddy_arenas_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	return arena_reallocate(state, block, new_size);
+}
+size_t buddy_arenas_block_size(void *state, void *block, size_t size) {
+	return arena_block_size(state, block);
+}
+size_t buddy_arenas_footprint(void *state) {
+	return ((struct arena_heap *)state)->mapped_bytes;
+}
+void buddy_arenas_destroy(void *state) {
+	destroy_arena_heap(state);
+	free(state);
+}
+
+// Blocks have no header, so it hands out offsets into the arena with the metadata next to it.
+struct bitmap_state {
+	struct arena arena;
+	struct bitmap_buddy buddy;
+	void *metadata;
+};
+void *bitmap_create(size_t capacity) {
+	struct bitmap_state *state = malloc(sizeof(struct bitmap_state));
+	state->arena = (struct arena){ aligned_alloc(ALIGNMENT, capacity), capacity, 0 };
+	state->metadata = malloc(metadata_size(capacity, 4));
+	bitmap_initialize(&state->buddy, state->metadata, capacity, 4);
+	return state;
+}
+void *offset_block(struct bitmap_state *bitmap, uint64_t offset, size_t size) {
+	if (offset == INVALID_OFFSET)
+		return 0;
+	return track_high_water(&bitmap->arena, bitmap->arena.memory + offset, size);
+}
+void *bitmap_allocate_block(void *state, size_t size, int hint) {
+	struct bitmap_state *bitmap = state;
+	return offset_block(bitmap, bitmap_allocate(&bitmap->buddy, size), size);
+}
+void bitmap_deallocate_block(void *state, void *block, size_t size, int hint) {
+	struct bitmap_state *bitmap = state;
+	bitmap_deallocate(&bitmap->buddy, (uint64_t)((char *)block - bitmap->arena.memory));
+}
+void *bitmap_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	struct bitmap_state *bitmap = state;
+	uint64_t offset = (uint64_t)((char *)block - bitmap->arena.memory);
+	if (new_size <= bitmap_block_size(&bitmap->buddy, offset))
+		return block;
+	void *result = bitmap_allocate_block(state, new_size, hint);
+	if (result) {
+		memcpy(result, block, old_size < new_size ? old_size : new_size);
+		bitmap_deallocate(&bitmap->buddy, offset);
+	}
+	return result;
+}
+size_t bitmap_block_size_of(void *state, void *block, size_t size) {
+	struct bitmap_state *bitmap = state;
+	return (size_t)bitmap_block_size(&bitmap->buddy, (uint64_t)((char *)block - bitmap->arena.memory));
+}
+size_t bitmap_footprint(void *state) {
+	return ((struct bitmap_state *)state)->arena.high_water;
+}
+void bitmap_destroy(void *state) {
+	free(((struct bitmap_state *)state)->arena.memory);
+	free(((struct bitmap_state *)state)->metadata);
+	free(state);
+}
+
+// Large blocks get slabs of their own, rounded up to pages, which the allocator only counts.
+struct slab_state {
+	struct small_allocator allocator;
+	size_t large_bytes;
+	int num_large;
+};
+size_t large_slab_bytes(size_t size) {
+	return (SMALL_HEADER_SIZE + size + LARGE_GRANULE - 1) & ~(size_t)(LARGE_GRANULE - 1);
+}
+void *slab_create(size_t capacity) {
+	struct slab_state *state = calloc(1, sizeof(struct slab_state));
+	initialize_small(&state->allocator);
+	return state;
+}
+void *slab_allocate_block(void *state, size_t size, int hint) {
+	struct slab_state *slab = state;
+	void *block = small_allocate(&slab->allocator, (int)size);
+	if (block && size > MAX_SMALL_SIZE) {
+		slab->large_bytes += large_slab_bytes(size);
+		slab->num_large++;
+	}
+	return block;
+}
+void slab_deallocate_block(void *state, void *block, size_t size, int hint) {
+	struct slab_state *slab = state;
+	if (slab_of(block)->size_class == LARGE_CLASS) {
+		slab->large_bytes -= large_slab_bytes((size_t)small_block_size(block));
+		slab->num_large--;
+	}
+	small_deallocate(&slab->allocator, block);
+}
+void *slab_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	struct slab_state *slab = state;
+	int was_large = slab_of(block)->size_class == LARGE_CLASS;
+	size_t old_bytes = was_large ? large_slab_bytes((size_t)small_block_size(block)) : 0;
+	void *result = small_reallocate(&slab->allocator, block, (int)new_size);
+	if (result && result != block) {
+		if (was_large) {
+			slab->large_bytes -= old_bytes;
+			slab->num_large--;
+		}
+		if (new_size > MAX_SMALL_SIZE) {
+			slab->large_bytes += large_slab_bytes(new_size);
+			slab->num_large++;
+		}
+	}
+	return result;
+}
+size_t slab_block_size(void *state, void *block, size_t size) {
+	return (size_t)small_block_size(block);
+}
+size_t slab_footprint(void *state) {
+	struct slab_state *slab = state;
+	return (size_t)(slab->allocator.num_slabs - slab->num_large) * SLAB_SIZE + slab->large_bytes;
+}
+void slab_destroy_state(void *state) {
+	small_destroy(&((struct slab_state *)state)->allocator);
+	free(state);
+}
+
+struct stack_state {
+	struct stack_allocator allocator;
+};
+void *stack_create(size_t capacity) {
+	struct stack_state *state = calloc(1, sizeof(struct stack_state));
+	state->allocator.buffer = aligned_alloc(16, capacity);
+	state->allocator.capacity = (int)capacity;
+	return state;
+}
+void *stack_allocate_block(void *state, size_t size, int hint) {
+	return stack_allocate(&((struct stack_state *)state)->allocator, (int)size, 16);
+}
+void stack_deallocate_block(void *state, void *block, size_t size, int hint) {
+	stack_deallocate(&((struct stack_state *)state)->allocator, block, (int)size);
+}
+void *stack_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	struct stack_allocator *allocator = &((struct stack_state *)state)->allocator;
+	void *result = stack_reallocate(allocator, block, (int)old_size, (int)new_size, 16);
+	if (result && result != block)
+		stack_deallocate(allocator, block, (int)old_size);
+	return result;
+}
+size_t stack_block_size(void *state, void *block, size_t size) {
+	return size;
+}
+size_t stack_footprint(void *state) {
+	return (size_t)((struct stack_state *)state)->allocator.high_water;
+}
+void stack_destroy(void *state) {
+	free(((struct stack_state *)state)->allocator.buffer);
+	free(state);
+}
+
+void *bistack_create(size_t capacity) {
+	struct bistack_allocator *allocator = calloc(1, sizeof(struct bistack_allocator));
+	allocator->buffer = aligned_alloc(16, capacity);
+	allocator->capacity = (int)capacity;
+	return allocator;
+}
+void *bistack_allocate_block(void *state, size_t size, int hint) {
+	if (hint)
+		return bistack_allocate_right(state, (int)size, 16);
+	return bistack_allocate_left(state, (int)size, 16);
+}
+void bistack_deallocate_block(void *state, void *block, size_t size, int hint) {
+	if (hint)
+		bistack_deallocate_right(state, block, (int)size);
+	else
+		bistack_deallocate_left(state, block, (int)size);
+}
+void *bistack_reallocate_block(void *state, void *block, size_t old_size, size_t new_size, int hint) {
+	void *result = hint ? bistack_reallocate_right(state, block, (int)old_size, (int)new_size, 16)
+		: bistack_reallocate_left(state, block, (int)old_size, (int)new_size, 16);
+	if (result && result != block)
+		bistack_deallocate_block(state, block, old_size, hint);
+	return result;
+}
+size_t bistack_block_size(void *state, void *block, size_t size) {
+	return size;
+}
+size_t bistack_footprint(void *state) {
+	struct bistack_allocator *allocator = state;
+	return (size_t)allocator->lcursor + (size_t)allocator->rcursor;
+}
+void bistack_destroy(void *state) {
+	free(((struct bistack_allocator *)state)->buffer);
+	free(state);
+}
+
+#define CANDIDATE(name) { #name, name##_create, name##_allocate_block, name##_deallocate_block, name##_reallocate_block, name##_block_size, name##_footprint, name##_destroy }
+struct candidate candidates[] = {
+	{ "malloc", malloc_create, malloc_allocate, malloc_deallocate, malloc_reallocate, malloc_block_size, malloc_footprint, malloc_destroy },
+	CANDIDATE(tlsf),
+	CANDIDATE(buddy),
+	CANDIDATE(buddy_arenas),
+	{ "bitmap_buddy", bitmap_create, bitmap_allocate_block, bitmap_deallocate_block, bitmap_reallocate_block, bitmap_block_size_of, bitmap_footprint, bitmap_destroy },
+	{ "slab", slab_create, slab_allocate_block, slab_deallocate_block, slab_reallocate_block, slab_block_size, slab_footprint, slab_destroy_state },
+	CANDIDATE(stack),
+	CANDIDATE(bistack),
+};
+#define NUM_CANDIDATES (int)(sizeof candidates / sizeof candidates[0])
+
+// Traces
+
+enum { ALLOCATE, DEALLOCATE, REALLOCATE };
+
+struct event {
+	int id; // Index of the block, ids are reused after the block is freed.
+	int size; // Unused for DEALLOCATE.
+	char op;
+	char hint;
+};
+
+struct trace {
+	char name[64];
+	struct event *events;
+	int num_events;
+	int capacity;
+	int num_ids;
+	size_t peak_bytes; // Most bytes live at once.
+};
+
+void add_event(struct trace *trace, int op, int id, int size, int hint) {
+	if (trace->num_events == trace->capacity) {
+		trace->capacity = trace->capacity ? 2 * trace->capacity : 1024;
+		trace->events = realloc(trace->events, (size_t)trace->capacity * sizeof(struct event));
+	}
+	trace->events[trace->num_events++] = (struct event){ id, size, (char)op, (char)hint };
+	if (id >= trace->num_ids)
+		trace->num_ids = id + 1;
+}
+
+// Also checks that the trace only frees and reallocates live blocks.
+int finish_trace(struct trace *trace) {
+	int *sizes = malloc((size_t)trace->num_ids * sizeof(int));
+	for (int i = 0; i < trace->num_ids; ++i)
+		sizes[i] = -1;
+	size_t live = 0;
+	int ok = 1;
+	for (int i = 0; i < trace->num_events && ok; ++i) {
+		struct event *event = &trace->events[i];
+		int *size = &sizes[event->id];
+		ok = (event->op == ALLOCATE) == (*size < 0);
+		if (!ok)
+			break;
+		live -= event->op == ALLOCATE ? 0 : (size_t)*size;
+		*size = event->op == DEALLOCATE ? -1 : event->size;
+		live += event->op == DEALLOCATE ? 0 : (size_t)*size;
+		if (live > trace->peak_bytes)
+			trace->peak_bytes = live;
+	}
+	free(sizes);
+	return ok;
+}
+
+unsigned long long random_next(unsigned long long *seed) {
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 0x2545F4914F6CDD1Du;
+}
+
+// Sizes between min and max, with as many in each power of 2 range, so small sizes are common.
+int random_size(unsigned long long *seed, int min_log2, int max_log2) {
+	int log2 = min_log2 + (int)(random_next(seed) % (unsigned)(max_log2 - min_log2));
+	return (1 << log2) + (int)(random_next(seed) % (1u << log2));
+}
+
+// Ids of freed blocks get reused, so the trace needs as many ids as blocks live at once.
+struct id_pool {
+	int *free_ids;
+	int num_free;
+	int next_id;
+};
+int take_id(struct id_pool *pool) {
+	return pool->num_free ? pool->free_ids[--pool->num_free] : pool->next_id++;
+}
+void give_id(struct id_pool *pool, int id) {
+	pool->free_ids[pool->num_free++] = id;
+}
+
+void producer_consumer_trace(struct trace *trace, int num_events, unsigned long long seed) {
+	snprintf(trace->name, sizeof trace->name, "producer/consumer");
+	int depth = 4096;
+	int *queue = malloc((size_t)depth * sizeof(int));
+	for (int i = 0; trace->num_events < num_events; ++i) {
+		if (i >= depth)
+			add_event(trace, DEALLOCATE, queue[i % depth], 0, 0);
+		queue[i % depth] = i % (2 * depth);
+		add_event(trace, ALLOCATE, i % (2 * depth), random_size(&seed, 4, 12), 0);
+	}
+	free(queue);
+}
+
+void game_frame_trace(struct trace *trace, int num_events, unsigned long long seed) {
+	snprintf(trace->name, sizeof trace->name, "game frame");
+	int num_persistent = 2000;
+	int *temporaries = malloc(1024 * sizeof(int));
+	struct id_pool ids = { malloc(1024 * sizeof(int)) };
+	for (int i = 0; i < num_persistent; ++i)
+		add_event(trace, ALLOCATE, ids.next_id++, random_size(&seed, 6, 16), 0);
+	while (trace->num_events < num_events) {
+		// Some level data gets swapped out, a block somewhere in the middle.
+		for (int i = 0; i < 4; ++i) {
+			int id = (int)(random_next(&seed) % (unsigned)num_persistent);
+			add_event(trace, DEALLOCATE, id, 0, 0);
+			add_event(trace, ALLOCATE, id, random_size(&seed, 6, 16), 0);
+		}
+		int num_temporaries = 256 + (int)(random_next(&seed) % 768);
+		for (int i = 0; i < num_temporaries; ++i) {
+			int id = num_persistent + take_id(&ids);
+			int size = random_size(&seed, 4, 12);
+			add_event(trace, ALLOCATE, id, size, 1);
+			// Arrays that get appended to grow while they're on top.
+			while (random_next(&seed) % 8 == 0 && size < (1 << 16)) {
+				size *= 2;
+				add_event(trace, REALLOCATE, id, size, 1);
+			}
+			temporaries[i] = id;
+		}
+		for (int i = num_temporaries - 1; i >= 0; --i) {
+			add_event(trace, DEALLOCATE, temporaries[i], 0, 1);
+			give_id(&ids, temporaries[i] - num_persistent);
+		}
+	}
+	free(temporaries);
+	free(ids.free_ids);
+}
+
+#define MAX_REQUEST_BLOCKS 32
+struct request {
+	int ids[MAX_REQUEST_BLOCKS];
+	int num_blocks;
+	int remaining; // Allocations left to do, then the request frees everything.
+	int buffer; // Index in ids of the body buffer, which grows.
+	int buffer_size;
+};
+void start_request(struct request *request, unsigned long long *seed) {
+	request->num_blocks = 0;
+	request->remaining = 4 + (int)(random_next(seed) % (MAX_REQUEST_BLOCKS - 4));
+	request->buffer = -1;
+}
+void server_request_trace(struct trace *trace, int num_events, unsigned long long seed) {
+	snprintf(trace->name, sizeof trace->name, "server request");
+	enum { NUM_IN_FLIGHT = 16 };
+	struct request requests[NUM_IN_FLIGHT];
+	struct id_pool ids = { malloc(NUM_IN_FLIGHT * MAX_REQUEST_BLOCKS * sizeof(int)) };
+	for (int i = 0; i < NUM_IN_FLIGHT; ++i)
+		start_request(&requests[i], &seed);
+	while (trace->num_events < num_events) {
+		struct request *request = &requests[random_next(&seed) % NUM_IN_FLIGHT];
+		if (request->remaining) {
+			request->remaining--;
+			if (request->buffer >= 0 && random_next(&seed) % 2 && request->buffer_size < (1 << 16)) {
+				request->buffer_size *= 2;
+				add_event(trace, REALLOCATE, request->ids[request->buffer], request->buffer_size, 0);
+				continue;
+			}
+			int id = take_id(&ids);
+			int size = random_size(&seed, 5, 14);
+			if (request->buffer < 0) {
+				request->buffer = request->num_blocks;
+				request->buffer_size = size;
+			}
+			request->ids[request->num_blocks++] = id;
+			add_event(trace, ALLOCATE, id, size, 0);
+			continue;
+		}
+		for (int i = 0; i < request->num_blocks; ++i) {
+			add_event(trace, DEALLOCATE, request->ids[i], 0, 0);
+			give_id(&ids, request->ids[i]);
+		}
+		start_request(request, &seed);
+	}
+	free(ids.free_ids);
+}
+
+void random_lifetimes_trace(struct trace *trace, int num_events, unsigned long long seed) {
+	snprintf(trace->name, sizeof trace->name, "random lifetimes");
+	int target = 50000;
+	int *live = malloc((size_t)target * 2 * sizeof(int));
+	int *sizes = malloc((size_t)target * 2 * sizeof(int));
+	int num_live = 0;
+	struct id_pool ids = { malloc((size_t)target * 2 * sizeof(int)) };
+	while (trace->num_events < num_events) {
+		unsigned long long r = random_next(&seed) % 100;
+		if (num_live && r < 5) {
+			int i = (int)(random_next(&seed) % (unsigned)num_live);
+			sizes[i] = random_size(&seed, 3, 13);
+			add_event(trace, REALLOCATE, live[i], sizes[i], 0);
+		} else if (num_live < target / 2 || (num_live < 2 * target && r < 55)) {
+			int size = random_next(&seed) % 1000 ? random_size(&seed, 3, 13) : random_size(&seed, 16, 20);
+			live[num_live] = take_id(&ids);
+			sizes[num_live] = size;
+			add_event(trace, ALLOCATE, live[num_live++], size, 0);
+		} else {
+			int i = (int)(random_next(&seed) % (unsigned)num_live);
+			add_event(trace, DEALLOCATE, live[i], 0, 0);
+			give_id(&ids, live[i]);
+			live[i] = live[--num_live];
+			sizes[i] = sizes[num_live];
+		}
+	}
+	free(live);
+	free(sizes);
+	free(ids.free_ids);
+}
+
+// Addresses of the live blocks in a malloc_trace.c log, to the ids of their blocks in the trace.
+// Open addressing with linear probing, and removal moves the following entries back.
+struct address_map {
+	uintptr_t *addresses; // 0 for empty slots.
+	int *ids;
+	size_t mask;
+};
+size_t address_slot(const struct address_map *map, uintptr_t address) {
+	size_t i = (size_t)((address >> 4) * 0x9E3779B97F4A7C15u) & map->mask;
+	while (map->addresses[i] && map->addresses[i] != address)
+		i = (i + 1) & map->mask;
+	return i;
+}
+int find_address(const struct address_map *map, uintptr_t address) {
+	size_t i = address_slot(map, address);
+	return map->addresses[i] ? map->ids[i] : -1;
+}
+void insert_address(struct address_map *map, uintptr_t address, int id) {
+	size_t i = address_slot(map, address);
+	map->addresses[i] = address;
+	map->ids[i] = id;
+}
+void remove_address(struct address_map *map, uintptr_t address) {
+	size_t i = address_slot(map, address);
+	map->addresses[i] = 0;
+	for (size_t j = (i + 1) & map->mask; map->addresses[j]; j = (j + 1) & map->mask) {
+		size_t home = (size_t)((map->addresses[j] >> 4) * 0x9E3779B97F4A7C15u) & map->mask;
+		if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+			map->addresses[i] = map->addresses[j];
+			map->ids[i] = map->ids[j];
+			map->addresses[j] = 0;
+			i = j;
+		}
+	}
+}
+
+struct log_records {
+	struct trace_record *records;
+	size_t count;
+	size_t capacity;
+};
+void collect_record(void *context, const struct trace_record *record) {
+	struct log_records *log = context;
+	if (log->count == log->capacity) {
+		log->capacity = log->capacity ? 2 * log->capacity : 1024;
+		log->records = realloc(log->records, log->capacity * sizeof(struct trace_record));
+	}
+	log->records[log->count++] = *record;
+}
+// Threads' records are in order, so ties keep the order they were in the log.
+int compare_records(const void *a, const void *b) {
+	const struct trace_record *x = a, *y = b;
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+// Frees the block at the address, if the trace knows about it.
+void free_logged_block(struct trace *trace, struct address_map *map, struct id_pool *ids, uintptr_t address) {
+	int id = find_address(map, address);
+	if (id < 0)
+		return;
+	add_event(trace, DEALLOCATE, id, 0, 0);
+	remove_address(map, address);
+	give_id(ids, id);
+}
+void allocate_logged_block(struct trace *trace, struct address_map *map, struct id_pool *ids, uintptr_t address, uint64_t size) {
+	if (!address || size > INT32_MAX)
+		return;
+	free_logged_block(trace, map, ids, address); // Its free wasn't recorded.
+	int id = take_id(ids);
+	insert_address(map, address, id);
+	add_event(trace, ALLOCATE, id, (int)size, 0);
+}
+
+int read_log_trace(struct trace *trace, FILE *file) {
+	fseek(file, 0, SEEK_END);
+	size_t size = (size_t)ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *log = malloc(size);
+	struct log_records records = { 0 };
+	int ok = fread(log, 1, size, file) == size && read_trace_log(log, size, collect_record, &records);
+	free(log);
+	qsort(records.records, records.count, sizeof(struct trace_record), compare_records);
+
+	struct address_map map = { 0 };
+	size_t capacity = 16;
+	while (capacity < 2 * records.count)
+		capacity *= 2;
+	map.addresses = calloc(capacity, sizeof(uintptr_t));
+	map.ids = malloc(capacity * sizeof(int));
+	map.mask = capacity - 1;
+	struct id_pool ids = { malloc((records.count + 1) * sizeof(int)) };
+	for (size_t i = 0; i < records.count && ok; ++i) {
+		const struct trace_record *record = &records.records[i];
+		switch (record->op) {
+		case TRACE_MALLOC:
+		case TRACE_ALIGNED:
+			allocate_logged_block(trace, &map, &ids, record->address, record->size);
+			break;
+		case TRACE_FREE:
+			free_logged_block(trace, &map, &ids, record->address);
+			break;
+		case TRACE_REALLOC: {
+			int id = find_address(&map, record->old_address);
+			if (!record->address || id < 0 || record->size > INT32_MAX) {
+				// Freed by realloc to 0 bytes, a block from before the log, or too big to play.
+				free_logged_block(trace, &map, &ids, record->old_address);
+				allocate_logged_block(trace, &map, &ids, record->address, record->size);
+				break;
+			}
+			remove_address(&map, record->old_address);
+			free_logged_block(trace, &map, &ids, record->address);
+			insert_address(&map, record->address, id);
+			add_event(trace, REALLOCATE, id, (int)record->size, 0);
+			break;
+		}
+		}
+	}
+	free(records.records);
+	free(map.addresses);
+	free(map.ids);
+	free(ids.free_ids);
+	return ok;
+}
+
+int read_trace(struct trace *trace, const char *path) {
+	snprintf(trace->name, sizeof trace->name, "%s", path);
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+	uint32_t magic = 0;
+	if (fread(&magic, sizeof magic, 1, file) == 1 && magic == TRACE_MAGIC) {
+		int ok = read_log_trace(trace, file);
+		fclose(file);
+		return ok;
+	}
+	rewind(file);
+
+	char op;
+	int id, size = 0;
+	int ok = 1;
+	while (ok && fscanf(file, " %c %d", &op, &id) == 2) {
+		ok = id >= 0 && (op == 'f' || (fscanf(file, "%d", &size) == 1 && size >= 0));
+		if (ok)
+			add_event(trace, op == 'a' ? ALLOCATE : op == 'r' ? REALLOCATE : DEALLOCATE, id, size, 0);
+		ok = ok && (op == 'a' || op == 'r' || op == 'f');
+	}
+	ok = ok && feof(file);
+	fclose(file);
+	return ok;
+}
+
+void free_trace(struct trace *trace) {
+	free(trace->events);
+	memset(trace, 0, sizeof(struct trace));
+}
+
+// Benchmark
+
+double seconds(void) {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// A perf event counting cache misses in this thread, or -1 if there's no perf.
+int open_cache_misses(void) {
+#if defined(__linux__)
+	struct perf_event_attr attr = { 0 };
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof attr;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+void start_counting(int counter) {
+#if defined(__linux__)
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+long long stop_counting(int counter) {
+	long long count = -1;
+#if defined(__linux__)
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &count, sizeof count) != sizeof count)
+			count = -1;
+	}
+#endif
+	return count;
+}
+
+struct result {
+	int failed_at; // Event where the allocator ran out of memory, or -1.
+	double ns_per_op;
+	double misses_per_op; // Negative without perf.
+	size_t peak_footprint;
+	double internal; // Fractions at the point with the most bytes live.
+	double external;
+};
+
+// Plays the trace, and returns the index of the event that failed, or -1.
+int replay(const struct candidate *candidate, void *state, const struct trace *trace, void **blocks, int *sizes) {
+	for (int i = 0; i < trace->num_events; ++i) {
+		const struct event *event = &trace->events[i];
+		void *block;
+		switch (event->op) {
+		case ALLOCATE:
+			block = candidate->allocate(state, (size_t)event->size, event->hint);
+			break;
+		case REALLOCATE:
+			block = candidate->reallocate(state, blocks[event->id], (size_t)sizes[event->id], (size_t)event->size, event->hint);
+			break;
+		default:
+			candidate->deallocate(state, blocks[event->id], (size_t)sizes[event->id], event->hint);
+			blocks[event->id] = NULL;
+			continue;
+		}
+		if (!block)
+			return i;
+		blocks[event->id] = block;
+		sizes[event->id] = event->size;
+	}
+	return -1;
+}
+
+// Frees what the trace left allocated, in reverse order of the ids so stacks unwind.
+void free_remaining(const struct candidate *candidate, void *state, const struct trace *trace, void **blocks, int *sizes, char *hints) {
+	for (int id = trace->num_ids - 1; id >= 0; --id) {
+		if (blocks[id])
+			candidate->deallocate(state, blocks[id], (size_t)sizes[id], hints[id]);
+		blocks[id] = NULL;
+	}
+}
+
+void measure(const struct candidate *candidate, const struct trace *trace, size_t capacity, int counter, struct result *result) {
+	void **blocks = calloc((size_t)trace->num_ids, sizeof(void *));
+	int *sizes = calloc((size_t)trace->num_ids, sizeof(int));
+	size_t *usable = calloc((size_t)trace->num_ids, sizeof(size_t));
+	char *hints = calloc((size_t)trace->num_ids, 1);
+	memset(result, 0, sizeof(struct result));
+	result->failed_at = -1;
+
+	// The first pass does the bookkeeping after every event, and touches the memory the timed
+	// pass is going to use, so page faults don't end up in the times.
+	void *state = candidate->create(capacity);
+	size_t live = 0, live_usable = 0, peak_live = 0;
+	for (int i = 0; i < trace->num_events && result->failed_at < 0; ++i) {
+		const struct event *event = &trace->events[i];
+		int id = event->id;
+		void *block = NULL;
+		if (event->op != ALLOCATE) {
+			live -= (size_t)sizes[id];
+			live_usable -= usable[id];
+		}
+		switch (event->op) {
+		case ALLOCATE:
+			block = candidate->allocate(state, (size_t)event->size, event->hint);
+			break;
+		case REALLOCATE:
+			block = candidate->reallocate(state, blocks[id], (size_t)sizes[id], (size_t)event->size, event->hint);
+			break;
+		default:
+			candidate->deallocate(state, blocks[id], (size_t)sizes[id], event->hint);
+			blocks[id] = NULL;
+			continue;
+		}
+		if (!block) {
+			result->failed_at = i;
+			if (event->op == REALLOCATE) // The old block is still there.
+				candidate->deallocate(state, blocks[id], (size_t)sizes[id], event->hint);
+			blocks[id] = NULL;
+			break;
+		}
+		blocks[id] = block;
+		sizes[id] = event->size;
+		usable[id] = candidate->block_size(state, block, (size_t)event->size);
+		hints[id] = event->hint;
+		live += (size_t)event->size;
+		live_usable += usable[id];
+
+		// The footprint can be slow to get for malloc, so it's only checked every so often, and
+		// whenever there are more bytes live than ever before.
+		if (live > peak_live || i % 256 == 0) {
+			size_t footprint = candidate->footprint(state);
+			if (footprint > result->peak_footprint)
+				result->peak_footprint = footprint;
+			if (live > peak_live) {
+				peak_live = live;
+				result->internal = live_usable ? 1.0 - (double)live / (double)live_usable : 0;
+				result->external = footprint > live_usable ? 1.0 - (double)live_usable / (double)footprint : 0;
+			}
+		}
+	}
+	free_remaining(candidate, state, trace, blocks, sizes, hints);
+	candidate->destroy(state);
+	if (result->failed_at >= 0)
+		goto done;
+
+	state = candidate->create(capacity);
+	start_counting(counter);
+	double start = seconds();
+	replay(candidate, state, trace, blocks, sizes);
+	double elapsed = seconds() - start;
+	long long misses = stop_counting(counter);
+	free_remaining(candidate, state, trace, blocks, sizes, hints);
+	candidate->destroy(state);
+	result->ns_per_op = 1e9 * elapsed / trace->num_events;
+	result->misses_per_op = misses >= 0 ? (double)misses / trace->num_events : -1;
+
+done:
+	free(blocks);
+	free(sizes);
+	free(usable);
+	free(hints);
+}
+
+void benchmark_trace(const struct trace *trace, int counter) {
+	size_t capacity = 1 << 20;
+	while (capacity < 4 * trace->peak_bytes && capacity < (1u << 30))
+		capacity *= 2;
+
+	printf("\n%s: %d events, %.1f MB live at most, %.0f MB arenas.\n", trace->name, trace->num_events,
+		(double)trace->peak_bytes / (1 << 20), (double)capacity / (1 << 20));
+	printf("%-12s %8s %10s %12s %10s %10s\n", "", "ns/op", "misses/op", "footprint MB", "internal%", "external%");
+	for (int c = 0; c < NUM_CANDIDATES; ++c) {
+		struct result result;
+		measure(&candidates[c], trace, capacity, counter, &result);
+		if (result.failed_at >= 0) {
+			printf("%-12s out of memory at event %d\n", candidates[c].name, result.failed_at);
+			continue;
+		}
+		char misses[32] = "n/a";
+		if (result.misses_per_op >= 0)
+			snprintf(misses, sizeof misses, "%.2f", result.misses_per_op);
+		printf("%-12s %8.1f %10s %12.1f %10.1f %10.1f\n", candidates[c].name, result.ns_per_op, misses,
+			(double)result.peak_footprint / (1 << 20), 100 * result.internal, 100 * result.external);
+	}
+}
+
+int main(int argc, char **argv) {
+	int num_events = argc > 1 ? atoi(argv[1]) : 1000000;
+	int counter = open_cache_misses();
+	void (*generators[])(struct trace *, int, unsigned long long) = {
+		producer_consumer_trace, game_frame_trace, server_request_trace, random_lifetimes_trace,
+	};
+	for (int i = 0; i < (int)(sizeof generators / sizeof generators[0]); ++i) {
+		struct trace trace = { 0 };
+		generators[i](&trace, num_events, 1234 + i);
+		int ok = finish_trace(&trace);
+		assert(ok);
+		benchmark_trace(&trace, counter);
+		free_trace(&trace);
+	}
+	for (int i = 2; i < argc; ++i) {
+		struct trace trace = { 0 };
+		if (read_trace(&trace, argv[i]) && finish_trace(&trace))
+			benchmark_trace(&trace, counter);
+		else
+			printf("\n%s: couldn't read the trace, or it frees blocks that aren't allocated.\n", argv[i]);
+		free_trace(&trace);
+	}
+	if (counter >= 0)
+		close(counter);
+	return 0;
+}
@@ -0,0 +1,450 @@
+// Approximate sets for answering "definitely not present" before doing something expensive.
+// Like hash_set.c these only take precomputed 64-bit hashes, so use a good hash function. Unlike
+// hash_set.c they don't store the hashes, only a few bits per item, and in exchange contains()
+// sometimes says yes for an item that was never added (but never says no for one that was).
+//
+// - Blocked bloom filter: each item only touches a single 64 byte cache line. Fastest and smallest,
+//   but items can't be removed.
+// - Cuckoo filter: stores a small fingerprint per item in one of two buckets of 4 slots. Supports
+//   removal, but it's a multiset - if you add the same item twice you need to remove it twice, and
+//   you must never remove an item that wasn't added.
+//
+// Both have a fixed capacity which is decided up front, along with the false positive rate.
+
+#include <stdlib.h> // malloc, calloc, free
+#include <string.h> // memset
+#include <stdint.h> // uintptr_t
+
+// Where the bits come from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+double log2_approximate(double x) {
+	double log2 = 0;
+	for (; x >= 2; x /= 2)
+		log2 += 1;
+	return log2 + (x - 1); // Linear interpolation is good enough here.
+}
+
+// Blocked bloom filter
+
+struct bloom {
+	void *memory;
+	unsigned long long (*blocks)[8]; // 512 bits, aligned to a cache line.
+	int num_blocks;
+	int num_probes;
+	const struct allocator_callbacks *allocator; // Set before initializing, NULL means malloc.
+};
+
+void bloom_initialize(struct bloom *bloom, int capacity, double false_positive_rate) {
+	// A classic bloom filter needs 1.44*log2(1/p) bits per item. Cramming all of an item's bits into a
+	// single block makes the load uneven across blocks, so we need more than that, especially for low rates.
+	double log2 = log2_approximate(1 / false_positive_rate);
+	double bits_per_item = 1.44 * log2 * (1 + log2 / 40);
+	int num_probes = (int)(0.69 * bits_per_item + 0.5);
+	num_probes = num_probes < 1 ? 1 : num_probes > 16 ? 16 : num_probes;
+	int num_blocks = (int)(capacity * bits_per_item / 512) + 1;
+
+	size_t size = ((size_t)num_blocks + 1) * sizeof bloom->blocks[0];
+	bloom->memory = allocate_memory(bloom->allocator, size);
+	memset(bloom->memory, 0, size);
+	bloom->blocks = (void *)(((uintptr_t)bloom->memory + 63) & ~(uintptr_t)63);
+	bloom->num_blocks = num_blocks;
+	bloom->num_probes = num_probes;
+}
+
+void bloom_add(struct bloom *bloom, unsigned long long hash) {
+	unsigned long long *block = bloom->blocks[((hash >> 32) * (unsigned)bloom->num_blocks) >> 32];
+	unsigned long long bits = hash;
+	for (int i = 0; i < bloom->num_probes; ++i) {
+		bits *= 0x9E3779B97F4A7C15u;
+		unsigned bit = (unsigned)(bits >> 55); // Top 9 bits select 1 of 512.
+		block[bit >> 6] |= 1ull << (bit & 63);
+	}
+}
+
+int bloom_contains(const struct bloom *bloom, unsigned long long hash) {
+	const unsigned long long *block = bloom->blocks[((hash >> 32) * (unsigned)bloom->num_blocks) >> 32];
+	unsigned long long bits = hash;
+	for (int i = 0; i < bloom->num_probes; ++i) {
+		bits *= 0x9E3779B97F4A7C15u;
+		unsigned bit = (unsigned)(bits >> 55);
+		if (!(block[bit >> 6] & (1ull << (bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+void bloom_destroy(struct bloom *bloom) {
+	deallocate_memory(bloom->allocator, bloom->memory, ((size_t)bloom->num_blocks + 1) * sizeof bloom->blocks[0]);
+	bloom->memory = NULL;
+	bloom->blocks = NULL;
+	bloom->num_blocks = 0;
+}
+
+// Cuckoo filter https://www.cs.cmu.edu/~dga/papers/cuckoo-conext2014.pdf
+
+#define SLOTS_PER_BUCKET 4
+#define MAX_KICKS 500
+
+struct cuckoo {
+	unsigned char *slots; // Fingerprints of fingerprint_bits each, packed back to back. 0 means empty.
+	int fingerprint_bits;
+	unsigned fingerprint_mask;
+	int num_buckets;
+	int count;
+	unsigned victim; // Fingerprint that couldn't be placed after MAX_KICKS, 0 if none.
+	unsigned victim_bucket;
+	unsigned long long random;
+	const struct allocator_callbacks *allocator; // Set before initializing, NULL means malloc.
+};
+
+// The packed fingerprints, and 2 bytes of padding so the 3 byte window of the last one stays inside.
+size_t cuckoo_bytes(const struct cuckoo *cuckoo) {
+	return ((size_t)cuckoo->num_buckets * SLOTS_PER_BUCKET * (size_t)cuckoo->fingerprint_bits + 7) / 8 + 2;
+}
+
+void cuckoo_initialize(struct cuckoo *cuckoo, int capacity, double false_positive_rate) {
+	// A lookup compares against 2 buckets worth of fingerprints, each matching with probability 1/2^bits.
+	int fingerprint_bits = (int)(log2_approximate(2 * SLOTS_PER_BUCKET / false_positive_rate) + 0.999);
+	fingerprint_bits = fingerprint_bits < 4 ? 4 : fingerprint_bits > 16 ? 16 : fingerprint_bits;
+	cuckoo->fingerprint_bits = fingerprint_bits;
+	cuckoo->fingerprint_mask = (1u << fingerprint_bits) - 1;
+	cuckoo->num_buckets = (int)(capacity / (0.95 * SLOTS_PER_BUCKET)) + 1; // Inserts start failing above ~95% load.
+	cuckoo->slots = allocate_memory(cuckoo->allocator, cuckoo_bytes(cuckoo));
+	memset(cuckoo->slots, 0, cuckoo_bytes(cuckoo));
+	cuckoo->count = 0;
+	cuckoo->victim = 0;
+	cuckoo->victim_bucket = 0;
+	cuckoo->random = 0x2545F4914F6CDD1Du;
+}
+
+// A fingerprint of up to 16 bits starting anywhere in a byte fits in the 3 bytes from there.
+unsigned cuckoo_get(const struct cuckoo *cuckoo, unsigned slot) {
+	size_t bit = (size_t)slot * (size_t)cuckoo->fingerprint_bits;
+	const unsigned char *bytes = cuckoo->slots + bit / 8;
+	unsigned window = bytes[0] | (unsigned)bytes[1] << 8 | (unsigned)bytes[2] << 16;
+	return (window >> (bit % 8)) & cuckoo->fingerprint_mask;
+}
+
+void cuckoo_set(struct cuckoo *cuckoo, unsigned slot, unsigned fingerprint) {
+	size_t bit = (size_t)slot * (size_t)cuckoo->fingerprint_bits;
+	unsigned char *bytes = cuckoo->slots + bit / 8;
+	unsigned window = bytes[0] | (unsigned)bytes[1] << 8 | (unsigned)bytes[2] << 16;
+	window &= ~(cuckoo->fingerprint_mask << (bit % 8));
+	window |= fingerprint << (bit % 8);
+	bytes[0] = (unsigned char)window;
+	bytes[1] = (unsigned char)(window >> 8);
+	bytes[2] = (unsigned char)(window >> 16);
+}
+
+unsigned cuckoo_fingerprint(const struct cuckoo *cuckoo, unsigned long long hash) {
+	unsigned fingerprint = (unsigned)(hash >> 32) & cuckoo->fingerprint_mask;
+	return fingerprint ? fingerprint : 1;
+}
+
+unsigned cuckoo_bucket(const struct cuckoo *cuckoo, unsigned long long hash) {
+	return (unsigned)(((hash & 0xFFFFFFFF) * (unsigned)cuckoo->num_buckets) >> 32);
+}
+
+unsigned cuckoo_other_bucket(const struct cuckoo *cuckoo, unsigned bucket, unsigned fingerprint) {
+	// (h - bucket) mod n takes us back and forth between the 2 buckets, even if n isn't a power of 2.
+	unsigned n = (unsigned)cuckoo->num_buckets;
+	unsigned h = (unsigned)(((fingerprint * 0x9E3779B97F4A7C15u) >> 32) % n);
+	return h >= bucket ? h - bucket : h + n - bucket;
+}
+
+int cuckoo_insert(struct cuckoo *cuckoo, unsigned bucket, unsigned fingerprint) {
+	for (unsigned i = 0; i < SLOTS_PER_BUCKET; ++i) {
+		if (!cuckoo_get(cuckoo, bucket * SLOTS_PER_BUCKET + i)) {
+			cuckoo_set(cuckoo, bucket * SLOTS_PER_BUCKET + i, fingerprint);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int cuckoo_find(const struct cuckoo *cuckoo, unsigned bucket, unsigned fingerprint) {
+	for (unsigned i = 0; i < SLOTS_PER_BUCKET; ++i)
+		if (cuckoo_get(cuckoo, bucket * SLOTS_PER_BUCKET + i) == fingerprint)
+			return (int)(bucket * SLOTS_PER_BUCKET + i);
+	return -1;
+}
+
+void cuckoo_place(struct cuckoo *cuckoo, unsigned bucket, unsigned fingerprint) {
+	unsigned other = cuckoo_other_bucket(cuckoo, bucket, fingerprint);
+	if (cuckoo_insert(cuckoo, bucket, fingerprint) || cuckoo_insert(cuckoo, other, fingerprint))
+		return;
+
+	// Both buckets are full, kick out a random fingerprint to its other bucket, and so on.
+	for (int kick = 0; kick < MAX_KICKS; ++kick) {
+		cuckoo->random ^= cuckoo->random >> 12;
+		cuckoo->random ^= cuckoo->random << 25;
+		cuckoo->random ^= cuckoo->random >> 27;
+		unsigned random = (unsigned)((cuckoo->random * 0x2545F4914F6CDD1Du) >> 32);
+		if (kick == 0 && (random & 0x80000000))
+			bucket = other;
+
+		unsigned slot = bucket * SLOTS_PER_BUCKET + random % SLOTS_PER_BUCKET;
+		unsigned kicked = cuckoo_get(cuckoo, slot);
+		cuckoo_set(cuckoo, slot, fingerprint);
+		fingerprint = kicked;
+		bucket = cuckoo_other_bucket(cuckoo, bucket, fingerprint);
+		if (cuckoo_insert(cuckoo, bucket, fingerprint))
+			return;
+	}
+
+	cuckoo->victim = fingerprint;
+	cuckoo->victim_bucket = bucket;
+}
+
+// Returns 0 if the filter is full. The very last item that fits gets stashed as the victim.
+int cuckoo_add(struct cuckoo *cuckoo, unsigned long long hash) {
+	if (cuckoo->victim)
+		return 0;
+	cuckoo->count++;
+	cuckoo_place(cuckoo, cuckoo_bucket(cuckoo, hash), cuckoo_fingerprint(cuckoo, hash));
+	return 1;
+}
+
+int cuckoo_contains(const struct cuckoo *cuckoo, unsigned long long hash) {
+	unsigned fingerprint = cuckoo_fingerprint(cuckoo, hash);
+	unsigned bucket = cuckoo_bucket(cuckoo, hash);
+	unsigned other = cuckoo_other_bucket(cuckoo, bucket, fingerprint);
+	if (cuckoo->victim == fingerprint && (cuckoo->victim_bucket == bucket || cuckoo->victim_bucket == other))
+		return 1;
+	return cuckoo_find(cuckoo, bucket, fingerprint) >= 0 || cuckoo_find(cuckoo, other, fingerprint) >= 0;
+}
+
+void cuckoo_remove(struct cuckoo *cuckoo, unsigned long long hash) {
+	unsigned fingerprint = cuckoo_fingerprint(cuckoo, hash);
+	unsigned bucket = cuckoo_bucket(cuckoo, hash);
+	unsigned other = cuckoo_other_bucket(cuckoo, bucket, fingerprint);
+	if (cuckoo->victim == fingerprint && (cuckoo->victim_bucket == bucket || cuckoo->victim_bucket == other)) {
+		cuckoo->victim = 0;
+		cuckoo->count--;
+		return;
+	}
+
+	int slot = cuckoo_find(cuckoo, bucket, fingerprint);
+	if (slot < 0)
+		slot = cuckoo_find(cuckoo, other, fingerprint);
+	if (slot < 0)
+		return;
+	cuckoo_set(cuckoo, (unsigned)slot, 0);
+	cuckoo->count--;
+
+	// Now that there's room, try to put the victim back so that we can accept new items again.
+	if (cuckoo->victim) {
+		unsigned victim = cuckoo->victim;
+		cuckoo->victim = 0;
+		cuckoo_place(cuckoo, cuckoo->victim_bucket, victim);
+	}
+}
+
+void cuckoo_destroy(struct cuckoo *cuckoo) {
+	deallocate_memory(cuckoo->allocator, cuckoo->slots, cuckoo_bytes(cuckoo));
+	cuckoo->slots = NULL;
+	cuckoo->num_buckets = 0;
+	cuckoo->count = 0;
+	cuckoo->victim = 0;
+}
+
+#include <assert.h>
+#include <stdio.h> // printf
+#include <time.h> // timespec_get
+double seconds(void) {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + time.tv_nsec * 1e-9;
+}
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
+int main(void) {
+	static unsigned long long hashes[2 * 1048576]; // First half gets added, second half doesn't.
+	int n = sizeof hashes / sizeof hashes[0] / 2;
+	unsigned long long seed = 42;
+	for (int i = 0; i < 2 * n; ++i) {
+		seed ^= seed >> 12;
+		seed ^= seed << 25;
+		seed ^= seed >> 27;
+		hashes[i] = seed * 0x2545F4914F6CDD1Du;
+	}
+
+	{
+		struct bloom bloom = { 0 };
+		bloom_initialize(&bloom, 0, 0.01);
+		assert(!bloom_contains(&bloom, hashes[0]));
+		bloom_add(&bloom, hashes[0]);
+		assert(bloom_contains(&bloom, hashes[0]));
+		bloom_destroy(&bloom);
+
+		struct cuckoo cuckoo = { 0 };
+		cuckoo_initialize(&cuckoo, 0, 0.01);
+		assert(!cuckoo_contains(&cuckoo, hashes[0]));
+		cuckoo_remove(&cuckoo, hashes[0]);
+		assert(cuckoo_add(&cuckoo, hashes[0]));
+		assert(cuckoo_contains(&cuckoo, hashes[0]));
+		cuckoo_remove(&cuckoo, hashes[0]);
+		assert(!cuckoo_contains(&cuckoo, hashes[0]) && cuckoo.count == 0);
+		cuckoo_destroy(&cuckoo);
+	}
+
+	{
+		// The filters' memory can come from somewhere else, and goes back with the size it was allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct bloom bloom = { .allocator = &callbacks };
+		bloom_initialize(&bloom, 1000, 0.01);
+		struct cuckoo cuckoo = { .allocator = &callbacks };
+		cuckoo_initialize(&cuckoo, 1000, 0.01);
+		assert(allocated == ((size_t)bloom.num_blocks + 1) * 64 + cuckoo_bytes(&cuckoo));
+		for (int i = 0; i < 1000; ++i) {
+			bloom_add(&bloom, hashes[i]);
+			assert(cuckoo_add(&cuckoo, hashes[i]));
+		}
+		for (int i = 0; i < 1000; ++i)
+			assert(bloom_contains(&bloom, hashes[i]) && cuckoo_contains(&cuckoo, hashes[i]));
+		bloom_destroy(&bloom);
+		cuckoo_destroy(&cuckoo);
+		assert(!allocated);
+	}
+
+	{
+		// Adding the same item twice means it needs to be removed twice.
+		struct cuckoo cuckoo = { 0 };
+		cuckoo_initialize(&cuckoo, 100, 0.001);
+		assert(cuckoo_add(&cuckoo, 123) && cuckoo_add(&cuckoo, 123));
+		cuckoo_remove(&cuckoo, 123);
+		assert(cuckoo_contains(&cuckoo, 123));
+		cuckoo_remove(&cuckoo, 123);
+		assert(!cuckoo_contains(&cuckoo, 123));
+		cuckoo_destroy(&cuckoo);
+	}
+
+	{
+		// Fill a cuckoo filter until it refuses, it should get close to its capacity.
+		int capacity = 10000;
+		struct cuckoo cuckoo = { 0 };
+		cuckoo_initialize(&cuckoo, capacity, 0.01);
+		int num_added = 0;
+		while (num_added < n && cuckoo_add(&cuckoo, hashes[num_added]))
+			++num_added;
+		assert(num_added >= capacity && cuckoo.victim);
+		for (int i = 0; i < num_added; ++i)
+			assert(cuckoo_contains(&cuckoo, hashes[i]));
+
+		// Making some room lets the victim back in.
+		for (int i = 0; i < capacity / 10; ++i)
+			cuckoo_remove(&cuckoo, hashes[i]);
+		assert(!cuckoo.victim && cuckoo.count == num_added - capacity / 10);
+		assert(cuckoo_add(&cuckoo, hashes[0]));
+		for (int i = capacity / 10; i < num_added; ++i)
+			assert(cuckoo_contains(&cuckoo, hashes[i]));
+		cuckoo_destroy(&cuckoo);
+	}
+
+	// Compare against a hash_set.c style set of full hashes, which uses the same 3/4 max load factor.
+	int set_capacity = 64;
+	while (3 * set_capacity < 4 * n)
+		set_capacity *= 2;
+	unsigned long long *set = calloc((size_t)set_capacity, sizeof set[0]);
+	for (int i = 0; i < n; ++i) {
+		unsigned mask = (unsigned)set_capacity - 1;
+		for (unsigned j = (unsigned)hashes[i] & mask;; j = (j + 1) & mask) {
+			if (!set[j]) {
+				set[j] = hashes[i];
+				break;
+			}
+		}
+	}
+	double t0 = seconds();
+	int set_hits = 0;
+	for (int i = 0; i < 2 * n; ++i) {
+		unsigned mask = (unsigned)set_capacity - 1;
+		for (unsigned j = (unsigned)hashes[i] & mask; set[j]; j = (j + 1) & mask) {
+			if (set[j] == hashes[i]) {
+				++set_hits;
+				break;
+			}
+		}
+	}
+	double t1 = seconds();
+	assert(set_hits == n);
+	printf("%-24s %6.2f bytes/item, false positives %.4f%%, %5.1f ns/lookup\n", "hash set",
+		(double)set_capacity * sizeof set[0] / n, 0.0, 1e9 * (t1 - t0) / (2 * n));
+	free(set);
+
+	double rates[] = { 0.05, 0.01, 0.001, 0.0001 };
+	for (int r = 0; r < 4; ++r) {
+		struct bloom bloom = { 0 };
+		bloom_initialize(&bloom, n, rates[r]);
+		for (int i = 0; i < n; ++i)
+			bloom_add(&bloom, hashes[i]);
+		t0 = seconds();
+		int bloom_hits = 0;
+		for (int i = 0; i < 2 * n; ++i)
+			bloom_hits += bloom_contains(&bloom, hashes[i]);
+		t1 = seconds();
+		for (int i = 0; i < n; ++i)
+			assert(bloom_contains(&bloom, hashes[i])); // No false negatives, ever.
+		double bloom_rate = (double)(bloom_hits - n) / n;
+		assert(bloom_rate < 1.5 * rates[r]);
+		char name[64];
+		snprintf(name, sizeof name, "bloom filter (%g%%)", 100 * rates[r]);
+		printf("%-24s %6.2f bytes/item, false positives %.4f%%, %5.1f ns/lookup\n", name,
+			(double)bloom.num_blocks * sizeof bloom.blocks[0] / n, 100 * bloom_rate, 1e9 * (t1 - t0) / (2 * n));
+		bloom_destroy(&bloom);
+
+		struct cuckoo cuckoo = { 0 };
+		cuckoo_initialize(&cuckoo, n, rates[r]);
+		for (int i = 0; i < n; ++i)
+			assert(cuckoo_add(&cuckoo, hashes[i]));
+		t0 = seconds();
+		int cuckoo_hits = 0;
+		for (int i = 0; i < 2 * n; ++i)
+			cuckoo_hits += cuckoo_contains(&cuckoo, hashes[i]);
+		t1 = seconds();
+		for (int i = 0; i < n; ++i)
+			assert(cuckoo_contains(&cuckoo, hashes[i]));
+		double cuckoo_rate = (double)(cuckoo_hits - n) / n;
+		assert(cuckoo_rate < 1.5 * rates[r]);
+		snprintf(name, sizeof name, "cuckoo filter (%g%%)", 100 * rates[r]);
+		printf("%-24s %6.2f bytes/item, false positives %.4f%%, %5.1f ns/lookup\n", name,
+			(double)cuckoo_bytes(&cuckoo) / n, 100 * cuckoo_rate, 1e9 * (t1 - t0) / (2 * n));
+
+		// Removing items should remove them (apart from false positives).
+		for (int i = 0; i < n / 2; ++i)
+			cuckoo_remove(&cuckoo, hashes[i]);
+		assert(cuckoo.count == n - n / 2);
+		int removed_hits = 0;
+		for (int i = 0; i < n / 2; ++i)
+			removed_hits += cuckoo_contains(&cuckoo, hashes[i]);
+		assert(removed_hits < 1.5 * rates[r] * n);
+		for (int i = n / 2; i < n; ++i)
+			assert(cuckoo_contains(&cuckoo, hashes[i]));
+		cuckoo_destroy(&cuckoo);
+	}
+}
@@ -0,0 +1,283 @@
+// O(log N) allocation and deallocation
+// 1/4 memory wasted on average, best fit
+// no header, the state is kept in bitmaps outside the managed range, so it hands out offsets into
+// anything: a mapped file, GPU memory, shared memory that other processes write to
+// blocks are aligned to their size, so requests of a page or more get exactly page aligned blocks
+// 2 bits of metadata per minimum size block, plus 1/64 of that for a summary
+// the range doesn't have to be a power of 2, the tree covers the next one and the rest stays used
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+#include <string.h> // memset
+#include <assert.h>
+
+#define INVALID_OFFSET UINT64_MAX
+#define MAX_LEVELS 64
+
+// Node i of level l is bit 2^l + i of the bitmaps, so its children are 2n and 2n + 1, its
+// parent n / 2 and its buddy n ^ 1. Level 0 is the root, which covers the whole tree, and blocks
+// on the last level are 2^min_block_log2 bytes. A node that's neither free nor split is a used
+// block, or the part of the tree past the end of the range.
+struct bitmap_buddy {
+	uint64_t *free_bits; // the node is a free block
+	uint64_t *split_bits; // the node is split into its two children
+	uint64_t *summary; // bit per word of free_bits, set if the word has a free block in it
+	uint64_t capacity;
+	int min_block_log2;
+	int num_levels;
+	uint64_t num_free[MAX_LEVELS]; // free blocks per level, so empty levels aren't searched
+};
+
+int ceillog2(uint64_t x) {
+	int log2 = 0;
+	while (log2 < 64 && ((uint64_t)1 << log2) < x)
+		++log2;
+	return log2;
+}
+
+int levels_for(uint64_t capacity, int min_block_log2) {
+	return ceillog2((capacity + ((uint64_t)1 << min_block_log2) - 1) >> min_block_log2) + 1;
+}
+size_t bitmap_words(int num_levels) {
+	return ((size_t)1 << num_levels) / 64 + 1;
+}
+
+// Bytes of metadata to pass to initialize.
+size_t metadata_size(uint64_t capacity, int min_block_log2) {
+	size_t words = bitmap_words(levels_for(capacity, min_block_log2));
+	return (2 * words + words / 64 + 1) * sizeof(uint64_t);
+}
+
+int get_bit(const uint64_t *bits, uint64_t i) {
+	return (bits[i / 64] >> (i % 64)) & 1;
+}
+void set_bit(uint64_t *bits, uint64_t i) {
+	bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+void clear_bit(uint64_t *bits, uint64_t i) {
+	bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+void set_free(struct bitmap_buddy *buddy, uint64_t node, int level) {
+	set_bit(buddy->free_bits, node);
+	set_bit(buddy->summary, node / 64);
+	buddy->num_free[level]++;
+}
+void clear_free(struct bitmap_buddy *buddy, uint64_t node, int level) {
+	clear_bit(buddy->free_bits, node);
+	if (!buddy->free_bits[node / 64])
+		clear_bit(buddy->summary, node / 64);
+	buddy->num_free[level]--;
+}
+
+// First set bit in [begin, end), which has to have one.
+uint64_t find_set_bit(const uint64_t *bits, uint64_t begin, uint64_t end) {
+	for (uint64_t word = begin / 64;; ++word) {
+		uint64_t mask = bits[word];
+		if (word == begin / 64)
+			mask &= ~(uint64_t)0 << (begin % 64);
+		if (word == (end - 1) / 64 && end % 64)
+			mask &= ~(~(uint64_t)0 << (end % 64));
+		if (mask)
+			return word * 64 + (uint64_t)__builtin_ctzll(mask); // _BitScanForward64 on msvc
+		assert(word < (end - 1) / 64);
+	}
+}
+
+// The free node on the level with the lowest offset, the summary says which words to look at.
+uint64_t find_free(struct bitmap_buddy *buddy, int level) {
+	uint64_t first = (uint64_t)1 << level;
+	uint64_t word = find_set_bit(buddy->summary, first / 64, (2 * first - 1) / 64 + 1);
+	uint64_t begin = word * 64 > first ? word * 64 : first;
+	uint64_t end = (word + 1) * 64 < 2 * first ? (word + 1) * 64 : 2 * first;
+	return find_set_bit(buddy->free_bits, begin, end);
+}
+
+int block_log2(struct bitmap_buddy *buddy, int level) {
+	return buddy->min_block_log2 + buddy->num_levels - 1 - level;
+}
+uint64_t node_offset(struct bitmap_buddy *buddy, uint64_t node, int level) {
+	return (node - ((uint64_t)1 << level)) << block_log2(buddy, level);
+}
+
+// Nodes that are all in the range are free, ones that are partly in it get split.
+void mark_range(struct bitmap_buddy *buddy, uint64_t node, int level, uint64_t offset) {
+	uint64_t size = (uint64_t)1 << block_log2(buddy, level);
+	if (offset >= buddy->capacity)
+		return;
+	if (offset + size <= buddy->capacity) {
+		set_free(buddy, node, level);
+		return;
+	}
+	set_bit(buddy->split_bits, node);
+	mark_range(buddy, 2 * node, level + 1, offset);
+	mark_range(buddy, 2 * node + 1, level + 1, offset + size / 2);
+}
+
+// Manages offsets [0, capacity), where capacity gets rounded down to a multiple of the minimum
+// block size. metadata has to be metadata_size(capacity, min_block_log2) bytes, and 8 byte aligned.
+void initialize(struct bitmap_buddy *buddy, void *metadata, uint64_t capacity, int min_block_log2) {
+	memset(buddy, 0, sizeof(struct bitmap_buddy));
+	buddy->capacity = capacity >> min_block_log2 << min_block_log2;
+	buddy->min_block_log2 = min_block_log2;
+	buddy->num_levels = levels_for(capacity, min_block_log2);
+	assert(buddy->num_levels + min_block_log2 <= MAX_LEVELS);
+
+	size_t words = bitmap_words(buddy->num_levels);
+	memset(metadata, 0, metadata_size(capacity, min_block_log2));
+	buddy->free_bits = metadata;
+	buddy->split_bits = buddy->free_bits + words;
+	buddy->summary = buddy->split_bits + words;
+	if (buddy->capacity)
+		mark_range(buddy, 1, 0, 0);
+}
+
+// Returns INVALID_OFFSET when there's no free block big enough.
+uint64_t allocate(struct bitmap_buddy *buddy, uint64_t size) {
+	int size_log2 = ceillog2(size);
+	if (size_log2 < buddy->min_block_log2)
+		size_log2 = buddy->min_block_log2;
+	int wanted = buddy->num_levels - 1 - (size_log2 - buddy->min_block_log2);
+	if (wanted < 0)
+		return INVALID_OFFSET;
+
+	int level = wanted;
+	while (level >= 0 && !buddy->num_free[level])
+		--level;
+	if (level < 0)
+		return INVALID_OFFSET;
+
+	// split the block down to the size that was asked for, keeping the left halves
+	uint64_t node = find_free(buddy, level);
+	clear_free(buddy, node, level);
+	for (; level < wanted; ++level) {
+		set_bit(buddy->split_bits, node);
+		set_free(buddy, 2 * node + 1, level + 1);
+		node *= 2;
+	}
+	return node_offset(buddy, node, level);
+}
+
+// The used block starting at offset, the only unsplit node on the path to it from the root.
+uint64_t find_block(struct bitmap_buddy *buddy, uint64_t offset, int *level) {
+	assert(offset < buddy->capacity); // not from this allocator
+	uint64_t node = 1;
+	*level = 0;
+	while (get_bit(buddy->split_bits, node)) {
+		int child_log2 = block_log2(buddy, *level) - 1;
+		node = 2 * node + ((offset >> child_log2) & 1);
+		++*level;
+	}
+	assert(node_offset(buddy, node, *level) == offset); // not the start of a block
+	assert(!get_bit(buddy->free_bits, node)); // double free
+	return node;
+}
+
+void deallocate(struct bitmap_buddy *buddy, uint64_t offset) {
+	if (offset == INVALID_OFFSET)
+		return;
+
+	int level;
+	uint64_t node = find_block(buddy, offset, &level);
+
+	// combine with free buddies, a used or split buddy stops it
+	while (level > 0 && get_bit(buddy->free_bits, node ^ 1)) {
+		clear_free(buddy, node ^ 1, level);
+		node /= 2;
+		--level;
+		clear_bit(buddy->split_bits, node);
+	}
+	set_free(buddy, node, level);
+}
+
+// The size of the block, which can be more than what was asked for.
+uint64_t block_size(struct bitmap_buddy *buddy, uint64_t offset) {
+	int level;
+	find_block(buddy, offset, &level);
+	return (uint64_t)1 << block_log2(buddy, level);
+}
+
+#include <stdlib.h> // malloc, free, rand
+
+// Marks the pages of a block as owned, and checks nobody else has them.
+void own(unsigned char *owners, uint64_t offset, uint64_t size, int page_log2, unsigned char owner) {
+	for (uint64_t page = offset >> page_log2; page < (offset + size) >> page_log2; ++page) {
+		assert(!owners[page] || !owner);
+		owners[page] = owner;
+	}
+}
+
+int main(void) {
+	{
+		// no range, and one that's smaller than a block
+		struct bitmap_buddy buddy;
+		uint64_t metadata[4];
+		assert(metadata_size(0, 12) <= sizeof metadata);
+		initialize(&buddy, metadata, 0, 12);
+		assert(allocate(&buddy, 1) == INVALID_OFFSET);
+		initialize(&buddy, metadata, 4095, 12);
+		assert(allocate(&buddy, 0) == INVALID_OFFSET);
+		deallocate(&buddy, INVALID_OFFSET);
+	}
+	{
+		// 5 pages: a block of 4 and a block of 1, and the rest of the tree can't be used
+		struct bitmap_buddy buddy;
+		void *metadata = malloc(metadata_size(5 * 4096, 12));
+		initialize(&buddy, metadata, 5 * 4096 + 100, 12);
+		assert(buddy.capacity == 5 * 4096);
+		assert(allocate(&buddy, 5 * 4096) == INVALID_OFFSET);
+		uint64_t a = allocate(&buddy, 4 * 4096);
+		uint64_t b = allocate(&buddy, 1);
+		assert(a == 0 && b == 4 * 4096);
+		assert(block_size(&buddy, a) == 4 * 4096 && block_size(&buddy, b) == 4096);
+		assert(allocate(&buddy, 1) == INVALID_OFFSET);
+		deallocate(&buddy, a);
+		uint64_t c = allocate(&buddy, 4096);
+		uint64_t d = allocate(&buddy, 8192);
+		assert(c == 0 && d == 8192);
+		deallocate(&buddy, c);
+		deallocate(&buddy, b);
+		deallocate(&buddy, d);
+		assert(allocate(&buddy, 4 * 4096) == 0);
+		free(metadata);
+	}
+	{
+		// random sizes in 1 GB of offsets that nothing backs, checked against a page map
+		enum { PAGE_LOG2 = 12, NUM_PAGES = 1 << 18, NUM_SLOTS = 1000 };
+		uint64_t capacity = (uint64_t)NUM_PAGES << PAGE_LOG2;
+		struct bitmap_buddy buddy;
+		void *metadata = malloc(metadata_size(capacity, PAGE_LOG2));
+		initialize(&buddy, metadata, capacity, PAGE_LOG2);
+		assert(buddy.num_levels == 19);
+		unsigned char *owners = calloc(NUM_PAGES, 1);
+		uint64_t offsets[NUM_SLOTS], sizes[NUM_SLOTS];
+		for (int i = 0; i < NUM_SLOTS; ++i)
+			offsets[i] = INVALID_OFFSET;
+		srand(1);
+		for (int round = 0; round < 100000; ++round) {
+			int i = rand() % NUM_SLOTS;
+			if (offsets[i] != INVALID_OFFSET) {
+				own(owners, offsets[i], sizes[i], PAGE_LOG2, 0);
+				deallocate(&buddy, offsets[i]);
+				offsets[i] = INVALID_OFFSET;
+				continue;
+			}
+			uint64_t size = (uint64_t)1 + (uint64_t)rand() % ((uint64_t)1 << (rand() % 24));
+			offsets[i] = allocate(&buddy, size);
+			if (offsets[i] == INVALID_OFFSET)
+				continue;
+			sizes[i] = block_size(&buddy, offsets[i]);
+			assert(sizes[i] >= size && sizes[i] < 2 * size + 4096);
+			assert(offsets[i] % sizes[i] == 0 && offsets[i] + sizes[i] <= capacity);
+			own(owners, offsets[i], sizes[i], PAGE_LOG2, (unsigned char)(i % 255 + 1));
+		}
+		for (int i = 0; i < NUM_SLOTS; ++i)
+			deallocate(&buddy, offsets[i]);
+		for (int level = 0; level < buddy.num_levels; ++level)
+			assert(buddy.num_free[level] == (level == 0));
+		assert(allocate(&buddy, capacity) == 0);
+		free(owners);
+		free(metadata);
+	}
+	return 0;
+}
@@ -1,9 +1,14 @@
 // O(log N) allocation and deallocation
 // 1/4 memory wasted on average, best fit
 // 2 pointer header, 16/8 byte on 64/32-bit
-// 16/8 byte min allocation on 64/32-bit
-// cannot be expanded at runtime
-
+// 16/8 byte min allocation on 64/32-bit, free blocks keep their size just past the header
+// size_t sizes, so heaps and blocks can be bigger than 2 GB
+// cannot be expanded at runtime, but see arena_heap for one that maps more arenas from the OS
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS when compiling with -std=c11
+#endif
+#include <stddef.h> // size_t
 #include <stdint.h> // intptr_t
 #include <string.h> // memcpy
 #include <assert.h>
@@ -19,32 +24,39 @@ union node {
 	};
 };
 
+// a free node's size is in the node after it, since its header is taken by the list links
+intptr_t freesize(union node *node) {
+	return node[1].size;
+}
+
+#define NUM_FREELISTS (int)(sizeof(size_t) * 8)
+
 struct heap {
 	void *memory;
-	int capacity;
-	union node freelists[32];
+	size_t capacity;
+	union node freelists[NUM_FREELISTS];
 };
 
-int ceillog2(int x) {
+int ceillog2(size_t x) {
 	int log2 = 0;
-	while ((1 << log2) < x)
+	while (((size_t)1 << log2) < x)
 		++log2;
 	return log2;
 }
 
-void initialize(struct heap *heap, void *memory, int capacity) {
+void initialize(struct heap *heap, void *memory, size_t capacity) {
 	// capacity must be a power of 2
 	assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
 
 	heap->memory = memory;
 	heap->capacity = capacity;
-	for (int i = 0; i < 32; ++i) {
+	for (int i = 0; i < NUM_FREELISTS; ++i) {
 		union node *list = &heap->freelists[i];
 		list->next = list;
 		list->prev = list;
 	}
 
-	int available = capacity - sizeof(union node);
+	size_t available = capacity - sizeof(union node);
 	int log2 = ceillog2(available);
 	union node *list = &heap->freelists[log2];
 	union node *node = memory;
@@ -52,13 +64,16 @@ void initialize(struct heap *heap, void *memory, int capacity) {
 	list->prev = node;
 	node->next = list;
 	node->prev = list;
+	node[1].size = (intptr_t)1 << log2;
 }
-void *allocate(struct heap *heap, int size) {
-	// you could clamp to 0, or return NULL
-	assert(size >= 0);
-
-	int needed = size + sizeof(union node);
-	for (int log2 = ceillog2(needed); log2 < 32; ++log2) {
+void *allocate(struct heap *heap, size_t size) {
+	if (size > heap->capacity)
+		return 0; // needed would overflow
+
+	size_t needed = size + sizeof(union node);
+	if (needed < 2 * sizeof(union node))
+		needed = 2 * sizeof(union node);
+	for (int log2 = ceillog2(needed); log2 < NUM_FREELISTS; ++log2) {
 		union node *list = &heap->freelists[log2];
 		if (list->next == list)
 			continue;
@@ -69,7 +84,7 @@ void *allocate(struct heap *heap, int size) {
 		assert(node->free);
 
 		// split node to smallest size that fits
-		while ((1 << (log2 - 1)) >= needed) {
+		while (((size_t)1 << (log2 - 1)) >= needed) {
 			--log2;
 			void *memory = (char *)node + ((intptr_t)1 << log2);
 			union node *buddy = memory;
@@ -78,6 +93,7 @@ void *allocate(struct heap *heap, int size) {
 			buddy->prev = list;
 			list->next->prev = buddy;
 			list->next = buddy;
+			buddy[1].size = (intptr_t)1 << log2;
 		}
 
 		node->free = 0;
@@ -99,14 +115,14 @@ void deallocate(struct heap *heap, void *block) {
 	assert((char *)node + node->size <= (char *)heap->memory + heap->capacity); // block isn't from this heap.
 
 	// combine neighboring free nodes
-	while (node->size < heap->capacity) {
+	while ((size_t)node->size < heap->capacity) {
 		// the buddy node is always just a bitflip away
 		uintptr_t base = (uintptr_t)heap->memory;
 		uintptr_t nodep = (uintptr_t)node - base;
 		uintptr_t buddyp = nodep ^ node->size;
 		union node *buddy = (union node *)(buddyp + base);
-		if (!buddy->free)
-			break;
+		if (!buddy->free || freesize(buddy) != node->size)
+			break; // buddy is used, or it's been split and part of it is used
 
 		buddy->next->prev = buddy->prev;
 		buddy->prev->next = buddy->next;
@@ -116,17 +132,15 @@ void deallocate(struct heap *heap, void *block) {
 		node->size = 2 * size;
 	}
 
-	int log2 = ceillog2((int)node->size);
+	int log2 = ceillog2((size_t)node->size);
 	union node *list = &heap->freelists[log2];
+	node[1].size = node->size;
 	node->next = list->next;
 	node->prev = list;
 	list->next->prev = node;
 	list->next = node;
 }
-void *reallocate(struct heap *heap, void *block, int size) {
-	// you could clamp to 0, or return NULL
-	assert(size >= 0);
-
+void *reallocate(struct heap *heap, void *block, size_t size) {
 	if (!block)
 		return allocate(heap, size);
 	if (!size) {
@@ -142,13 +156,17 @@ void *reallocate(struct heap *heap, void *block, int size) {
 	assert(!node->free); // double free
 	assert((char *)node + node->size <= (char *)heap->memory + heap->capacity); // block isn't from this heap.
 
-	int needed = size + sizeof(union node);
-	if (needed > node->size) {
+	if (size > heap->capacity)
+		return 0; // allocation doesn't fit in the heap
+	size_t needed = size + sizeof(union node);
+	if (needed < 2 * sizeof(union node))
+		needed = 2 * sizeof(union node);
+	if (needed > (size_t)node->size) {
 		if (needed > heap->capacity)
 			return 0; // allocation doesn't fit in the heap
 
 		// try to merge with neighboring free buddies
-		int oldsize = (int)node->size;
+		intptr_t oldsize = node->size;
 		for (;;) {
 			// we can only merge with the buddy if we are the "left" buddy
 			uintptr_t base = (uintptr_t)heap->memory;
@@ -158,7 +176,7 @@ void *reallocate(struct heap *heap, void *block, int size) {
 
 			uintptr_t buddyp = nodep ^ node->size;
 			union node *buddy = (union node *)(buddyp + base);
-			if (!buddy->free)
+			if (!buddy->free || freesize(buddy) != node->size)
 				break; // buddy isn't free so we can't merge
 
 			// ok we can merge with this buddy
@@ -166,7 +184,7 @@ void *reallocate(struct heap *heap, void *block, int size) {
 			buddy->prev->next = buddy->next;
 			node->size *= 2;
 
-			if (node->size >= needed)
+			if ((size_t)node->size >= needed)
 				return block;
 		}
 
@@ -176,30 +194,28 @@ void *reallocate(struct heap *heap, void *block, int size) {
 
 			void *memory = (char *)node + node->size;
 			union node *buddy = memory;
-			buddy->free = 1;
-			buddy->size = node->size;
-
 			// add buddy back to the freelist
-			int log2 = ceillog2((int)node->size);
+			int log2 = ceillog2((size_t)node->size);
 			union node *list = &heap->freelists[log2];
 			buddy->next = list->next;
 			buddy->prev = list;
 			list->next->prev = buddy;
 			list->next = buddy;
+			buddy[1].size = node->size;
 		}
 
 		// make a new allocation and copy the old one
 		void *copy = allocate(heap, size);
 		if (!copy)
 			return 0; // out of memory
-		memcpy(copy, block, (size_t)node->size);
+		memcpy(copy, block, (size_t)node->size - sizeof(union node));
 		deallocate(heap, block);
 		return copy;
 	}
 	else {
 		// split off as many buddies from the node as we can
-		int log2 = ceillog2((int)node->size);
-		while ((1 << (log2 - 1)) >= needed) {
+		int log2 = ceillog2((size_t)node->size);
+		while (((size_t)1 << (log2 - 1)) >= needed) {
 			--log2;
 			void *memory = (char *)node + ((intptr_t)1 << log2);
 			union node *buddy = memory;
@@ -208,9 +224,296 @@ void *reallocate(struct heap *heap, void *block, int size) {
 			buddy->prev = list;
 			list->next->prev = buddy;
 			list->next = buddy;
+			buddy[1].size = (intptr_t)1 << log2;
+		}
+		node->size = (intptr_t)1 << log2;
+		return block;
+	}
+}
+
+// Arena heap: buddy heaps over arenas that are mapped from the OS when the ones there are run
+// out. Every mapping is aligned to arena_size, so deallocate finds the arena of a block by
+// masking its address, and the arena's header is the first block of its own heap. Blocks too big
+// for an arena get a mapping of their own, laid out the same way but without the heap. Arenas
+// that become empty go back to the OS, except for up to retain_bytes of spares, so a workload
+// that goes up and down doesn't map and unmap all the time. Allocation tries the arenas newest
+// first, skipping the ones that couldn't fit a block as big since their last deallocate.
+#if defined(_WIN32)
+#include <Windows.h> // VirtualAlloc, VirtualFree
+#else
+#include <sys/mman.h> // mmap, munmap
+#include <unistd.h> // sysconf
+#endif
+
+struct buddy_arena {
+	struct heap heap; // over the whole arena, unused for a large block
+	struct arena_heap *owner;
+	struct buddy_arena *prev;
+	struct buddy_arena *next;
+	size_t size; // of the mapping
+	size_t num_blocks; // not counting the header
+	int failed_log2; // blocks of this size or bigger didn't fit
+	int is_large;
+};
+
+// the header is always just past the first node, the one of the header's own block
+#define ARENA_HEADER_OFFSET sizeof(union node)
+#define LARGE_HEADER_SIZE ((ARENA_HEADER_OFFSET + sizeof(struct buddy_arena) + 15) & ~(size_t)15)
+
+struct arena_heap {
+	struct buddy_arena *arenas;
+	struct buddy_arena *large; // mappings with a single large block
+	struct buddy_arena *spares; // empty arenas
+	size_t arena_size; // power of 2
+	size_t retain_bytes;
+	size_t mapped_bytes;
+	int num_arenas; // not counting spares or large blocks
+	int num_spares;
+};
+
+size_t page_size(void) {
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+// alignment must be a power of 2, and a multiple of the page size
+void *map_aligned(size_t size, size_t alignment) {
+#if defined(_WIN32)
+	// reserve enough to find an aligned address in, and map just that, someone else can take it in between
+	for (;;) {
+		char *reserved = VirtualAlloc(NULL, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+		if (!reserved)
+			return NULL;
+		char *aligned = (char *)(((uintptr_t)reserved + alignment - 1) & ~(uintptr_t)(alignment - 1));
+		VirtualFree(reserved, 0, MEM_RELEASE);
+		void *memory = VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (memory)
+			return memory;
+	}
+#else
+	// map extra, and unmap what's before and after the aligned part
+	char *mapped = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+		return NULL;
+	char *aligned = (char *)(((uintptr_t)mapped + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	if (aligned > mapped)
+		munmap(mapped, (size_t)(aligned - mapped));
+	munmap(aligned + size, (size_t)(mapped + alignment - aligned));
+	return aligned;
+#endif
+}
+void unmap(void *memory, size_t size) {
+#if defined(_WIN32)
+	(void)size;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+// the freelist heads are pointed to by the first and last node in each list, so a heap can't just be copied
+void move_heap(struct heap *to, struct heap *from) {
+	*to = *from;
+	for (int i = 0; i < NUM_FREELISTS; ++i) {
+		union node *list = &to->freelists[i];
+		if (from->freelists[i].next == &from->freelists[i]) {
+			list->next = list;
+			list->prev = list;
+		} else {
+			list->next->prev = list;
+			list->prev->next = list;
+		}
+	}
+}
+
+void link_arena(struct buddy_arena **list, struct buddy_arena *arena) {
+	arena->prev = NULL;
+	arena->next = *list;
+	if (*list)
+		(*list)->prev = arena;
+	*list = arena;
+}
+void unlink_arena(struct buddy_arena **list, struct buddy_arena *arena) {
+	if (arena->prev)
+		arena->prev->next = arena->next;
+	else
+		*list = arena->next;
+	if (arena->next)
+		arena->next->prev = arena->prev;
+}
+
+void initialize_arena_heap(struct arena_heap *arenas, size_t arena_size, size_t retain_bytes) {
+	// arena_size must be a power of 2, and a multiple of the page size
+	assert(arena_size >= page_size() && (arena_size & (arena_size - 1)) == 0);
+	memset(arenas, 0, sizeof(struct arena_heap));
+	arenas->arena_size = arena_size;
+	arenas->retain_bytes = retain_bytes;
+}
+
+struct buddy_arena *arena_of(struct arena_heap *arenas, void *block) {
+	char *memory = (char *)((uintptr_t)block & ~(uintptr_t)(arenas->arena_size - 1));
+	struct buddy_arena *arena = (struct buddy_arena *)(memory + ARENA_HEADER_OFFSET);
+	assert(arena->owner == arenas); // block isn't from this heap
+	return arena;
+}
+void unmap_arena(struct arena_heap *arenas, struct buddy_arena *arena) {
+	arenas->mapped_bytes -= arena->size;
+	unmap((char *)arena - ARENA_HEADER_OFFSET, arena->size);
+}
+
+// the arena's header goes in the first block, which is the start of the arena
+struct buddy_arena *map_arena(struct arena_heap *arenas) {
+	void *memory = map_aligned(arenas->arena_size, arenas->arena_size);
+	if (!memory)
+		return NULL;
+	struct heap heap;
+	initialize(&heap, memory, arenas->arena_size);
+	struct buddy_arena *arena = allocate(&heap, sizeof(struct buddy_arena));
+	assert(arena && (char *)arena - (char *)memory == ARENA_HEADER_OFFSET);
+	move_heap(&arena->heap, &heap);
+	arena->owner = arenas;
+	arena->size = arenas->arena_size;
+	arena->num_blocks = 0;
+	arena->failed_log2 = NUM_FREELISTS;
+	arena->is_large = 0;
+	arenas->mapped_bytes += arena->size;
+	return arena;
+}
+
+// blocks bigger than this don't fit next to the header
+size_t largest_arena_block(struct arena_heap *arenas) {
+	return arenas->arena_size / 2 - sizeof(union node);
+}
+
+void *allocate_large(struct arena_heap *arenas, size_t size) {
+	size_t page = page_size();
+	if (size > SIZE_MAX - LARGE_HEADER_SIZE - page)
+		return NULL;
+	size_t mapping = (LARGE_HEADER_SIZE + size + page - 1) & ~(page - 1);
+	char *memory = map_aligned(mapping, arenas->arena_size);
+	if (!memory)
+		return NULL;
+	struct buddy_arena *arena = (struct buddy_arena *)(memory + ARENA_HEADER_OFFSET);
+	arena->owner = arenas;
+	arena->size = mapping;
+	arena->num_blocks = 1;
+	arena->is_large = 1;
+	link_arena(&arenas->large, arena);
+	arenas->mapped_bytes += mapping;
+	return memory + LARGE_HEADER_SIZE;
+}
+
+void *arena_allocate(struct arena_heap *arenas, size_t size) {
+	if (size > largest_arena_block(arenas))
+		return allocate_large(arenas, size);
+
+	int log2 = ceillog2(size + sizeof(union node));
+	for (struct buddy_arena *arena = arenas->arenas; arena; arena = arena->next) {
+		if (log2 >= arena->failed_log2)
+			continue;
+		void *block = allocate(&arena->heap, size);
+		if (block) {
+			arena->num_blocks++;
+			return block;
+		}
+		arena->failed_log2 = log2;
+	}
+
+	struct buddy_arena *arena = arenas->spares;
+	if (arena) {
+		unlink_arena(&arenas->spares, arena);
+		arenas->num_spares--;
+	} else {
+		arena = map_arena(arenas);
+	}
+	if (!arena)
+		return NULL;
+	link_arena(&arenas->arenas, arena);
+	arenas->num_arenas++;
+	void *block = allocate(&arena->heap, size);
+	arena->num_blocks++;
+	return block;
+}
+
+void arena_deallocate(struct arena_heap *arenas, void *block) {
+	if (!block)
+		return;
+
+	struct buddy_arena *arena = arena_of(arenas, block);
+	if (arena->is_large) {
+		unlink_arena(&arenas->large, arena);
+		unmap_arena(arenas, arena);
+		return;
+	}
+
+	deallocate(&arena->heap, block);
+	arena->failed_log2 = NUM_FREELISTS;
+	if (--arena->num_blocks)
+		return;
+	unlink_arena(&arenas->arenas, arena);
+	arenas->num_arenas--;
+	if ((size_t)(arenas->num_spares + 1) * arenas->arena_size <= arenas->retain_bytes) {
+		link_arena(&arenas->spares, arena);
+		arenas->num_spares++;
+		return;
+	}
+	unmap_arena(arenas, arena);
+}
+
+// usable bytes, which can be more than what was asked for
+size_t arena_block_size(struct arena_heap *arenas, void *block) {
+	struct buddy_arena *arena = arena_of(arenas, block);
+	if (arena->is_large)
+		return arena->size - LARGE_HEADER_SIZE;
+	union node *node = (union node *)((char *)block - sizeof(union node));
+	return (size_t)node->size - sizeof(union node);
+}
+
+void *arena_reallocate(struct arena_heap *arenas, void *block, size_t size) {
+	if (!block)
+		return arena_allocate(arenas, size);
+	if (!size) {
+		arena_deallocate(arenas, block);
+		return NULL;
+	}
+
+	// in place, or somewhere else in the same arena
+	struct buddy_arena *arena = arena_of(arenas, block);
+	size_t old_size = arena_block_size(arenas, block);
+	int fits_arena = size <= largest_arena_block(arenas);
+	if (!arena->is_large && fits_arena) {
+		void *result = reallocate(&arena->heap, block, size);
+		if (result) {
+			arena->failed_log2 = NUM_FREELISTS; // it can free the old block, or split it
+			return result;
 		}
+	}
+	if (arena->is_large && !fits_arena && size <= old_size)
 		return block;
+
+	void *copy = arena_allocate(arenas, size);
+	if (!copy)
+		return NULL;
+	memcpy(copy, block, old_size < size ? old_size : size);
+	arena_deallocate(arenas, block);
+	return copy;
+}
+
+void destroy_arena_heap(struct arena_heap *arenas) {
+	struct buddy_arena *lists[] = { arenas->arenas, arenas->large, arenas->spares };
+	for (int i = 0; i < 3; ++i) {
+		for (struct buddy_arena *arena = lists[i]; arena;) {
+			struct buddy_arena *next = arena->next;
+			unmap_arena(arenas, arena);
+			arena = next;
+		}
 	}
+	assert(!arenas->mapped_bytes);
+	memset(arenas, 0, sizeof(struct arena_heap));
 }
 
 int main(void) {
@@ -239,4 +542,90 @@ int main(void) {
 	deallocate(&heap, h);
 	deallocate(&heap, f);
 	deallocate(&heap, g);
+
+	// a free buddy that's been split only merges once all of it is free
+	char *x = allocate(&heap, 496);
+	char *y = allocate(&heap, 16);
+	char *z = allocate(&heap, 16);
+	deallocate(&heap, y);
+	deallocate(&heap, x);
+	assert(!allocate(&heap, 1000));
+	deallocate(&heap, z);
+	char *all = allocate(&heap, 1000); memset(all, 1, 1000);
+	deallocate(&heap, all);
+
+	// shrinking gives the tail back
+	char *big = allocate(&heap, 1000);
+	big = reallocate(&heap, big, 100);
+	char *tail = allocate(&heap, 496); memset(tail, 1, 496);
+	deallocate(&heap, big);
+	deallocate(&heap, tail);
+
+	{
+		size_t arena_size = 1 << 16;
+		if (arena_size < page_size())
+			arena_size = page_size();
+		struct arena_heap arenas;
+		initialize_arena_heap(&arenas, arena_size, arena_size);
+		assert(!arenas.mapped_bytes);
+
+		// enough blocks for a few arenas, each of them found by masking
+		enum { NUM_BLOCKS = 200 };
+		char *blocks[NUM_BLOCKS];
+		for (int i = 0; i < NUM_BLOCKS; ++i) {
+			blocks[i] = arena_allocate(&arenas, 1000);
+			assert(blocks[i]);
+			memset(blocks[i], i, 1000);
+			assert(arena_block_size(&arenas, blocks[i]) >= 1000);
+		}
+		assert(arenas.num_arenas > 2);
+		assert(arenas.mapped_bytes == (size_t)arenas.num_arenas * arena_size);
+		for (int i = 0; i < NUM_BLOCKS; ++i) {
+			struct buddy_arena *arena = arena_of(&arenas, blocks[i]);
+			assert((char *)blocks[i] > (char *)arena && (char *)blocks[i] < (char *)arena + arena_size);
+			for (int j = 0; j < 1000; ++j)
+				assert(blocks[i][j] == (char)i);
+		}
+
+		// growing in place, moving, and into a large block and back
+		char *r = arena_allocate(&arenas, 100);
+		memset(r, 7, 100);
+		r = arena_reallocate(&arenas, r, 3000);
+		for (int j = 0; j < 100; ++j)
+			assert(r[j] == 7);
+		memset(r, 7, 3000);
+		r = arena_reallocate(&arenas, r, 4 * arena_size);
+		assert(arena_of(&arenas, r)->is_large);
+		for (int j = 0; j < 3000; ++j)
+			assert(r[j] == 7);
+		memset(r, 8, 4 * arena_size);
+		assert(arena_reallocate(&arenas, r, 3 * arena_size) == r);
+		r = arena_reallocate(&arenas, r, 10);
+		assert(!arena_of(&arenas, r)->is_large);
+		for (int j = 0; j < 10; ++j)
+			assert(r[j] == 8);
+		assert(!arena_reallocate(&arenas, r, 0));
+
+		// blocks bigger than a whole arena, still found by masking
+		char *large = arena_allocate(&arenas, 3 * arena_size);
+		assert(arena_of(&arenas, large)->is_large);
+		memset(large, 9, 3 * arena_size);
+		arena_deallocate(&arenas, large);
+
+		// empty arenas get unmapped, but retain_bytes of them are kept
+		for (int i = 0; i < NUM_BLOCKS; ++i)
+			arena_deallocate(&arenas, blocks[i]);
+		assert(arenas.num_arenas == 0 && !arenas.arenas && !arenas.large);
+		assert(arenas.num_spares == 1 && arenas.mapped_bytes == arena_size);
+		char *again = arena_allocate(&arenas, 1000);
+		assert(arena_of(&arenas, again) == arenas.arenas && !arenas.spares);
+		assert(arenas.mapped_bytes == arena_size);
+		arena_deallocate(&arenas, again);
+		char *leaked = arena_allocate(&arenas, 5000);
+		char *leaked_large = arena_allocate(&arenas, 2 * arena_size);
+		memset(leaked, 1, 5000);
+		memset(leaked_large, 1, 2 * arena_size);
+		destroy_arena_heap(&arenas);
+		assert(!arenas.mapped_bytes);
+	}
 }
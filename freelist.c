@@ -11,6 +11,278 @@ void deallocate(void **freelist, void *item) {
 }
 
 #include <assert.h>
+#include <string.h> // memset
+
+// A pool of fixed size objects for many threads, on top of the freelists above. Each thread has a
+// cache of two magazines, which are freelists of up to batch_size objects, so most allocations
+// and frees touch nothing shared. When both magazines are empty or both are full, a whole
+// magazine gets swapped with a global lock-free stack of full magazines. Objects freed on another
+// thread go into that thread's magazines, so they don't have to find their way back.
+//
+// The global stack is a tagged pointer: the top 16 bits count changes to the stack, so a pop
+// fails if the top got popped and pushed back in between (the ABA problem). This relies on user
+// space pointers fitting in 48 bits. Memory comes in page aligned chunks that are only given
+// back when the pool is destroyed, which is what makes reading a stale top safe.
+#include <stdatomic.h>
+#include <stdint.h> // uint64_t, uintptr_t
+#include <stdlib.h> // aligned_alloc, free
+
+#define POOL_CHUNK_SIZE (1 << 16)
+#define POOL_PAGE_SIZE 4096
+#define POINTER_BITS 48
+#define POINTER_MASK ((1ull << POINTER_BITS) - 1)
+
+struct pool {
+	_Alignas(64) _Atomic uint64_t full_magazines; // Tagged pointer to a magazine. Its second word links to the next, the third is its count.
+	_Alignas(64) _Atomic(void *) chunks; // Only ever pushed to until the pool is destroyed, so no ABA.
+	int object_size;
+	int batch_size;
+	// Statistics, updated once per magazine so they stay off the hot path.
+	_Atomic long long num_chunks;
+	_Atomic long long num_allocations;
+	_Atomic long long num_deallocations;
+	_Atomic long long num_magazine_pops;
+	_Atomic long long num_magazine_pushes;
+	_Atomic long long num_retries; // Failed compare and swaps on the global stack, i.e. contention.
+};
+
+struct pool_cache {
+	struct pool *pool;
+	void *loaded;
+	void *previous;
+	int loaded_count;
+	int previous_count;
+	long long num_allocations;
+	long long num_deallocations;
+};
+
+struct pool_stats {
+	long long num_chunks;
+	long long reserved_bytes;
+	long long objects_in_use; // Exact only after every cache has been flushed.
+	long long num_magazine_pops;
+	long long num_magazine_pushes;
+	long long num_retries;
+};
+
+void initialize_pool(struct pool *pool, int object_size, int batch_size) {
+	assert(batch_size > 0);
+	// Objects have to fit the freelist link, the link between magazines and the magazine count.
+	if (object_size < 3 * (int)sizeof(void *))
+		object_size = 3 * (int)sizeof(void *);
+	object_size = (object_size + 15) & ~15;
+	assert(object_size <= POOL_CHUNK_SIZE - POOL_PAGE_SIZE);
+
+	atomic_init(&pool->full_magazines, 0);
+	atomic_init(&pool->chunks, NULL);
+	pool->object_size = object_size;
+	pool->batch_size = batch_size;
+	atomic_init(&pool->num_chunks, 0);
+	atomic_init(&pool->num_allocations, 0);
+	atomic_init(&pool->num_deallocations, 0);
+	atomic_init(&pool->num_magazine_pops, 0);
+	atomic_init(&pool->num_magazine_pushes, 0);
+	atomic_init(&pool->num_retries, 0);
+}
+
+void destroy_pool(struct pool *pool) {
+	void *chunk = atomic_load(&pool->chunks);
+	while (chunk) {
+		void *next = *(void **)chunk;
+		free(chunk);
+		chunk = next;
+	}
+	atomic_store(&pool->chunks, NULL);
+	atomic_store(&pool->full_magazines, 0);
+}
+
+void push_magazine(struct pool *pool, void *magazine, int count) {
+	assert(((uintptr_t)magazine & ~POINTER_MASK) == 0);
+	((uintptr_t *)magazine)[2] = (uintptr_t)count;
+	uint64_t top = atomic_load_explicit(&pool->full_magazines, memory_order_relaxed);
+	for (;;) {
+		atomic_store_explicit((_Atomic(void *) *)&((void **)magazine)[1], (void *)(uintptr_t)(top & POINTER_MASK), memory_order_relaxed);
+		uint64_t new_top = (uintptr_t)magazine | ((top & ~POINTER_MASK) + (1ull << POINTER_BITS));
+		if (atomic_compare_exchange_weak_explicit(&pool->full_magazines, &top, new_top, memory_order_release, memory_order_relaxed))
+			break;
+		atomic_fetch_add_explicit(&pool->num_retries, 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&pool->num_magazine_pushes, 1, memory_order_relaxed);
+}
+
+void *pop_magazine(struct pool *pool, int *count) {
+	uint64_t top = atomic_load_explicit(&pool->full_magazines, memory_order_acquire);
+	for (;;) {
+		void **magazine = (void **)(uintptr_t)(top & POINTER_MASK);
+		if (!magazine)
+			return NULL;
+		// If another thread popped this magazine already, this reads whatever is in there now, and
+		// the tag makes the compare and swap fail.
+		void *next = atomic_load_explicit((_Atomic(void *) *)&magazine[1], memory_order_relaxed);
+		uint64_t new_top = (uintptr_t)next | ((top & ~POINTER_MASK) + (1ull << POINTER_BITS));
+		if (atomic_compare_exchange_weak_explicit(&pool->full_magazines, &top, new_top, memory_order_acquire, memory_order_acquire))
+			break;
+		atomic_fetch_add_explicit(&pool->num_retries, 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&pool->num_magazine_pops, 1, memory_order_relaxed);
+	void **magazine = (void **)(uintptr_t)(top & POINTER_MASK);
+	*count = (int)((uintptr_t *)magazine)[2];
+	return magazine;
+}
+
+// Carves a new chunk into magazines. The first one goes to the caller and the rest get pushed.
+void *grow_pool(struct pool *pool, int *count) {
+	char *chunk = aligned_alloc(POOL_PAGE_SIZE, POOL_CHUNK_SIZE);
+	if (!chunk)
+		return NULL;
+	void *prev = atomic_load_explicit(&pool->chunks, memory_order_relaxed);
+	do *(void **)chunk = prev;
+	while (!atomic_compare_exchange_weak_explicit(&pool->chunks, &prev, chunk, memory_order_release, memory_order_relaxed));
+	atomic_fetch_add_explicit(&pool->num_chunks, 1, memory_order_relaxed);
+
+	// The first 64 bytes hold the chunk link, objects stay 16 byte aligned after that.
+	int num_objects = (POOL_CHUNK_SIZE - 64) / pool->object_size;
+	char *objects = chunk + 64;
+	for (int i = num_objects; i > 0; i -= pool->batch_size) {
+		int first = i > pool->batch_size ? i - pool->batch_size : 0;
+		void *magazine = NULL;
+		for (int j = i - 1; j >= first; --j)
+			deallocate(&magazine, objects + j * pool->object_size);
+		if (first == 0) {
+			*count = i;
+			return magazine;
+		}
+		push_magazine(pool, magazine, i - first);
+	}
+	return NULL;
+}
+
+void initialize_pool_cache(struct pool_cache *cache, struct pool *pool) {
+	memset(cache, 0, sizeof(struct pool_cache));
+	cache->pool = pool;
+}
+
+void publish_counts(struct pool_cache *cache) {
+	atomic_fetch_add_explicit(&cache->pool->num_allocations, cache->num_allocations, memory_order_relaxed);
+	atomic_fetch_add_explicit(&cache->pool->num_deallocations, cache->num_deallocations, memory_order_relaxed);
+	cache->num_allocations = 0;
+	cache->num_deallocations = 0;
+}
+
+void *pool_allocate(struct pool_cache *cache) {
+	if (!cache->loaded) {
+		if (cache->previous_count) {
+			cache->loaded = cache->previous;
+			cache->loaded_count = cache->previous_count;
+			cache->previous = NULL;
+			cache->previous_count = 0;
+		} else {
+			publish_counts(cache);
+			cache->loaded = pop_magazine(cache->pool, &cache->loaded_count);
+			if (!cache->loaded)
+				cache->loaded = grow_pool(cache->pool, &cache->loaded_count);
+			if (!cache->loaded) {
+				cache->loaded_count = 0;
+				return NULL; // out of memory
+			}
+		}
+	}
+	cache->loaded_count--;
+	cache->num_allocations++;
+	return allocate(&cache->loaded);
+}
+
+void pool_deallocate(struct pool_cache *cache, void *object) {
+	if (!object)
+		return;
+	if (cache->loaded_count >= cache->pool->batch_size) {
+		if (cache->previous_count >= cache->pool->batch_size) {
+			publish_counts(cache);
+			push_magazine(cache->pool, cache->previous, cache->previous_count);
+			cache->previous_count = 0;
+			cache->previous = NULL;
+		}
+		void *temp = cache->previous;
+		cache->previous = cache->loaded;
+		cache->loaded = temp;
+		int temp_count = cache->previous_count;
+		cache->previous_count = cache->loaded_count;
+		cache->loaded_count = temp_count;
+	}
+	cache->loaded_count++;
+	cache->num_deallocations++;
+	deallocate(&cache->loaded, object);
+}
+
+// Gives the magazines back to the pool, call this before a thread exits.
+void flush_pool_cache(struct pool_cache *cache) {
+	if (cache->loaded)
+		push_magazine(cache->pool, cache->loaded, cache->loaded_count);
+	if (cache->previous)
+		push_magazine(cache->pool, cache->previous, cache->previous_count);
+	cache->loaded = cache->previous = NULL;
+	cache->loaded_count = cache->previous_count = 0;
+	publish_counts(cache);
+}
+
+void get_pool_stats(struct pool *pool, struct pool_stats *stats) {
+	stats->num_chunks = atomic_load(&pool->num_chunks);
+	stats->reserved_bytes = stats->num_chunks * POOL_CHUNK_SIZE;
+	stats->objects_in_use = atomic_load(&pool->num_allocations) - atomic_load(&pool->num_deallocations);
+	stats->num_magazine_pops = atomic_load(&pool->num_magazine_pops);
+	stats->num_magazine_pushes = atomic_load(&pool->num_magazine_pushes);
+	stats->num_retries = atomic_load(&pool->num_retries);
+}
+
+// Threads allocate and free objects, and pass some to each other through a mailbox so they get
+// freed on a different thread than they were allocated on.
+#include <threads.h> // thrd_create, thrd_join
+#define NUM_POOL_THREADS 4
+#define POOL_MAILBOX_SIZE 64
+struct test_object {
+	uint64_t check;
+	uint64_t not_check;
+	char payload[40];
+};
+struct pool_test {
+	struct pool pool;
+	_Atomic(struct test_object *) mailbox[POOL_MAILBOX_SIZE];
+};
+struct pool_test_thread {
+	struct pool_test *test;
+	unsigned seed;
+};
+int pool_test_thread(void *arg) {
+	struct pool_test_thread *thread = arg;
+	struct pool_cache cache;
+	initialize_pool_cache(&cache, &thread->test->pool);
+	struct test_object *objects[64] = { 0 };
+	for (int i = 0; i < 200000; ++i) {
+		thread->seed = thread->seed * 1103515245 + 12345;
+		unsigned r = thread->seed >> 8;
+		struct test_object **object = &objects[r % 64];
+		if (!*object) {
+			*object = pool_allocate(&cache);
+			assert(*object && (uintptr_t)*object % 16 == 0);
+			(*object)->check = (uint64_t)(uintptr_t)*object ^ r;
+			(*object)->not_check = ~(*object)->check;
+			continue;
+		}
+		if (r & 0x100) {
+			*object = atomic_exchange(&thread->test->mailbox[(r >> 9) % POOL_MAILBOX_SIZE], *object);
+			if (!*object)
+				continue;
+		}
+		assert((*object)->check == ~(*object)->not_check); // Nobody else wrote to it.
+		pool_deallocate(&cache, *object);
+		*object = NULL;
+	}
+	for (int i = 0; i < 64; ++i)
+		pool_deallocate(&cache, objects[i]);
+	flush_pool_cache(&cache);
+	return 0;
+}
+
 int main(void) {
 	void *items[10];
 	void *list = 0;
@@ -33,4 +305,42 @@ int main(void) {
 		assert(index == i);
 		assert(!allocate(&list));
 	}
-}
\ No newline at end of file
+
+	{
+		static struct pool_test test;
+		initialize_pool(&test.pool, sizeof(struct test_object), 32);
+		struct pool_test_thread threads[NUM_POOL_THREADS];
+		thrd_t handles[NUM_POOL_THREADS];
+		for (int t = 0; t < NUM_POOL_THREADS; ++t) {
+			threads[t].test = &test;
+			threads[t].seed = (unsigned)t * 7919 + 1;
+			thrd_create(&handles[t], pool_test_thread, &threads[t]);
+		}
+		for (int t = 0; t < NUM_POOL_THREADS; ++t)
+			thrd_join(handles[t], NULL);
+
+		struct pool_cache cache;
+		initialize_pool_cache(&cache, &test.pool);
+		for (int i = 0; i < POOL_MAILBOX_SIZE; ++i)
+			pool_deallocate(&cache, atomic_load(&test.mailbox[i]));
+		flush_pool_cache(&cache);
+
+		struct pool_stats stats;
+		get_pool_stats(&test.pool, &stats);
+		assert(stats.objects_in_use == 0);
+		assert(stats.num_chunks >= 1 && stats.reserved_bytes == stats.num_chunks * POOL_CHUNK_SIZE);
+		assert(stats.num_magazine_pops > 0 && stats.num_magazine_pushes > 0);
+
+		// Every object made it back, exactly once.
+		long long num_objects = 0;
+		for (void **magazine = (void **)(uintptr_t)(atomic_load(&test.pool.full_magazines) & POINTER_MASK); magazine; magazine = magazine[1]) {
+			int count = 0;
+			for (void **object = magazine; object; object = *object)
+				++count;
+			assert(count == (int)((uintptr_t *)magazine)[2]);
+			num_objects += count;
+		}
+		assert(num_objects == stats.num_chunks * ((POOL_CHUNK_SIZE - 64) / test.pool.object_size));
+		destroy_pool(&test.pool);
+	}
+}
@@ -0,0 +1,758 @@
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy, memmove, memset
+
+// Ordered map with the same kind of macro API as generic_table.c, for when you need range queries.
+// It's a B+tree: all keyvals live in the leaves, which are linked in key order so ranges are a
+// linear scan, and inner nodes only store keys to route lookups. Each node is NODE_SIZE bytes with
+// its keys next to each other, so a binary search touches a few cache lines per level, and with
+// small keys there are only 3-4 levels for millions of items.
+//
+// Keys are ordered with the compare function in the header. The default one compares keys of 1, 2,
+// 4 or 8 bytes as signed integers and anything else with memcmp, so set your own for unsigned or
+// floating point keys, strings and so on. Keys and values are copied as bytes, so anything they
+// point to has to outlive the tree.
+
+// Where the header and nodes come from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+#define NODE_SIZE 512
+
+struct node { // Leaves: [node][keys][values]. Inner nodes: [node][keys][children].
+	int count; // Number of keys. Inner nodes have count + 1 children.
+	int is_leaf;
+	struct node *next; // Leaves only, the next leaf in key order.
+};
+
+struct header { // [header][keyval]
+	int(*compare)(void *context, const void *key_a, const void *key_b, int key_size);
+	void *compare_context;
+	struct node *root;
+	int count;
+	int height; // Number of inner node levels, 0 if the root is a leaf.
+	int key_size;
+	int val_size;
+	int val_offset; // Of the val in a keyval.
+	int leaf_capacity;
+	int inner_capacity;
+	int keyval_size;
+	const struct allocator_callbacks *allocator; // Set with use_allocator, NULL means malloc.
+};
+
+#define btree(KV) KV*
+
+#define get_header(ptree)\
+	((!*(ptree)?(*(ptree)=private__create(sizeof*(*(ptree)),NULL),\
+		private__layout(*(ptree),sizeof(*(ptree))->key,(int)((char*)&(*(ptree))->val-(char*)*(ptree)),sizeof(*(ptree))->val)):0),\
+	(struct header*)(*(ptree))-1)
+
+// Moves the header and all the nodes into memory from the allocator. Do this before adding anything
+// if you can.
+#define use_allocator(ptree, pallocator)\
+	((void)get_header(ptree), private__move((void **)(ptree),(pallocator)))
+
+#define add(ptree, new_key, new_value)do{\
+	(void)get_header(ptree);\
+	(*(ptree))->key = (new_key);\
+	(*(ptree))->val = (new_value);\
+	private__add(*(ptree));\
+}while(0)
+
+#define remove(ptree, existing_key)do{\
+	if (!count(*(ptree))) break;\
+	(*(ptree))->key = (existing_key);\
+	private__remove(*(ptree));\
+}while(0)
+
+#define contains(tree, target_key)\
+	(count(tree) && ((tree)->key=(target_key), private__get(tree)))
+
+// The key has to be in the tree.
+#define get_value(tree, target_key)\
+	((void)contains((tree),(target_key)), (tree)->val)
+
+// Iterates over the keys from low_key up to but not including high_key.
+#define iterate_range(tree, piterator, low_key, high_key)(\
+	count(tree)?\
+		((tree)->key=(low_key), private__seek((tree),(piterator),0), (tree)->key=(high_key), private__seek((tree),(piterator),1))\
+		:private__seek(NULL,(piterator),0))
+
+// Iterates over the keys from low_key up to the last one.
+#define iterate_from(tree, piterator, low_key)(\
+	count(tree)?\
+		((tree)->key=(low_key), private__seek((tree),(piterator),0))\
+		:private__seek(NULL,(piterator),0))
+
+struct iterator {
+	const void *key; // Set by next, point into the leaf and stay valid until the tree is modified.
+	void *val;
+	const struct header *header;
+	struct node *leaf;
+	int index;
+	struct node *end_leaf; // Where to stop, NULL and 0 for the end of the tree.
+	int end_index;
+};
+
+int count(const btree(void) tree) {
+	return tree ? ((struct header *)tree)[-1].count : 0;
+}
+
+int default_compare(void *context, const void *key_a, const void *key_b, int key_size) {
+	(void)context;
+	long long a, b;
+	switch (key_size) {
+	case 1: a = *(const signed char *)key_a; b = *(const signed char *)key_b; break;
+	case 2: a = *(const short *)key_a; b = *(const short *)key_b; break;
+	case 4: a = *(const int *)key_a; b = *(const int *)key_b; break;
+	case 8: a = *(const long long *)key_a; b = *(const long long *)key_b; break;
+	default: return memcmp(key_a, key_b, (size_t)key_size);
+	}
+	return (a > b) - (a < b);
+}
+
+btree(void) private__create(int keyval_size, const struct allocator_callbacks *allocator) {
+	struct header *header = allocate_memory(allocator, sizeof(struct header) + (size_t)keyval_size);
+	memset(header, 0, sizeof header[0]);
+	header->compare = default_compare;
+	header->keyval_size = keyval_size;
+	header->allocator = allocator;
+	return header + 1;
+}
+
+int private__layout(btree(void) tree, int key_size, int val_offset, int val_size) {
+	struct header *header = (struct header *)tree - 1;
+	header->key_size = key_size;
+	header->val_offset = val_offset;
+	header->val_size = val_size;
+	int space = NODE_SIZE - (int)sizeof(struct node) - 8; // Leave room for aligning the values and children.
+	header->leaf_capacity = space / (key_size + val_size);
+	header->inner_capacity = (space - (int)sizeof(struct node *)) / (key_size + (int)sizeof(struct node *));
+	if (header->leaf_capacity < 4)
+		header->leaf_capacity = 4;
+	if (header->inner_capacity < 4)
+		header->inner_capacity = 4;
+	return 0;
+}
+
+int align(int size) {
+	return (size + 7) & ~7;
+}
+
+char *node_key(const struct header *header, const struct node *node, int index) {
+	return (char *)(node + 1) + index * header->key_size;
+}
+
+char *node_val(const struct header *header, const struct node *node, int index) {
+	return (char *)(node + 1) + align(header->leaf_capacity * header->key_size) + index * header->val_size;
+}
+
+struct node **node_children(const struct header *header, const struct node *node) {
+	return (struct node **)((char *)(node + 1) + align(header->inner_capacity * header->key_size));
+}
+
+size_t node_bytes(const struct header *header, int is_leaf) {
+	int size = is_leaf ?
+		align(header->leaf_capacity * header->key_size) + header->leaf_capacity * header->val_size :
+		align(header->inner_capacity * header->key_size) + (header->inner_capacity + 1) * (int)sizeof(struct node *);
+	return sizeof(struct node) + (size_t)size;
+}
+
+struct node *allocate_node(const struct header *header, int is_leaf) {
+	struct node *node = allocate_memory(header->allocator, node_bytes(header, is_leaf));
+	node->count = 0;
+	node->is_leaf = is_leaf;
+	node->next = NULL;
+	return node;
+}
+
+int is_full(const struct header *header, const struct node *node) {
+	return node->count == (node->is_leaf ? header->leaf_capacity : header->inner_capacity);
+}
+
+// Index of the first key in the node that is >= key, or > key if after is set.
+int search(const struct header *header, const struct node *node, const void *key, int after) {
+	int low = 0;
+	int high = node->count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int order = header->compare(header->compare_context, node_key(header, node, mid), key, header->key_size);
+		if (order < 0 || (after && order == 0))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+// Moves the keys (and values or children) of a node from index onwards by offset.
+void shift(const struct header *header, struct node *node, int index, int offset) {
+	int n = node->count - index;
+	memmove(node_key(header, node, index + offset), node_key(header, node, index), (size_t)n * header->key_size);
+	if (node->is_leaf)
+		memmove(node_val(header, node, index + offset), node_val(header, node, index), (size_t)n * header->val_size);
+	else {
+		struct node **children = node_children(header, node);
+		memmove(children + index + 1 + offset, children + index + 1, (size_t)n * sizeof children[0]);
+	}
+}
+
+// Splits the full child at index in two, and adds the key between them to the parent, which isn't full.
+void split_child(const struct header *header, struct node *parent, int index) {
+	struct node *child = node_children(header, parent)[index];
+	struct node *right = allocate_node(header, child->is_leaf);
+	int mid = child->count / 2;
+	const char *separator;
+	if (child->is_leaf) {
+		right->count = child->count - mid;
+		memcpy(node_key(header, right, 0), node_key(header, child, mid), (size_t)right->count * header->key_size);
+		memcpy(node_val(header, right, 0), node_val(header, child, mid), (size_t)right->count * header->val_size);
+		right->next = child->next;
+		child->next = right;
+		separator = node_key(header, right, 0);
+	} else {
+		right->count = child->count - mid - 1;
+		memcpy(node_key(header, right, 0), node_key(header, child, mid + 1), (size_t)right->count * header->key_size);
+		memcpy(node_children(header, right), node_children(header, child) + mid + 1, (size_t)(right->count + 1) * sizeof(struct node *));
+		separator = node_key(header, child, mid); // Moves up to the parent.
+	}
+	child->count = mid;
+
+	shift(header, parent, index, 1);
+	memcpy(node_key(header, parent, index), separator, (size_t)header->key_size);
+	node_children(header, parent)[index + 1] = right;
+	parent->count++;
+}
+
+void private__add(btree(void) tree) {
+	struct header *header = (struct header *)tree - 1;
+	const char *key = tree;
+	const char *val = (const char *)tree + header->val_offset;
+	if (!header->root)
+		header->root = allocate_node(header, 1);
+
+	// Split full nodes on the way down, so there's always room for a key coming up from a split below.
+	if (is_full(header, header->root)) {
+		struct node *root = allocate_node(header, 0);
+		node_children(header, root)[0] = header->root;
+		split_child(header, root, 0);
+		header->root = root;
+		header->height++;
+	}
+	struct node *node = header->root;
+	for (int level = header->height; level > 0; --level) {
+		int i = search(header, node, key, 1);
+		if (is_full(header, node_children(header, node)[i])) {
+			split_child(header, node, i);
+			if (header->compare(header->compare_context, key, node_key(header, node, i), header->key_size) >= 0)
+				i++;
+		}
+		node = node_children(header, node)[i];
+	}
+
+	int i = search(header, node, key, 0);
+	if (i < node->count && header->compare(header->compare_context, node_key(header, node, i), key, header->key_size) == 0) {
+		memcpy(node_val(header, node, i), val, (size_t)header->val_size);
+		return;
+	}
+	shift(header, node, i, 1);
+	memcpy(node_key(header, node, i), key, (size_t)header->key_size);
+	memcpy(node_val(header, node, i), val, (size_t)header->val_size);
+	node->count++;
+	header->count++;
+}
+
+// Copies the value into the keyval after the header if the key is found, otherwise zeroes it.
+int private__get(btree(void) tree) {
+	struct header *header = (struct header *)tree - 1;
+	const char *key = tree;
+	struct node *node = header->root;
+	for (int level = header->height; level > 0; --level)
+		node = node_children(header, node)[search(header, node, key, 1)];
+	int i = search(header, node, key, 0);
+	char *val = (char *)tree + header->val_offset;
+	if (i < node->count && header->compare(header->compare_context, node_key(header, node, i), key, header->key_size) == 0) {
+		memcpy(val, node_val(header, node, i), (size_t)header->val_size);
+		return 1;
+	}
+	memset(val, 0, (size_t)header->val_size);
+	return 0;
+}
+
+// Moves the last key of the child's left sibling over to the child.
+void borrow_from_left(const struct header *header, struct node *parent, int index) {
+	struct node **children = node_children(header, parent);
+	struct node *child = children[index];
+	struct node *left = children[index - 1];
+	shift(header, child, 0, 1);
+	if (child->is_leaf) {
+		memcpy(node_key(header, child, 0), node_key(header, left, left->count - 1), (size_t)header->key_size);
+		memcpy(node_val(header, child, 0), node_val(header, left, left->count - 1), (size_t)header->val_size);
+		memcpy(node_key(header, parent, index - 1), node_key(header, child, 0), (size_t)header->key_size);
+	} else {
+		struct node **child_children = node_children(header, child);
+		child_children[1] = child_children[0]; // shift moved the children after the keys, but not the first one.
+		child_children[0] = node_children(header, left)[left->count];
+		memcpy(node_key(header, child, 0), node_key(header, parent, index - 1), (size_t)header->key_size);
+		memcpy(node_key(header, parent, index - 1), node_key(header, left, left->count - 1), (size_t)header->key_size);
+	}
+	left->count--;
+	child->count++;
+}
+
+// Moves the first key of the child's right sibling over to the child.
+void borrow_from_right(const struct header *header, struct node *parent, int index) {
+	struct node **children = node_children(header, parent);
+	struct node *child = children[index];
+	struct node *right = children[index + 1];
+	if (child->is_leaf) {
+		memcpy(node_key(header, child, child->count), node_key(header, right, 0), (size_t)header->key_size);
+		memcpy(node_val(header, child, child->count), node_val(header, right, 0), (size_t)header->val_size);
+		shift(header, right, 1, -1);
+		memcpy(node_key(header, parent, index), node_key(header, right, 0), (size_t)header->key_size);
+	} else {
+		struct node **right_children = node_children(header, right);
+		memcpy(node_key(header, child, child->count), node_key(header, parent, index), (size_t)header->key_size);
+		node_children(header, child)[child->count + 1] = right_children[0];
+		memcpy(node_key(header, parent, index), node_key(header, right, 0), (size_t)header->key_size);
+		right_children[0] = right_children[1];
+		shift(header, right, 1, -1);
+	}
+	right->count--;
+	child->count++;
+}
+
+// Merges the child at index + 1 into the child at index, and removes the key between them from the parent.
+void merge_children(const struct header *header, struct node *parent, int index) {
+	struct node **children = node_children(header, parent);
+	struct node *left = children[index];
+	struct node *right = children[index + 1];
+	if (left->is_leaf) {
+		memcpy(node_key(header, left, left->count), node_key(header, right, 0), (size_t)right->count * header->key_size);
+		memcpy(node_val(header, left, left->count), node_val(header, right, 0), (size_t)right->count * header->val_size);
+		left->count += right->count;
+		left->next = right->next;
+	} else {
+		memcpy(node_key(header, left, left->count), node_key(header, parent, index), (size_t)header->key_size);
+		memcpy(node_key(header, left, left->count + 1), node_key(header, right, 0), (size_t)right->count * header->key_size);
+		memcpy(node_children(header, left) + left->count + 1, node_children(header, right), (size_t)(right->count + 1) * sizeof(struct node *));
+		left->count += right->count + 1;
+	}
+	deallocate_memory(header->allocator, right, node_bytes(header, right->is_leaf));
+	shift(header, parent, index + 1, -1);
+	parent->count--;
+}
+
+// Makes sure the child at index has more than the minimum number of keys, so that a key can be removed
+// from it. Returns the node that now covers the child's keys, which is different if it got merged.
+struct node *fix_child(const struct header *header, struct node *parent, int index) {
+	struct node **children = node_children(header, parent);
+	struct node *child = children[index];
+	int min_count = child->is_leaf ? header->leaf_capacity / 2 : (header->inner_capacity - 1) / 2;
+	if (child->count > min_count)
+		return child;
+	if (index > 0 && children[index - 1]->count > min_count)
+		borrow_from_left(header, parent, index);
+	else if (index < parent->count && children[index + 1]->count > min_count)
+		borrow_from_right(header, parent, index);
+	else if (index > 0) {
+		merge_children(header, parent, index - 1);
+		return children[index - 1];
+	} else
+		merge_children(header, parent, index);
+	return child;
+}
+
+void private__remove(btree(void) tree) {
+	struct header *header = (struct header *)tree - 1;
+	const char *key = tree;
+	struct node *node = header->root;
+	for (int level = header->height; level > 0; --level) {
+		struct node *child = fix_child(header, node, search(header, node, key, 1));
+		if (node == header->root && node->count == 0) { // The root's last two children got merged.
+			header->root = child;
+			header->height--;
+			deallocate_memory(header->allocator, node, node_bytes(header, 0));
+		}
+		node = child;
+	}
+
+	int i = search(header, node, key, 0);
+	if (i < node->count && header->compare(header->compare_context, node_key(header, node, i), key, header->key_size) == 0) {
+		shift(header, node, i + 1, -1);
+		node->count--;
+		header->count--;
+	}
+	if (!header->count) {
+		deallocate_memory(header->allocator, header->root, node_bytes(header, 1));
+		header->root = NULL;
+	}
+}
+
+int private__seek(const btree(void) tree, struct iterator *iterator, int end) {
+	struct node *node = NULL;
+	int i = 0;
+	if (tree) {
+		const struct header *header = (const struct header *)tree - 1;
+		iterator->header = header;
+		node = header->root;
+		for (int level = header->height; level > 0; --level)
+			node = node_children(header, node)[search(header, node, tree, 1)];
+		i = search(header, node, tree, 0);
+		if (i == node->count) {
+			node = node->next;
+			i = 0;
+		}
+	}
+	if (end) {
+		iterator->end_leaf = node;
+		iterator->end_index = i;
+		// empty if the first key is already at or past the end, which covers low_key > high_key too
+		const struct header *header = iterator->header;
+		if (iterator->leaf && header->compare(header->compare_context, node_key(header, iterator->leaf, iterator->index), tree, header->key_size) >= 0)
+			iterator->leaf = NULL;
+	} else {
+		iterator->leaf = node;
+		iterator->index = i;
+		iterator->end_leaf = NULL;
+		iterator->end_index = 0;
+	}
+	return 0;
+}
+
+void iterate_all(const btree(void) tree, struct iterator *iterator) {
+	memset(iterator, 0, sizeof iterator[0]);
+	if (count(tree)) {
+		const struct header *header = (const struct header *)tree - 1;
+		struct node *node = header->root;
+		for (int level = header->height; level > 0; --level)
+			node = node_children(header, node)[0];
+		iterator->header = header;
+		iterator->leaf = node;
+	}
+}
+
+// Returns 0 when there are no keys left, otherwise points the iterator's key and val at the next keyval.
+int next(struct iterator *iterator) {
+	if (!iterator->leaf || (iterator->leaf == iterator->end_leaf && iterator->index == iterator->end_index))
+		return 0;
+	iterator->key = node_key(iterator->header, iterator->leaf, iterator->index);
+	iterator->val = node_val(iterator->header, iterator->leaf, iterator->index);
+	if (++iterator->index == iterator->leaf->count) {
+		iterator->leaf = iterator->leaf->next;
+		iterator->index = 0;
+	}
+	return 1;
+}
+
+void free_node(const struct header *header, struct node *node) {
+	if (!node->is_leaf)
+		for (int i = 0; i <= node->count; ++i)
+			free_node(header, node_children(header, node)[i]);
+	deallocate_memory(header->allocator, node, node_bytes(header, node->is_leaf));
+}
+
+// Copies the node and everything under it into memory from the allocator, and frees the old nodes.
+// Leaves get linked in key order, after *prev_leaf.
+struct node *move_node(const struct header *header, struct node *node, const struct allocator_callbacks *allocator, struct node **prev_leaf) {
+	size_t size = node_bytes(header, node->is_leaf);
+	struct node *copy = allocate_memory(allocator, size);
+	memcpy(copy, node, size);
+	if (copy->is_leaf) {
+		if (*prev_leaf)
+			(*prev_leaf)->next = copy;
+		*prev_leaf = copy;
+	} else {
+		for (int i = 0; i <= copy->count; ++i)
+			node_children(header, copy)[i] = move_node(header, node_children(header, node)[i], allocator, prev_leaf);
+	}
+	deallocate_memory(header->allocator, node, size);
+	return copy;
+}
+
+int private__move(btree(void) *ptree, const struct allocator_callbacks *allocator) {
+	struct header *header = (struct header *)*ptree - 1;
+	struct node *prev_leaf = NULL;
+	if (header->root)
+		header->root = move_node(header, header->root, allocator, &prev_leaf);
+	size_t size = sizeof(struct header) + (size_t)header->keyval_size;
+	struct header *new_header = allocate_memory(allocator, size);
+	memcpy(new_header, header, size);
+	new_header->allocator = allocator;
+	deallocate_memory(header->allocator, header, size);
+	*ptree = new_header + 1;
+	return 0;
+}
+
+void destroy(btree(void) *ptree) {
+	if (*ptree) {
+		struct header *header = (struct header *)*ptree - 1;
+		if (header->root)
+			free_node(header, header->root);
+		deallocate_memory(header->allocator, header, sizeof(struct header) + (size_t)header->keyval_size);
+		*ptree = NULL;
+	}
+}
+
+#undef NDEBUG
+#include <assert.h>
+int compare_strings(void *context, const void *key_a, const void *key_b, int key_size) {
+	(void)context; (void)key_size;
+	return strcmp(*(const char **)key_a, *(const char **)key_b);
+}
+// Checks the node sizes and key order, and returns the number of keys under the node.
+int check_node(const struct header *header, const struct node *node, int level, const void *low, const void *high) {
+	if (node != header->root) {
+		int min_count = node->is_leaf ? header->leaf_capacity / 2 : (header->inner_capacity - 1) / 2;
+		assert(node->count >= min_count);
+	}
+	assert(node->is_leaf == (level == 0));
+	for (int i = 0; i < node->count; ++i) {
+		const char *key = node_key(header, node, i);
+		assert(!low || header->compare(header->compare_context, low, key, header->key_size) <= 0);
+		assert(!high || header->compare(header->compare_context, key, high, header->key_size) < 0);
+		assert(!i || header->compare(header->compare_context, node_key(header, node, i - 1), key, header->key_size) < 0);
+	}
+	if (node->is_leaf)
+		return node->count;
+	int total = 0;
+	for (int i = 0; i <= node->count; ++i) {
+		const void *child_low = i ? node_key(header, node, i - 1) : low;
+		const void *child_high = i < node->count ? node_key(header, node, i) : high;
+		total += check_node(header, node_children(header, node)[i], level - 1, child_low, child_high);
+	}
+	return total;
+}
+void check_tree(const btree(void) tree) {
+	if (tree) {
+		const struct header *header = (const struct header *)tree - 1;
+		assert(header->root ? check_node(header, header->root, header->height, NULL, NULL) == header->count : !header->count);
+	}
+}
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
+int main(void) {
+	struct int_int { int key; int val; };
+	struct str_int { char *key; int val; };
+
+	{
+		btree(struct int_int) tree = NULL;
+		assert(!count(tree));
+		assert(!contains(tree, 0));
+		struct iterator iterator;
+		iterate_all(tree, &iterator);
+		assert(!next(&iterator));
+		iterate_range(tree, &iterator, 0, 10);
+		assert(!next(&iterator));
+		destroy(&tree);
+	}
+
+	{
+		static int keys[100000];
+		int n = sizeof keys / sizeof keys[0];
+		for (int i = 0; i < n; ++i)
+			keys[i] = i;
+		unsigned long long seed = 42;
+		for (int i = n - 1; i > 0; --i) {
+			seed ^= seed >> 12;
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			int j = (int)(seed * 0x2545F4914F6CDD1Du % (unsigned)(i + 1));
+			int temp = keys[i];
+			keys[i] = keys[j];
+			keys[j] = temp;
+		}
+
+		btree(struct int_int) tree = NULL;
+		for (int i = 0; i < n; ++i)
+			add(&tree, keys[i], 2 * keys[i]);
+		check_tree(tree);
+		assert(count(tree) == n);
+		for (int i = 0; i < n; ++i)
+			assert(get_value(tree, i) == 2 * i);
+		assert(!contains(tree, -1) && !contains(tree, n));
+		add(&tree, 7, 700);
+		assert(count(tree) == n && get_value(tree, 7) == 700);
+
+		// Everything comes out in order.
+		struct iterator iterator;
+		int expected = 0;
+		for (iterate_all(tree, &iterator); next(&iterator); ++expected)
+			assert(*(const int *)iterator.key == expected);
+		assert(expected == n);
+
+		expected = 1000;
+		for (iterate_range(tree, &iterator, 1000, 2000); next(&iterator); ++expected) {
+			assert(*(const int *)iterator.key == expected);
+			*(int *)iterator.val = -expected;
+		}
+		assert(expected == 2000);
+		assert(get_value(tree, 1500) == -1500 && get_value(tree, 2000) == 4000);
+		iterate_range(tree, &iterator, 500, 500);
+		assert(!next(&iterator));
+		iterate_range(tree, &iterator, 500, 100);
+		assert(!next(&iterator));
+		iterate_range(tree, &iterator, n + 10, -10);
+		assert(!next(&iterator));
+		iterate_range(tree, &iterator, -10, 2);
+		assert(next(&iterator) && *(const int *)iterator.key == 0);
+		assert(next(&iterator) && *(const int *)iterator.key == 1);
+		assert(!next(&iterator));
+		expected = n - 5;
+		for (iterate_from(tree, &iterator, n - 5); next(&iterator); ++expected)
+			assert(*(const int *)iterator.key == expected);
+		assert(expected == n);
+
+		for (int i = 0; i < n; ++i)
+			if (keys[i] % 2)
+				remove(&tree, keys[i]);
+		check_tree(tree);
+		assert(count(tree) == n / 2);
+		for (int i = 0; i < n; ++i)
+			assert(contains(tree, i) == !(i % 2));
+		expected = 0;
+		for (iterate_range(tree, &iterator, 1, n); next(&iterator); ++expected)
+			assert(*(const int *)iterator.key == 2 * expected + 2);
+		assert(expected == n / 2 - 1);
+
+		for (int i = 0; i < n; ++i)
+			remove(&tree, keys[i]);
+		assert(!count(tree));
+		iterate_all(tree, &iterator);
+		assert(!next(&iterator));
+		add(&tree, 1, 1);
+		assert(count(tree) == 1 && get_value(tree, 1) == 1);
+		destroy(&tree);
+		assert(!tree);
+	}
+
+	{
+		// The default compare function orders negative numbers first.
+		btree(struct int_int) tree = NULL;
+		for (int i = 5; i >= -5; --i)
+			add(&tree, i, i);
+		struct iterator iterator;
+		int expected = -5;
+		for (iterate_all(tree, &iterator); next(&iterator); ++expected)
+			assert(*(const int *)iterator.key == expected);
+		assert(expected == 6);
+		destroy(&tree);
+	}
+
+	{
+		// Prefix scan: everything from the prefix up to the prefix with its last character incremented.
+		btree(struct str_int) tree = NULL;
+		get_header(&tree)->compare = compare_strings;
+		const char *words[] = { "banana", "apricot", "app", "b", "apple", "aq", "ap", "a" };
+		for (int i = 0; i < 8; ++i)
+			add(&tree, (char *)words[i], i);
+		struct iterator iterator;
+		const char *expected[] = { "ap", "app", "apple", "apricot" };
+		int i = 0;
+		for (iterate_range(tree, &iterator, "ap", "aq"); next(&iterator); ++i)
+			assert(strcmp(*(char *const *)iterator.key, expected[i]) == 0);
+		assert(i == 4);
+		assert(get_value(tree, "apple") == 4);
+		destroy(&tree);
+	}
+
+	{
+		// Random adds and removes, checked against a plain array.
+		static int values[5000];
+		int n = sizeof values / sizeof values[0];
+		btree(struct int_int) tree = NULL;
+		int num_items = 0;
+		unsigned long long seed = 1234;
+		for (int round = 0; round < 400000; ++round) {
+			seed ^= seed >> 12;
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			unsigned long long random = seed * 0x2545F4914F6CDD1Du;
+			int key = (int)(random % (unsigned)n);
+			if ((random >> 32) % 3) {
+				num_items += !values[key];
+				values[key] = round + 1;
+				add(&tree, key, round + 1);
+			} else {
+				num_items -= !!values[key];
+				values[key] = 0;
+				remove(&tree, key);
+			}
+			assert(count(tree) == num_items);
+			if (round % 50000 == 0) {
+				check_tree(tree);
+				struct iterator iterator;
+				int previous = -1;
+				for (iterate_all(tree, &iterator); next(&iterator);) {
+					int k = *(const int *)iterator.key;
+					assert(k > previous && values[k] == *(const int *)iterator.val);
+					for (int j = previous + 1; j < k; ++j)
+						assert(!values[j]);
+					previous = k;
+				}
+			}
+		}
+		check_tree(tree);
+		destroy(&tree);
+	}
+
+	{
+		// Nodes come from the allocator and go back with the size they were allocated with, also when
+		// a tree that's already in use moves to another allocator.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		btree(struct int_int) tree = NULL;
+		for (int i = 0; i < 5000; ++i)
+			add(&tree, i, i);
+		use_allocator(&tree, &callbacks);
+		assert(allocated > 5000 * sizeof(struct int_int));
+		for (int i = 5000; i < 20000; ++i)
+			add(&tree, i, -i);
+		for (int i = 0; i < 20000; i += 2)
+			remove(&tree, i);
+		check_tree(tree);
+		struct iterator iterator;
+		int expected = 1;
+		for (iterate_all(tree, &iterator); next(&iterator); expected += 2)
+			assert(*(const int *)iterator.key == expected && *(const int *)iterator.val == (expected < 5000 ? expected : -expected));
+		assert(expected == 20001);
+		for (int i = 1; i < 20000; i += 2)
+			remove(&tree, i);
+		assert(!count(tree) && allocated == sizeof(struct header) + sizeof(struct int_int)); // Just the header.
+		destroy(&tree);
+		assert(!allocated);
+	}
+
+	{
+		// This shouldn't leak.
+		for (int i = 0; i < 1000; ++i) {
+			btree(struct int_int) tree = NULL;
+			for (int j = 0; j < 10000; ++j)
+				add(&tree, j, j);
+			for (int j = 0; j < 5000; ++j)
+				remove(&tree, j);
+			destroy(&tree);
+		}
+	}
+}
@@ -1,7 +1,45 @@
 #include <stdlib.h> // realloc, free
+#include <string.h> // memcpy
+
+// Where a list gets its memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+void *reallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t old_size, size_t new_size) {
+	if (!allocator)
+		return realloc(block, new_size);
+	if (allocator->reallocate)
+		return allocator->reallocate(allocator->context, block, old_size, new_size, 16);
+	void *new_block = allocator->allocate(allocator->context, new_size, 16);
+	if (block) {
+		memcpy(new_block, block, old_size < new_size ? old_size : new_size);
+		deallocate_memory(allocator, block, old_size);
+	}
+	return new_block;
+}
 
 #define list(T) T*
 
+// Moves the list into memory from the allocator. The allocator pointer lives in the spare ints
+// before the capacity.
+#define use_allocator(plist, pallocator)\
+	private__move((plist), (pallocator), sizeof *(*plist))
+
 #define reserve(plist, num_items)\
 	private__reserve((plist), (num_items), sizeof *(*plist))
 
@@ -28,11 +66,41 @@ int capacity(const list(void) list) {
 	return list ? ((int *)list)[-2] : 0;
 }
 
-void destroy(list(void) *plist) {
-	free((int *)(*plist) - 4);
+const struct allocator_callbacks *get_allocator(const list(void) list) {
+	return list ? ((const struct allocator_callbacks **)list)[-2] : NULL;
+}
+
+// A macro so that the allocator gets back the size it handed out.
+#define destroy(plist)\
+	private__destroy((plist), sizeof *(*plist))
+
+static void private__destroy(list(void) *plist, int item_size) {
+	if (*plist)
+		deallocate_memory(get_allocator(*plist), (int *)(*plist) - 4, (size_t)capacity(*plist) * item_size + 4 * sizeof(int));
 	*plist = NULL;
 }
 
+static void private__resize(list(void) *plist, int new_capacity, int item_size, const struct allocator_callbacks *allocator) {
+	// Overallocate by 4 ints to keep overall alignment to 16 bytes.
+	int cnt = count(*plist);
+	size_t old_size = *plist ? (size_t)capacity(*plist) * item_size + 4 * sizeof(int) : 0;
+	size_t new_size = (size_t)new_capacity * item_size + 4 * sizeof(int);
+	int *newlist;
+	if (allocator == get_allocator(*plist)) {
+		newlist = (int *)reallocate_memory(allocator, *plist ? (int *)(*plist) - 4 : NULL, old_size, new_size) + 4;
+	} else {
+		newlist = (int *)allocate_memory(allocator, new_size) + 4;
+		if (*plist) {
+			memcpy(newlist, *plist, (size_t)cnt * item_size);
+			deallocate_memory(get_allocator(*plist), (int *)(*plist) - 4, old_size);
+		}
+	}
+	((const struct allocator_callbacks **)newlist)[-2] = allocator;
+	newlist[-2] = new_capacity;
+	newlist[-1] = cnt;
+	*plist = newlist;
+}
+
 static void private__reserve(list(void) *plist, int min_capacity, int item_size) {
 	int cap = capacity(*plist);
 	if (cap < min_capacity) {
@@ -41,16 +109,24 @@ static void private__reserve(list(void) *plist, int min_capacity, int item_size)
 			cap = 64;
 		while (cap < min_capacity)
 			cap *= 2;
-		// Overallocate by 4 ints to keep overall alignment to 16 bytes.
-		int cnt = count(*plist);
-		int *newlist = (int *)realloc(*plist ? (int *)(*plist) - 4 : NULL, cap * item_size + 4 * sizeof(int)) + 4;
-		newlist[-2] = cap;
-		newlist[-1] = cnt;
-		*plist = newlist;
+		private__resize(plist, cap, item_size, get_allocator(*plist));
 	}
 }
 
+static void private__move(list(void) *plist, const struct allocator_callbacks *allocator, int item_size) {
+	private__resize(plist, capacity(*plist) > 64 ? capacity(*plist) : 64, item_size, allocator);
+}
+
 #include <assert.h>
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	{
 		list(int) *ints = NULL;
@@ -72,6 +148,25 @@ int main(void) {
 		assert(!ints);
 	}
 	
+	{
+		// A list that's already in use moves to the allocator, and growing and destroying it give the
+		// old blocks back with the size they were allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		list(int) ints = NULL;
+		for (int i = 0; i < 100; ++i)
+			add(&ints, i);
+		use_allocator(&ints, &callbacks);
+		assert(get_allocator(ints) == &callbacks);
+		for (int i = 100; i < 10000; ++i)
+			add(&ints, i);
+		assert(allocated == (size_t)capacity(ints) * sizeof ints[0] + 4 * sizeof(int));
+		for (int i = 0; i < 10000; ++i)
+			assert(ints[i] == i);
+		destroy(&ints);
+		assert(!allocated);
+	}
+
 	{
 		// This shouldn't leak.
 		for (int i = 0; i < 100000; ++i) {
@@ -2,8 +2,28 @@
 #include <string.h> // memcmp, memcpy, memset
 #include <stdint.h> // uintptr_t
 
+// Where a set and its key slabs get their memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
 struct slab {
 	struct slab *prev;
+	const struct allocator_callbacks *allocator; // Where this slab came from, and where the next one comes from.
 	int capacity;
 	int cursor;
 	// Memory comes right after here.
@@ -21,6 +41,7 @@ struct header { // [header][keyvals][metadata]
 	int count;
 	int capacity;
 	int num_tombstones;
+	const struct allocator_callbacks *allocator; // Set with use_allocator, NULL means malloc.
 };
 
 #define TOMBSTONE 1
@@ -33,6 +54,11 @@ struct header { // [header][keyvals][metadata]
 #define reserve(pset, min_capacity)\
 	private__reserve((pset),(min_capacity),sizeof*(*(pset)))
 
+// Moves the set into memory from the allocator, along with the slab, which is where the copy
+// function should allocate items from. Do this before adding anything if you can.
+#define use_allocator(pset, pallocator)\
+	private__move((pset),capacity(*(pset))?capacity(*(pset)):64,sizeof*(*(pset)),(pallocator))
+
 #define get_header(pset)\
 	((!*(pset)?(reserve((pset),64),0):0),(struct header*)(*(pset))-1)
 
@@ -61,11 +87,12 @@ void *allocate(struct slab **slab, int size, int alignment) {
 	for (;;) {
 		int capacity = 128;
 		if (*slab) {
-			capacity = (*slab)->capacity;
+			if ((*slab)->capacity) // Slabs that only say which allocator to use are empty.
+				capacity = (*slab)->capacity;
 			uintptr_t unaligned = (uintptr_t)(*slab + 1) + (*slab)->cursor;
 			uintptr_t aligned = (unaligned + mask) & ~mask;
 			int needed_size = size + (int)(aligned - unaligned);
-			if (needed_size <= capacity - (*slab)->cursor)
+			if (needed_size <= (*slab)->capacity - (*slab)->cursor)
 			{
 				(*slab)->cursor += needed_size;
 				return (void *)aligned;
@@ -76,7 +103,9 @@ void *allocate(struct slab **slab, int size, int alignment) {
 		while (new_capacity < size + alignment - 1)
 			new_capacity *= 2;
 
-		struct slab *new_slab = malloc(sizeof new_slab[0] + new_capacity);
+		const struct allocator_callbacks *allocator = *slab ? (*slab)->allocator : NULL;
+		struct slab *new_slab = allocate_memory(allocator, sizeof new_slab[0] + (size_t)new_capacity);
+		new_slab->allocator = allocator;
 		new_slab->capacity = new_capacity;
 		new_slab->cursor = 0;
 		new_slab->prev = *slab;
@@ -87,11 +116,23 @@ void *allocate(struct slab **slab, int size, int alignment) {
 void freeall(struct slab **slab) {
 	while (*slab) {
 		struct slab *prev = (*slab)->prev;
-		free(*slab);
+		deallocate_memory((*slab)->allocator, *slab, sizeof(struct slab) + (size_t)(*slab)->capacity);
 		*slab = prev;
 	}
 }
 
+// An empty slab at the bottom of the chain, so that allocate gets memory from the allocator.
+struct slab *first_slab(const struct allocator_callbacks *allocator) {
+	if (!allocator)
+		return NULL;
+	struct slab *slab = allocate_memory(allocator, sizeof slab[0]);
+	slab->prev = NULL;
+	slab->allocator = allocator;
+	slab->capacity = 0;
+	slab->cursor = 0;
+	return slab;
+}
+
 int count(const set(void) set) {
 	return set ? ((struct header *)set)[-1].count : 0;
 }
@@ -100,11 +141,16 @@ int capacity(const set(void) set) {
 	return set ? ((struct header *)set)[-1].capacity : 0;
 }
 
+// Size of the header, items and metadata, which are allocated together.
+size_t set_bytes(const struct header *header) {
+	return (size_t)((char *)(header->metadata + header->capacity + 1) - (char *)header);
+}
+
 void destroy(set(void) *set) {
 	if (*set) {
 		struct header *header = ((struct header *)*set) - 1;
 		freeall(&header->slab);
-		free(header);
+		deallocate_memory(header->allocator, header, set_bytes(header));
 		*set = NULL;
 	}
 }
@@ -149,7 +195,7 @@ unsigned long long default_hash(void *context, const void *key, int key_size) {
 	return hash;
 }
 
-void private__resize(set(void) *pset, int new_capacity, int item_size) {
+void private__move(set(void) *pset, int new_capacity, int item_size, const struct allocator_callbacks *allocator) {
 	int old_count = count(*pset);
 	int old_capacity = capacity(*pset);
 	if (new_capacity <= old_count)
@@ -160,7 +206,7 @@ void private__resize(set(void) *pset, int new_capacity, int item_size) {
 	new_capacity = 1 << pow2;
 	int num_items = new_capacity + 1; //1 extra item at the end for temporary storage that we can take the address of in macros.
 
-	void *new_memory = malloc(sizeof(struct header) + num_items * (item_size + sizeof(unsigned char)));
+	void *new_memory = allocate_memory(allocator, sizeof(struct header) + (size_t)num_items * (item_size + sizeof(unsigned char)));
 	struct header *new_header = new_memory;
 	char *new_items = (char *)(new_header + 1);
 	unsigned char *new_metadata = (unsigned char *)(new_items + num_items * item_size);
@@ -177,7 +223,8 @@ void private__resize(set(void) *pset, int new_capacity, int item_size) {
 		new_header->copy_context = NULL;
 		new_header->equal_context = NULL;
 	}
-	new_header->slab = NULL;
+	new_header->allocator = allocator;
+	new_header->slab = first_slab(allocator);
 	new_header->metadata = new_metadata;
 	new_header->capacity = new_capacity;
 	new_header->num_tombstones = 0;
@@ -206,11 +253,15 @@ void private__resize(set(void) *pset, int new_capacity, int item_size) {
 
 	if (old_header) {
 		freeall(&old_header->slab);
-		free(old_header);
+		deallocate_memory(old_header->allocator, old_header, set_bytes(old_header));
 	}
 	*pset = new_header + 1;
 }
 
+void private__resize(set(void) *pset, int new_capacity, int item_size) {
+	private__move(pset, new_capacity, item_size, *pset ? ((struct header *)*pset)[-1].allocator : NULL);
+}
+
 void private__reserve(set(void) *pset, int min_capacity, int item_size) {
 	if (4 * min_capacity > 3 * capacity(*pset)) {
 		int new_capacity = 4 * min_capacity / 3;
@@ -301,6 +352,15 @@ void copy_string(void *context, void *destination, const void *item, int size, s
 	*dst = allocate(slab, string_size, 1);
 	memcpy(*dst, *src, string_size);
 }
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	{
 		set(int) set = NULL;
@@ -480,6 +540,28 @@ int main(void) {
 		destroy(&set);
 	}
 
+	{
+		// A set that's already in use moves to the allocator along with the strings in its slab, and
+		// growing and destroying it give everything back with the size it was allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		set(char *) strings = NULL;
+		get_header(&strings)->copy = copy_string;
+		static char items[10000][8];
+		for (int i = 0; i < 10000; ++i)
+			for (int j = 0, x = i; j < 7; ++j, x /= 10)
+				items[i][6 - j] = (char)('0' + x % 10);
+		for (int i = 0; i < 1000; ++i)
+			add(&strings, items[i]);
+		use_allocator(&strings, &callbacks);
+		assert(allocated > set_bytes(get_header(&strings)));
+		for (int i = 1000; i < 10000; ++i)
+			add(&strings, items[i]);
+		assert(count(strings) == 10000);
+		destroy(&strings);
+		assert(!allocated);
+	}
+
 	{
 		// This shouldn't leak
 		for (int i = 0; i < 10000; ++i) {
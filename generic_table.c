@@ -2,8 +2,28 @@
 #include <string.h> // memcmp, memcpy, memset
 #include <stdint.h> // uintptr_t
 
+// Where a table and its key slabs get their memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
 struct slab {
 	struct slab *prev;
+	const struct allocator_callbacks *allocator; // Where this slab came from, and where the next one comes from.
 	int capacity;
 	int cursor;
 	// Memory comes right after here.
@@ -21,6 +41,15 @@ struct header { // [header][keyvals][metadata]
 	int count;
 	int capacity;
 	int num_tombstones;
+
+	// Growth policy, 0 means the default. Set these through get_header before adding anything.
+	float max_load; // Grow when adding would go over this load factor, default 3/4, at most 15/16.
+	float min_load; // Shrink when removing goes under this load factor, default 1/4.
+	int min_capacity; // Default 64.
+	int growth_factor; // Grow to at least this many times the capacity, default 2.
+	int never_shrink; // For latency sensitive tables, removing never resizes except to get rid of tombstones.
+
+	const struct allocator_callbacks *allocator; // Set with use_allocator, NULL means malloc.
 };
 
 #define TOMBSTONE 1
@@ -33,6 +62,11 @@ struct header { // [header][keyvals][metadata]
 #define reserve(ptable, min_capacity)\
 	private__reserve((ptable),(min_capacity),sizeof*(*(ptable)),sizeof(*(ptable))->key)
 
+// Moves the table into memory from the allocator, along with the slab, which is where the copy
+// function should allocate keys and values from. Do this before adding anything if you can.
+#define use_allocator(ptable, pallocator)\
+	private__move((ptable),capacity(*(ptable))?capacity(*(ptable)):64,sizeof*(*(ptable)),sizeof(*(ptable))->key,(pallocator))
+
 #define get_header(ptable)\
 	((!*(ptable)?(reserve((ptable),64),0):0),(struct header*)(*(ptable))-1)
 
@@ -65,11 +99,12 @@ void *allocate(struct slab **slab, int size, int alignment) {
 	for (;;) {
 		int capacity = 128;
 		if (*slab) {
-			capacity = (*slab)->capacity;
+			if ((*slab)->capacity) // Slabs that only say which allocator to use are empty.
+				capacity = (*slab)->capacity;
 			uintptr_t unaligned = (uintptr_t)(*slab + 1) + (*slab)->cursor;
 			uintptr_t aligned = (unaligned + mask) & ~mask;
 			int needed_size = size + (int)(aligned - unaligned);
-			if (needed_size <= capacity - (*slab)->cursor)
+			if (needed_size <= (*slab)->capacity - (*slab)->cursor)
 			{
 				(*slab)->cursor += needed_size;
 				return (void *)aligned;
@@ -80,7 +115,9 @@ void *allocate(struct slab **slab, int size, int alignment) {
 		while (new_capacity < size + alignment - 1)
 			new_capacity *= 2;
 
-		struct slab *new_slab = malloc(sizeof new_slab[0] + new_capacity);
+		const struct allocator_callbacks *allocator = *slab ? (*slab)->allocator : NULL;
+		struct slab *new_slab = allocate_memory(allocator, sizeof new_slab[0] + (size_t)new_capacity);
+		new_slab->allocator = allocator;
 		new_slab->capacity = new_capacity;
 		new_slab->cursor = 0;
 		new_slab->prev = *slab;
@@ -91,11 +128,23 @@ void *allocate(struct slab **slab, int size, int alignment) {
 void freeall(struct slab **slab) {
 	while (*slab) {
 		struct slab *prev = (*slab)->prev;
-		free(*slab);
+		deallocate_memory((*slab)->allocator, *slab, sizeof(struct slab) + (size_t)(*slab)->capacity);
 		*slab = prev;
 	}
 }
 
+// An empty slab at the bottom of the chain, so that allocate gets memory from the allocator.
+struct slab *first_slab(const struct allocator_callbacks *allocator) {
+	if (!allocator)
+		return NULL;
+	struct slab *slab = allocate_memory(allocator, sizeof slab[0]);
+	slab->prev = NULL;
+	slab->allocator = allocator;
+	slab->capacity = 0;
+	slab->cursor = 0;
+	return slab;
+}
+
 int count(const table(void) table) {
 	return table ? ((struct header *)table)[-1].count : 0;
 }
@@ -104,11 +153,16 @@ int capacity(const table(void) table) {
 	return table ? ((struct header *)table)[-1].capacity : 0;
 }
 
+// Size of the header, keyvals and metadata, which are allocated together.
+size_t table_bytes(const struct header *header) {
+	return (size_t)((char *)(header->metadata + header->capacity + 1) - (char *)header);
+}
+
 void destroy(table(void) *ptable) {
 	if (*ptable) {
 		struct header *header = ((struct header *)*ptable) - 1;
 		freeall(&header->slab);
-		free(header);
+		deallocate_memory(header->allocator, header, table_bytes(header));
 		*ptable = NULL;
 	}
 }
@@ -153,7 +207,7 @@ unsigned long long default_hash(void *context, const void *key, int key_size) {
 	return hash;
 }
 
-void private__resize(table(void) *ptable, int new_capacity, int keyval_size, int key_size) {
+void private__move(table(void) *ptable, int new_capacity, int keyval_size, int key_size, const struct allocator_callbacks *allocator) {
 	int old_count = count(*ptable);
 	int old_capacity = capacity(*ptable);
 	if (new_capacity <= old_count)
@@ -164,7 +218,7 @@ void private__resize(table(void) *ptable, int new_capacity, int keyval_size, int
 	new_capacity = 1 << pow2;
 	int num_keyvals = new_capacity + 1;
 
-	void *new_memory = malloc(sizeof(struct header) + num_keyvals * (keyval_size + sizeof(unsigned char)));
+	void *new_memory = allocate_memory(allocator, sizeof(struct header) + (size_t)num_keyvals * (keyval_size + sizeof(unsigned char)));
 	struct header *new_header = new_memory;
 	char *new_keyvals = (char *)(new_header + 1);
 	unsigned char *new_metadata = (unsigned char *)(new_keyvals + num_keyvals * keyval_size);
@@ -180,8 +234,14 @@ void private__resize(table(void) *ptable, int new_capacity, int keyval_size, int
 		new_header->hash_context = NULL;
 		new_header->copy_context = NULL;
 		new_header->equal_context = NULL;
+		new_header->max_load = 0;
+		new_header->min_load = 0;
+		new_header->min_capacity = 0;
+		new_header->growth_factor = 0;
+		new_header->never_shrink = 0;
 	}
-	new_header->slab = NULL;
+	new_header->allocator = allocator;
+	new_header->slab = first_slab(allocator);
 	new_header->metadata = new_metadata;
 	new_header->capacity = new_capacity;
 	new_header->num_tombstones = 0;
@@ -210,16 +270,38 @@ void private__resize(table(void) *ptable, int new_capacity, int keyval_size, int
 
 	if (old_header) {
 		freeall(&old_header->slab);
-		free(old_header);
+		deallocate_memory(old_header->allocator, old_header, table_bytes(old_header));
 	}
 	*ptable = new_header + 1;
 }
 
+void private__resize(table(void) *ptable, int new_capacity, int keyval_size, int key_size) {
+	private__move(ptable, new_capacity, keyval_size, key_size, *ptable ? ((struct header *)*ptable)[-1].allocator : NULL);
+}
+
+double table_max_load(const struct header *header) {
+	if (!header || header->max_load <= 0)
+		return 0.75;
+	return header->max_load < 0.9375 ? header->max_load : 0.9375; // Lookups stop at empty slots, so there has to be some.
+}
+
+// Smallest capacity that fits count items at the given load factor, before rounding up to a power of 2.
+int capacity_for(const struct header *header, int count, double load) {
+	int new_capacity = (int)(count / load);
+	if (new_capacity * load < count)
+		new_capacity++;
+	int min_capacity = header && header->min_capacity > 0 ? header->min_capacity : 64;
+	return new_capacity < min_capacity ? min_capacity : new_capacity;
+}
+
 void private__reserve(table(void) *ptable, int min_capacity, int keyval_size, int key_size) {
-	if (4 * min_capacity > 3 * capacity(*ptable)) {
-		int new_capacity = 4 * min_capacity / 3;
-		if (new_capacity < 64)
-			new_capacity = 64;
+	struct header *header = *ptable ? (struct header *)*ptable - 1 : NULL;
+	double max_load = table_max_load(header);
+	if (min_capacity > max_load * capacity(*ptable)) {
+		int new_capacity = capacity_for(header, min_capacity, max_load);
+		int growth_factor = header && header->growth_factor > 1 ? header->growth_factor : 2;
+		if (new_capacity < growth_factor * capacity(*ptable))
+			new_capacity = growth_factor * capacity(*ptable);
 		private__resize(ptable, new_capacity, keyval_size, key_size);
 	}
 }
@@ -274,20 +356,938 @@ void private__remove(table(void) *ptable, const void *key, int keyval_size, int
 			header->metadata[i] = TOMBSTONE;
 			header->count--;
 			header->num_tombstones++;
-			if (4 * header->count < header->capacity)
-				private__resize(ptable, 2 * header->count, keyval_size, key_size);
-			else if (8 * header->num_tombstones > header->capacity)
+			double max_load = table_max_load(header);
+			double min_load = header->min_load > 0 ? header->min_load : 0.25;
+			if (!header->never_shrink && header->count < min_load * header->capacity) {
+				// Shrink to a load factor halfway between the two limits, so it takes a lot of adds or removes
+				// before resizing again. Only if that at least halves the capacity though, resizing to the
+				// same capacity on every remove would be quadratic.
+				int new_capacity = capacity_for(header, header->count, (min_load + max_load) / 2);
+				if (2 * new_capacity <= header->capacity) {
+					private__resize(ptable, new_capacity, keyval_size, key_size);
+					return;
+				}
+			}
+			// Tombstones take up slots just like items, so a higher max load leaves less room for them.
+			double max_tombstones = max_load < 0.75 ? 0.125 : (1 - max_load) / 2;
+			if (header->num_tombstones > max_tombstones * header->capacity)
 				private__resize(ptable, header->capacity, keyval_size, key_size); // Get rid of tombstones.
 			return;
 		}
 	}
 }
 
+#define NUM_CLUSTER_BUCKETS 16
+
+#define table_stats(table, pstats)\
+	private__table_stats((table),(pstats),sizeof*(table),sizeof(table)->key)
+
+// For figuring out why a table got slow. A cluster is a run of non-empty slots (tombstones included),
+// which is what lookups have to walk through. Long clusters with short probes point to tombstones,
+// long probes with a low load factor point to a bad hash function.
+struct table_stats {
+	int count;
+	int capacity;
+	int num_tombstones;
+	double load_factor; // (count + num_tombstones) / capacity, since tombstones slow down probing as much as items.
+	double average_probe_length; // Slots looked at to find an item, 1 if it's in its home slot.
+	int max_probe_length;
+	int max_cluster_length;
+	int clusters[NUM_CLUSTER_BUCKETS]; // clusters[i] counts clusters of length 2^i to 2^(i+1)-1, the last one also the longer ones.
+	long long bytes; // Header, keyvals and metadata.
+	long long slab_bytes; // Memory allocated by the copy function, including what's not used yet.
+};
+
+// One pass over the slots without allocating, so it's fine to sample every now and then. It has to
+// hash every key to find its home slot though, so it costs about as much as looking up every item.
+void private__table_stats(const table(void) table, struct table_stats *stats, int keyval_size, int key_size) {
+	*stats = (struct table_stats){ 0 };
+	if (!table)
+		return;
+	struct header *header = (struct header *)table - 1;
+	stats->count = header->count;
+	stats->capacity = header->capacity;
+	stats->num_tombstones = header->num_tombstones;
+	stats->load_factor = (double)(header->count + header->num_tombstones) / header->capacity;
+	stats->bytes = sizeof(struct header) + (header->capacity + 1LL) * (keyval_size + sizeof(unsigned char));
+	for (struct slab *slab = header->slab; slab; slab = slab->prev)
+		stats->slab_bytes += sizeof slab[0] + slab->capacity;
+
+	// Start after an empty slot, so that no cluster wraps around the end.
+	unsigned capacity = (unsigned)header->capacity;
+	unsigned mask = capacity - 1;
+	unsigned start = 0;
+	while (start < capacity && header->metadata[start])
+		start++;
+
+	long long total_probe_length = 0;
+	int cluster_length = 0;
+	for (unsigned n = 1; n <= capacity; ++n) {
+		unsigned i = (start + n) & mask;
+		unsigned char metadata = header->metadata[i];
+		if (metadata) {
+			cluster_length++;
+			if (metadata > TOMBSTONE) {
+				unsigned long long hash = header->hash(header->hash_context, (const char *)table + i * keyval_size, key_size);
+				int probe_length = (int)((i - (unsigned)hash) & mask) + 1;
+				total_probe_length += probe_length;
+				if (stats->max_probe_length < probe_length)
+					stats->max_probe_length = probe_length;
+			}
+		}
+		if (cluster_length && (!metadata || n == capacity)) {
+			int bucket = 0;
+			while (bucket < NUM_CLUSTER_BUCKETS - 1 && (2 << bucket) <= cluster_length)
+				bucket++;
+			stats->clusters[bucket]++;
+			if (stats->max_cluster_length < cluster_length)
+				stats->max_cluster_length = cluster_length;
+			cluster_length = 0;
+		}
+	}
+	if (header->count)
+		stats->average_probe_length = (double)total_probe_length / header->count;
+}
+
+// Parallel bulk insertion. The table is sized once up front, then the slots are split into one
+// contiguous range per thread. Since the slot index comes from the low bits of the hash, every
+// item is routed to the thread owning its home slot, and each thread inserts its items in input
+// order without ever touching another thread's range. The few items whose probe sequence would
+// spill over into the next range are inserted sequentially at the end. The resulting table has
+// the same contents as if all items had been added one by one in order. The hash, equal and copy
+// functions get called from multiple threads at once, and each thread copies into its own slab.
+// Those slabs come from the table's allocator, so with more than one thread it has to be thread safe.
+
+#include <threads.h> // thrd_create, thrd_join - only needed for build_from
+
+#define MAX_BUILD_THREADS 64
+
+#define build_from(ptable, keyvals, n, num_threads)\
+	private__build_from((ptable),(keyvals),(n),(num_threads),sizeof*(*(ptable)),sizeof(*(ptable))->key)
+
+struct build {
+	struct header *header;
+	char *keyvals;
+	const char *items;
+	unsigned long long *hashes;
+	int n;
+	int keyval_size;
+	int key_size;
+	int num_threads;
+	int shift; // Slot index >> shift gives the thread that owns the slot.
+	int *order; // Input indices grouped by owning thread, in input order.
+	int offsets[MAX_BUILD_THREADS][MAX_BUILD_THREADS]; // [input chunk][owning thread].
+	int starts[MAX_BUILD_THREADS + 1]; // Where each thread's items start in order.
+	int num_added[MAX_BUILD_THREADS];
+	int num_spilled[MAX_BUILD_THREADS];
+	struct slab *slabs[MAX_BUILD_THREADS];
+};
+
+struct build_thread {
+	struct build *build;
+	int index;
+	int phase;
+};
+
+int build_thread(void *parameter) {
+	struct build_thread *thread = parameter;
+	struct build *build = thread->build;
+	struct header *header = build->header;
+	unsigned mask = (unsigned)header->capacity - 1;
+	int t = thread->index;
+	int begin = (int)((long long)build->n * t / build->num_threads);
+	int end = (int)((long long)build->n * (t + 1) / build->num_threads);
+
+	if (thread->phase == 0) { // Hash our input chunk and count how many items go to each thread.
+		for (int i = begin; i < end; ++i) {
+			unsigned long long hash = header->hash(header->hash_context, build->items + i * build->keyval_size, build->key_size);
+			build->hashes[i] = hash;
+			build->offsets[t][((unsigned)hash & mask) >> build->shift]++;
+		}
+	}
+	else if (thread->phase == 1) { // Scatter our input chunk so that each thread's items are contiguous.
+		for (int i = begin; i < end; ++i)
+			build->order[build->offsets[t][((unsigned)build->hashes[i] & mask) >> build->shift]++] = i;
+	}
+	else { // Insert our items into our own slot range.
+		unsigned range_end = (unsigned)(t + 1) << build->shift;
+		int *order = build->order + build->starts[t];
+		int count = build->starts[t + 1] - build->starts[t];
+		int num_spilled = 0;
+		int num_added = 0;
+		for (int j = 0; j < count; ++j) {
+			int i = order[j];
+			const char *keyval = build->items + i * build->keyval_size;
+			unsigned long long hash = build->hashes[i];
+			unsigned char metadata = hash & 0xFF;
+			metadata += (metadata <= TOMBSTONE) ? 2 : 0;
+			unsigned k;
+			for (k = (unsigned)hash & mask; k < range_end; ++k) {
+				char *slot = build->keyvals + k * build->keyval_size;
+				if (!header->metadata[k]) {
+					header->metadata[k] = metadata;
+					header->copy(header->copy_context, slot, keyval, build->keyval_size, &build->slabs[t]);
+					num_added++;
+					break;
+				}
+				if (header->metadata[k] == metadata && header->equal(header->equal_context, slot, keyval, build->key_size)) {
+					header->copy(header->copy_context, slot, keyval, build->keyval_size, &build->slabs[t]);
+					break;
+				}
+			}
+			if (k == range_end)
+				order[num_spilled++] = i; // Overwriting order is fine because we've already read that far.
+		}
+		build->num_added[t] = num_added;
+		build->num_spilled[t] = num_spilled;
+	}
+	return 0;
+}
+
+void private__build_from(table(void) *ptable, const void *keyvals, int n, int num_threads, int keyval_size, int key_size) {
+	struct header *old_header = *ptable ? (struct header *)*ptable - 1 : NULL;
+	int new_capacity = capacity_for(old_header, count(*ptable) + n, table_max_load(old_header));
+	if (new_capacity > capacity(*ptable) || (*ptable && ((struct header *)*ptable)[-1].num_tombstones))
+		private__resize(ptable, new_capacity > capacity(*ptable) ? new_capacity : capacity(*ptable), keyval_size, key_size);
+	struct header *header = (struct header *)*ptable - 1;
+
+	// Every thread needs a decently sized range, otherwise most items would spill over.
+	int pow2;
+	for (pow2 = 0; (2 << pow2) <= num_threads && (2 << pow2) <= MAX_BUILD_THREADS; ++pow2);
+	while (pow2 > 0 && (header->capacity >> pow2) < 4096)
+		--pow2;
+	num_threads = 1 << pow2;
+
+	if (num_threads == 1) {
+		for (int i = 0; i < n; ++i)
+			private__add(ptable, (const char *)keyvals + i * keyval_size, keyval_size, key_size);
+		return;
+	}
+
+	struct build *build = calloc(1, sizeof build[0]);
+	build->header = header;
+	build->keyvals = *ptable;
+	build->items = keyvals;
+	build->n = n;
+	build->keyval_size = keyval_size;
+	build->key_size = key_size;
+	build->num_threads = num_threads;
+	for (build->shift = 0; (num_threads << build->shift) < header->capacity; ++build->shift);
+	build->order = malloc((size_t)n * sizeof build->order[0]);
+	build->hashes = malloc((size_t)n * sizeof build->hashes[0]);
+	for (int t = 0; t < num_threads; ++t)
+		build->slabs[t] = first_slab(header->allocator);
+
+	struct build_thread threads[MAX_BUILD_THREADS];
+	thrd_t handles[MAX_BUILD_THREADS];
+	for (int phase = 0; phase < 3; ++phase) {
+		for (int t = 0; t < num_threads; ++t) {
+			threads[t] = (struct build_thread){ build, t, phase };
+			thrd_create(&handles[t], build_thread, &threads[t]);
+		}
+		for (int t = 0; t < num_threads; ++t)
+			thrd_join(handles[t], NULL);
+
+		if (phase == 0) { // Turn the counts into offsets.
+			int offset = 0;
+			for (int owner = 0; owner < num_threads; ++owner) {
+				build->starts[owner] = offset;
+				for (int chunk = 0; chunk < num_threads; ++chunk) {
+					int count = build->offsets[chunk][owner];
+					build->offsets[chunk][owner] = offset;
+					offset += count;
+				}
+			}
+			build->starts[num_threads] = offset;
+		}
+	}
+
+	for (int t = 0; t < num_threads; ++t) {
+		header->count += build->num_added[t];
+		// Hand over the slab each thread copied into.
+		struct slab *slab = build->slabs[t];
+		if (slab) {
+			while (slab->prev)
+				slab = slab->prev;
+			slab->prev = header->slab;
+			header->slab = build->slabs[t];
+		}
+	}
+	for (int t = 0; t < num_threads; ++t)
+		for (int j = 0; j < build->num_spilled[t]; ++j) {
+			int i = build->order[build->starts[t] + j];
+			private__add(ptable, (const char *)keyvals + i * keyval_size, keyval_size, key_size); // Already reserved, so this won't resize.
+		}
+
+	free(build->hashes);
+	free(build->order);
+	free(build);
+}
+
+// Frozen tables. Once a table won't change anymore it can be frozen into a minimal perfect hash
+// table (hash-and-displace, like CHD/PTHash). Keys are split into small buckets, and each bucket
+// stores a pilot value which was brute forced so that all of the bucket's keys land on distinct
+// slots. The pilots pick from about 1.5% more slots than there are keys, since finding a pilot for
+// the last few buckets gets very slow when every slot has to be filled. The slots past the end are
+// remapped into the holes that are left, so the keys still fill an array of exactly the key count,
+// with no metadata and no probing. A lookup reads one 4 byte pilot (with 4 keys per bucket these
+// are usually in cache), and for the few keys that landed past the end one remapped slot, and then
+// compares exactly one key. Since all slots are full, you iterate with a plain for loop.
+//
+// If some bucket needs more than MAX_PILOTS tries, freezing starts over with another seed, and
+// gives up after MAX_FREEZE_SEEDS of them.
+//
+// Freezing takes over the table's slab, so any keys or values pointing into it stay valid. The
+// frozen table is a single block of memory which can be saved and loaded as is, as long as the
+// keys and values don't point to any other memory. After loading, the default hash and equal
+// functions are used, so if you changed them you need to set them again before any lookups.
+
+#define frozen(KV) KV*
+
+#define MAX_PILOTS (1 << 16) // Tries per bucket, the slowest ones usually need a few thousand.
+#define MAX_FREEZE_SEEDS 8
+
+#define freeze(ptable)\
+	private__freeze((void **)(ptable),sizeof*(*(ptable)),sizeof(*(ptable))->key)
+
+#define get_frozen_header(table)\
+	((struct frozen_header*)(table)-1)
+
+#define frozen_get(table, target_key)(\
+	frozen_count(table)?\
+		((table)[frozen_count(table)].key=(target_key), private__frozen_get((table),&(table)[frozen_count(table)].key, sizeof*(table), sizeof(table)->key))\
+		:-1)
+
+#define frozen_get_value(table, key)\
+	((table)[frozen_get((table),(key))].val)
+
+#define frozen_contains(table, key)\
+	(frozen_get((table),(key))>=0)
+
+#define load_frozen(pfrozen, data, size)\
+	private__load_frozen((void **)(pfrozen),(data),(size),sizeof*(*(pfrozen)))
+
+struct frozen_info { // This is the part that gets saved. [info][keyvals][pilots][remap]
+	int count;
+	int num_slots; // What the pilots pick from, the ones from count on are in remap.
+	int num_buckets;
+	int seed;
+	int keyval_size;
+	int size; // Of the info, keyvals, pilots and remap, in bytes.
+};
+
+struct frozen_header { // [header][keyvals][extra keyval][pilots][remap]
+	int(*equal)(void *context, const void *key_a, const void *key_b, int key_size);
+	unsigned long long(*hash)(void *context, const void *key, int key_size);
+	void *equal_context;
+	void *hash_context;
+	struct slab *slab;
+	unsigned *pilots;
+	unsigned *remap;
+	struct frozen_info info; // Must come last, right before the keyvals.
+};
+
+int frozen_count(const frozen(void) table) {
+	return table ? ((struct frozen_header *)table)[-1].info.count : 0;
+}
+
+unsigned long long frozen_mix(unsigned long long x) {
+	// splitmix64 finalizer https://xoshiro.di.unimi.it/splitmix64.c
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9u;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBu;
+	return x ^ (x >> 31);
+}
+
+unsigned frozen_bucket(unsigned long long hash, int num_buckets) {
+	// Mixed, since the high bits of FNV-1a on short keys clump, and big buckets make the small ones
+	// that get placed last much slower to place.
+	return (unsigned)(((frozen_mix(hash) >> 32) * (unsigned long long)num_buckets) >> 32);
+}
+
+unsigned frozen_slot(unsigned long long hash, unsigned pilot, int seed, int num_slots) {
+	unsigned long long x = frozen_mix(hash ^ (pilot * 0x9E3779B97F4A7C15u) ^ ((unsigned long long)seed * 0xD1B54A32D192ED03u));
+	return (unsigned)(((x & 0xFFFFFFFF) * (unsigned long long)num_slots) >> 32);
+}
+
+frozen(void) private__freeze(table(void) *ptable, int keyval_size, int key_size) {
+	struct header *header = *ptable ? (struct header *)*ptable - 1 : NULL;
+	int n = count(*ptable);
+	int num_buckets = n / 4 + 1;
+
+	// Sort the keys by bucket.
+	unsigned long long *hashes = malloc((size_t)n * sizeof hashes[0] + 1);
+	int *from = malloc((size_t)n * sizeof from[0] + 1); // Table index of each key.
+	int *sorted = malloc((size_t)n * sizeof sorted[0] + 1);
+	unsigned long long *sorted_hashes = malloc((size_t)n * sizeof sorted_hashes[0] + 1); // Next to each other for the pilot search.
+	int *bucket_starts = calloc((size_t)num_buckets + 1, sizeof bucket_starts[0]);
+	for (int i = first_index(*ptable), j = 0; i >= 0; i = next_index(*ptable, i), ++j) {
+		hashes[j] = header->hash(header->hash_context, (char *)*ptable + i * keyval_size, key_size);
+		from[j] = i;
+		bucket_starts[frozen_bucket(hashes[j], num_buckets) + 1]++;
+	}
+	int max_bucket_size = 0;
+	for (int b = 0; b < num_buckets; ++b) {
+		if (max_bucket_size < bucket_starts[b + 1])
+			max_bucket_size = bucket_starts[b + 1];
+		bucket_starts[b + 1] += bucket_starts[b];
+	}
+	int *cursors = malloc(((size_t)num_buckets + (size_t)max_bucket_size + 2) * sizeof cursors[0]);
+	memcpy(cursors, bucket_starts, (size_t)num_buckets * sizeof cursors[0]);
+	for (int j = 0; j < n; ++j) {
+		int at = cursors[frozen_bucket(hashes[j], num_buckets)]++;
+		sorted[at] = j;
+		sorted_hashes[at] = hashes[j];
+	}
+
+	// Place the biggest buckets first, while there are still lots of free slots.
+	int *size_starts = cursors; // Reuse the memory, we're done with it.
+	memset(size_starts, 0, ((size_t)max_bucket_size + 2) * sizeof size_starts[0]);
+	for (int b = 0; b < num_buckets; ++b)
+		size_starts[max_bucket_size - (bucket_starts[b + 1] - bucket_starts[b]) + 1]++;
+	for (int s = 0; s <= max_bucket_size; ++s)
+		size_starts[s + 1] += size_starts[s];
+	int *bucket_order = malloc((size_t)num_buckets * sizeof bucket_order[0]);
+	for (int b = 0; b < num_buckets; ++b)
+		bucket_order[size_starts[max_bucket_size - (bucket_starts[b + 1] - bucket_starts[b])]++] = b;
+
+	int num_slots = n + n / 64 + 1;
+	int size = (int)sizeof(struct frozen_info) + (n + 1) * keyval_size + (num_buckets + num_slots - n) * (int)sizeof(unsigned);
+	struct frozen_header *frozen = malloc(sizeof(struct frozen_header) - sizeof(struct frozen_info) + (size_t)size);
+	char *keyvals = (char *)(frozen + 1);
+	frozen->pilots = (unsigned *)(keyvals + (n + 1) * keyval_size);
+	frozen->remap = frozen->pilots + num_buckets;
+	frozen->info.count = n;
+	frozen->info.num_slots = num_slots;
+	frozen->info.num_buckets = num_buckets;
+	frozen->info.keyval_size = keyval_size;
+	frozen->info.size = size;
+
+	int failed = 0;
+	for (int b = 0; b < num_buckets && !failed; ++b) {
+		unsigned long long *bucket_hashes = sorted_hashes + bucket_starts[b];
+		int bucket_size = bucket_starts[b + 1] - bucket_starts[b];
+		for (int j = 0; j < bucket_size && !failed; ++j)
+			for (int k = 0; k < j; ++k)
+				if (bucket_hashes[j] == bucket_hashes[k])
+					failed = 1; // No pilot can ever separate keys with equal hashes.
+	}
+
+	// Brute force a pilot for each bucket so that its keys land in distinct free slots.
+	unsigned long long *taken = malloc(((size_t)num_slots / 64 + 1) * sizeof taken[0]); // A bit per slot.
+	unsigned *slot_of = malloc((size_t)n * sizeof slot_of[0] + 1); // Of each key, in the order of from.
+	unsigned *slots = malloc(((size_t)max_bucket_size + 1) * sizeof slots[0]);
+	for (int seed = 0; !failed; ++seed) {
+		if (seed == MAX_FREEZE_SEEDS) {
+			failed = 1;
+			break;
+		}
+		memset(taken, 0, ((size_t)num_slots / 64 + 1) * sizeof taken[0]);
+		int o;
+		for (o = 0; o < num_buckets; ++o) {
+			int b = bucket_order[o];
+			unsigned long long *bucket_hashes = sorted_hashes + bucket_starts[b];
+			int bucket_size = bucket_starts[b + 1] - bucket_starts[b];
+			unsigned pilot;
+			for (pilot = 0; pilot < MAX_PILOTS; ++pilot) {
+				int j;
+				for (j = 0; j < bucket_size; ++j) {
+					slots[j] = frozen_slot(bucket_hashes[j], pilot, seed, num_slots);
+					if (taken[slots[j] / 64] & (1ull << (slots[j] % 64)))
+						break;
+					taken[slots[j] / 64] |= 1ull << (slots[j] % 64);
+				}
+				if (j == bucket_size)
+					break;
+				while (j-- > 0)
+					taken[slots[j] / 64] &= ~(1ull << (slots[j] % 64));
+			}
+			if (pilot == MAX_PILOTS)
+				break;
+			frozen->pilots[b] = pilot;
+			for (int j = 0; j < bucket_size; ++j)
+				slot_of[sorted[bucket_starts[b] + j]] = slots[j];
+		}
+		if (o == num_buckets) {
+			frozen->info.seed = seed;
+			break;
+		}
+	}
+
+	if (!failed) {
+		// There are as many holes before the end as there are keys past it, so point those slots at
+		// the holes.
+		for (int t = 0, hole = 0; t < num_slots - n; ++t) {
+			frozen->remap[t] = 0; // Only keys that aren't there get here.
+			if (!(taken[(n + t) / 64] & (1ull << ((n + t) % 64))))
+				continue;
+			while (taken[hole / 64] & (1ull << (hole % 64)))
+				++hole;
+			frozen->remap[t] = (unsigned)hole++;
+		}
+		// In table order, so at least the reads are sequential.
+		for (int j = 0; j < n; ++j) {
+			unsigned slot = slot_of[j] < (unsigned)n ? slot_of[j] : frozen->remap[slot_of[j] - (unsigned)n];
+			memcpy(keyvals + slot * keyval_size, (char *)*ptable + from[j] * keyval_size, (size_t)keyval_size);
+		}
+	}
+
+	free(slot_of);
+	free(slots);
+	free(taken);
+	free(bucket_order);
+	free(cursors);
+	free(bucket_starts);
+	free(sorted_hashes);
+	free(sorted);
+	free(from);
+	free(hashes);
+	if (failed) {
+		free(frozen);
+		return NULL;
+	}
+
+	frozen->hash = header ? header->hash : default_hash;
+	frozen->equal = header ? header->equal : default_compare;
+	frozen->hash_context = header ? header->hash_context : NULL;
+	frozen->equal_context = header ? header->equal_context : NULL;
+	frozen->slab = header ? header->slab : NULL;
+	if (header)
+		deallocate_memory(header->allocator, header, table_bytes(header)); // We took over the slab, so don't free it.
+	*ptable = NULL;
+	return frozen + 1;
+}
+
+int private__frozen_get(const frozen(void) table, const void *key, int keyval_size, int key_size) {
+	struct frozen_header *header = (struct frozen_header *)table - 1;
+	unsigned long long hash = header->hash(header->hash_context, key, key_size);
+	unsigned pilot = header->pilots[frozen_bucket(hash, header->info.num_buckets)];
+	unsigned slot = frozen_slot(hash, pilot, header->info.seed, header->info.num_slots);
+	if (slot >= (unsigned)header->info.count)
+		slot = header->remap[slot - (unsigned)header->info.count];
+	if (header->equal(header->equal_context, key, (char *)table + slot * keyval_size, key_size))
+		return (int)slot;
+	return -1;
+}
+
+const void *save_frozen(const frozen(void) table, int *size) {
+	struct frozen_header *header = (struct frozen_header *)table - 1;
+	*size = header->info.size;
+	return &header->info;
+}
+
+int private__load_frozen(frozen(void) *ptable, const void *data, int size, int keyval_size) {
+	struct frozen_info info;
+	if (size < (int)sizeof info)
+		return 0;
+	memcpy(&info, data, sizeof info);
+	if (info.size != size || info.keyval_size != keyval_size || info.count < 0 || info.num_slots <= info.count || info.num_buckets <= 0)
+		return 0;
+	if (size != (int)sizeof info + (info.count + 1) * keyval_size + (info.num_buckets + info.num_slots - info.count) * (int)sizeof(unsigned))
+		return 0;
+
+	struct frozen_header *header = malloc(sizeof(struct frozen_header) - sizeof(struct frozen_info) + (size_t)size);
+	memcpy(&header->info, data, (size_t)size);
+	header->hash = default_hash;
+	header->equal = default_compare;
+	header->hash_context = NULL;
+	header->equal_context = NULL;
+	header->slab = NULL;
+	header->pilots = (unsigned *)((char *)(header + 1) + (info.count + 1) * keyval_size);
+	header->remap = header->pilots + info.num_buckets;
+	for (int t = 0; t < info.num_slots - info.count; ++t) {
+		if (info.count && header->remap[t] >= (unsigned)info.count) {
+			free(header);
+			return 0;
+		}
+	}
+	*ptable = header + 1;
+	return 1;
+}
+
+void destroy_frozen(frozen(void) *ptable) {
+	if (*ptable) {
+		struct frozen_header *header = (struct frozen_header *)*ptable - 1;
+		freeall(&header->slab);
+		free(header);
+		*ptable = NULL;
+	}
+}
+
+// Snapshots. A snapshot is an immutable version of a table that any number of threads can read
+// without locking, while a writer prepares the next version. The slots are split into chunks of
+// SNAPSHOT_CHUNK_SIZE, and versions share the chunks they have in common. snapshot_edit makes a
+// new version which shares all chunks with the old one, and adding or removing then copies only
+// the chunk it writes to (if it's still shared). So a batch of k changes costs O(k) chunk copies
+// plus one pass over the chunk pointers, no matter how many items there are.
+//
+// Only modify a snapshot you got from snapshot_edit (or that started out NULL) and haven't published
+// yet. Everything the copy function allocates goes into the slab of the chunk it was copied into.
+//
+// To hand snapshots to readers, publish_snapshot them. Readers call enter_snapshot to get the latest
+// one, which stays valid until they call leave_snapshot. That's two atomic adds per reader and
+// never blocks. If a reader needs it for longer it can snapshot_retain it before leaving, and
+// snapshot_release it when done. There can only be one writer at a time per published_snapshot,
+// and publish_snapshot waits for readers that might still be looking at the previous version.
+//
+// Snapshots always use malloc, even in a table that has an allocator: a chunk is freed by whichever
+// thread drops the last reference to it, which is usually a reader and not the writer.
+
+#include <stdatomic.h> // atomic_int, atomic_fetch_add, atomic_fetch_sub, atomic_exchange
+
+#define SNAPSHOT_CHUNK_SIZE 256 // Slots per chunk, a power of 2.
+
+#define snapshot(KV) KV*
+
+#define get_snapshot_header(psnapshot)\
+	((!*(psnapshot)?(*(psnapshot)=private__snapshot_create(sizeof*(*(psnapshot)),sizeof(*(psnapshot))->key),0):0),(struct snapshot_header*)(*(psnapshot))-1)
+
+#define snapshot_add(psnapshot, new_key, new_value)do{\
+	(void)get_snapshot_header(psnapshot);\
+	(*(psnapshot))->key = (new_key);\
+	(*(psnapshot))->val = (new_value);\
+	private__snapshot_add((void **)(psnapshot));\
+}while(0)
+
+#define snapshot_remove(psnapshot, existing_key)do{\
+	if (!snapshot_count(*(psnapshot))) break;\
+	(*(psnapshot))->key = (existing_key);\
+	private__snapshot_remove((void **)(psnapshot));\
+}while(0)
+
+// Returns a pointer to the keyval, or NULL. Readers share the snapshot, so unlike get there's no
+// spare keyval to put the key in and the key has to be a variable.
+#define snapshot_get(snapshot, target_key)\
+	((void)sizeof(char[sizeof(target_key)==sizeof((snapshot)->key)?1:-1]), private__snapshot_get((snapshot),&(target_key)))
+
+#define snapshot_contains(snapshot, target_key)\
+	(snapshot_get((snapshot),target_key)!=NULL)
+
+#define snapshot_release(psnapshot)\
+	private__snapshot_release((void **)(psnapshot))
+
+struct snapshot_chunk { // [chunk][keyvals]
+	atomic_int refcount; // Number of snapshots sharing this chunk.
+	struct slab *slab;
+	unsigned char metadata[SNAPSHOT_CHUNK_SIZE];
+};
+
+struct snapshot_header { // [header][spare keyval][chunk pointers]
+	int(*equal)(void *context, const void *key_a, const void *key_b, int key_size);
+	void(*copy)(void *context, void *destination, const void *keyval, int keyval_size, struct slab **slab);
+	unsigned long long(*hash)(void *context, const void *key, int key_size);
+	void *equal_context;
+	void *copy_context;
+	void *hash_context;
+	struct snapshot_chunk **chunks;
+	atomic_int refcount;
+	int count;
+	int capacity;
+	int num_tombstones;
+	int keyval_size;
+	int key_size;
+};
+
+struct published_snapshot {
+	_Atomic(void *) snapshot;
+	atomic_int epoch;
+	atomic_int readers[2]; // Readers that entered during an even or an odd epoch.
+};
+
+char *snapshot_keyval(struct snapshot_chunk *chunk, int slot, int keyval_size) {
+	return (char *)(chunk + 1) + slot * keyval_size;
+}
+
+void release_chunk(struct snapshot_chunk *chunk) {
+	if (atomic_fetch_sub(&chunk->refcount, 1) == 1) {
+		freeall(&chunk->slab);
+		free(chunk);
+	}
+}
+
+int snapshot_count(const snapshot(void) snapshot) {
+	return snapshot ? ((struct snapshot_header *)snapshot)[-1].count : 0;
+}
+
+snapshot(void) snapshot_retain(const snapshot(void) snapshot) {
+	if (snapshot)
+		atomic_fetch_add(&((struct snapshot_header *)snapshot)[-1].refcount, 1);
+	return (void *)snapshot;
+}
+
+void private__snapshot_release(snapshot(void) *psnapshot) {
+	if (*psnapshot) {
+		struct snapshot_header *header = (struct snapshot_header *)*psnapshot - 1;
+		if (atomic_fetch_sub(&header->refcount, 1) == 1) {
+			for (int c = 0; c < header->capacity / SNAPSHOT_CHUNK_SIZE; ++c)
+				release_chunk(header->chunks[c]);
+			free(header);
+		}
+		*psnapshot = NULL;
+	}
+}
+
+snapshot(void) allocate_snapshot(const struct snapshot_header *like, int capacity) {
+	int keyval_size = (like->keyval_size + (int)sizeof(void *) - 1) & ~((int)sizeof(void *) - 1); // Align the chunk pointers.
+	int num_chunks = capacity / SNAPSHOT_CHUNK_SIZE;
+	struct snapshot_header *header = malloc(sizeof(struct snapshot_header) + keyval_size + num_chunks * sizeof(struct snapshot_chunk *));
+	*header = *like;
+	header->chunks = (struct snapshot_chunk **)((char *)(header + 1) + keyval_size);
+	atomic_init(&header->refcount, 1);
+	header->capacity = capacity;
+	return header + 1;
+}
+
+// A new snapshot with the same settings and items as like, which doesn't need to have any chunks.
+snapshot(void) rehash_snapshot(const struct snapshot_header *like, int new_capacity) {
+	if (new_capacity <= like->count)
+		new_capacity = like->count + 1;
+	int pow2;
+	for (pow2 = 0; (1 << pow2) < new_capacity || (1 << pow2) < SNAPSHOT_CHUNK_SIZE; ++pow2);
+	new_capacity = 1 << pow2;
+
+	snapshot(void) snapshot = allocate_snapshot(like, new_capacity);
+	struct snapshot_header *header = (struct snapshot_header *)snapshot - 1;
+	header->num_tombstones = 0;
+	int keyval_size = header->keyval_size;
+	for (int c = 0; c < new_capacity / SNAPSHOT_CHUNK_SIZE; ++c) {
+		header->chunks[c] = malloc(sizeof(struct snapshot_chunk) + SNAPSHOT_CHUNK_SIZE * keyval_size);
+		atomic_init(&header->chunks[c]->refcount, 1);
+		header->chunks[c]->slab = NULL;
+		memset(header->chunks[c]->metadata, 0, SNAPSHOT_CHUNK_SIZE);
+	}
+
+	unsigned mask = (unsigned)new_capacity - 1;
+	for (int c = 0; c < like->capacity / SNAPSHOT_CHUNK_SIZE; ++c) {
+		struct snapshot_chunk *old_chunk = like->chunks[c];
+		for (int i = 0; i < SNAPSHOT_CHUNK_SIZE; ++i) {
+			if (old_chunk->metadata[i] > TOMBSTONE) {
+				const char *keyval = snapshot_keyval(old_chunk, i, keyval_size);
+				unsigned long long hash = header->hash(header->hash_context, keyval, header->key_size);
+				for (unsigned j = (unsigned)hash & mask;; j = (j + 1) & mask) {
+					struct snapshot_chunk *chunk = header->chunks[j / SNAPSHOT_CHUNK_SIZE];
+					if (!chunk->metadata[j % SNAPSHOT_CHUNK_SIZE]) {
+						chunk->metadata[j % SNAPSHOT_CHUNK_SIZE] = old_chunk->metadata[i];
+						header->copy(header->copy_context, snapshot_keyval(chunk, j % SNAPSHOT_CHUNK_SIZE, keyval_size), keyval, keyval_size, &chunk->slab);
+						break;
+					}
+				}
+			}
+		}
+	}
+	return snapshot;
+}
+
+snapshot(void) private__snapshot_create(int keyval_size, int key_size) {
+	struct snapshot_header like = { 0 };
+	like.hash = default_hash;
+	like.copy = default_copy;
+	like.equal = default_compare;
+	like.keyval_size = keyval_size;
+	like.key_size = key_size;
+	return rehash_snapshot(&like, SNAPSHOT_CHUNK_SIZE);
+}
+
+// A new version to modify, which shares all of its chunks with snapshot.
+snapshot(void) snapshot_edit(const snapshot(void) snapshot) {
+	if (!snapshot)
+		return NULL;
+	struct snapshot_header *old_header = (struct snapshot_header *)snapshot - 1;
+	snapshot(void) edit = allocate_snapshot(old_header, old_header->capacity);
+	struct snapshot_header *header = (struct snapshot_header *)edit - 1;
+	for (int c = 0; c < header->capacity / SNAPSHOT_CHUNK_SIZE; ++c) {
+		header->chunks[c] = old_header->chunks[c];
+		atomic_fetch_add(&header->chunks[c]->refcount, 1);
+	}
+	return edit;
+}
+
+// Copy on write: makes sure no other snapshot sees the chunk before it gets modified.
+struct snapshot_chunk *own_chunk(struct snapshot_header *header, int c) {
+	struct snapshot_chunk *chunk = header->chunks[c];
+	if (atomic_load(&chunk->refcount) == 1)
+		return chunk;
+	struct snapshot_chunk *copy = malloc(sizeof(struct snapshot_chunk) + SNAPSHOT_CHUNK_SIZE * header->keyval_size);
+	atomic_init(&copy->refcount, 1);
+	copy->slab = NULL;
+	memcpy(copy->metadata, chunk->metadata, SNAPSHOT_CHUNK_SIZE);
+	for (int i = 0; i < SNAPSHOT_CHUNK_SIZE; ++i)
+		if (chunk->metadata[i] > TOMBSTONE)
+			header->copy(header->copy_context, snapshot_keyval(copy, i, header->keyval_size), snapshot_keyval(chunk, i, header->keyval_size), header->keyval_size, &copy->slab);
+	release_chunk(chunk);
+	header->chunks[c] = copy;
+	return copy;
+}
+
+// Replaces *psnapshot with a resized copy. The spare keyval goes along, since it holds the keyval being added.
+void snapshot_resize_in_place(snapshot(void) *psnapshot, int new_capacity) {
+	struct snapshot_header *header = (struct snapshot_header *)*psnapshot - 1;
+	snapshot(void) resized = rehash_snapshot(header, new_capacity);
+	memcpy(resized, *psnapshot, (size_t)header->keyval_size);
+	private__snapshot_release(psnapshot);
+	*psnapshot = resized;
+}
+
+void private__snapshot_add(snapshot(void) *psnapshot) {
+	struct snapshot_header *header = (struct snapshot_header *)*psnapshot - 1;
+	if (4 * (header->count + 1) > 3 * header->capacity) {
+		snapshot_resize_in_place(psnapshot, 2 * header->capacity);
+		header = (struct snapshot_header *)*psnapshot - 1;
+	}
+	const void *keyval = *psnapshot;
+	int keyval_size = header->keyval_size;
+	unsigned long long hash = header->hash(header->hash_context, keyval, header->key_size);
+	unsigned char metadata = hash & 0xFF;
+	metadata += (metadata <= TOMBSTONE) ? 2 : 0;
+	unsigned mask = (unsigned)header->capacity - 1;
+	unsigned index = (unsigned)-1;
+	for (unsigned i = (unsigned)hash & mask;; i = (i + 1) & mask) {
+		struct snapshot_chunk *chunk = header->chunks[i / SNAPSHOT_CHUNK_SIZE];
+		unsigned char slot_metadata = chunk->metadata[i % SNAPSHOT_CHUNK_SIZE];
+		if (!slot_metadata) {
+			index = min(index, i);
+			break;
+		}
+		if (slot_metadata == TOMBSTONE)
+			index = min(index, i);
+		else if (slot_metadata == metadata && header->equal(header->equal_context, snapshot_keyval(chunk, i % SNAPSHOT_CHUNK_SIZE, keyval_size), keyval, header->key_size)) {
+			chunk = own_chunk(header, i / SNAPSHOT_CHUNK_SIZE);
+			header->copy(header->copy_context, snapshot_keyval(chunk, i % SNAPSHOT_CHUNK_SIZE, keyval_size), keyval, keyval_size, &chunk->slab);
+			return;
+		}
+	}
+	struct snapshot_chunk *chunk = own_chunk(header, index / SNAPSHOT_CHUNK_SIZE);
+	if (chunk->metadata[index % SNAPSHOT_CHUNK_SIZE] == TOMBSTONE)
+		header->num_tombstones--;
+	chunk->metadata[index % SNAPSHOT_CHUNK_SIZE] = metadata;
+	header->copy(header->copy_context, snapshot_keyval(chunk, index % SNAPSHOT_CHUNK_SIZE, keyval_size), keyval, keyval_size, &chunk->slab);
+	header->count++;
+}
+
+const void *private__snapshot_get(const snapshot(void) snapshot, const void *key) {
+	if (!snapshot)
+		return NULL;
+	struct snapshot_header *header = (struct snapshot_header *)snapshot - 1;
+	unsigned long long hash = header->hash(header->hash_context, key, header->key_size);
+	unsigned char metadata = hash & 0xFF;
+	metadata += (metadata <= TOMBSTONE) ? 2 : 0;
+	unsigned mask = (unsigned)header->capacity - 1;
+	for (unsigned i = (unsigned)hash & mask;; i = (i + 1) & mask) {
+		struct snapshot_chunk *chunk = header->chunks[i / SNAPSHOT_CHUNK_SIZE];
+		unsigned char slot_metadata = chunk->metadata[i % SNAPSHOT_CHUNK_SIZE];
+		if (!slot_metadata)
+			return NULL;
+		const char *keyval = snapshot_keyval(chunk, i % SNAPSHOT_CHUNK_SIZE, header->keyval_size);
+		if (slot_metadata == metadata && header->equal(header->equal_context, key, keyval, header->key_size))
+			return keyval;
+	}
+}
+
+void private__snapshot_remove(snapshot(void) *psnapshot) {
+	struct snapshot_header *header = (struct snapshot_header *)*psnapshot - 1;
+	const void *key = *psnapshot;
+	unsigned long long hash = header->hash(header->hash_context, key, header->key_size);
+	unsigned char metadata = hash & 0xFF;
+	metadata += (metadata <= TOMBSTONE) ? 2 : 0;
+	unsigned mask = (unsigned)header->capacity - 1;
+	for (unsigned i = (unsigned)hash & mask;; i = (i + 1) & mask) {
+		struct snapshot_chunk *chunk = header->chunks[i / SNAPSHOT_CHUNK_SIZE];
+		unsigned char slot_metadata = chunk->metadata[i % SNAPSHOT_CHUNK_SIZE];
+		if (!slot_metadata)
+			return;
+		if (slot_metadata == metadata && header->equal(header->equal_context, key, snapshot_keyval(chunk, i % SNAPSHOT_CHUNK_SIZE, header->keyval_size), header->key_size)) {
+			chunk = own_chunk(header, i / SNAPSHOT_CHUNK_SIZE);
+			chunk->metadata[i % SNAPSHOT_CHUNK_SIZE] = TOMBSTONE;
+			header->count--;
+			header->num_tombstones++;
+			if (4 * header->count < header->capacity && header->capacity > SNAPSHOT_CHUNK_SIZE)
+				snapshot_resize_in_place(psnapshot, 2 * header->count);
+			else if (8 * header->num_tombstones > header->capacity)
+				snapshot_resize_in_place(psnapshot, header->capacity); // Get rid of tombstones.
+			return;
+		}
+	}
+}
+
+// Iterate with snapshot_first_index and snapshot_next_index, and get the keyval with snapshot_at.
+const void *snapshot_at(const snapshot(void) snapshot, int index) {
+	struct snapshot_header *header = (struct snapshot_header *)snapshot - 1;
+	return snapshot_keyval(header->chunks[index / SNAPSHOT_CHUNK_SIZE], index % SNAPSHOT_CHUNK_SIZE, header->keyval_size);
+}
+
+int snapshot_next_index(const snapshot(void) snapshot, int index) {
+	if (snapshot) {
+		struct snapshot_header *header = (struct snapshot_header *)snapshot - 1;
+		for (int i = index + 1; i < header->capacity; ++i)
+			if (header->chunks[i / SNAPSHOT_CHUNK_SIZE]->metadata[i % SNAPSHOT_CHUNK_SIZE] > TOMBSTONE)
+				return i;
+	}
+	return -1;
+}
+
+int snapshot_first_index(const snapshot(void) snapshot) {
+	return snapshot_next_index(snapshot, -1);
+}
+
+// A snapshot with the same contents, hash, equal and copy functions as a table. The table is left as is.
+#define snapshot_from_table(table)\
+	private__snapshot_from_table((table),sizeof*(table),sizeof(table)->key)
+
+snapshot(void) private__snapshot_from_table(const table(void) table, int keyval_size, int key_size) {
+	if (!count(table))
+		return NULL;
+	struct header *table_header = (struct header *)table - 1;
+	struct snapshot_header like = { 0 };
+	like.equal = table_header->equal;
+	like.copy = table_header->copy;
+	like.hash = table_header->hash;
+	like.equal_context = table_header->equal_context;
+	like.copy_context = table_header->copy_context;
+	like.hash_context = table_header->hash_context;
+	like.keyval_size = keyval_size;
+	like.key_size = key_size;
+	snapshot(void) snapshot = rehash_snapshot(&like, 4 * table_header->count / 3 + 1);
+	for (int i = first_index(table); i >= 0; i = next_index(table, i)) {
+		memcpy(snapshot, (const char *)table + i * keyval_size, (size_t)keyval_size);
+		private__snapshot_add(&snapshot);
+	}
+	return snapshot;
+}
+
+void publish_snapshot(struct published_snapshot *published, snapshot(void) snapshot) {
+	snapshot(void) old = atomic_exchange(&published->snapshot, snapshot);
+	// Readers that entered during the current epoch might still be looking at the old snapshot. Move
+	// on to the next epoch and wait for them to leave. Readers from the epoch before that already left
+	// during the previous publish, except for ones that are just about to find out they have to retry.
+	int epoch = atomic_load(&published->epoch);
+	while (atomic_load(&published->readers[(epoch + 1) & 1]))
+		thrd_yield();
+	atomic_store(&published->epoch, epoch + 1);
+	while (atomic_load(&published->readers[epoch & 1]))
+		thrd_yield();
+	private__snapshot_release(&old);
+}
+
+snapshot(void) enter_snapshot(struct published_snapshot *published, int *ticket) {
+	for (;;) {
+		int epoch = atomic_load(&published->epoch);
+		atomic_fetch_add(&published->readers[epoch & 1], 1);
+		if (atomic_load(&published->epoch) == epoch) {
+			*ticket = epoch & 1;
+			return atomic_load(&published->snapshot);
+		}
+		atomic_fetch_sub(&published->readers[epoch & 1], 1);
+	}
+}
+
+void leave_snapshot(struct published_snapshot *published, int ticket) {
+	atomic_fetch_sub(&published->readers[ticket], 1);
+}
+
 #undef NDEBUG
 #include <assert.h>
 uint64_t hash_string(void *context, const void *key, int key_size) {
 	(void)context; (void)key_size;
-	const char *string = key;
+	const char *string = *(const char **)key;
 	unsigned long long hash = 14695981039346656037u;
 	for (int i = 0; string[i]; ++i)
 		hash = (hash ^ string[i]) * 1099511628211u;
@@ -308,8 +1308,47 @@ void copy_strings(void *context, void *destination, const void *keyval, int keyv
 	memcpy(dst[0], src[0], key_size);
 	memcpy(dst[1], src[1], val_size);
 }
+unsigned long long collide_hash(void *context, const void *key, int key_size) {
+	(void)context; (void)key_size;
+	return *(const int *)key < 2 ? 12345 : (unsigned long long)*(const int *)key * 0x9E3779B97F4A7C15u;
+}
+unsigned long long identity_hash(void *context, const void *key, int key_size) {
+	(void)context; (void)key_size;
+	return (unsigned long long)*(const int *)key;
+}
+struct int_int { int key; int val; };
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
+struct snapshot_test {
+	struct published_snapshot published;
+	atomic_int done;
+	atomic_int num_reads; // Bumped by every reader thread.
+};
+int snapshot_reader(void *parameter) {
+	struct snapshot_test *test = parameter;
+	while (!atomic_load(&test->done)) {
+		// Every version has keys 0 to count-1, each with value key+count.
+		int ticket;
+		snapshot(struct int_int) snapshot = enter_snapshot(&test->published, &ticket);
+		int n = snapshot_count(snapshot);
+		for (int key = 0; key < n; key += 1 + key / 8) {
+			const struct int_int *keyval = snapshot_get(snapshot, key);
+			assert(keyval && keyval->val == key + n);
+		}
+		assert(!snapshot_contains(snapshot, n));
+		leave_snapshot(&test->published, ticket);
+		atomic_fetch_add(&test->num_reads, 1);
+	}
+	return 0;
+}
 int main(void) {
-	struct int_int { int key; int val; };
 	struct str_str { char *key; char *val; };
 
 	{
@@ -498,6 +1537,357 @@ int main(void) {
 		destroy(&table);
 	}
 
+	{
+		static struct int_int keyvals[1048576];
+		int n = sizeof keyvals / sizeof keyvals[0];
+		for (int i = 0; i < n; ++i) {
+			keyvals[i].key = i % 7 == 0 ? i / 2 : i; // Duplicates, the later value should win.
+			keyvals[i].val = i;
+		}
+
+		table(struct int_int) sequential = NULL;
+		for (int i = 0; i < n; ++i)
+			add(&sequential, keyvals[i].key, keyvals[i].val);
+
+		for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+			table(struct int_int) table = NULL;
+			build_from(&table, keyvals, n, num_threads);
+			assert(count(table) == count(sequential));
+			for (int i = first_index(sequential); i >= 0; i = next_index(sequential, i))
+				assert(get_value(table, sequential[i].key) == sequential[i].val);
+			destroy(&table);
+		}
+		destroy(&sequential);
+	}
+
+	{
+		static char keys[65536][9];
+		static struct str_str keyvals[65536];
+		int n = sizeof keys / sizeof keys[0];
+		for (int i = 0; i < n; ++i) {
+			keys[i][0] = 'k';
+			int x = i;
+			for (int j = 0; j < 7; ++j) {
+				keys[i][7 - j] = '0' + x % 10;
+				x /= 10;
+			}
+			keyvals[i].key = keys[i];
+			keyvals[i].val = keys[n - 1 - i];
+		}
+
+		// Strings get copied into per-thread slabs that are handed over to the table.
+		table(struct str_str) table = NULL;
+		struct header *header = get_header(&table);
+		header->hash = hash_string;
+		header->equal = equal_strings;
+		header->copy = copy_strings;
+		add(&table, "Existing", "Value");
+		build_from(&table, keyvals, n, 4);
+		assert(count(table) == n + 1);
+		assert(strcmp(get_value(table, "Existing"), "Value") == 0);
+		for (int i = 0; i < n; ++i) {
+			int index = get(table, keys[i]);
+			assert(index >= 0 && table[index].key != keys[i]);
+			assert(strcmp(table[index].val, keys[n - 1 - i]) == 0);
+		}
+		destroy(&table);
+	}
+
+	{
+		frozen(struct int_int) frozen = NULL;
+		assert(!frozen_count(frozen));
+		assert(frozen_get(frozen, 1) == -1);
+
+		table(struct int_int) table = NULL;
+		frozen = freeze(&table);
+		assert(frozen && !table && !frozen_count(frozen));
+		assert(frozen_get(frozen, 1) == -1);
+		destroy_frozen(&frozen);
+		assert(!frozen);
+	}
+
+	{
+		int n = 1000000;
+		table(struct int_int) table = NULL;
+		for (int i = 0; i < n; ++i)
+			add(&table, 3 * i, i);
+		int table_size = capacity(table) * (int)(sizeof table[0] + 1);
+
+		frozen(struct int_int) frozen = freeze(&table);
+		assert(frozen && !table);
+		assert(frozen_count(frozen) == n);
+		for (int i = 0; i < n; ++i) {
+			assert(frozen_contains(frozen, 3 * i));
+			assert(frozen_get_value(frozen, 3 * i) == i);
+			assert(!frozen_contains(frozen, 3 * i + 1));
+		}
+		static int total[1000000];
+		for (int i = 0; i < frozen_count(frozen); ++i)
+			total[frozen[i].val]++;
+		for (int i = 0; i < n; ++i)
+			assert(total[i] == 1);
+
+		int size;
+		const void *saved = save_frozen(frozen, &size);
+		assert(size < table_size * 3 / 4);
+		void *copy = malloc((size_t)size);
+		memcpy(copy, saved, (size_t)size);
+		destroy_frozen(&frozen);
+
+		assert(!load_frozen(&frozen, copy, size - 1));
+		assert(load_frozen(&frozen, copy, size));
+		free(copy);
+		assert(frozen_count(frozen) == n);
+		for (int i = 0; i < n; ++i) {
+			assert(frozen_get_value(frozen, 3 * i) == i);
+			assert(!frozen_contains(frozen, 3 * i + 2));
+		}
+		destroy_frozen(&frozen);
+	}
+
+	{
+		// The frozen table takes over the slab, so strings stay valid.
+		table(struct str_str) table = NULL;
+		struct header *header = get_header(&table);
+		header->hash = hash_string;
+		header->equal = equal_strings;
+		header->copy = copy_strings;
+		add(&table, "Key0", "Val0");
+		add(&table, "Key1", "Val1");
+		add(&table, "Key2", "Val2");
+		frozen(struct str_str) frozen = freeze(&table);
+		assert(frozen_count(frozen) == 3);
+		assert(strcmp(frozen_get_value(frozen, "Key0"), "Val0") == 0);
+		assert(strcmp(frozen_get_value(frozen, "Key1"), "Val1") == 0);
+		assert(strcmp(frozen_get_value(frozen, "Key2"), "Val2") == 0);
+		assert(!frozen_contains(frozen, "Key3"));
+		destroy_frozen(&frozen);
+	}
+
+	{
+		// Keys with identical hashes can't be told apart by a perfect hash, so freezing fails.
+		table(struct int_int) table = NULL;
+		get_header(&table)->hash = collide_hash;
+		for (int i = 0; i < 100; ++i)
+			add(&table, i, i);
+		assert(!freeze(&table));
+		assert(count(table) == 100 && get_value(table, 1) == 1);
+		destroy(&table);
+	}
+
+	{
+		struct table_stats stats;
+		table(struct int_int) table = NULL;
+		table_stats(table, &stats);
+		assert(stats.count == 0 && stats.capacity == 0 && stats.max_cluster_length == 0);
+
+		// Four items with the same home slot make a cluster of 4, forty items in their own home slots
+		// make a cluster of 40 with no extra probes, and two items at the end wrap around.
+		get_header(&table)->hash = identity_hash;
+		for (int i = 0; i < 4; ++i)
+			add(&table, 128 * i + 5, i);
+		for (int i = 20; i < 60; ++i)
+			add(&table, i, i);
+		add(&table, 127, 0);
+		add(&table, 255, 0);
+		table_stats(table, &stats);
+		assert(stats.count == 46 && stats.capacity == 128 && stats.num_tombstones == 0);
+		assert(stats.max_probe_length == 4);
+		assert(stats.average_probe_length == (1 + 2 + 3 + 4 + 40 + 1 + 2) / 46.0);
+		assert(stats.max_cluster_length == 40);
+		assert(stats.clusters[1] == 1 && stats.clusters[2] == 1 && stats.clusters[5] == 1);
+		assert(stats.slab_bytes == 0);
+
+		// Tombstones don't count as probes, but they still hold clusters together.
+		remove(&table, 128 + 5);
+		table_stats(table, &stats);
+		assert(stats.count == 45 && stats.num_tombstones == 1);
+		assert(stats.load_factor == 46 / 128.0);
+		assert(stats.average_probe_length == (1 + 3 + 4 + 40 + 1 + 2) / 45.0);
+		assert(stats.clusters[2] == 1);
+		destroy(&table);
+
+		table(struct str_str) strings = NULL;
+		struct header *header = get_header(&strings);
+		header->hash = hash_string;
+		header->equal = equal_strings;
+		header->copy = copy_strings;
+		add(&strings, "Key", "Value");
+		table_stats(strings, &stats);
+		assert(stats.count == 1 && stats.average_probe_length == 1 && stats.slab_bytes > 0);
+		destroy(&strings);
+	}
+
+	{
+		// By default tables grow at 3/4 and shrink at 1/4, to halfway between the two.
+		table(struct int_int) table = NULL;
+		for (int i = 0; i < 700; ++i)
+			add(&table, i, i);
+		assert(capacity(table) == 1024);
+		for (int i = 0; i < 445; ++i)
+			remove(&table, i);
+		assert(count(table) == 255 && capacity(table) == 512);
+		for (int round = 0; round < 100; ++round) {
+			add(&table, 1000, 1000);
+			remove(&table, 1000);
+			remove(&table, 445);
+			add(&table, 445, 445);
+		}
+		assert(count(table) == 255 && capacity(table) == 512);
+		for (int i = 445; i < 700; ++i)
+			assert(get_value(table, i) == i);
+		for (int i = 445; i < 700; ++i)
+			remove(&table, i);
+		assert(count(table) == 0 && capacity(table) == 64);
+		destroy(&table);
+
+		// Latency sensitive tables never shrink.
+		get_header(&table)->never_shrink = 1;
+		for (int i = 0; i < 700; ++i)
+			add(&table, i, i);
+		for (int i = 0; i < 700; ++i)
+			remove(&table, i);
+		assert(count(table) == 0 && capacity(table) == 1024);
+		destroy(&table);
+
+		// Memory-tight tables can run fuller.
+		struct header *header = get_header(&table);
+		header->max_load = 0.875f;
+		for (int i = 0; i < 112; ++i)
+			add(&table, i, i);
+		assert(capacity(table) == 128);
+		add(&table, 112, 112);
+		assert(capacity(table) == 256);
+		for (int i = 0; i < 113; ++i)
+			assert(get_value(table, i) == i);
+		for (int i = 0; i < 50; ++i)
+			remove(&table, i);
+		for (int i = 50; i < 113; ++i)
+			assert(get_value(table, i) == i);
+		destroy(&table);
+
+		header = get_header(&table);
+		header->growth_factor = 4;
+		for (int i = 0; i < 97; ++i)
+			add(&table, i, i);
+		assert(capacity(table) == 512);
+		destroy(&table);
+	}
+
+	{
+		snapshot(struct int_int) empty = NULL;
+		int key = 1;
+		assert(!snapshot_count(empty) && !snapshot_get(empty, key) && snapshot_first_index(empty) == -1);
+		snapshot_release(&empty);
+
+		int n = 10000;
+		snapshot(struct int_int) first = NULL;
+		for (int i = 0; i < n; ++i)
+			snapshot_add(&first, i, i);
+		assert(snapshot_count(first) == n);
+		for (int i = 0; i < n; ++i)
+			assert(((const struct int_int *)snapshot_get(first, i))->val == i);
+
+		// Changes to the next version copy only the chunks they touch.
+		snapshot(struct int_int) second = snapshot_edit(first);
+		key = 0;
+		snapshot_remove(&second, key);
+		snapshot_add(&second, n, n);
+		snapshot_add(&second, 5, 500);
+		assert(snapshot_count(first) == n && snapshot_count(second) == n);
+		assert(snapshot_contains(first, key) && !snapshot_contains(second, key));
+		key = n;
+		assert(!snapshot_contains(first, key) && snapshot_contains(second, key));
+		key = 5;
+		assert(((const struct int_int *)snapshot_get(first, key))->val == 5);
+		assert(((const struct int_int *)snapshot_get(second, key))->val == 500);
+		struct snapshot_header *first_header = (struct snapshot_header *)first - 1;
+		struct snapshot_header *second_header = (struct snapshot_header *)second - 1;
+		assert(first_header->capacity == second_header->capacity);
+		int num_copied = 0;
+		for (int c = 0; c < first_header->capacity / SNAPSHOT_CHUNK_SIZE; ++c)
+			num_copied += first_header->chunks[c] != second_header->chunks[c];
+		assert(num_copied >= 1 && num_copied <= 3);
+
+		// The first version can go away while the second one still uses its chunks.
+		snapshot_release(&first);
+		assert(!first);
+		int total = 0;
+		for (int i = snapshot_first_index(second); i >= 0; i = snapshot_next_index(second, i)) {
+			const struct int_int *keyval = snapshot_at(second, i);
+			assert(keyval->key > 0 && keyval->key <= n);
+			total++;
+		}
+		assert(total == n);
+
+		// Growing and shrinking make a snapshot with all new chunks.
+		snapshot(struct int_int) third = snapshot_edit(second);
+		for (int i = n + 1; i < 4 * n; ++i)
+			snapshot_add(&third, i, i);
+		for (int i = 1; i < 4 * n - 10; ++i)
+			snapshot_remove(&third, i);
+		assert(snapshot_count(third) == 10);
+		for (int i = 4 * n - 10; i < 4 * n; ++i)
+			assert(((const struct int_int *)snapshot_get(third, i))->val == i);
+		assert(snapshot_count(second) == n);
+		snapshot_release(&second);
+		snapshot_release(&third);
+	}
+
+	{
+		// Strings get copied into the slab of their chunk, so they don't depend on the table or
+		// on older versions.
+		table(struct str_str) table = NULL;
+		struct header *header = get_header(&table);
+		header->hash = hash_string;
+		header->equal = equal_strings;
+		header->copy = copy_strings;
+		static char keys[1000][5], vals[1000][5];
+		for (int i = 0; i < 1000; ++i) {
+			keys[i][0] = 'k';
+			vals[i][0] = 'v';
+			for (int j = 0, x = i; j < 3; ++j, x /= 10) {
+				keys[i][3 - j] = '0' + x % 10;
+				vals[i][3 - j] = '0' + x % 10;
+			}
+			add(&table, keys[i], vals[i]);
+		}
+		snapshot(struct str_str) first = snapshot_from_table(table);
+		destroy(&table);
+		snapshot(struct str_str) second = snapshot_edit(first);
+		snapshot_add(&second, "k000", "changed");
+		snapshot_release(&first);
+		memset(keys, 0, sizeof keys); // Make sure nothing points to these.
+		for (int i = 0; i < 1000; ++i) {
+			char key[5] = { 'k', '0' + i / 100, '0' + i / 10 % 10, '0' + i % 10, 0 };
+			char *k = key;
+			const struct str_str *keyval = snapshot_get(second, k);
+			assert(keyval && strcmp(keyval->val, i ? vals[i] : "changed") == 0);
+		}
+		snapshot_release(&second);
+	}
+
+	{
+		// Readers check that every version they see is consistent, while the writer publishes new ones.
+		static struct snapshot_test test;
+		thrd_t readers[2];
+		for (int t = 0; t < 2; ++t)
+			thrd_create(&readers[t], snapshot_reader, &test);
+		snapshot(struct int_int) latest = NULL;
+		for (int n = 1; n <= 500; ++n) {
+			snapshot(struct int_int) next = snapshot_edit(latest);
+			for (int key = 0; key < n - 1; ++key)
+				snapshot_add(&next, key, key + n);
+			snapshot_add(&next, n - 1, n - 1 + n);
+			publish_snapshot(&test.published, next);
+			latest = next;
+		}
+		atomic_store(&test.done, 1);
+		for (int t = 0; t < 2; ++t)
+			thrd_join(readers[t], NULL);
+		publish_snapshot(&test.published, NULL);
+	}
+
 	{
 		// Potential pathological case: create a bunch of items and then delete them 
 		// to leave tombstones, then lookup each item. If we don't clean tombstones this is O(n^2).
@@ -515,6 +1905,35 @@ int main(void) {
 		destroy(&table);
 	}
 
+	{
+		// A table that's already in use moves to the allocator along with the strings in its slab, and
+		// growing, shrinking and destroying it give everything back with the size it was allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		table(struct str_str) table = NULL;
+		struct header *header = get_header(&table);
+		header->hash = hash_string;
+		header->equal = equal_strings;
+		header->copy = copy_strings;
+		static char keys[2000][8];
+		for (int i = 0; i < 2000; ++i)
+			for (int j = 0, x = i; j < 7; ++j, x /= 10)
+				keys[i][6 - j] = (char)('0' + x % 10);
+		for (int i = 0; i < 1000; ++i)
+			add(&table, keys[i], keys[i]);
+		use_allocator(&table, &callbacks);
+		assert(allocated > table_bytes(get_header(&table)));
+		for (int i = 1000; i < 2000; ++i)
+			add(&table, keys[i], keys[i]);
+		int grown_capacity = capacity(table);
+		for (int i = 0; i < 1900; ++i)
+			remove(&table, keys[i]);
+		assert(capacity(table) < grown_capacity && count(table) == 100);
+		assert(strcmp(get_value(table, keys[1950]), keys[1950]) == 0);
+		destroy(&table);
+		assert(!allocated);
+	}
+
 	{
 		// This shouldn't leak
 		for (int i = 0; i < 10000; ++i) {
@@ -0,0 +1,947 @@
+// Benchmark for the hash containers in this collection: hash_table.c, hash_set.c, string_table.c,
+// string_set.c, generic_table.c and generic_set.c. All six get included into this one file, with
+// their global names renamed so they don't clash, and go through the same workloads:
+//
+// - Key streams: uniform random, zipfian (a few hot keys get most of the lookups) and sequential.
+// - Lookups where 100%, 50% and 0% of the keys are present.
+// - Churn: remove an existing key and add a new one, over and over.
+// - Load factors: lookups in a table that was resized up front and then filled to 25%, 50% and 65%.
+// - Sizes from 1000 items (fits in L1) up to the number of items given on the command line.
+//
+// Each reports ns/op, bytes/entry and a histogram of probe lengths, i.e. how many slots a lookup
+// of each key in the table has to look at. Integer keys are hashed with splitmix64 before going
+// into hash_table.c and hash_set.c, the string containers get the key formatted in decimal and
+// generic_table.c/generic_set.c get the integer key itself.
+//
+// Build with optimizations and the math library, and pass the largest size to try:
+//   cc -O2 hash_benchmark.c -lm && ./a.out 100000000
+// The containers use int capacities, so sizes are limited to around a billion slots.
+
+#include <stdlib.h> // malloc, calloc, free, atoi
+#include <string.h> // memset
+#include <stdint.h> // uint64_t
+#include <stdio.h> // printf, snprintf
+#include <time.h> // timespec_get
+#include <math.h> // pow
+#include <threads.h> // Included by hash_table.c and generic_table.c, has to come before the renaming.
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define NUM_PROBE_BUCKETS 6 // 1, 2, 3-4, 5-8, 9-16, 17+
+
+void record_probe(long long histogram[NUM_PROBE_BUCKETS], unsigned length) {
+	int bucket = 0;
+	for (unsigned limit = 1; bucket < NUM_PROBE_BUCKETS - 1 && length > limit; limit *= 2)
+		bucket++;
+	histogram[bucket]++;
+}
+
+unsigned long long splitmix64(unsigned long long x) {
+	x += 0x9E3779B97F4A7C15u;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9u;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBu;
+	return x ^ (x >> 31);
+}
+
+// hash_table.c
+
+#define table hash_table_table
+#define resize hash_table_resize
+#define table_max_load hash_table_table_max_load
+#define capacity_for hash_table_capacity_for
+#define reserve hash_table_reserve
+#define add hash_table_add
+#define remove hash_table_remove
+#define get hash_table_get
+#define first_index hash_table_first_index
+#define next_index hash_table_next_index
+#define destroy hash_table_destroy
+#define build hash_table_build
+#define build_thread hash_table_build_thread
+#define build_from hash_table_build_from
+#define table_stats hash_table_table_stats
+#define hash hash_table_hash
+#define allocator_callbacks hash_table_allocator_callbacks
+#define allocate_memory hash_table_allocate_memory
+#define deallocate_memory hash_table_deallocate_memory
+#define counting_allocator hash_table_counting_allocator
+#define counting_allocate hash_table_counting_allocate
+#define counting_deallocate hash_table_counting_deallocate
+#define frame_arena hash_table_frame_arena
+#define frame_allocate hash_table_frame_allocate
+#define main hash_table_main
+#include "hash_table.c"
+void *hash_table_create(void) {
+	return calloc(1, sizeof(struct table));
+}
+void hash_table_prepare(void *container, int capacity) {
+	resize(container, capacity);
+}
+void hash_table_insert(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	add(container, splitmix64(key), key);
+}
+int hash_table_lookup(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	return get(*(struct table *)container, splitmix64(key)) != NULL;
+}
+void hash_table_erase(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	remove(container, splitmix64(key));
+}
+long long hash_table_memory(void *container) {
+	struct table *table = container;
+	return (long long)table->capacity * (sizeof table->hashes[0] + sizeof table->values[0]);
+}
+void hash_table_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	struct table *table = container;
+	unsigned mask = (unsigned)table->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)table->capacity; ++i)
+		if (table->hashes[i] > TOMBSTONE)
+			record_probe(histogram, ((i - (unsigned)table->hashes[i]) & mask) + 1);
+}
+void hash_table_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef table
+#undef resize
+#undef table_max_load
+#undef capacity_for
+#undef reserve
+#undef add
+#undef remove
+#undef get
+#undef first_index
+#undef next_index
+#undef destroy
+#undef build
+#undef build_thread
+#undef build_from
+#undef table_stats
+#undef hash
+#undef main
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef counting_allocator
+#undef counting_allocate
+#undef counting_deallocate
+#undef frame_arena
+#undef frame_allocate
+#undef TOMBSTONE
+#undef MAX_BUILD_THREADS
+#undef NUM_CLUSTER_BUCKETS
+
+// hash_set.c
+
+#define set hash_set_set
+#define resize hash_set_resize
+#define reserve hash_set_reserve
+#define add hash_set_add
+#define remove hash_set_remove
+#define contains hash_set_contains
+#define destroy hash_set_destroy
+#define hash hash_set_hash
+#define allocator_callbacks hash_set_allocator_callbacks
+#define allocate_memory hash_set_allocate_memory
+#define deallocate_memory hash_set_deallocate_memory
+#define counting_allocate hash_set_counting_allocate
+#define counting_deallocate hash_set_counting_deallocate
+#define main hash_set_main
+#include "hash_set.c"
+void *hash_set_create(void) {
+	return calloc(1, sizeof(struct set));
+}
+void hash_set_prepare(void *container, int capacity) {
+	resize(container, capacity);
+}
+void hash_set_insert(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	add(container, splitmix64(key));
+}
+int hash_set_lookup(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	return contains(*(struct set *)container, splitmix64(key));
+}
+void hash_set_erase(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	remove(container, splitmix64(key));
+}
+long long hash_set_memory(void *container) {
+	struct set *set = container;
+	return (long long)set->capacity * sizeof set->hashes[0];
+}
+void hash_set_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	struct set *set = container;
+	unsigned mask = (unsigned)set->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)set->capacity; ++i)
+		if (set->hashes[i] > TOMBSTONE)
+			record_probe(histogram, ((i - (unsigned)set->hashes[i]) & mask) + 1);
+}
+void hash_set_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef set
+#undef resize
+#undef reserve
+#undef add
+#undef remove
+#undef contains
+#undef destroy
+#undef hash
+#undef main
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef counting_allocate
+#undef counting_deallocate
+#undef TOMBSTONE
+
+// string_table.c
+
+#define slot string_table_slot
+#define table string_table_table
+#define slab string_table_slab
+#define hash_string string_table_hash_string
+#define copy_string string_table_copy_string
+#define string_chars string_table_string_chars
+#define slab_size string_table_slab_size
+#define store_string string_table_store_string
+#define resize string_table_resize
+#define reserve string_table_reserve
+#define collect_garbage string_table_collect_garbage
+#define add string_table_add
+#define remove string_table_remove
+#define get string_table_get
+#define key_at string_table_key_at
+#define val_at string_table_val_at
+#define first_index string_table_first_index
+#define next_index string_table_next_index
+#define destroy string_table_destroy
+#define allocator_callbacks string_table_allocator_callbacks
+#define allocate_memory string_table_allocate_memory
+#define deallocate_memory string_table_deallocate_memory
+#define free_memory string_table_free_memory
+#define counting_allocate string_table_counting_allocate
+#define counting_deallocate string_table_counting_deallocate
+#define main string_table_main
+#include "string_table.c"
+void *string_table_create(void) {
+	return calloc(1, sizeof(struct table));
+}
+void string_table_prepare(void *container, int capacity) {
+	resize(container, capacity);
+}
+void string_table_insert(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	add(container, string, string);
+}
+int string_table_lookup(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	return get(*(struct table *)container, string) != NULL;
+}
+void string_table_erase(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	remove(container, string);
+}
+long long string_table_memory(void *container) {
+	struct table *table = container;
+	long long bytes = (long long)table->capacity * sizeof table->slots[0];
+	for (struct slab *slab = table->slab; slab; slab = slab->prev)
+		bytes += sizeof slab[0] + slab->capacity;
+	return bytes;
+}
+void string_table_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	struct table *table = container;
+	unsigned mask = (unsigned)table->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)table->capacity; ++i)
+		if (table->slots[i].hash > TOMBSTONE)
+			record_probe(histogram, ((i - (unsigned)table->slots[i].hash) & mask) + 1);
+}
+void string_table_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef slot
+#undef table
+#undef slab
+#undef hash_string
+#undef copy_string
+#undef string_chars
+#undef slab_size
+#undef store_string
+#undef resize
+#undef reserve
+#undef collect_garbage
+#undef add
+#undef remove
+#undef get
+#undef key_at
+#undef val_at
+#undef first_index
+#undef next_index
+#undef destroy
+#undef main
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef free_memory
+#undef counting_allocate
+#undef counting_deallocate
+#undef TOMBSTONE
+#undef INLINE_CAPACITY
+
+// string_set.c
+
+#define set string_set_set
+#define slab string_set_slab
+#define hash_string string_set_hash_string
+#define copy_string string_set_copy_string
+#define resize string_set_resize
+#define reserve string_set_reserve
+#define add string_set_add
+#define remove string_set_remove
+#define contains string_set_contains
+#define first_index string_set_first_index
+#define next_index string_set_next_index
+#define destroy string_set_destroy
+#define allocator_callbacks string_set_allocator_callbacks
+#define allocate_memory string_set_allocate_memory
+#define deallocate_memory string_set_deallocate_memory
+#define free_memory string_set_free_memory
+#define counting_allocate string_set_counting_allocate
+#define counting_deallocate string_set_counting_deallocate
+#define main string_set_main
+#include "string_set.c"
+void *string_set_create(void) {
+	return calloc(1, sizeof(struct set));
+}
+void string_set_prepare(void *container, int capacity) {
+	resize(container, capacity);
+}
+void string_set_insert(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	add(container, string);
+}
+int string_set_lookup(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	return contains(*(struct set *)container, string);
+}
+void string_set_erase(void *container, unsigned long long key, const char *string) {
+	(void)key;
+	remove(container, string);
+}
+long long string_set_memory(void *container) {
+	struct set *set = container;
+	long long bytes = (long long)set->capacity * sizeof set->items[0];
+	for (struct slab *slab = set->slab; slab; slab = slab->prev)
+		bytes += sizeof slab[0] + slab->capacity;
+	return bytes;
+}
+void string_set_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	struct set *set = container;
+	unsigned mask = (unsigned)set->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)set->capacity; ++i)
+		if ((size_t)set->items[i] > TOMBSTONE)
+			record_probe(histogram, ((i - (unsigned)hash_string(set->items[i])) & mask) + 1);
+}
+void string_set_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef set
+#undef slab
+#undef hash_string
+#undef copy_string
+#undef resize
+#undef reserve
+#undef add
+#undef remove
+#undef contains
+#undef first_index
+#undef next_index
+#undef destroy
+#undef main
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef free_memory
+#undef counting_allocate
+#undef counting_deallocate
+#undef TOMBSTONE
+
+// generic_table.c
+
+#define slab generic_table_slab
+#define header generic_table_header
+#define allocate generic_table_allocate
+#define freeall generic_table_freeall
+#define count generic_table_count
+#define capacity generic_table_capacity
+#define destroy generic_table_destroy
+#define first_index generic_table_first_index
+#define next_index generic_table_next_index
+#define default_compare generic_table_default_compare
+#define default_copy generic_table_default_copy
+#define default_hash generic_table_default_hash
+#define private__resize generic_table_private__resize
+#define table_max_load generic_table_table_max_load
+#define capacity_for generic_table_capacity_for
+#define private__reserve generic_table_private__reserve
+#define private__add generic_table_private__add
+#define private__get generic_table_private__get
+#define private__remove generic_table_private__remove
+#define private__table_stats generic_table_private__table_stats
+#define build generic_table_build
+#define build_thread generic_table_build_thread
+#define private__build_from generic_table_private__build_from
+#define frozen_info generic_table_frozen_info
+#define frozen_header generic_table_frozen_header
+#define frozen_count generic_table_frozen_count
+#define frozen_mix generic_table_frozen_mix
+#define frozen_bucket generic_table_frozen_bucket
+#define frozen_slot generic_table_frozen_slot
+#define private__freeze generic_table_private__freeze
+#define private__frozen_get generic_table_private__frozen_get
+#define save_frozen generic_table_save_frozen
+#define private__load_frozen generic_table_private__load_frozen
+#define destroy_frozen generic_table_destroy_frozen
+#define hash_string generic_table_hash_string
+#define equal_strings generic_table_equal_strings
+#define copy_strings generic_table_copy_strings
+#define collide_hash generic_table_collide_hash
+#define identity_hash generic_table_identity_hash
+#define allocator_callbacks generic_table_allocator_callbacks
+#define allocate_memory generic_table_allocate_memory
+#define deallocate_memory generic_table_deallocate_memory
+#define first_slab generic_table_first_slab
+#define table_bytes generic_table_table_bytes
+#define private__move generic_table_private__move
+#define counting_allocate generic_table_counting_allocate
+#define counting_deallocate generic_table_counting_deallocate
+#define main generic_table_main
+#include "generic_table.c"
+struct generic_table_entry {
+	unsigned long long key;
+	unsigned long long val;
+};
+void *generic_table_create(void) {
+	return calloc(1, sizeof(table(struct generic_table_entry)));
+}
+void generic_table_prepare(void *container, int slots) {
+	table(struct generic_table_entry) *ptable = container;
+	resize(ptable, slots);
+}
+void generic_table_insert(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	table(struct generic_table_entry) *ptable = container;
+	add(ptable, key, key);
+}
+int generic_table_lookup(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	table(struct generic_table_entry) *ptable = container;
+	return contains(*ptable, key);
+}
+void generic_table_erase(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	table(struct generic_table_entry) *ptable = container;
+	remove(ptable, key);
+}
+long long generic_table_memory(void *container) {
+	table(struct generic_table_entry) *ptable = container;
+	if (!*ptable)
+		return 0;
+	struct header *header = (struct header *)*ptable - 1;
+	long long bytes = sizeof header[0] + (header->capacity + 1LL) * (sizeof (*ptable)[0] + sizeof header->metadata[0]);
+	for (struct slab *slab = header->slab; slab; slab = slab->prev)
+		bytes += sizeof slab[0] + slab->capacity;
+	return bytes;
+}
+void generic_table_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	table(struct generic_table_entry) *ptable = container;
+	if (!*ptable)
+		return;
+	struct header *header = (struct header *)*ptable - 1;
+	unsigned mask = (unsigned)header->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)header->capacity; ++i) {
+		if (header->metadata[i] > TOMBSTONE) {
+			unsigned long long hash = header->hash(header->hash_context, &(*ptable)[i].key, sizeof (*ptable)[i].key);
+			record_probe(histogram, ((i - (unsigned)hash) & mask) + 1);
+		}
+	}
+}
+void generic_table_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef slab
+#undef header
+#undef allocate
+#undef freeall
+#undef count
+#undef capacity
+#undef destroy
+#undef first_index
+#undef next_index
+#undef default_compare
+#undef default_copy
+#undef default_hash
+#undef private__resize
+#undef table_max_load
+#undef capacity_for
+#undef private__reserve
+#undef private__add
+#undef private__get
+#undef private__remove
+#undef private__table_stats
+#undef build
+#undef build_thread
+#undef private__build_from
+#undef frozen_info
+#undef frozen_header
+#undef frozen_count
+#undef frozen_bucket
+#undef frozen_mix
+#undef frozen_slot
+#undef private__freeze
+#undef private__frozen_get
+#undef save_frozen
+#undef private__load_frozen
+#undef destroy_frozen
+#undef hash_string
+#undef equal_strings
+#undef copy_strings
+#undef collide_hash
+#undef identity_hash
+#undef main
+#undef use_allocator
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef first_slab
+#undef table_bytes
+#undef private__move
+#undef counting_allocate
+#undef counting_deallocate
+#undef TOMBSTONE
+#undef MAX_BUILD_THREADS
+#undef NUM_CLUSTER_BUCKETS
+#undef table
+#undef table_stats
+#undef resize
+#undef reserve
+#undef get_header
+#undef add
+#undef get
+#undef get_value
+#undef contains
+#undef remove
+#undef build_from
+#undef frozen
+#undef freeze
+#undef get_frozen_header
+#undef frozen_get
+#undef frozen_get_value
+#undef frozen_contains
+#undef load_frozen
+#undef SNAPSHOT_CHUNK_SIZE
+#undef snapshot
+#undef get_snapshot_header
+#undef snapshot_add
+#undef snapshot_remove
+#undef snapshot_get
+#undef snapshot_contains
+#undef snapshot_release
+#undef snapshot_from_table
+
+// generic_set.c
+
+#define slab generic_set_slab
+#define header generic_set_header
+#define allocate generic_set_allocate
+#define freeall generic_set_freeall
+#define count generic_set_count
+#define capacity generic_set_capacity
+#define destroy generic_set_destroy
+#define first_index generic_set_first_index
+#define next_index generic_set_next_index
+#define default_compare generic_set_default_compare
+#define default_copy generic_set_default_copy
+#define default_hash generic_set_default_hash
+#define private__resize generic_set_private__resize
+#define private__reserve generic_set_private__reserve
+#define private__add generic_set_private__add
+#define private__get generic_set_private__get
+#define private__remove generic_set_private__remove
+#define hash_string generic_set_hash_string
+#define equal_strings generic_set_equal_strings
+#define copy_string generic_set_copy_string
+#define allocator_callbacks generic_set_allocator_callbacks
+#define allocate_memory generic_set_allocate_memory
+#define deallocate_memory generic_set_deallocate_memory
+#define first_slab generic_set_first_slab
+#define set_bytes generic_set_set_bytes
+#define private__move generic_set_private__move
+#define counting_allocate generic_set_counting_allocate
+#define counting_deallocate generic_set_counting_deallocate
+#define main generic_set_main
+#include "generic_set.c"
+void *generic_set_create(void) {
+	return calloc(1, sizeof(set(unsigned long long)));
+}
+void generic_set_prepare(void *container, int slots) {
+	set(unsigned long long) *pset = container;
+	resize(pset, slots);
+}
+void generic_set_insert(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	set(unsigned long long) *pset = container;
+	add(pset, key);
+}
+int generic_set_lookup(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	set(unsigned long long) *pset = container;
+	return contains(*pset, key);
+}
+void generic_set_erase(void *container, unsigned long long key, const char *string) {
+	(void)string;
+	set(unsigned long long) *pset = container;
+	remove(pset, key);
+}
+long long generic_set_memory(void *container) {
+	set(unsigned long long) *pset = container;
+	if (!*pset)
+		return 0;
+	struct header *header = (struct header *)*pset - 1;
+	long long bytes = sizeof header[0] + (header->capacity + 1LL) * (sizeof (*pset)[0] + sizeof header->metadata[0]);
+	for (struct slab *slab = header->slab; slab; slab = slab->prev)
+		bytes += sizeof slab[0] + slab->capacity;
+	return bytes;
+}
+void generic_set_probes(void *container, long long histogram[NUM_PROBE_BUCKETS]) {
+	set(unsigned long long) *pset = container;
+	if (!*pset)
+		return;
+	struct header *header = (struct header *)*pset - 1;
+	unsigned mask = (unsigned)header->capacity - 1;
+	for (unsigned i = 0; i < (unsigned)header->capacity; ++i) {
+		if (header->metadata[i] > TOMBSTONE) {
+			unsigned long long hash = header->hash(header->hash_context, &(*pset)[i], sizeof (*pset)[i]);
+			record_probe(histogram, ((i - (unsigned)hash) & mask) + 1);
+		}
+	}
+}
+void generic_set_free(void *container) {
+	destroy(container);
+	free(container);
+}
+#undef slab
+#undef header
+#undef allocate
+#undef freeall
+#undef count
+#undef capacity
+#undef destroy
+#undef first_index
+#undef next_index
+#undef default_compare
+#undef default_copy
+#undef default_hash
+#undef private__resize
+#undef private__reserve
+#undef private__add
+#undef private__get
+#undef private__remove
+#undef hash_string
+#undef equal_strings
+#undef copy_string
+#undef main
+#undef use_allocator
+#undef allocator_callbacks
+#undef allocate_memory
+#undef deallocate_memory
+#undef first_slab
+#undef set_bytes
+#undef private__move
+#undef counting_allocate
+#undef counting_deallocate
+#undef TOMBSTONE
+#undef set
+#undef resize
+#undef reserve
+#undef get_header
+#undef add
+#undef get_index
+#undef contains
+#undef remove
+
+// Benchmark
+
+struct container {
+	const char *name;
+	void *(*create)(void);
+	void (*prepare)(void *container, int capacity); // Resize up front so adding doesn't grow the table.
+	void (*insert)(void *container, unsigned long long key, const char *string);
+	int (*lookup)(void *container, unsigned long long key, const char *string);
+	void (*erase)(void *container, unsigned long long key, const char *string);
+	long long (*memory)(void *container);
+	void (*probes)(void *container, long long histogram[NUM_PROBE_BUCKETS]);
+	void (*destroy)(void *container);
+};
+
+#define CONTAINER(name) { #name, name##_create, name##_prepare, name##_insert, name##_lookup, name##_erase, name##_memory, name##_probes, name##_free }
+struct container containers[] = {
+	CONTAINER(hash_table),
+	CONTAINER(hash_set),
+	CONTAINER(string_table),
+	CONTAINER(string_set),
+	CONTAINER(generic_table),
+	CONTAINER(generic_set),
+};
+#define NUM_CONTAINERS (int)(sizeof containers / sizeof containers[0])
+
+enum distribution { UNIFORM, ZIPFIAN, SEQUENTIAL, NUM_DISTRIBUTIONS };
+const char *distribution_names[NUM_DISTRIBUTIONS] = { "uniform", "zipfian", "sequential" };
+
+// Key i for i < n is added to the table, keys n to 2n-1 are the misses.
+struct keys {
+	unsigned long long *values;
+	char **strings;
+	char *chars;
+	int n;
+};
+
+struct stream {
+	int *ids; // Indices into the keys.
+	int length;
+};
+
+double seconds(void) {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+unsigned long long random_next(unsigned long long *seed) {
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 0x2545F4914F6CDD1Du;
+}
+
+double random_double(unsigned long long *seed) {
+	return (double)(random_next(seed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian ranks as in YCSB (Gray et al., "Quickly generating billion-record synthetic databases").
+struct zipf {
+	int n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+};
+
+void zipf_initialize(struct zipf *zipf, int n, double theta) {
+	double zeta2 = 1 + pow(0.5, theta);
+	double zetan = 0;
+	for (int i = 1; i <= n; ++i)
+		zetan += pow(i, -theta);
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->alpha = 1 / (1 - theta);
+	zipf->zetan = zetan;
+	zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+int zipf_next(const struct zipf *zipf, unsigned long long *seed) {
+	double u = random_double(seed);
+	double uz = u * zipf->zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, zipf->theta))
+		return 1;
+	int rank = (int)(zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+	return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+void make_keys(struct keys *keys, int n, enum distribution distribution) {
+	keys->n = n;
+	keys->values = malloc(2 * (size_t)n * sizeof keys->values[0]);
+	keys->strings = malloc(2 * (size_t)n * sizeof keys->strings[0]);
+	keys->chars = malloc(2 * (size_t)n * 21);
+	for (int i = 0; i < 2 * n; ++i) {
+		keys->values[i] = distribution == SEQUENTIAL ? (unsigned long long)i : splitmix64((unsigned long long)i);
+		keys->strings[i] = keys->chars + (size_t)i * 21;
+		snprintf(keys->strings[i], 21, "%llu", keys->values[i]);
+	}
+}
+
+void free_keys(struct keys *keys) {
+	free(keys->values);
+	free(keys->strings);
+	free(keys->chars);
+}
+
+// A stream of lookups, where hit_ratio of them are for keys in the table.
+void make_stream(struct stream *stream, int length, int n, double hit_ratio, enum distribution distribution, unsigned long long seed) {
+	struct zipf zipf;
+	if (distribution == ZIPFIAN)
+		zipf_initialize(&zipf, n, 0.99);
+	stream->length = length;
+	stream->ids = malloc((size_t)length * sizeof stream->ids[0]);
+	for (int i = 0; i < length; ++i) {
+		int id;
+		if (distribution == SEQUENTIAL)
+			id = i % n;
+		else if (distribution == ZIPFIAN) // Scatter the ranks so the hot keys aren't next to each other.
+			id = (int)((unsigned long long)zipf_next(&zipf, &seed) * 2654435761u % (unsigned)n);
+		else
+			id = (int)(random_next(&seed) % (unsigned)n);
+		if (random_double(&seed) >= hit_ratio)
+			id += n;
+		stream->ids[i] = id;
+	}
+}
+
+volatile int sink; // Keeps the lookups from being optimized out.
+
+double time_lookups(const struct container *container, void *instance, const struct keys *keys, const struct stream *stream) {
+	int found = 0;
+	double start = seconds();
+	for (int i = 0; i < stream->length; ++i) {
+		int id = stream->ids[i];
+		found += container->lookup(instance, keys->values[id], keys->strings[id]);
+	}
+	double elapsed = seconds() - start;
+	sink = found;
+	return 1e9 * elapsed / stream->length;
+}
+
+void print_histogram(const long long histogram[NUM_PROBE_BUCKETS]) {
+	long long total = 0;
+	for (int i = 0; i < NUM_PROBE_BUCKETS; ++i)
+		total += histogram[i];
+	for (int i = 0; i < NUM_PROBE_BUCKETS; ++i)
+		printf(" %5.1f", total ? 100.0 * histogram[i] / total : 0.0);
+	printf("\n");
+}
+
+void benchmark_workloads(const struct keys *keys, enum distribution distribution, int num_operations) {
+	int n = keys->n;
+	double hit_ratios[3] = { 1, 0.5, 0 };
+	struct stream streams[3];
+	for (int i = 0; i < 3; ++i)
+		make_stream(&streams[i], num_operations, n, hit_ratios[i], distribution, 1234 + i);
+
+	printf("\n%d items, %s keys. Times in ns/op, probe lengths in %% of items.\n", n, distribution_names[distribution]);
+	printf("%-14s %7s %7s %7s %7s %7s %11s | probes %5s %5s %5s %5s %5s %5s\n",
+		"", "insert", "hit", "50%hit", "miss", "churn", "bytes/entry", "1", "2", "3-4", "5-8", "9-16", "17+");
+	for (int c = 0; c < NUM_CONTAINERS; ++c) {
+		const struct container *container = &containers[c];
+
+		// Small tables are built several times, so the time isn't just noise.
+		int repeats = num_operations / n;
+		double insert_seconds = 0;
+		void *instance = NULL;
+		for (int r = 0; r < repeats; ++r) {
+			if (instance)
+				container->destroy(instance);
+			instance = container->create();
+			double start = seconds();
+			for (int i = 0; i < n; ++i)
+				container->insert(instance, keys->values[i], keys->strings[i]);
+			insert_seconds += seconds() - start;
+		}
+
+		long long histogram[NUM_PROBE_BUCKETS] = { 0 };
+		container->probes(instance, histogram);
+		double bytes_per_entry = (double)container->memory(instance) / n;
+
+		double lookups[3];
+		for (int i = 0; i < 3; ++i)
+			lookups[i] = time_lookups(container, instance, keys, &streams[i]);
+
+		// Key i is removed and key n+i added, wrapping around, so there are always n keys in the table.
+		int num_pairs = num_operations / 2;
+		double start = seconds();
+		for (int i = 0; i < num_pairs; ++i) {
+			int removed = i % (2 * n);
+			int added = (n + i) % (2 * n);
+			container->erase(instance, keys->values[removed], keys->strings[removed]);
+			container->insert(instance, keys->values[added], keys->strings[added]);
+		}
+		double churn = 1e9 * (seconds() - start) / (2.0 * num_pairs);
+		container->destroy(instance);
+
+		printf("%-14s %7.1f %7.1f %7.1f %7.1f %7.1f %11.1f |       ",
+			container->name, 1e9 * insert_seconds / ((double)repeats * n), lookups[0], lookups[1], lookups[2], churn, bytes_per_entry);
+		print_histogram(histogram);
+	}
+
+	for (int i = 0; i < 3; ++i)
+		free(streams[i].ids);
+}
+
+// Hit and miss lookups in tables with the same capacity and different numbers of items.
+void benchmark_load_factors(const struct keys *keys, int num_operations) {
+	int n = keys->n;
+	int capacity = 1;
+	while (capacity < n)
+		capacity *= 2;
+	double loads[3] = { 0.25, 0.5, 0.65 };
+
+	printf("\n%d slots, uniform keys. Times in ns/op, probe lengths in %% of items.\n", capacity);
+	printf("%-14s %5s %7s %7s %11s | probes %5s %5s %5s %5s %5s %5s\n",
+		"", "load", "hit", "miss", "bytes/entry", "1", "2", "3-4", "5-8", "9-16", "17+");
+	for (int c = 0; c < NUM_CONTAINERS; ++c) {
+		const struct container *container = &containers[c];
+		for (int l = 0; l < 3; ++l) {
+			int num_items = (int)(loads[l] * capacity);
+			if (num_items < 1)
+				continue;
+			struct stream hits, misses;
+			make_stream(&hits, num_operations, n, 1, UNIFORM, 42);
+			make_stream(&misses, num_operations, n, 0, UNIFORM, 43);
+			for (int i = 0; i < num_operations; ++i)
+				hits.ids[i] %= num_items;
+
+			void *instance = container->create();
+			container->prepare(instance, capacity);
+			for (int i = 0; i < num_items; ++i)
+				container->insert(instance, keys->values[i], keys->strings[i]);
+			long long histogram[NUM_PROBE_BUCKETS] = { 0 };
+			container->probes(instance, histogram);
+			double bytes_per_entry = (double)container->memory(instance) / num_items;
+			double hit = time_lookups(container, instance, keys, &hits);
+			double miss = time_lookups(container, instance, keys, &misses);
+			container->destroy(instance);
+
+			printf("%-14s %5.2f %7.1f %7.1f %11.1f |       ", container->name, loads[l], hit, miss, bytes_per_entry);
+			print_histogram(histogram);
+			free(hits.ids);
+			free(misses.ids);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	int max_items = argc > 1 ? atoi(argv[1]) : 1000000;
+	for (long long n = 1000; n <= max_items; n *= 32) {
+		// At least a million operations per measurement, so the small sizes aren't just timer noise.
+		int num_operations = n < 1048576 ? 1048576 : (int)n;
+		for (int d = 0; d < NUM_DISTRIBUTIONS; ++d) {
+			struct keys keys;
+			make_keys(&keys, (int)n, d);
+			benchmark_workloads(&keys, d, num_operations);
+			if (d == UNIFORM)
+				benchmark_load_factors(&keys, num_operations);
+			free_keys(&keys);
+		}
+	}
+	return 0;
+}
@@ -1,4 +1,23 @@
-#include <stdlib.h> // calloc, free
+#include <stdlib.h> // malloc, free
+
+// Where a set gets its memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
 
 // For simplicity and efficiency, this set doesn't actually store the items. 
 // It only stores the item hashes. You'd better have a good hash function, because 
@@ -12,6 +31,7 @@ struct set {
 	int capacity; // Always a power of 2 or 0.
 	int count;
 	int num_tombstones;
+	const struct allocator_callbacks *allocator; // Set before adding anything, NULL means malloc.
 };
 
 #define TOMBSTONE 1
@@ -24,7 +44,9 @@ void resize(struct set *set, int capacity) {
 	for (pow2 = 1; (1 << pow2) < capacity; ++pow2);
 	capacity = (1 << pow2);
 
-	unsigned long long *new_hashes = calloc((size_t)capacity, sizeof new_hashes[0]);
+	unsigned long long *new_hashes = allocate_memory(set->allocator, (size_t)capacity * sizeof new_hashes[0]);
+	for (int i = 0; i < capacity; ++i)
+		new_hashes[i] = 0;
 	unsigned mask = (unsigned)capacity - 1;
 	for (int i = 0; i < set->capacity; ++i) {
 		unsigned long long hash = set->hashes[i];
@@ -38,7 +60,7 @@ void resize(struct set *set, int capacity) {
 		}
 	}
 
-	free(set->hashes);
+	deallocate_memory(set->allocator, set->hashes, (size_t)set->capacity * sizeof set->hashes[0]);
 	set->hashes = new_hashes;
 	set->capacity = capacity;
 	set->num_tombstones = 0;
@@ -106,7 +128,7 @@ int contains(struct set set, unsigned long long hash) {
 }
 
 void destroy(struct set *set) {
-	free(set->hashes);
+	deallocate_memory(set->allocator, set->hashes, (size_t)set->capacity * sizeof set->hashes[0]);
 	set->capacity = 0;
 	set->count = 0;
 	set->hashes = NULL;
@@ -120,6 +142,15 @@ unsigned long long hash(const char *string) {
 		hash = (hash ^ string[i]) * 1099511628211u;
 	return hash;
 }
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	{
 		struct set set = { 0 };
@@ -230,6 +261,26 @@ int main(void) {
 			assert(!contains(set, i));
 	}
 
+	{
+		// Growing and cleaning up tombstones give the old hashes back with the size they were allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct set set = { 0 };
+		set.allocator = &callbacks;
+		for (unsigned long long i = 2; i < 10000; ++i)
+			add(&set, i);
+		assert(allocated == (size_t)set.capacity * sizeof set.hashes[0]);
+		for (unsigned long long i = 2; i < 9000; ++i)
+			remove(&set, i);
+		for (unsigned long long i = 10000; i < 20000; ++i)
+			add(&set, i);
+		assert(allocated == (size_t)set.capacity * sizeof set.hashes[0]);
+		for (unsigned long long i = 2; i < 20000; ++i)
+			assert(contains(set, i) == (i >= 9000));
+		destroy(&set);
+		assert(!allocated);
+	}
+
 	{
 		// This shouldn't leak.
 		for (int i = 0; i < 10000; ++i) {
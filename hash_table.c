@@ -1,5 +1,26 @@
 #include <stdlib.h> // malloc, free
 
+// Where a container gets its memory from, for example a frame arena that gets dropped after each
+// request. A NULL allocator means malloc and free. Allocators that can only release everything at
+// once, like stack_allocator.c, can leave deallocate NULL.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
 // For simplicity and efficiency, this table doesn't actually store the keys. 
 // It only stores the key hashes. You'd better have a good hash function, because 
 // if two keys happen to hash to the same value you're in big trouble. They will 
@@ -11,6 +32,14 @@ struct table {
 	int capacity; // Always a power of 2 or 0.
 	int count;
 	int num_tombstones;
+
+	// Growth policy, 0 means the default. These are kept by destroy, so a table can be reused.
+	float max_load; // Grow when adding would go over this load factor, default 3/4, at most 15/16.
+	float min_load; // Shrink when removing goes under this load factor, default 0 which means never shrink.
+	int min_capacity; // Default 64.
+	int growth_factor; // Grow to at least this many times the capacity, default 2.
+
+	const struct allocator_callbacks *allocator; // Set before adding anything, NULL means malloc.
 };
 
 #define TOMBSTONE 1
@@ -23,7 +52,7 @@ void resize(struct table *table, int capacity) {
 	for (pow2 = 1; (1 << pow2) < capacity; ++pow2);
 	capacity = (1 << pow2);
 
-	unsigned long long *new_memory = malloc((size_t)capacity * 2 * sizeof new_memory[0]);
+	unsigned long long *new_memory = allocate_memory(table->allocator, (size_t)capacity * 2 * sizeof new_memory[0]);
 	unsigned long long *new_hashes = new_memory;
 	unsigned long long *new_values = new_hashes + capacity;
 	for (int i = 0; i < capacity; ++i)
@@ -43,18 +72,34 @@ void resize(struct table *table, int capacity) {
 		}
 	}
 
-	free(table->hashes); // This also frees the values.
+	deallocate_memory(table->allocator, table->hashes, (size_t)table->capacity * 2 * sizeof table->hashes[0]); // This also frees the values.
 	table->hashes = new_hashes;
 	table->values = new_values;
 	table->capacity = capacity;
 	table->num_tombstones = 0;
 }
 
+double table_max_load(const struct table *table) {
+	if (table->max_load <= 0)
+		return 0.75;
+	return table->max_load < 0.9375 ? table->max_load : 0.9375; // Lookups stop at empty slots, so there has to be some.
+}
+
+// Smallest capacity that fits count items at the given load factor, before rounding up to a power of 2.
+int capacity_for(const struct table *table, int count, double load) {
+	int capacity = (int)(count / load);
+	if (capacity * load < count)
+		capacity++;
+	int min_capacity = table->min_capacity > 0 ? table->min_capacity : 64;
+	return capacity < min_capacity ? min_capacity : capacity;
+}
+
 void reserve(struct table *table, int min_capacity) {
-	if (3 * table->capacity < 4 * min_capacity) {
-		int capacity = 4 * min_capacity / 3;
-		if (capacity < 64)
-			capacity = 64;
+	if (min_capacity > table_max_load(table) * table->capacity) {
+		int capacity = capacity_for(table, min_capacity, table_max_load(table));
+		int growth_factor = table->growth_factor > 1 ? table->growth_factor : 2;
+		if (capacity < growth_factor * table->capacity)
+			capacity = growth_factor * table->capacity;
 		resize(table, capacity);
 	}
 }
@@ -95,7 +140,20 @@ void remove(struct table *table, unsigned long long hash) {
 			table->hashes[i] = TOMBSTONE;
 			table->count--;
 			table->num_tombstones++;
-			if (8 * table->num_tombstones > table->capacity)
+			double max_load = table_max_load(table);
+			if (table->count < table->min_load * table->capacity) {
+				// Shrink to a load factor halfway between the two limits, so it takes a lot of adds or removes
+				// before resizing again. Only if that at least halves the capacity though, resizing to the
+				// same capacity on every remove would be quadratic.
+				int capacity = capacity_for(table, table->count, (table->min_load + max_load) / 2);
+				if (2 * capacity <= table->capacity) {
+					resize(table, capacity);
+					return;
+				}
+			}
+			// Tombstones take up slots just like items, so a higher max load leaves less room for them.
+			double max_tombstones = max_load < 0.75 ? 0.125 : (1 - max_load) / 2;
+			if (table->num_tombstones > max_tombstones * table->capacity)
 				resize(table, table->capacity); // Get rid of tombstones.
 			return;
 		}
@@ -130,13 +188,226 @@ int next_index(struct table table, int index) {
 }
 
 void destroy(struct table *table) {
-	free(table->hashes); // This also frees the values.
+	deallocate_memory(table->allocator, table->hashes, (size_t)table->capacity * 2 * sizeof table->hashes[0]); // This also frees the values.
 	table->capacity = 0;
 	table->count = 0;
 	table->hashes = NULL;
 	table->values = NULL;
 }
 
+#define NUM_CLUSTER_BUCKETS 16
+
+// For figuring out why a table got slow. A cluster is a run of non-empty slots (tombstones included),
+// which is what lookups have to walk through. Long clusters with short probes point to tombstones,
+// long probes with a low load factor point to a bad hash function.
+struct table_stats {
+	int count;
+	int capacity;
+	int num_tombstones;
+	double load_factor; // (count + num_tombstones) / capacity, since tombstones slow down probing as much as items.
+	double average_probe_length; // Slots looked at to find an item, 1 if it's in its home slot.
+	int max_probe_length;
+	int max_cluster_length;
+	int clusters[NUM_CLUSTER_BUCKETS]; // clusters[i] counts clusters of length 2^i to 2^(i+1)-1, the last one also the longer ones.
+	long long bytes;
+};
+
+// One pass over the slots without allocating, so it's fine to sample every now and then.
+void table_stats(struct table table, struct table_stats *stats) {
+	*stats = (struct table_stats){ 0 };
+	stats->count = table.count;
+	stats->capacity = table.capacity;
+	stats->num_tombstones = table.num_tombstones;
+	stats->bytes = (long long)table.capacity * (sizeof table.hashes[0] + sizeof table.values[0]);
+	if (!table.capacity)
+		return;
+	stats->load_factor = (double)(table.count + table.num_tombstones) / table.capacity;
+
+	// Start after an empty slot, so that no cluster wraps around the end.
+	unsigned capacity = (unsigned)table.capacity;
+	unsigned mask = capacity - 1;
+	unsigned start = 0;
+	while (start < capacity && table.hashes[start])
+		start++;
+
+	long long total_probe_length = 0;
+	int cluster_length = 0;
+	for (unsigned n = 1; n <= capacity; ++n) {
+		unsigned i = (start + n) & mask;
+		unsigned long long hash = table.hashes[i];
+		if (hash) {
+			cluster_length++;
+			if (hash > TOMBSTONE) {
+				int probe_length = (int)((i - (unsigned)hash) & mask) + 1;
+				total_probe_length += probe_length;
+				if (stats->max_probe_length < probe_length)
+					stats->max_probe_length = probe_length;
+			}
+		}
+		if (cluster_length && (!hash || n == capacity)) {
+			int bucket = 0;
+			while (bucket < NUM_CLUSTER_BUCKETS - 1 && (2 << bucket) <= cluster_length)
+				bucket++;
+			stats->clusters[bucket]++;
+			if (stats->max_cluster_length < cluster_length)
+				stats->max_cluster_length = cluster_length;
+			cluster_length = 0;
+		}
+	}
+	if (table.count)
+		stats->average_probe_length = (double)total_probe_length / table.count;
+}
+
+// Parallel bulk insertion. The table is sized once up front, then the slots are split into one
+// contiguous range per thread. Since the slot index comes from the low bits of the hash, every
+// item is routed to the thread owning its home slot, and each thread inserts its items in input
+// order without ever touching another thread's range. The few items whose probe sequence would
+// spill over into the next range are inserted sequentially at the end. The resulting table has
+// the same contents as if all items had been added one by one in order, including which value
+// wins for duplicate hashes.
+
+#include <threads.h> // thrd_create, thrd_join - only needed for build_from
+
+#define MAX_BUILD_THREADS 64
+
+struct build {
+	struct table *table;
+	const unsigned long long *hashes;
+	const unsigned long long *values;
+	int n;
+	int num_threads;
+	int shift; // Slot index >> shift gives the thread that owns the slot.
+	int *order; // Input indices grouped by owning thread, in input order.
+	int offsets[MAX_BUILD_THREADS][MAX_BUILD_THREADS]; // [input chunk][owning thread].
+	int starts[MAX_BUILD_THREADS + 1]; // Where each thread's items start in order.
+	int num_added[MAX_BUILD_THREADS];
+	int num_spilled[MAX_BUILD_THREADS];
+};
+
+struct build_thread {
+	struct build *build;
+	int index;
+	int phase;
+};
+
+int build_thread(void *parameter) {
+	struct build_thread *thread = parameter;
+	struct build *build = thread->build;
+	struct table *table = build->table;
+	unsigned mask = (unsigned)table->capacity - 1;
+	int t = thread->index;
+	int begin = (int)((long long)build->n * t / build->num_threads);
+	int end = (int)((long long)build->n * (t + 1) / build->num_threads);
+
+	if (thread->phase == 0) { // Count how many items from our input chunk go to each thread.
+		for (int i = begin; i < end; ++i) {
+			unsigned long long hash = build->hashes[i];
+			hash += (hash <= TOMBSTONE) ? 2 : 0;
+			build->offsets[t][((unsigned)hash & mask) >> build->shift]++;
+		}
+	}
+	else if (thread->phase == 1) { // Scatter our input chunk so that each thread's items are contiguous.
+		for (int i = begin; i < end; ++i) {
+			unsigned long long hash = build->hashes[i];
+			hash += (hash <= TOMBSTONE) ? 2 : 0;
+			build->order[build->offsets[t][((unsigned)hash & mask) >> build->shift]++] = i;
+		}
+	}
+	else { // Insert our items into our own slot range.
+		unsigned range_end = (unsigned)(t + 1) << build->shift;
+		int *order = build->order + build->starts[t];
+		int count = build->starts[t + 1] - build->starts[t];
+		int num_spilled = 0;
+		int num_added = 0;
+		for (int j = 0; j < count; ++j) {
+			int i = order[j];
+			unsigned long long hash = build->hashes[i];
+			hash += (hash <= TOMBSTONE) ? 2 : 0;
+			unsigned k;
+			for (k = (unsigned)hash & mask; k < range_end; ++k) {
+				if (table->hashes[k] == hash) {
+					table->values[k] = build->values[i];
+					break;
+				}
+				if (!table->hashes[k]) {
+					table->hashes[k] = hash;
+					table->values[k] = build->values[i];
+					num_added++;
+					break;
+				}
+			}
+			if (k == range_end)
+				order[num_spilled++] = i; // Overwriting order is fine because we've already read that far.
+		}
+		build->num_added[t] = num_added;
+		build->num_spilled[t] = num_spilled;
+	}
+	return 0;
+}
+
+void build_from(struct table *table, const unsigned long long *hashes, const unsigned long long *values, int n, int num_threads) {
+	int capacity = capacity_for(table, table->count + n, table_max_load(table));
+	if (capacity > table->capacity || table->num_tombstones)
+		resize(table, capacity > table->capacity ? capacity : table->capacity);
+
+	// Every thread needs a decently sized range, otherwise most items would spill over.
+	int pow2;
+	for (pow2 = 0; (2 << pow2) <= num_threads && (2 << pow2) <= MAX_BUILD_THREADS; ++pow2);
+	while (pow2 > 0 && (table->capacity >> pow2) < 4096)
+		--pow2;
+	num_threads = 1 << pow2;
+
+	if (num_threads == 1) {
+		for (int i = 0; i < n; ++i)
+			add(table, hashes[i], values[i]);
+		return;
+	}
+
+	struct build *build = calloc(1, sizeof build[0]);
+	build->table = table;
+	build->hashes = hashes;
+	build->values = values;
+	build->n = n;
+	build->num_threads = num_threads;
+	for (build->shift = 0; (num_threads << build->shift) < table->capacity; ++build->shift);
+	build->order = malloc((size_t)n * sizeof build->order[0]);
+
+	struct build_thread threads[MAX_BUILD_THREADS];
+	thrd_t handles[MAX_BUILD_THREADS];
+	for (int phase = 0; phase < 3; ++phase) {
+		for (int t = 0; t < num_threads; ++t) {
+			threads[t] = (struct build_thread){ build, t, phase };
+			thrd_create(&handles[t], build_thread, &threads[t]);
+		}
+		for (int t = 0; t < num_threads; ++t)
+			thrd_join(handles[t], NULL);
+
+		if (phase == 0) { // Turn the counts into offsets.
+			int offset = 0;
+			for (int owner = 0; owner < num_threads; ++owner) {
+				build->starts[owner] = offset;
+				for (int chunk = 0; chunk < num_threads; ++chunk) {
+					int count = build->offsets[chunk][owner];
+					build->offsets[chunk][owner] = offset;
+					offset += count;
+				}
+			}
+			build->starts[num_threads] = offset;
+		}
+	}
+
+	for (int t = 0; t < num_threads; ++t)
+		table->count += build->num_added[t];
+	for (int t = 0; t < num_threads; ++t)
+		for (int j = 0; j < build->num_spilled[t]; ++j) {
+			int i = build->order[build->starts[t] + j];
+			add(table, hashes[i], values[i]); // Already reserved, so this won't resize.
+		}
+
+	free(build->order);
+	free(build);
+}
+
 #include <assert.h>
 unsigned long long hash(const char *string) {
 	// FNV-1a https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function#FNV-1a_hash
@@ -145,6 +416,39 @@ unsigned long long hash(const char *string) {
 		hash = (hash ^ string[i]) * 1099511628211u;
 	return hash;
 }
+struct counting_allocator {
+	int num_blocks;
+	int num_bytes;
+};
+void *counting_allocate(void *context, size_t size, int alignment) {
+	struct counting_allocator *counter = context;
+	assert(alignment <= 16);
+	long long *block = malloc(16 + size);
+	block[0] = (long long)size;
+	counter->num_blocks++;
+	counter->num_bytes += size;
+	return block + 2;
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	struct counting_allocator *counter = context;
+	assert(((long long *)block)[-2] == (long long)size); // Containers have to give back the size they asked for.
+	counter->num_blocks--;
+	counter->num_bytes -= size;
+	free((long long *)block - 2);
+}
+// Like stack_allocator.c, but only a cursor that gets reset at the end of each frame.
+struct frame_arena {
+	char *buffer;
+	size_t capacity;
+	size_t cursor;
+};
+void *frame_allocate(void *context, size_t size, int alignment) {
+	struct frame_arena *arena = context;
+	size_t start = (arena->cursor + (size_t)alignment - 1) & ~((size_t)alignment - 1);
+	assert(start + size <= arena->capacity);
+	arena->cursor = start + size;
+	return arena->buffer + start;
+}
 int main(void) {
 	{
 		struct table table = { 0 };
@@ -254,6 +558,50 @@ int main(void) {
 		destroy(&table);
 	}
 
+	{
+		static unsigned long long hashes[1048576];
+		static unsigned long long values[1048576];
+		int n = sizeof hashes / sizeof hashes[0];
+		unsigned long long seed = 42;
+		for (int i = 0; i < n; ++i) {
+			seed ^= seed >> 12;
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			hashes[i] = seed * 0x2545F4914F6CDD1Du;
+			values[i] = (unsigned)i;
+			if (i % 7 == 0)
+				hashes[i] = hashes[i / 2]; // Duplicates, the later value should win.
+		}
+		hashes[100] = 0;
+		hashes[200] = 1;
+
+		struct table sequential = { 0 };
+		for (int i = 0; i < n; ++i)
+			add(&sequential, hashes[i], values[i]);
+		struct table sequential_twice = { 0 };
+		for (int i = 0; i < n; ++i)
+			add(&sequential_twice, hashes[i], values[i]);
+		for (int i = 0; i < n / 2; ++i)
+			add(&sequential_twice, hashes[i], hashes[i]);
+
+		for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+			struct table table = { 0 };
+			build_from(&table, hashes, values, n, num_threads);
+			assert(table.count == sequential.count);
+			for (int i = first_index(sequential); i >= 0; i = next_index(sequential, i))
+				assert(*get(table, sequential.hashes[i]) == sequential.values[i]);
+
+			// Building on top of existing items works just like adding them.
+			build_from(&table, hashes, hashes, n / 2, num_threads);
+			assert(table.count == sequential_twice.count);
+			for (int i = first_index(sequential_twice); i >= 0; i = next_index(sequential_twice, i))
+				assert(*get(table, sequential_twice.hashes[i]) == sequential_twice.values[i]);
+			destroy(&table);
+		}
+		destroy(&sequential);
+		destroy(&sequential_twice);
+	}
+
 	{
 		// Potential pathological case: create a bunch of items and then delete them 
 		// to leave tombstones, then lookup each item. If we don't clean tombstones this is O(n^2).
@@ -261,12 +609,139 @@ int main(void) {
 		for (unsigned i = 2; i <= 1048577; ++i)
 			add(&table, i, i);
 		for (unsigned i = 2; i <= 1048577; ++i)
-			remove(&table, i, i);
+			remove(&table, i);
 		assert(table.count == 0);
 		for (unsigned i = 2; i <= 1048577; ++i)
 			assert(!get(table, i));
 	}
 
+	{
+		struct table_stats stats;
+		struct table table = { 0 };
+		table_stats(table, &stats);
+		assert(stats.count == 0 && stats.capacity == 0 && stats.max_cluster_length == 0);
+
+		// Four items with the same home slot make a cluster of 4, and two items at the end wrap around.
+		resize(&table, 64);
+		for (unsigned long long i = 0; i < 4; ++i)
+			add(&table, 64 * i + 5, i);
+		add(&table, 63, 0);
+		add(&table, 127, 0);
+		table_stats(table, &stats);
+		assert(stats.count == 6 && stats.capacity == 64 && stats.num_tombstones == 0);
+		assert(stats.max_probe_length == 4);
+		assert(stats.average_probe_length == (1 + 2 + 3 + 4 + 1 + 2) / 6.0);
+		assert(stats.max_cluster_length == 4);
+		assert(stats.clusters[1] == 1 && stats.clusters[2] == 1);
+		assert(stats.bytes == 64 * 16);
+
+		// Tombstones don't count as probes, but they still hold clusters together.
+		remove(&table, 64 + 5);
+		table_stats(table, &stats);
+		assert(stats.count == 5 && stats.num_tombstones == 1);
+		assert(stats.load_factor == 6 / 64.0);
+		assert(stats.average_probe_length == (1 + 3 + 4 + 1 + 2) / 5.0);
+		assert(stats.max_cluster_length == 4);
+		destroy(&table);
+	}
+
+	{
+		// By default tables grow at 3/4 and never shrink.
+		struct table table = { 0 };
+		for (unsigned i = 2; i < 1002; ++i)
+			add(&table, i, i);
+		assert(table.capacity == 2048);
+		for (unsigned i = 2; i < 1002; ++i)
+			remove(&table, i);
+		assert(table.capacity == 2048 && table.count == 0);
+		destroy(&table);
+
+		// Memory-tight tables can run fuller.
+		table.max_load = 0.875f;
+		for (unsigned i = 2; i < 58; ++i)
+			add(&table, i, i);
+		assert(table.count == 56 && table.capacity == 64);
+		add(&table, 58, 58);
+		assert(table.capacity == 128);
+		for (unsigned i = 2; i < 59; ++i)
+			assert(*get(table, i) == i);
+		destroy(&table);
+		assert(table.max_load == 0.875f); // The policy outlives destroy.
+
+		table.max_load = 0;
+		table.growth_factor = 4;
+		table.min_capacity = 16;
+		for (unsigned i = 2; i < 14; ++i)
+			add(&table, i, i);
+		assert(table.capacity == 16);
+		add(&table, 14, 14);
+		assert(table.capacity == 64);
+		destroy(&table);
+
+		// Shrinking goes to halfway between min_load and max_load, so going back and forth across the
+		// threshold doesn't resize every time.
+		table.growth_factor = 0;
+		table.min_capacity = 0;
+		table.min_load = 0.25f;
+		for (unsigned i = 2; i < 702; ++i)
+			add(&table, i, i);
+		assert(table.capacity == 1024);
+		for (unsigned i = 2; i < 447; ++i)
+			remove(&table, i);
+		assert(table.count == 255 && table.capacity == 512);
+		for (int round = 0; round < 100; ++round) {
+			add(&table, 1000, 1000);
+			remove(&table, 1000);
+			remove(&table, 447);
+			add(&table, 447, 447);
+		}
+		assert(table.count == 255 && table.capacity == 512);
+		for (unsigned i = 447; i < 702; ++i)
+			assert(*get(table, i) == i);
+		for (unsigned i = 447; i < 702; ++i)
+			remove(&table, i);
+		assert(table.count == 0 && table.capacity == 64);
+		destroy(&table);
+	}
+
+	{
+		// Memory can come from somewhere else, and growing and shrinking give it back with the size it
+		// was allocated with.
+		struct counting_allocator counter = { 0 };
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &counter };
+		struct table table = { 0 };
+		table.allocator = &callbacks;
+		table.min_load = 0.25f;
+		for (unsigned i = 2; i < 10000; ++i)
+			add(&table, i, i);
+		int grown_capacity = table.capacity;
+		for (unsigned i = 2; i < 9000; ++i)
+			remove(&table, i);
+		assert(table.capacity < grown_capacity);
+		assert(counter.num_blocks == 1 && counter.num_bytes == table.capacity * 16);
+		for (unsigned i = 9000; i < 10000; ++i)
+			assert(*get(table, i) == i);
+		destroy(&table);
+		assert(!counter.num_blocks && !counter.num_bytes);
+
+		// Per-frame tables in an arena that never frees anything, and gets dropped all at once.
+		static char buffer[1 << 20];
+		struct frame_arena arena = { buffer, sizeof buffer, 0 };
+		struct allocator_callbacks frame = { frame_allocate, NULL, NULL, &arena };
+		for (int i = 0; i < 3; ++i) {
+			struct table per_frame = { 0 };
+			per_frame.allocator = &frame;
+			for (unsigned j = 2; j < 1000; ++j)
+				add(&per_frame, j, j + i);
+			for (unsigned j = 2; j < 1000; ++j)
+				assert(*get(per_frame, j) == j + i);
+			destroy(&per_frame);
+			// Nothing went back before the end of the frame: 64 + 128 + ... + 2048 slots of 16 bytes.
+			assert(arena.cursor == 4032 * 16);
+			arena.cursor = 0;
+		}
+	}
+
 	{
 		// This shouldn't leak.
 		for (int i = 0; i < 10000; ++i) {
@@ -0,0 +1,495 @@
+// Records the malloc, calloc, realloc, reallocarray, free, aligned_alloc, memalign, posix_memalign,
+// valloc and pvalloc calls of a program into a compact binary log, which allocator_benchmark.c
+// replays against the allocators in this collection. Preload it into the program to trace:
+//   cc -O2 -shared -fPIC malloc_trace.c -o malloc_trace.so -lpthread
+//   MALLOC_TRACE_LOG=app.mtrace LD_PRELOAD=./malloc_trace.so ./app
+// The log goes to malloc.mtrace when MALLOC_TRACE_LOG isn't set. Built as a program instead, it
+// runs the tests at the bottom on itself.
+//
+// Linux and glibc only: calls are forwarded to glibc's __libc_malloc and friends, so there's no
+// dlsym, which allocates and would end up back in the hooks while they're being looked up.
+//
+// Each thread encodes its calls into a buffer in thread local storage, and appends the buffer to
+// the log as one chunk when it's full, when the thread exits and when the process exits. Records
+// are varints, with the time and address as differences from the previous record in the chunk,
+// so most calls take 5 to 8 bytes. Chunks from different threads interleave in the log, and the
+// times put the calls back in order. Allocations made while a thread is recording (by
+// pthread_setspecific, say) and after the log is closed aren't recorded.
+//
+// Log: header { uint32 magic, uint32 version, uint64 time the log was opened }, then chunks of
+//   chunk header { uint32 thread, uint32 bytes of records, uint64 time }, then records of
+//   op byte, time delta, zigzag address delta, and then
+//     TRACE_MALLOC: size
+//     TRACE_ALIGNED: size, alignment
+//     TRACE_REALLOC: zigzag delta from the new address to the old one, size
+//     TRACE_FREE: nothing
+// The address is the block that was returned, 0 if the call failed, or the block that was freed.
+// A realloc to 0 bytes that frees the block has a new address of 0 and a size of 0. Times are
+// nanoseconds on CLOCK_MONOTONIC.
+
+#define _GNU_SOURCE // pthread_setspecific and friends with -std=c11
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t, uint32_t, uintptr_t
+#include <string.h> // memcpy
+
+#define TRACE_MAGIC 0x4352544d // "MTRC" in a little endian file
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (16 * 1024)
+#define MAX_RECORD_SIZE 64 // op byte and 5 varints of up to 10 bytes
+
+enum { TRACE_MALLOC, TRACE_FREE, TRACE_REALLOC, TRACE_ALIGNED };
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_time;
+};
+
+struct trace_chunk {
+	uint32_t thread; // Numbered from 0 in the order threads first allocate.
+	uint32_t bytes;
+	uint64_t time; // Of the first record in the chunk.
+};
+
+struct trace_record {
+	int op;
+	uint32_t thread;
+	uint64_t time;
+	uintptr_t address;
+	uintptr_t old_address; // TRACE_REALLOC only.
+	uint64_t size;
+	uint64_t alignment; // TRACE_ALIGNED only.
+};
+
+unsigned char *put_varint(unsigned char *p, uint64_t x) {
+	while (x >= 0x80) {
+		*p++ = (unsigned char)(x | 0x80);
+		x >>= 7;
+	}
+	*p++ = (unsigned char)x;
+	return p;
+}
+// Returns NULL if the varint runs past the end.
+const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *x) {
+	*x = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char byte = *p++;
+		*x |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+// Small differences either way get small varints.
+uint64_t zigzag(uint64_t delta) {
+	return (delta << 1) ^ (uint64_t)-(int64_t)(delta >> 63);
+}
+uint64_t unzigzag(uint64_t x) {
+	return (x >> 1) ^ (uint64_t)-(int64_t)(x & 1);
+}
+
+// Calls visit for every record in a log that was read into memory, in file order, which is only
+// in time order within a thread. Returns 0 if the log is cut short or isn't a log.
+typedef void trace_visitor(void *context, const struct trace_record *record);
+int read_trace_log(const void *log, size_t size, trace_visitor *visit, void *context) {
+	struct trace_header header;
+	if (size < sizeof header)
+		return 0;
+	memcpy(&header, log, sizeof header);
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+		return 0;
+
+	const unsigned char *p = (const unsigned char *)log + sizeof header;
+	const unsigned char *end = (const unsigned char *)log + size;
+	while (p < end) {
+		struct trace_chunk chunk;
+		if ((size_t)(end - p) < sizeof chunk)
+			return 0;
+		memcpy(&chunk, p, sizeof chunk);
+		p += sizeof chunk;
+		if ((size_t)(end - p) < chunk.bytes)
+			return 0;
+		const unsigned char *chunk_end = p + chunk.bytes;
+
+		struct trace_record record = { 0 };
+		record.thread = chunk.thread;
+		record.time = chunk.time;
+		while (p && p < chunk_end) {
+			uint64_t time, address, old_address = 0, size = 0, alignment = 0;
+			record.op = *p++;
+			p = p ? get_varint(p, chunk_end, &time) : NULL;
+			p = p ? get_varint(p, chunk_end, &address) : NULL;
+			if (record.op == TRACE_REALLOC)
+				p = p ? get_varint(p, chunk_end, &old_address) : NULL;
+			if (record.op != TRACE_FREE)
+				p = p ? get_varint(p, chunk_end, &size) : NULL;
+			if (record.op == TRACE_ALIGNED)
+				p = p ? get_varint(p, chunk_end, &alignment) : NULL;
+			if (!p || record.op > TRACE_ALIGNED)
+				return 0;
+			record.time += time;
+			record.address += (uintptr_t)unzigzag(address);
+			record.old_address = record.op == TRACE_REALLOC ? record.address + (uintptr_t)unzigzag(old_address) : 0;
+			record.size = size;
+			record.alignment = alignment;
+			visit(context, &record);
+		}
+		if (!p)
+			return 0;
+	}
+	return 1;
+}
+
+#if !defined(MALLOC_TRACE_READER_ONLY) // allocator_benchmark.c only needs the reader.
+
+#include <errno.h> // EINVAL, ENOMEM
+#include <fcntl.h> // open
+#include <unistd.h> // write, close, sysconf
+#include <stdlib.h> // getenv
+#include <time.h> // clock_gettime
+#include <pthread.h> // pthread_mutex_t, pthread_key_t
+#include <stdatomic.h>
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *block, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void __libc_free(void *block);
+
+struct thread_log {
+	struct thread_log *prev; // In the list of logs to flush when the process exits.
+	struct thread_log *next;
+	uint32_t thread;
+	int state; // LOG_NEW, LOG_ACTIVE or LOG_EXITED.
+	int recording; // Set while encoding, so allocations made meanwhile go straight through.
+	uint64_t chunk_time;
+	uint64_t last_time;
+	uintptr_t last_address;
+	_Atomic size_t used; // Bytes below this are whole records, for the flush at exit.
+	unsigned char buffer[TRACE_BUFFER_SIZE];
+};
+enum { LOG_NEW, LOG_ACTIVE, LOG_EXITED };
+
+// Initial exec, so the first access doesn't call malloc to make room for it.
+_Thread_local struct thread_log thread_log __attribute__((tls_model("initial-exec")));
+
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // For everything below.
+int log_fd = -1;
+int log_closed;
+struct thread_log *thread_logs;
+uint32_t num_threads;
+pthread_key_t exit_key;
+pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+uint64_t trace_time(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+void write_all(int fd, const void *bytes, size_t size) {
+	const char *p = bytes;
+	while (size) {
+		ssize_t written = write(fd, p, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return;
+		p += written;
+		size -= (size_t)written;
+	}
+}
+
+// The log is opened by the first flush, open and getenv don't allocate.
+void flush_locked(struct thread_log *log) {
+	size_t used = atomic_load_explicit(&log->used, memory_order_acquire);
+	if (!used || log_closed)
+		return;
+	if (log_fd < 0) {
+		const char *path = getenv("MALLOC_TRACE_LOG");
+		log_fd = open(path ? path : "malloc.mtrace", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (log_fd < 0) {
+			log_closed = 1;
+			return;
+		}
+		struct trace_header header = { TRACE_MAGIC, TRACE_VERSION, trace_time() };
+		write_all(log_fd, &header, sizeof header);
+	}
+	struct trace_chunk chunk = { log->thread, (uint32_t)used, log->chunk_time };
+	write_all(log_fd, &chunk, sizeof chunk);
+	write_all(log_fd, log->buffer, used);
+}
+
+void unlink_log(struct thread_log *log) {
+	if (log->prev)
+		log->prev->next = log->next;
+	else
+		thread_logs = log->next;
+	if (log->next)
+		log->next->prev = log->prev;
+}
+
+void flush_at_thread_exit(void *arg) {
+	struct thread_log *log = arg;
+	log->recording = 1;
+	pthread_mutex_lock(&log_lock);
+	flush_locked(log);
+	unlink_log(log);
+	pthread_mutex_unlock(&log_lock);
+	log->state = LOG_EXITED;
+}
+
+void create_exit_key(void) {
+	pthread_key_create(&exit_key, flush_at_thread_exit);
+}
+
+void register_log(struct thread_log *log) {
+	pthread_once(&exit_key_once, create_exit_key);
+	pthread_mutex_lock(&log_lock);
+	log->thread = num_threads++;
+	log->prev = NULL;
+	log->next = thread_logs;
+	if (thread_logs)
+		thread_logs->prev = log;
+	thread_logs = log;
+	pthread_mutex_unlock(&log_lock);
+	pthread_setspecific(exit_key, log);
+	log->state = LOG_ACTIVE;
+}
+
+// Flushes every thread's log and closes the file. Threads that are still running lose what they
+// record afterwards, and a record they're in the middle of encoding.
+__attribute__((destructor)) void close_trace_log(void) {
+	thread_log.recording = 1;
+	pthread_mutex_lock(&log_lock);
+	for (struct thread_log *log = thread_logs; log; log = log->next)
+		flush_locked(log);
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = -1;
+	log_closed = 1;
+	pthread_mutex_unlock(&log_lock);
+}
+
+void record(int op, uint64_t time, void *address, void *old_address, size_t size, size_t alignment) {
+	struct thread_log *log = &thread_log;
+	if (log->recording || log->state == LOG_EXITED)
+		return;
+	log->recording = 1;
+	if (log->state == LOG_NEW)
+		register_log(log);
+
+	size_t used = atomic_load_explicit(&log->used, memory_order_relaxed);
+	if (used + MAX_RECORD_SIZE > TRACE_BUFFER_SIZE) {
+		pthread_mutex_lock(&log_lock);
+		flush_locked(log);
+		atomic_store_explicit(&log->used, 0, memory_order_relaxed);
+		pthread_mutex_unlock(&log_lock);
+		used = 0;
+	}
+	if (!used) {
+		log->chunk_time = time;
+		log->last_time = time;
+		log->last_address = 0;
+	}
+
+	// A realloc takes its time before the call, so it can be a little older than the last record.
+	uint64_t delta = time > log->last_time ? time - log->last_time : 0;
+	unsigned char *p = log->buffer + used;
+	*p++ = (unsigned char)op;
+	p = put_varint(p, delta);
+	p = put_varint(p, zigzag((uint64_t)((uintptr_t)address - log->last_address)));
+	if (op == TRACE_REALLOC)
+		p = put_varint(p, zigzag((uint64_t)((uintptr_t)old_address - (uintptr_t)address)));
+	if (op != TRACE_FREE)
+		p = put_varint(p, size);
+	if (op == TRACE_ALIGNED)
+		p = put_varint(p, alignment);
+	log->last_time += delta;
+	log->last_address = (uintptr_t)address;
+	atomic_store_explicit(&log->used, (size_t)(p - log->buffer), memory_order_release);
+	log->recording = 0;
+}
+
+// Allocations are timed after they return, and frees before, so when another thread gets the
+// same address back the times are in the right order. realloc frees and allocates.
+void *malloc(size_t size) {
+	void *block = __libc_malloc(size);
+	record(TRACE_MALLOC, trace_time(), block, NULL, size, 0);
+	return block;
+}
+void *calloc(size_t count, size_t size) {
+	void *block = __libc_calloc(count, size);
+	record(TRACE_MALLOC, trace_time(), block, NULL, count * size, 0);
+	return block;
+}
+void *realloc(void *block, size_t size) {
+	uint64_t time = trace_time();
+	void *result = __libc_realloc(block, size);
+	if (!block)
+		record(TRACE_MALLOC, trace_time(), result, NULL, size, 0);
+	else if (result || !size)
+		record(TRACE_REALLOC, time, result, block, size, 0);
+	return result;
+}
+void *reallocarray(void *block, size_t count, size_t size) {
+	if (size && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(block, count * size);
+}
+void free(void *block) {
+	if (block)
+		record(TRACE_FREE, trace_time(), block, NULL, 0, 0);
+	__libc_free(block);
+}
+void *memalign(size_t alignment, size_t size) {
+	void *block = __libc_memalign(alignment, size);
+	record(TRACE_ALIGNED, trace_time(), block, NULL, size, alignment);
+	return block;
+}
+void *aligned_alloc(size_t alignment, size_t size) {
+	return memalign(alignment, size);
+}
+int posix_memalign(void **result, size_t alignment, size_t size) {
+	if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+	void *block = memalign(alignment, size);
+	if (!block)
+		return ENOMEM;
+	*result = block;
+	return 0;
+}
+void *valloc(size_t size) {
+	void *block = __libc_valloc(size);
+	record(TRACE_ALIGNED, trace_time(), block, NULL, size, (size_t)sysconf(_SC_PAGESIZE));
+	return block;
+}
+void *pvalloc(size_t size) {
+	void *block = __libc_pvalloc(size);
+	record(TRACE_ALIGNED, trace_time(), block, NULL, size, (size_t)sysconf(_SC_PAGESIZE));
+	return block;
+}
+
+#include <assert.h>
+#include <stdio.h> // fopen, remove
+
+#define TEST_SIZE 12345 // A size nothing else in the process asks for.
+#define NUM_TEST_THREADS 4
+#define NUM_TEST_BLOCKS 2000
+
+struct test_log {
+	int num_records;
+	int num_test_records[4]; // By op.
+	uint32_t test_threads; // Bit per thread that allocated TEST_SIZE.
+	uint64_t last_time[64]; // By thread.
+	int in_order;
+	void *blocks[NUM_TEST_THREADS][NUM_TEST_BLOCKS];
+	int num_freed; // Records that free one of the blocks above.
+};
+
+void check_record(void *context, const struct trace_record *record) {
+	struct test_log *test = context;
+	test->num_records++;
+	if (record->thread < 64) {
+		test->in_order &= record->time >= test->last_time[record->thread];
+		test->last_time[record->thread] = record->time;
+	}
+	if (record->size == TEST_SIZE || (record->op == TRACE_REALLOC && record->size == 2 * TEST_SIZE)) {
+		test->num_test_records[record->op]++;
+		test->test_threads |= 1u << record->thread;
+	}
+	// Threads can get each other's addresses after they're freed, so each free matches one block.
+	for (int i = 0; i < NUM_TEST_THREADS && record->op == TRACE_FREE; ++i) {
+		for (int j = 0; j < NUM_TEST_BLOCKS; ++j) {
+			if (test->blocks[i][j] == (void *)record->address) {
+				test->blocks[i][j] = NULL;
+				test->num_freed++;
+				return;
+			}
+		}
+	}
+}
+
+void *test_thread(void *arg) {
+	void **blocks = arg;
+	// Enough records to need several chunks.
+	for (int i = 0; i < NUM_TEST_BLOCKS; ++i)
+		blocks[i] = malloc(TEST_SIZE);
+	for (int i = 0; i < NUM_TEST_BLOCKS; ++i)
+		free(blocks[i]);
+	return NULL;
+}
+
+int main(void) {
+	{
+		unsigned char bytes[16];
+		uint64_t values[] = { 0, 1, 127, 128, 300, 1ull << 35, UINT64_MAX };
+		for (int i = 0; i < (int)(sizeof values / sizeof values[0]); ++i) {
+			unsigned char *end = put_varint(bytes, values[i]);
+			uint64_t x;
+			assert(get_varint(bytes, end, &x) == end && x == values[i]);
+			assert(!get_varint(bytes, end - 1, &x));
+			assert(unzigzag(zigzag(values[i])) == values[i]);
+		}
+		assert(zigzag((uint64_t)-1) == 1 && zigzag(1) == 2);
+		assert(!read_trace_log("nope", 4, check_record, NULL));
+	}
+	{
+		static void *blocks[NUM_TEST_THREADS][NUM_TEST_BLOCKS];
+		pthread_t threads[NUM_TEST_THREADS];
+		for (int i = 0; i < NUM_TEST_THREADS; ++i)
+			pthread_create(&threads[i], NULL, test_thread, blocks[i]);
+		for (int i = 0; i < NUM_TEST_THREADS; ++i)
+			pthread_join(threads[i], NULL);
+
+		void *a = malloc(TEST_SIZE);
+		a = realloc(a, 2 * TEST_SIZE);
+		void *b = aligned_alloc(64, TEST_SIZE);
+		assert(b && (uintptr_t)b % 64 == 0);
+		void *c = NULL;
+		assert(posix_memalign(&c, 3, TEST_SIZE) == EINVAL);
+		assert(posix_memalign(&c, 128, TEST_SIZE) == 0 && (uintptr_t)c % 128 == 0);
+		free(a);
+		free(b);
+		free(c);
+		close_trace_log();
+		void *d = malloc(TEST_SIZE); // Not recorded, the log is closed.
+		free(d);
+
+		const char *path = getenv("MALLOC_TRACE_LOG");
+		path = path ? path : "malloc.mtrace";
+		FILE *file = fopen(path, "rb");
+		assert(file);
+		fseek(file, 0, SEEK_END);
+		size_t size = (size_t)ftell(file);
+		fseek(file, 0, SEEK_SET);
+		char *log = __libc_malloc(size);
+		assert(fread(log, 1, size, file) == size);
+		fclose(file);
+		remove(path);
+
+		static struct test_log test;
+		test.in_order = 1;
+		memcpy(test.blocks, blocks, sizeof blocks);
+		assert(read_trace_log(log, size, check_record, &test));
+		assert(test.in_order);
+		assert(test.num_test_records[TRACE_MALLOC] == NUM_TEST_THREADS * NUM_TEST_BLOCKS + 1);
+		assert(test.num_test_records[TRACE_REALLOC] == 1);
+		assert(test.num_test_records[TRACE_ALIGNED] == 2);
+		assert(test.num_freed == NUM_TEST_THREADS * NUM_TEST_BLOCKS);
+		int num_threads = 0;
+		for (uint32_t bits = test.test_threads; bits; bits &= bits - 1)
+			num_threads++;
+		assert(num_threads == NUM_TEST_THREADS + 1);
+		assert(!read_trace_log(log, size - 1, check_record, &test)); // Cut short.
+		__libc_free(log);
+	}
+	return 0;
+}
+
+#endif
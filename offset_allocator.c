@@ -0,0 +1,423 @@
+// O(1) allocation and deallocation
+// 1/(2*SECOND_LEVEL_COUNT) memory wasted on average, good-fit
+// hands out offsets into a range [0, size), and never touches the range itself, so it can pack
+// records into a mapped file, a shared memory segment, or a GPU buffer
+// all the metadata is in a pool of nodes the caller gives it, one node per allocation or gap
+// between allocations, allocations are {offset, metadata_id} pairs and the id is what gets freed
+// when the pool runs out, blocks get handed out whole instead of being split
+
+#include <stdint.h> // uint64_t, uint32_t
+#include <string.h> // memset
+#include <assert.h>
+
+#define SECOND_LEVEL_LOG2 3 // each power of 2 size range is split into this many bins
+#define SECOND_LEVEL_COUNT (1 << SECOND_LEVEL_LOG2)
+#define FIRST_LEVEL_COUNT (64 - SECOND_LEVEL_LOG2 + 1) // list 0 is sizes below SECOND_LEVEL_COUNT
+#define NUM_BINS (FIRST_LEVEL_COUNT * SECOND_LEVEL_COUNT)
+#define NO_NODE UINT32_MAX
+#define NO_SPACE UINT64_MAX
+
+struct offset_node {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t prev; // in the bin if the node is free, or the pool of unused nodes
+	uint32_t next;
+	uint32_t prev_neighbor; // the node right before this one in the range
+	uint32_t next_neighbor;
+	int used;
+};
+
+struct allocation {
+	uint64_t offset; // NO_SPACE if the allocation failed
+	uint32_t metadata_id; // the node of the allocation
+};
+
+struct offset_allocator {
+	struct offset_node *nodes;
+	uint32_t num_nodes;
+	uint32_t unused; // singly linked through next
+	uint64_t size;
+	uint64_t free_bytes;
+	uint64_t listmap;
+	uint32_t slotmaps[FIRST_LEVEL_COUNT];
+	uint32_t bins[NUM_BINS]; // the first free node of each bin
+};
+
+int findfirstset(uint64_t x) {
+	if (!x)
+		return -1;
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	// _BitScanForward64(&i, x) on msvc
+	for (int i = 0; i < 64; ++i)
+		if (x & ((uint64_t)1 << i))
+			return i;
+	return -1;
+#endif
+}
+int floorlog2(uint64_t x) {
+	if (!x)
+		return -1;
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(x);
+#else
+	// _BitScanReverse64(&i, x) on msvc
+	for (int i = 63; i >= 0; --i)
+		if (x & ((uint64_t)1 << i))
+			return i;
+	return -1;
+#endif
+}
+
+// Sizes below SECOND_LEVEL_COUNT each get a bin in list 0, bigger ones go in list
+// log2 - SECOND_LEVEL_LOG2 + 1, which splits the range of the power of 2 into equal bins.
+int bin_of(uint64_t size) {
+	if (size < SECOND_LEVEL_COUNT)
+		return (int)size;
+	int log2 = floorlog2(size);
+	int listid = log2 - SECOND_LEVEL_LOG2 + 1;
+	int slotid = (int)((size >> (log2 - SECOND_LEVEL_LOG2)) - SECOND_LEVEL_COUNT);
+	return listid * SECOND_LEVEL_COUNT + slotid;
+}
+uint64_t bin_start(int bin) {
+	int listid = bin / SECOND_LEVEL_COUNT;
+	int slotid = bin % SECOND_LEVEL_COUNT;
+	if (!listid)
+		return (uint64_t)slotid;
+	return (uint64_t)(SECOND_LEVEL_COUNT + slotid) << (listid - 1);
+}
+
+void add(struct offset_allocator *allocator, uint32_t id) {
+	struct offset_node *node = &allocator->nodes[id];
+	int bin = bin_of(node->size);
+	int listid = bin / SECOND_LEVEL_COUNT;
+	int slotid = bin % SECOND_LEVEL_COUNT;
+
+	// add the node to the front of its bin
+	node->used = 0;
+	node->prev = NO_NODE;
+	node->next = allocator->bins[bin];
+	if (node->next != NO_NODE)
+		allocator->nodes[node->next].prev = id;
+	allocator->bins[bin] = id;
+	allocator->free_bytes += node->size;
+
+	// mark the list and slot as full
+	allocator->listmap |= (uint64_t)1 << listid;
+	allocator->slotmaps[listid] |= 1u << slotid;
+}
+void remove(struct offset_allocator *allocator, uint32_t id) {
+	struct offset_node *node = &allocator->nodes[id];
+	int bin = bin_of(node->size);
+	int listid = bin / SECOND_LEVEL_COUNT;
+	int slotid = bin % SECOND_LEVEL_COUNT;
+
+	assert(!node->used);
+	node->used = 1;
+	if (node->prev != NO_NODE)
+		allocator->nodes[node->prev].next = node->next;
+	else
+		allocator->bins[bin] = node->next;
+	if (node->next != NO_NODE)
+		allocator->nodes[node->next].prev = node->prev;
+	allocator->free_bytes -= node->size;
+
+	// if the bin becomes empty clear its bit, and if the list becomes empty clear that too
+	if (allocator->bins[bin] == NO_NODE)
+		allocator->slotmaps[listid] &= ~(1u << slotid);
+	if (!allocator->slotmaps[listid])
+		allocator->listmap &= ~((uint64_t)1 << listid);
+}
+
+uint32_t take_node(struct offset_allocator *allocator) {
+	uint32_t id = allocator->unused;
+	if (id != NO_NODE)
+		allocator->unused = allocator->nodes[id].next;
+	return id;
+}
+void give_node(struct offset_allocator *allocator, uint32_t id) {
+	allocator->nodes[id].next = allocator->unused;
+	allocator->unused = id;
+}
+
+// Makes a node of the part of the block from offset on, and puts it in the range right after.
+// Returns NO_NODE when the pool is empty, and the block stays whole.
+uint32_t split(struct offset_allocator *allocator, uint32_t id, uint64_t offset) {
+	uint32_t right_id = take_node(allocator);
+	if (right_id == NO_NODE)
+		return NO_NODE;
+	struct offset_node *node = &allocator->nodes[id];
+	struct offset_node *right = &allocator->nodes[right_id];
+	right->offset = node->offset + offset;
+	right->size = node->size - offset;
+	node->size = offset;
+	right->prev_neighbor = id;
+	right->next_neighbor = node->next_neighbor;
+	if (node->next_neighbor != NO_NODE)
+		allocator->nodes[node->next_neighbor].prev_neighbor = right_id;
+	node->next_neighbor = right_id;
+	return right_id;
+}
+// Gives the node's range to the one before it, and the node back to the pool.
+void merge(struct offset_allocator *allocator, uint32_t id) {
+	struct offset_node *node = &allocator->nodes[id];
+	struct offset_node *prev = &allocator->nodes[node->prev_neighbor];
+	prev->size += node->size;
+	prev->next_neighbor = node->next_neighbor;
+	if (node->next_neighbor != NO_NODE)
+		allocator->nodes[node->next_neighbor].prev_neighbor = node->prev_neighbor;
+	give_node(allocator, id);
+}
+
+// nodes has to have room for at least 1, and every allocation and gap between them takes one
+void initialize(struct offset_allocator *allocator, struct offset_node *nodes, uint32_t num_nodes, uint64_t size) {
+	assert(num_nodes > 0 && num_nodes < NO_NODE);
+	memset(allocator, 0, sizeof(struct offset_allocator));
+	allocator->nodes = nodes;
+	allocator->num_nodes = num_nodes;
+	allocator->size = size;
+	for (int i = 0; i < NUM_BINS; ++i)
+		allocator->bins[i] = NO_NODE;
+
+	allocator->unused = NO_NODE;
+	for (uint32_t i = num_nodes; i-- > 1;)
+		give_node(allocator, i);
+
+	nodes[0] = (struct offset_node){ 0, size, NO_NODE, NO_NODE, NO_NODE, NO_NODE, 1 };
+	if (size)
+		add(allocator, 0);
+	else
+		give_node(allocator, 0);
+}
+
+// A free node of at least size bytes, or NO_NODE.
+uint32_t find_free(struct offset_allocator *allocator, uint64_t size) {
+	// round up to the next bin so anything in the bin is big enough
+	int exact = bin_of(size);
+	int bin = bin_start(exact) < size ? exact + 1 : exact;
+	if (bin >= NUM_BINS)
+		return NO_NODE;
+
+	int listid = bin / SECOND_LEVEL_COUNT;
+	uint32_t slotmap = allocator->slotmaps[listid] & ~((1u << (bin % SECOND_LEVEL_COUNT)) - 1);
+	if (!slotmap) {
+		// nothing in this list is big enough, take the first slot of a bigger one
+		uint64_t listmap = listid + 1 < 64 ? allocator->listmap & (~(uint64_t)0 << (listid + 1)) : 0;
+		listid = findfirstset(listmap);
+		if (listid < 0) {
+			// last chance, the first node in the size's own bin might be big enough
+			uint32_t id = allocator->bins[exact];
+			return id != NO_NODE && allocator->nodes[id].size >= size ? id : NO_NODE;
+		}
+		slotmap = allocator->slotmaps[listid];
+	}
+	return allocator->bins[listid * SECOND_LEVEL_COUNT + findfirstset(slotmap)];
+}
+
+// alignment has to be a power of 2, the gap in front of the block becomes a free node, so it fails
+// if the pool has none left for it
+struct allocation aligned_allocate(struct offset_allocator *allocator, uint64_t size, uint64_t alignment) {
+	assert(alignment && !(alignment & (alignment - 1)));
+	struct allocation failed = { NO_SPACE, NO_NODE };
+	if (!size)
+		size = 1;
+	if (size > NO_SPACE - alignment)
+		return failed;
+
+	uint32_t id = find_free(allocator, size + alignment - 1);
+	if (id == NO_NODE)
+		return failed;
+	remove(allocator, id);
+
+	uint64_t gap = (alignment - allocator->nodes[id].offset % alignment) % alignment;
+	if (gap) {
+		uint32_t aligned = split(allocator, id, gap);
+		if (aligned == NO_NODE) {
+			add(allocator, id);
+			return failed;
+		}
+		add(allocator, id);
+		id = aligned;
+		allocator->nodes[id].used = 1;
+	}
+
+	// give the end back
+	if (allocator->nodes[id].size > size) {
+		uint32_t rest = split(allocator, id, size);
+		if (rest != NO_NODE)
+			add(allocator, rest);
+	}
+	return (struct allocation){ allocator->nodes[id].offset, id };
+}
+struct allocation allocate(struct offset_allocator *allocator, uint64_t size) {
+	return aligned_allocate(allocator, size, 1);
+}
+
+void deallocate(struct offset_allocator *allocator, struct allocation allocation) {
+	uint32_t id = allocation.metadata_id;
+	if (id == NO_NODE)
+		return;
+	assert(id < allocator->num_nodes);
+	struct offset_node *node = &allocator->nodes[id];
+	assert(node->used); // double free
+	assert(node->offset == allocation.offset); // the id was reused by another allocation
+
+	// merge with the free nodes on either side
+	uint32_t next = node->next_neighbor;
+	if (next != NO_NODE && !allocator->nodes[next].used) {
+		remove(allocator, next);
+		merge(allocator, next);
+	}
+	uint32_t prev = node->prev_neighbor;
+	if (prev != NO_NODE && !allocator->nodes[prev].used) {
+		remove(allocator, prev);
+		merge(allocator, id);
+		id = prev;
+	}
+	add(allocator, id);
+}
+
+// The size of the block, which is more than what was asked for when the pool ran out of nodes.
+uint64_t allocation_size(struct offset_allocator *allocator, struct allocation allocation) {
+	if (allocation.metadata_id == NO_NODE)
+		return 0;
+	return allocator->nodes[allocation.metadata_id].size;
+}
+
+// The biggest allocation that would succeed, looking through the nodes in the biggest bin.
+uint64_t largest_free(struct offset_allocator *allocator) {
+	if (!allocator->listmap)
+		return 0;
+	int listid = floorlog2(allocator->listmap);
+	int slotid = floorlog2(allocator->slotmaps[listid]);
+	uint64_t largest = 0;
+	for (uint32_t id = allocator->bins[listid * SECOND_LEVEL_COUNT + slotid]; id != NO_NODE; id = allocator->nodes[id].next)
+		if (allocator->nodes[id].size > largest)
+			largest = allocator->nodes[id].size;
+	return largest;
+}
+
+// checks that the nodes cover the range in order, with no 2 free ones next to each other, that
+// the free ones are in the right bins, and that every node is either in the range or unused
+void verify(struct offset_allocator *allocator) {
+	uint32_t num_in_range = 0;
+	uint64_t offset = 0, free_bytes = 0;
+	uint32_t first = NO_NODE;
+	for (uint32_t i = 0; i < allocator->num_nodes && first == NO_NODE; ++i) {
+		struct offset_node *node = &allocator->nodes[i];
+		if (node->offset == 0 && node->prev_neighbor == NO_NODE && node->size)
+			first = i;
+	}
+	uint32_t prev = NO_NODE;
+	for (uint32_t id = first; id != NO_NODE; id = allocator->nodes[id].next_neighbor) {
+		struct offset_node *node = &allocator->nodes[id];
+		assert(node->offset == offset && node->size > 0);
+		assert(node->prev_neighbor == prev);
+		if (!node->used) {
+			assert(prev == NO_NODE || allocator->nodes[prev].used);
+			free_bytes += node->size;
+			uint32_t in_bin = allocator->bins[bin_of(node->size)];
+			while (in_bin != id && in_bin != NO_NODE)
+				in_bin = allocator->nodes[in_bin].next;
+			assert(in_bin == id);
+		}
+		offset += node->size;
+		prev = id;
+		++num_in_range;
+	}
+	assert(offset == allocator->size);
+	assert(free_bytes == allocator->free_bytes);
+
+	uint32_t num_unused = 0;
+	for (uint32_t id = allocator->unused; id != NO_NODE; id = allocator->nodes[id].next)
+		++num_unused;
+	assert(num_in_range + num_unused == allocator->num_nodes);
+}
+
+#include <stdlib.h> // rand
+
+int main(void) {
+	{
+		struct offset_node nodes[16];
+		struct offset_allocator allocator;
+		initialize(&allocator, nodes, 16, 1000);
+		verify(&allocator);
+		assert(largest_free(&allocator) == 1000);
+
+		struct allocation a = allocate(&allocator, 100); verify(&allocator);
+		struct allocation b = allocate(&allocator, 200); verify(&allocator);
+		struct allocation c = allocate(&allocator, 0); verify(&allocator);
+		assert(a.offset == 0 && b.offset == 100 && c.offset == 300);
+		assert(allocation_size(&allocator, c) == 1);
+		assert(allocator.free_bytes == 699 && largest_free(&allocator) == 699);
+		assert(allocate(&allocator, 700).offset == NO_SPACE);
+
+		// a hole in the middle gets reused, and merges with both sides when it's all freed
+		deallocate(&allocator, b); verify(&allocator);
+		struct allocation d = allocate(&allocator, 150); verify(&allocator);
+		assert(d.offset == 100);
+		struct allocation e = aligned_allocate(&allocator, 64, 256); verify(&allocator);
+		assert(e.offset == 512);
+		deallocate(&allocator, a); verify(&allocator);
+		deallocate(&allocator, d); verify(&allocator);
+		deallocate(&allocator, c); verify(&allocator);
+		deallocate(&allocator, e); verify(&allocator);
+		assert(allocator.free_bytes == 1000 && allocate(&allocator, 1000).offset == 0);
+	}
+	{
+		// with 3 nodes the last allocation can't be split off and gets the rest of the range
+		struct offset_node nodes[3];
+		struct offset_allocator allocator;
+		initialize(&allocator, nodes, 3, 1 << 20);
+		struct allocation a = allocate(&allocator, 10);
+		struct allocation b = allocate(&allocator, 10);
+		struct allocation c = allocate(&allocator, 10);
+		verify(&allocator);
+		assert(a.offset == 0 && b.offset == 10 && c.offset == 20);
+		assert(allocation_size(&allocator, c) == (1 << 20) - 20);
+		assert(allocate(&allocator, 1).offset == NO_SPACE);
+		deallocate(&allocator, c);
+		deallocate(&allocator, a); verify(&allocator);
+		assert(aligned_allocate(&allocator, 4, 8).offset == NO_SPACE); // no node for the gap
+		deallocate(&allocator, b); verify(&allocator);
+		assert(allocation_size(&allocator, allocate(&allocator, 1 << 20)) == 1 << 20);
+	}
+	{
+		// random sizes and alignments in a 4 GB range that nothing backs
+		enum { NUM_NODES = 4096, NUM_SLOTS = 1000 };
+		static struct offset_node nodes[NUM_NODES];
+		struct offset_allocator allocator;
+		uint64_t size = (uint64_t)1 << 32;
+		initialize(&allocator, nodes, NUM_NODES, size);
+		struct allocation allocations[NUM_SLOTS];
+		uint64_t sizes[NUM_SLOTS];
+		for (int i = 0; i < NUM_SLOTS; ++i)
+			allocations[i] = (struct allocation){ NO_SPACE, NO_NODE };
+		srand(1);
+		for (int round = 0; round < 100000; ++round) {
+			int i = rand() % NUM_SLOTS;
+			if (allocations[i].metadata_id != NO_NODE) {
+				deallocate(&allocator, allocations[i]);
+				allocations[i] = (struct allocation){ NO_SPACE, NO_NODE };
+			} else {
+				sizes[i] = 1 + (uint64_t)rand() % ((uint64_t)1 << (rand() % 26));
+				uint64_t alignment = (uint64_t)1 << (rand() % 13);
+				allocations[i] = aligned_allocate(&allocator, sizes[i], alignment);
+				if (allocations[i].offset != NO_SPACE) {
+					assert(allocations[i].offset % alignment == 0);
+					assert(allocation_size(&allocator, allocations[i]) >= sizes[i]);
+					assert(allocations[i].offset + sizes[i] <= size);
+				}
+			}
+			if (round % 1000 == 0)
+				verify(&allocator);
+		}
+		verify(&allocator);
+		for (int i = 0; i < NUM_SLOTS; ++i)
+			deallocate(&allocator, allocations[i]);
+		verify(&allocator);
+		assert(allocator.free_bytes == size && largest_free(&allocator) == size);
+	}
+	return 0;
+}
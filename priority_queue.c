@@ -1,9 +1,43 @@
 #include <stdlib.h> // realloc, free
+#include <string.h> // memcpy
+
+// Where a queue gets its memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+void *reallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t old_size, size_t new_size) {
+	if (!allocator)
+		return realloc(block, new_size);
+	if (allocator->reallocate)
+		return allocator->reallocate(allocator->context, block, old_size, new_size, 16);
+	void *new_block = allocator->allocate(allocator->context, new_size, 16);
+	if (block) {
+		memcpy(new_block, block, old_size < new_size ? old_size : new_size);
+		deallocate_memory(allocator, block, old_size);
+	}
+	return new_block;
+}
 
 struct queue { // max heap
 	struct item *items;
 	int capacity;
 	int count;
+	const struct allocator_callbacks *allocator; // Set before pushing anything, NULL means malloc.
 };
 
 struct item {
@@ -49,7 +83,8 @@ void reserve(struct queue *queue, int min_capacity) {
 		while (new_capacity < min_capacity)
 			new_capacity *= 2;
 		
-		queue->items = realloc(queue->items, (int)new_capacity * sizeof queue->items[0]);
+		queue->items = reallocate_memory(queue->allocator, queue->items,
+			(size_t)queue->capacity * sizeof queue->items[0], (size_t)new_capacity * sizeof queue->items[0]);
 		queue->capacity = new_capacity;
 	}
 }
@@ -108,13 +143,23 @@ void change_priority(struct queue *queue, int index, int new_priority) {
 }
 
 void destroy(struct queue *queue) {
-	free(queue->items);
+	if (queue->items)
+		deallocate_memory(queue->allocator, queue->items, (size_t)queue->capacity * sizeof queue->items[0]);
 	queue->items = NULL;
 	queue->capacity = 0;
 	queue->count = 0;
 }
 
 #include <assert.h>
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	{
 		struct queue queue = { 0 };
@@ -160,4 +205,18 @@ int main(void) {
 		assert(pop(&queue) == 2);
 		destroy(&queue);
 	}
+
+	{
+		// Without a reallocate callback, growing copies into a new block and gives back the old one.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct queue queue = { .allocator = &callbacks };
+		for (int i = 0; i < 1000; ++i)
+			push(&queue, i, i);
+		assert(allocated == (size_t)queue.capacity * sizeof queue.items[0]);
+		for (int i = 999; i >= 0; --i)
+			assert(pop(&queue) == i);
+		destroy(&queue);
+		assert(!allocated);
+	}
 }
\ No newline at end of file
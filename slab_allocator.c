@@ -1,11 +1,42 @@
-#include <stdlib.h> // malloc, free, size_t
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and posix_memalign when compiling with -std=c11
+#endif
+#include <stdlib.h> // malloc, free, posix_memalign, _aligned_malloc, size_t
 #include <string.h> // memcpy
+#include <assert.h>
 
 #define SLAB_SIZE (64*1024)
 
+// Memory given back by release is poisoned when building with address sanitizer, so blocks from a
+// frame that's gone can't be used by mistake. Build with -DPOISON_RELEASED=0 to turn that off.
+#ifndef POISON_RELEASED
+#if defined(__SANITIZE_ADDRESS__)
+#define POISON_RELEASED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POISON_RELEASED 1
+#endif
+#endif
+#endif
+#if POISON_RELEASED
+#include <sanitizer/asan_interface.h>
+#define poison(memory, size) ASAN_POISON_MEMORY_REGION(memory, size)
+#define unpoison(memory, size) ASAN_UNPOISON_MEMORY_REGION(memory, size)
+#else
+#define poison(memory, size) ((void)(memory), (void)(size))
+#define unpoison(memory, size) ((void)(memory), (void)(size))
+#endif
+
 struct allocator {
 	struct slab *slab;
 	int cursor;
+	int high_water; // The most the cursor has been at, since the innermost mark.
+};
+
+// Where a frame started, and the high water mark outside of it.
+struct mark {
+	int cursor;
+	int high_water;
 };
 
 struct slab {
@@ -26,6 +57,9 @@ void *allocate(struct allocator *allocator, int size, int alignment) {
 		if (needed <= remaining) {
 			allocator->slab->cursor += needed;
 			allocator->cursor += needed;
+			if (allocator->cursor > allocator->high_water)
+				allocator->high_water = allocator->cursor;
+			unpoison((void *)aligned, (size_t)size);
 			return (void *)aligned;
 		}
 
@@ -67,6 +101,9 @@ void *reallocate(struct allocator *allocator, void *block, int old_size, int new
 		if (end == top && allocator->slab->cursor + delta <= allocator->slab->capacity) {
 			allocator->slab->cursor += delta;
 			allocator->cursor += delta;
+			if (allocator->cursor > allocator->high_water)
+				allocator->high_water = allocator->cursor;
+			unpoison(block, (size_t)new_size);
 			return block;
 		}
 		if (new_size < old_size)
@@ -97,6 +134,36 @@ void reset(struct allocator *allocator, int cursor) {
 	}
 }
 
+// Starts a frame, everything allocated after it goes away with release.
+struct mark mark(struct allocator *allocator) {
+	struct mark mark = { allocator->cursor, allocator->high_water };
+	allocator->high_water = allocator->cursor;
+	return mark;
+}
+
+// Frees everything allocated since the mark, which has to be the innermost one that's still
+// around, and keeps the slabs for later. Returns the most bytes the frame had allocated at once.
+int release(struct allocator *allocator, struct mark mark) {
+	assert(mark.cursor <= allocator->cursor); // An outer frame was released first.
+	int frame_high_water = allocator->high_water - mark.cursor;
+	int remaining = allocator->cursor - mark.cursor;
+	for (struct slab *slab = allocator->slab; remaining > 0; slab = slab->prev) {
+		int size = remaining < slab->cursor ? remaining : slab->cursor;
+		poison((char *)slab->memory + slab->cursor - size, (size_t)size);
+		remaining -= size;
+	}
+	reset(allocator, mark.cursor);
+	if (mark.high_water > allocator->high_water)
+		allocator->high_water = mark.high_water;
+	return frame_high_water;
+}
+
+// Runs the statement after it in a frame: FRAME(&allocator) { ... }
+// Leaving it with break, goto or return skips the release.
+#define FRAME(allocator) \
+	for (struct mark frame_mark = mark(allocator), *frame_once = &frame_mark; frame_once; \
+		release(allocator, frame_mark), frame_once = NULL)
+
 void trim(struct allocator *allocator) {
 	struct slab *slab = allocator->slab->next;
 	allocator->slab->next = NULL;
@@ -113,13 +180,405 @@ void destroy(struct allocator *allocator) {
 		slab = slab->prev;
 	while (slab) {
 		struct slab *next = slab->next;
-		if (slab->capacity)
+		if (slab->memory == slab + 1) // Made by allocate, the first one can be anything.
 			free(slab);
 		slab = next;
 	}
 }
 
-#include <assert.h>
+// Scratch arenas: each thread has a pair of slab allocators for temporary memory, and a function
+// that takes an arena for its results gets scratch from the other one, so its temporaries don't
+// end up under the results. scratch_begin marks whichever isn't in the conflicts, and scratch_end
+// releases it, without locking since they're per thread. The first slab of each is a large page
+// where the OS gives one: a reserved huge page, or a transparent one on Linux, or a large page on
+// Windows if the process may lock memory.
+#if defined(_WIN32)
+#include <Windows.h> // VirtualAlloc, VirtualFree
+#else
+#include <sys/mman.h> // mmap, munmap, madvise
+#endif
+#include <stdint.h> // uintptr_t
+
+#define NUM_SCRATCH_ARENAS 2
+#define SCRATCH_SIZE (2 * 1024 * 1024) // The first slab of each arena, a large page on x64.
+
+struct scratch {
+	struct allocator *allocator;
+	struct mark mark;
+};
+
+_Thread_local struct allocator scratch_arenas[NUM_SCRATCH_ARENAS];
+_Thread_local struct slab scratch_first_slabs[NUM_SCRATCH_ARENAS];
+
+void *map_scratch(size_t size) {
+#if defined(_WIN32)
+	size_t large_page = GetLargePageMinimum();
+	if (large_page && size % large_page == 0) {
+		void *memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (memory)
+			return memory;
+	}
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#if defined(MAP_HUGETLB)
+	void *huge = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (huge != MAP_FAILED)
+		return huge;
+#endif
+	// transparent huge pages only back ranges that are aligned to them
+	char *mapped = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+		return NULL;
+	char *aligned = (char *)(((uintptr_t)mapped + size - 1) & ~(uintptr_t)(size - 1));
+	if (aligned > mapped)
+		munmap(mapped, (size_t)(aligned - mapped));
+	munmap(aligned + size, (size_t)(mapped + size - aligned));
+#if defined(MADV_HUGEPAGE)
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+#endif
+}
+void unmap_scratch(void *memory, size_t size) {
+#if defined(_WIN32)
+	(void)size;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+// conflicts are arenas the caller allocates results from, usually the ones it was passed. Ends
+// with scratch_end, in the reverse order of scratch_begin.
+struct scratch scratch_begin(struct allocator **conflicts, int num_conflicts) {
+	for (int i = 0; i < NUM_SCRATCH_ARENAS; ++i) {
+		struct allocator *arena = &scratch_arenas[i];
+		int conflicting = 0;
+		for (int j = 0; j < num_conflicts; ++j)
+			conflicting |= conflicts[j] == arena;
+		if (conflicting)
+			continue;
+
+		if (!arena->slab) {
+			struct slab *first = &scratch_first_slabs[i];
+			first->memory = map_scratch(SCRATCH_SIZE);
+			first->capacity = first->memory ? SCRATCH_SIZE : 0; // Slabs come from malloc then.
+			arena->slab = first;
+		}
+		return (struct scratch){ arena, mark(arena) };
+	}
+	assert(0); // Every arena is a conflict.
+	return (struct scratch){ NULL, { 0, 0 } };
+}
+
+void scratch_end(struct scratch scratch) {
+	release(scratch.allocator, scratch.mark);
+}
+
+// Gives back the thread's scratch memory. Call this before a thread exits.
+void scratch_thread_exit(void) {
+	for (int i = 0; i < NUM_SCRATCH_ARENAS; ++i) {
+		struct allocator *arena = &scratch_arenas[i];
+		struct slab *first = &scratch_first_slabs[i];
+		if (!arena->slab)
+			continue;
+		assert(arena->cursor == 0); // A scratch_begin without a scratch_end.
+		destroy(arena);
+		if (first->memory) {
+			unpoison(first->memory, SCRATCH_SIZE); // The addresses get reused by the next mapping.
+			unmap_scratch(first->memory, SCRATCH_SIZE);
+		}
+		memset(arena, 0, sizeof arena[0]);
+		memset(first, 0, sizeof first[0]);
+	}
+}
+
+// Small object allocator: sizes up to about 16 KB are rounded up to one of 68 size classes, and
+// each class carves fixed size objects out of its own slabs. The slabs are SLAB_SIZE aligned,
+// so deallocate finds the slab header by masking the address, and it doesn't need the size. A
+// bitmap in the header says which objects are free, and there's no per object header. Slabs
+// that become empty go back to the system, except for one spare. Bigger blocks get a slab of
+// their own, rounded up to LARGE_GRANULE.
+#include <stdint.h> // uint64_t, uintptr_t
+
+#define NUM_SIZE_CLASSES 68 // 40 up to 2048 bytes, then 28 that split a slab into 31 down to 4 objects.
+#define MAX_SMALL_SIZE ((int)((SLAB_SIZE - SMALL_HEADER_SIZE) / 4) & ~15)
+#define LARGE_CLASS -1 // A single block bigger than MAX_SMALL_SIZE, with a slab header of its own.
+#define LARGE_GRANULE 4096 // A page.
+
+struct small_slab {
+	struct small_allocator *owner;
+	struct small_slab *prev; // In its size class's list of slabs with free objects.
+	struct small_slab *next;
+	struct small_slab *all_prev; // In the list of all slabs, for destroy.
+	struct small_slab *all_next;
+	int size_class;
+	int object_size; // Or the usable size of the pages for LARGE_CLASS.
+	int num_objects;
+	int num_free;
+	int first_word; // There are no free objects before this word of the bitmap.
+	uint64_t free_bits[SLAB_SIZE / 16 / 64]; // Set for free objects.
+};
+
+#define SMALL_HEADER_SIZE ((sizeof(struct small_slab) + 15) & ~(size_t)15)
+
+// Still SLAB_SIZE aligned so slab_of works, and aligned_alloc would want the size to be a multiple
+// of that.
+struct small_slab *allocate_small_slab(size_t capacity) {
+#if defined(_WIN32)
+	return _aligned_malloc(capacity, SLAB_SIZE);
+#else
+	void *slab;
+	return posix_memalign(&slab, SLAB_SIZE, capacity) ? NULL : slab;
+#endif
+}
+void release_small_slab(struct small_slab *slab) {
+#if defined(_WIN32)
+	_aligned_free(slab); // Can't go to free.
+#else
+	free(slab);
+#endif
+}
+int lowest_set_bit(uint64_t bits) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+struct small_allocator {
+	struct small_slab *partial[NUM_SIZE_CLASSES];
+	struct small_slab *all;
+	struct small_slab *spare;
+	int class_sizes[NUM_SIZE_CLASSES];
+	unsigned char class_of[MAX_SMALL_SIZE / 16 + 1]; // Indexed by size rounded up to 16 bytes.
+	int num_slabs;
+};
+
+void initialize_small(struct small_allocator *allocator) {
+	memset(allocator, 0, sizeof allocator[0]);
+	// 16 byte steps up to 256, then 8 classes per doubling, so at most 1/8 gets wasted.
+	int size = 0, num_classes = 0;
+	while (size < 2048) {
+		size += size < 256 ? 16 : size < 512 ? 32 : size < 1024 ? 64 : 128;
+		allocator->class_sizes[num_classes++] = size;
+	}
+	// Past that the leftover at the end of a slab would add up, so the classes are the sizes that
+	// fill a slab with a whole number of objects.
+	for (int num_objects = 31; num_objects >= 4; --num_objects) {
+		size = (int)((SLAB_SIZE - SMALL_HEADER_SIZE) / (size_t)num_objects) & ~15;
+		assert(size > allocator->class_sizes[num_classes - 1]);
+		allocator->class_sizes[num_classes++] = size;
+	}
+	assert(num_classes == NUM_SIZE_CLASSES && size == MAX_SMALL_SIZE);
+	for (int i = 0, c = 0; i <= MAX_SMALL_SIZE / 16; ++i) {
+		while (allocator->class_sizes[c] < i * 16)
+			++c;
+		allocator->class_of[i] = (unsigned char)c;
+	}
+}
+
+struct small_slab *slab_of(void *block) {
+	return (struct small_slab *)((uintptr_t)block & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+char *slab_objects(struct small_slab *slab) {
+	return (char *)slab + SMALL_HEADER_SIZE;
+}
+
+void link_slab(struct small_slab **list, struct small_slab *slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list)
+		(*list)->prev = slab;
+	*list = slab;
+}
+void unlink_slab(struct small_slab **list, struct small_slab *slab) {
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+struct small_slab *new_small_slab(struct small_allocator *allocator, int size_class, int size) {
+	struct small_slab *slab;
+	if (size_class != LARGE_CLASS && allocator->spare) {
+		slab = allocator->spare;
+		allocator->spare = NULL;
+	} else {
+		size_t capacity = SLAB_SIZE;
+		if (size_class == LARGE_CLASS)
+			capacity = (SMALL_HEADER_SIZE + (size_t)size + LARGE_GRANULE - 1) & ~(size_t)(LARGE_GRANULE - 1);
+		slab = allocate_small_slab(capacity);
+		if (!slab)
+			return NULL;
+		allocator->num_slabs++;
+	}
+	slab->owner = allocator;
+	slab->size_class = size_class;
+	slab->all_prev = NULL;
+	slab->all_next = allocator->all;
+	if (allocator->all)
+		allocator->all->all_prev = slab;
+	allocator->all = slab;
+	if (size_class == LARGE_CLASS) {
+		slab->object_size = (int)(((SMALL_HEADER_SIZE + (size_t)size + LARGE_GRANULE - 1) & ~(size_t)(LARGE_GRANULE - 1)) - SMALL_HEADER_SIZE);
+		return slab;
+	}
+
+	slab->object_size = allocator->class_sizes[size_class];
+	slab->num_objects = (int)((SLAB_SIZE - SMALL_HEADER_SIZE) / (size_t)slab->object_size);
+	slab->num_free = slab->num_objects;
+	slab->first_word = 0;
+	memset(slab->free_bits, 0, sizeof slab->free_bits);
+	for (int i = 0; i < slab->num_objects; ++i)
+		slab->free_bits[i / 64] |= 1ull << (i % 64);
+	link_slab(&allocator->partial[size_class], slab);
+	return slab;
+}
+void free_small_slab(struct small_allocator *allocator, struct small_slab *slab) {
+	if (slab->all_prev)
+		slab->all_prev->all_next = slab->all_next;
+	else
+		allocator->all = slab->all_next;
+	if (slab->all_next)
+		slab->all_next->all_prev = slab->all_prev;
+	if (slab->size_class != LARGE_CLASS && !allocator->spare) {
+		allocator->spare = slab;
+		return;
+	}
+	release_small_slab(slab);
+	allocator->num_slabs--;
+}
+
+// Blocks are aligned to 16 bytes.
+void *small_allocate(struct small_allocator *allocator, int size) {
+	assert(size >= 0);
+	if (size > MAX_SMALL_SIZE) {
+		struct small_slab *slab = new_small_slab(allocator, LARGE_CLASS, size);
+		return slab ? slab_objects(slab) : NULL;
+	}
+
+	int size_class = allocator->class_of[(size + 15) / 16];
+	struct small_slab *slab = allocator->partial[size_class];
+	if (!slab) {
+		slab = new_small_slab(allocator, size_class, size);
+		if (!slab)
+			return NULL;
+	}
+
+	while (!slab->free_bits[slab->first_word])
+		slab->first_word++;
+	uint64_t bits = slab->free_bits[slab->first_word];
+	int bit = lowest_set_bit(bits);
+	slab->free_bits[slab->first_word] = bits & (bits - 1);
+	int index = slab->first_word * 64 + bit;
+	if (!--slab->num_free)
+		unlink_slab(&allocator->partial[size_class], slab);
+	return slab_objects(slab) + index * slab->object_size;
+}
+
+void small_deallocate(struct small_allocator *allocator, void *block) {
+	if (!block)
+		return;
+
+	struct small_slab *slab = slab_of(block);
+	assert(slab->owner == allocator); // Not from this allocator.
+	if (slab->size_class == LARGE_CLASS) {
+		free_small_slab(allocator, slab);
+		return;
+	}
+
+	int offset = (int)((char *)block - slab_objects(slab));
+	int index = offset / slab->object_size;
+	assert(index * slab->object_size == offset); // Not the start of an object.
+	assert(!(slab->free_bits[index / 64] & (1ull << (index % 64)))); // Double free.
+	slab->free_bits[index / 64] |= 1ull << (index % 64);
+	if (index / 64 < slab->first_word)
+		slab->first_word = index / 64;
+	if (!slab->num_free++)
+		link_slab(&allocator->partial[slab->size_class], slab);
+	if (slab->num_free == slab->num_objects) {
+		unlink_slab(&allocator->partial[slab->size_class], slab);
+		free_small_slab(allocator, slab);
+	}
+}
+
+// The size is the usable size of the block, which can be more than what was asked for.
+int small_block_size(void *block) {
+	return slab_of(block)->object_size;
+}
+
+void *small_reallocate(struct small_allocator *allocator, void *block, int new_size) {
+	if (!block)
+		return small_allocate(allocator, new_size);
+	int old_size = small_block_size(block);
+	int old_class = slab_of(block)->size_class;
+	if (old_class != LARGE_CLASS && new_size <= MAX_SMALL_SIZE && allocator->class_of[(new_size + 15) / 16] == old_class)
+		return block;
+	if (old_class == LARGE_CLASS && new_size > MAX_SMALL_SIZE && new_size <= old_size && old_size - new_size < LARGE_GRANULE)
+		return block; // Still needs all the pages it has.
+
+	void *copy = small_allocate(allocator, new_size);
+	if (!copy)
+		return NULL;
+	memcpy(copy, block, (size_t)(old_size < new_size ? old_size : new_size));
+	small_deallocate(allocator, block);
+	return copy;
+}
+
+void small_destroy(struct small_allocator *allocator) {
+	while (allocator->all) {
+		struct small_slab *next = allocator->all->all_next;
+		release_small_slab(allocator->all);
+		allocator->all = next;
+	}
+	release_small_slab(allocator->spare);
+	memset(allocator, 0, sizeof allocator[0]);
+}
+
+#include <threads.h> // thrd_create
+
+// Copies the numbers into arena in reverse, going through scratch memory, and recursing so the
+// nested calls have the other arena as their conflict.
+int *reversed(struct allocator *arena, const int *numbers, int count) {
+	struct scratch scratch = scratch_begin(&arena, 1);
+	assert(scratch.allocator != arena);
+	int *temporary = allocate(scratch.allocator, count * (int)sizeof(int), _Alignof(int));
+	for (int i = 0; i < count; ++i)
+		temporary[i] = numbers[count - 1 - i];
+	if (count > 1) {
+		int *again = reversed(scratch.allocator, temporary, count - 1);
+		for (int i = 0; i < count - 1; ++i)
+			assert(again[i] == temporary[count - 2 - i]);
+	}
+	int *result = allocate(arena, count * (int)sizeof(int), _Alignof(int));
+	memcpy(result, temporary, (size_t)count * sizeof(int));
+	scratch_end(scratch);
+	return result;
+}
+
+int scratch_test_thread(void *arg) {
+	int seed = *(int *)arg;
+	for (int request = 0; request < 1000; ++request) {
+		struct scratch scratch = scratch_begin(NULL, 0);
+		int numbers[8];
+		for (int i = 0; i < 8; ++i)
+			numbers[i] = seed + request + i;
+		int *result = reversed(scratch.allocator, numbers, 8);
+		for (int i = 0; i < 8; ++i)
+			assert(result[i] == numbers[7 - i]);
+		scratch_end(scratch);
+		assert(scratch_arenas[0].cursor == 0 && scratch_arenas[1].cursor == 0);
+	}
+	scratch_thread_exit();
+	return 0;
+}
+
 int main(void) {
 	{
 		struct allocator allocator = { .slab = &(struct slab) { 0 } };
@@ -251,4 +710,146 @@ int main(void) {
 		trim(&allocator);
 		destroy(&allocator);
 	}
+
+	{
+		// Nested frames across slabs, each with its own high water mark.
+		struct allocator allocator = { .slab = &(struct slab) { 0 } };
+		char *outer = allocate(&allocator, 1000, 1);
+		struct mark m1 = mark(&allocator);
+		char *big = allocate(&allocator, SLAB_SIZE, 1);
+		struct mark m2 = mark(&allocator);
+		allocate(&allocator, 3 * SLAB_SIZE, 16);
+		assert(release(&allocator, m2) >= 3 * SLAB_SIZE);
+		assert(allocator.cursor == m2.cursor);
+		memset(big, 1, SLAB_SIZE);
+		int high_water = allocator.high_water;
+		assert(release(&allocator, m1) == high_water - m1.cursor);
+		assert(allocator.cursor == m1.cursor && allocator.high_water == high_water);
+		memset(outer, 2, 1000);
+#if POISON_RELEASED
+		assert(__asan_address_is_poisoned(big));
+#endif
+
+		// Requests reuse the slabs of the ones before them.
+		int num_slabs = 0;
+		for (int request = 0; request < 100; ++request) {
+			FRAME(&allocator) {
+				for (int i = 0; i < 100; ++i) {
+					char *temporary = allocate(&allocator, 1 + (request * 7 + i * 13) % 3000, 8);
+					memset(temporary, request, 1 + (size_t)((request * 7 + i * 13) % 3000));
+				}
+			}
+			assert(allocator.cursor == m1.cursor);
+			int count = 0;
+			for (struct slab *slab = allocator.slab; slab; slab = slab->next)
+				++count;
+			assert(request == 0 || count == num_slabs);
+			num_slabs = count;
+		}
+		trim(&allocator);
+		destroy(&allocator);
+	}
+
+	{
+		// Scratch arenas take turns, and every thread has its own.
+		struct scratch outer = scratch_begin(NULL, 0);
+		assert(outer.allocator == &scratch_arenas[0]);
+		struct scratch inner = scratch_begin(&outer.allocator, 1);
+		assert(inner.allocator == &scratch_arenas[1]);
+		char *big = allocate(inner.allocator, SCRATCH_SIZE + 1, 1); // past the first slab
+		memset(big, 1, SCRATCH_SIZE + 1);
+		scratch_end(inner);
+		scratch_end(outer);
+		assert(scratch_arenas[0].cursor == 0 && scratch_arenas[1].cursor == 0);
+
+		enum { NUM_THREADS = 4 };
+		thrd_t threads[NUM_THREADS];
+		int seeds[NUM_THREADS];
+		for (int i = 0; i < NUM_THREADS; ++i) {
+			seeds[i] = i * 1000;
+			thrd_create(&threads[i], scratch_test_thread, &seeds[i]);
+		}
+		for (int i = 0; i < NUM_THREADS; ++i)
+			thrd_join(threads[i], NULL);
+		scratch_test_thread(&(int){ 0 });
+		assert(!scratch_arenas[0].slab && !scratch_arenas[1].slab);
+	}
+
+	{
+		static struct small_allocator allocator;
+		initialize_small(&allocator);
+		for (int size = 0; size <= MAX_SMALL_SIZE; ++size) {
+			int size_class = allocator.class_of[(size + 15) / 16];
+			assert(allocator.class_sizes[size_class] >= size);
+			assert(size_class == 0 || allocator.class_sizes[size_class - 1] < size);
+		}
+
+		// Random churn, every live block is filled with its own byte, which has to survive.
+		enum { NUM_BLOCKS = 4096 };
+		static char *blocks[NUM_BLOCKS];
+		static int sizes[NUM_BLOCKS];
+		unsigned seed = 1;
+		for (int i = 0; i < 1000000; ++i) {
+			seed = seed * 1103515245 + 12345;
+			unsigned r = seed >> 8;
+			int slot = r % NUM_BLOCKS;
+			if (blocks[slot]) {
+				for (int j = 0; j < sizes[slot]; ++j)
+					assert(blocks[slot][j] == (char)slot);
+				if (r & 0x100000) {
+					int size = (r >> 12) % 3000;
+					blocks[slot] = small_reallocate(&allocator, blocks[slot], size);
+					for (int j = 0; j < size && j < sizes[slot]; ++j)
+						assert(blocks[slot][j] == (char)slot);
+					memset(blocks[slot], slot, (size_t)size);
+					sizes[slot] = size;
+					continue;
+				}
+				small_deallocate(&allocator, blocks[slot]);
+				blocks[slot] = NULL;
+			} else {
+				int size = (r >> 12) % 8 ? (r >> 15) % 256 : (r >> 15) % 3000;
+				blocks[slot] = small_allocate(&allocator, size);
+				assert(!((uintptr_t)blocks[slot] & 15));
+				assert(small_block_size(blocks[slot]) >= size);
+				memset(blocks[slot], slot, (size_t)size);
+				sizes[slot] = size;
+			}
+		}
+
+		// Empty slabs go back, except for the spare.
+		for (int i = 0; i < NUM_BLOCKS; ++i)
+			small_deallocate(&allocator, blocks[i]);
+		assert(allocator.num_slabs == 1 && allocator.spare && !allocator.all);
+		for (int i = 0; i < NUM_SIZE_CLASSES; ++i)
+			assert(!allocator.partial[i]);
+
+		// A slab is full before the next one gets started.
+		int num_objects = (int)((SLAB_SIZE - SMALL_HEADER_SIZE) / 64);
+		for (int i = 0; i < num_objects + 1; ++i)
+			blocks[i] = small_allocate(&allocator, 64);
+		assert(allocator.num_slabs == 2);
+		for (int i = 0; i < num_objects; ++i)
+			assert(slab_of(blocks[i]) == slab_of(blocks[0]));
+		assert(slab_of(blocks[num_objects]) != slab_of(blocks[0]));
+		small_deallocate(&allocator, blocks[10]);
+		assert(small_allocate(&allocator, 60) == blocks[10]);
+
+		// Up to MAX_SMALL_SIZE the last object ends close to the end of its slab, past it blocks
+		// only get rounded up to pages.
+		for (int i = 40; i < NUM_SIZE_CLASSES; ++i) {
+			int size = allocator.class_sizes[i];
+			int leftover = (int)(SLAB_SIZE - SMALL_HEADER_SIZE) % size;
+			assert(leftover < 16 * (int)((SLAB_SIZE - SMALL_HEADER_SIZE) / (size_t)size));
+		}
+		char *large = small_allocate(&allocator, MAX_SMALL_SIZE + 1);
+		assert(slab_of(large)->size_class == LARGE_CLASS);
+		assert(SMALL_HEADER_SIZE + (size_t)small_block_size(large) == 5 * LARGE_GRANULE);
+		assert(small_reallocate(&allocator, large, MAX_SMALL_SIZE + 100) == large);
+		large = small_reallocate(&allocator, large, 100000);
+		memset(large, 1, 100000);
+		assert(small_block_size(large) >= 100000 && small_block_size(large) < 100000 + LARGE_GRANULE);
+		small_deallocate(&allocator, small_allocate(&allocator, MAX_SMALL_SIZE));
+		small_destroy(&allocator);
+	}
 }
\ No newline at end of file
@@ -1,10 +1,38 @@
 #include <stdint.h> // uintptr_t
 #include <string.h> // memcpy - only needed for realloc
+#include <assert.h>
+
+// Memory given back by release is poisoned when building with address sanitizer, so blocks from a
+// frame that's gone can't be used by mistake. Build with -DPOISON_RELEASED=0 to turn that off.
+#ifndef POISON_RELEASED
+#if defined(__SANITIZE_ADDRESS__)
+#define POISON_RELEASED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POISON_RELEASED 1
+#endif
+#endif
+#endif
+#if POISON_RELEASED
+#include <sanitizer/asan_interface.h>
+#define poison(memory, size) ASAN_POISON_MEMORY_REGION(memory, size)
+#define unpoison(memory, size) ASAN_UNPOISON_MEMORY_REGION(memory, size)
+#else
+#define poison(memory, size) ((void)(memory), (void)(size))
+#define unpoison(memory, size) ((void)(memory), (void)(size))
+#endif
 
 struct allocator {
 	void *buffer;
 	int capacity;
 	int cursor;
+	int high_water; // The most the cursor has been at, since the innermost mark.
+};
+
+// Where a frame started, and the high water mark outside of it.
+struct mark {
+	int cursor;
+	int high_water;
 };
 
 void *allocate(struct allocator *allocator, int size, int alignment) {
@@ -16,6 +44,9 @@ void *allocate(struct allocator *allocator, int size, int alignment) {
 		return 0;
 
 	allocator->cursor = new_cursor;
+	if (new_cursor > allocator->high_water)
+		allocator->high_water = new_cursor;
+	unpoison((void *)aligned, (size_t)size);
 	return (void *)aligned;
 }
 
@@ -31,6 +62,9 @@ void *reallocate(struct allocator *allocator, void *block, int old_size, int new
 		if (new_cursor > allocator->capacity)
 			return 0;
 		allocator->cursor = new_cursor;
+		if (new_cursor > allocator->high_water)
+			allocator->high_water = new_cursor;
+		unpoison(block, (size_t)new_size);
 		return block;
 	}
 
@@ -42,7 +76,31 @@ void *reallocate(struct allocator *allocator, void *block, int old_size, int new
 	return result;
 }
 
-#include <assert.h>
+// Starts a frame, everything allocated after it goes away with release.
+struct mark mark(struct allocator *allocator) {
+	struct mark mark = { allocator->cursor, allocator->high_water };
+	allocator->high_water = allocator->cursor;
+	return mark;
+}
+
+// Frees everything allocated since the mark, which has to be the innermost one that's still
+// around. Returns the most bytes the frame had allocated at once.
+int release(struct allocator *allocator, struct mark mark) {
+	assert(mark.cursor <= allocator->cursor); // An outer frame was released first.
+	int frame_high_water = allocator->high_water - mark.cursor;
+	poison((char *)allocator->buffer + mark.cursor, (size_t)(allocator->cursor - mark.cursor));
+	allocator->cursor = mark.cursor;
+	if (mark.high_water > allocator->high_water)
+		allocator->high_water = mark.high_water;
+	return frame_high_water;
+}
+
+// Runs the statement after it in a frame: FRAME(&allocator) { ... }
+// Leaving it with break, goto or return skips the release.
+#define FRAME(allocator) \
+	for (struct mark frame_mark = mark(allocator), *frame_once = &frame_mark; frame_once; \
+		release(allocator, frame_mark), frame_once = NULL)
+
 int main(void) {
 	struct allocator allocator = { 0 };
 	assert(!allocate(&allocator, 1, 1));
@@ -109,4 +167,33 @@ int main(void) {
 	assert(i3 != i2);
 	for (int j = 0; j < 3; ++j)
 		assert(i2[j] == j);
+
+	// Nested frames, each with its own high water mark.
+	static _Alignas(16) char frame_buffer[1024];
+	allocator = (struct allocator){ .buffer = frame_buffer, .capacity = sizeof frame_buffer };
+	char *outer = allocate(&allocator, 100, 1);
+	struct mark m1 = mark(&allocator);
+	allocate(&allocator, 300, 1);
+	struct mark m2 = mark(&allocator);
+	allocate(&allocator, 200, 1);
+	assert(release(&allocator, m2) == 200);
+	allocate(&allocator, 50, 1);
+	assert(allocator.cursor == 450);
+	assert(release(&allocator, m1) == 500);
+	assert(allocator.cursor == 100 && allocator.high_water == 600);
+	memset(outer, 1, 100);
+
+	char *temporary = NULL;
+	FRAME(&allocator) {
+		temporary = allocate(&allocator, 800, 16);
+		memset(temporary, 2, 800);
+		FRAME(&allocator)
+			assert(!allocate(&allocator, 200, 1));
+	}
+	assert(allocator.cursor == 100 && allocator.high_water == 912);
+#if POISON_RELEASED
+	assert(__asan_address_is_poisoned(temporary));
+#endif
+	char *reused = allocate(&allocator, 900, 1);
+	memset(reused, 3, 900);
 }
\ No newline at end of file
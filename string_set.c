@@ -1,12 +1,34 @@
 #include <stdlib.h> // malloc, free
 #include <string.h> // strlen, strcmp, memcpy, memset
 
+// Where a set and its string slabs get their memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
 struct set {
 	char **items;
 	struct slab *slab;
 	int count;
 	int capacity;
 	int num_tombstones;
+	int live_bytes; // Slab bytes used by items still in the set.
+	int dead_bytes; // Slab bytes used by items that were removed.
+	const struct allocator_callbacks *allocator; // Set before adding anything, NULL means malloc.
 };
 
 struct slab {
@@ -25,13 +47,13 @@ unsigned long long hash_string(const char *string) {
 	return hash;
 }
 
-char *copy_string(struct slab **slab, const char *string) {
+char *copy_string(const struct allocator_callbacks *allocator, struct slab **slab, const char *string) {
 	int size = 1 + (int)strlen(string);
 	if ((*slab)->capacity - (*slab)->cursor < size) {
 		int new_capacity = 1024;
 		while (new_capacity < size)
 			new_capacity *= 2;
-		struct slab *new_slab = malloc(sizeof new_slab[0] + new_capacity);
+		struct slab *new_slab = allocate_memory(allocator, sizeof new_slab[0] + (size_t)new_capacity);
 		new_slab->capacity = new_capacity;
 		new_slab->cursor = 0;
 		new_slab->prev = *slab;
@@ -43,6 +65,18 @@ char *copy_string(struct slab **slab, const char *string) {
 	return copy;
 }
 
+// Frees the slabs that were added after resizing, and then the items along with the first slab.
+void free_memory(struct set *set) {
+	struct slab *slab = set->slab;
+	while (slab && slab->prev) {
+		struct slab *prev = slab->prev;
+		deallocate_memory(set->allocator, slab, sizeof slab[0] + (size_t)slab->capacity);
+		slab = prev;
+	}
+	if (set->items)
+		deallocate_memory(set->allocator, set->items, (size_t)set->capacity * sizeof set->items[0] + sizeof slab[0] + (size_t)slab->capacity);
+}
+
 void resize(struct set *set, int capacity) {
 	if (capacity <= set->count)
 		capacity = set->count + 1;
@@ -51,15 +85,12 @@ void resize(struct set *set, int capacity) {
 	for (pow2 = 0; (1 << pow2) < capacity; ++pow2);
 	capacity = 1 << pow2;
 
-	int total_string_size = 0;
-	for (struct slab *slab = set->slab; slab; slab = slab->prev)
-		total_string_size += slab->cursor;
-
+	// Only live items get copied over, so this also compacts the slab.
 	int first_slab_capacity = 1024;
-	while (first_slab_capacity < total_string_size)
+	while (first_slab_capacity < set->live_bytes)
 		first_slab_capacity *= 2;
 
-	void *new_memory = malloc(capacity * sizeof set->items[0] + sizeof set->slab[0] + first_slab_capacity);
+	void *new_memory = allocate_memory(set->allocator, (size_t)capacity * sizeof set->items[0] + sizeof set->slab[0] + (size_t)first_slab_capacity);
 	char **new_items = new_memory;
 	memset(new_items, 0, capacity * sizeof set->items[0]);
 	struct slab *new_slab = (struct slab *)(new_items + capacity);
@@ -70,7 +101,7 @@ void resize(struct set *set, int capacity) {
 	unsigned mask = capacity - 1;
 	for (int i = 0; i < set->capacity; ++i) {
 		if ((size_t)set->items[i] > TOMBSTONE) {
-			char *item = copy_string(&new_slab, set->items[i]);
+			char *item = copy_string(set->allocator, &new_slab, set->items[i]);
 			unsigned long long hash = hash_string(item);
 			for (unsigned j = (unsigned)hash & mask;; j = (j + 1) & mask) {
 				if (!new_items[j]) {
@@ -81,16 +112,12 @@ void resize(struct set *set, int capacity) {
 		}
 	}
 
-	for (struct slab *slab = set->slab; slab && slab->prev;) {
-		struct slab *prev = slab->prev;
-		free(slab);
-		slab = prev;
-	}
-	free(set->items); // This also frees the metadata, and slab.
+	free_memory(set);
 	set->items = new_items;
 	set->slab = new_slab;
 	set->capacity = capacity;
 	set->num_tombstones = 0;
+	set->dead_bytes = 0;
 }
 
 void reserve(struct set *set, int min_capacity) {
@@ -120,7 +147,8 @@ void add(struct set *set, const char *item) {
 	if (set->items[index] == (void *)TOMBSTONE)
 		--set->num_tombstones;
 	set->count++;
-	set->items[index] = copy_string(&set->slab, item);
+	set->items[index] = copy_string(set->allocator, &set->slab, item);
+	set->live_bytes += 1 + (int)strlen(item);
 }
 
 void remove(struct set *set, const char *item) {
@@ -131,11 +159,16 @@ void remove(struct set *set, const char *item) {
 	unsigned mask = (unsigned)set->capacity - 1;
 	for (unsigned i = (unsigned)hash & mask; set->items[i]; i = (i + 1) & mask) {
 		if (set->items[i] != (void *)TOMBSTONE && strcmp(set->items[i], item) == 0) {
+			int size = 1 + (int)strlen(item);
 			set->items[i] = (void *)TOMBSTONE;
 			set->count--;
 			set->num_tombstones++;
-			if (8 * set->num_tombstones > set->capacity)
-				resize(set, set->capacity); // Get rid of tombstones.
+			set->live_bytes -= size;
+			set->dead_bytes += size;
+			// Compact once most of the slab is dead. Compaction is O(capacity) so we also wait for at least
+			// that many dead bytes, which keeps the amortized cost per removed byte constant.
+			if (8 * set->num_tombstones > set->capacity || (set->dead_bytes > set->live_bytes && set->dead_bytes > set->capacity))
+				resize(set, set->capacity); // Get rid of tombstones and dead items.
 			return;
 		}
 	}
@@ -168,16 +201,22 @@ int next_index(struct set set, int index) {
 }
 
 void destroy(struct set *set) {
-	for (struct slab *slab = set->slab; slab && slab->prev;) {
-		struct slab *prev = slab->prev;
-		free(slab);
-		slab = prev;
-	}
-	free(set->items); // This also frees the slab.
+	free_memory(set);
+	const struct allocator_callbacks *allocator = set->allocator;
 	memset(set, 0, sizeof set[0]);
+	set->allocator = allocator;
 }
 
 #include <assert.h>
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	static char items[1048576][8] = { 0 };
 	int n = sizeof items / sizeof items[0];
@@ -286,6 +325,31 @@ int main(void) {
 		destroy(&set);
 	}
 
+	{
+		// Removing and re-adding items reuses tombstones, but shouldn't grow the slab forever.
+		struct set set = { 0 };
+		for (int i = 0; i < 1000; ++i)
+			add(&set, items[i]);
+		assert(set.live_bytes == 1000 * 8 && set.dead_bytes == 0);
+		remove(&set, items[0]);
+		assert(set.live_bytes == 999 * 8 && set.dead_bytes == 8);
+
+		for (int i = 0; i < 1000000; ++i) {
+			remove(&set, items[i % 1000]);
+			add(&set, items[i % 1000]);
+		}
+		assert(set.count == 1000 && set.live_bytes == 1000 * 8);
+		for (int i = 0; i < 1000; ++i)
+			assert(contains(set, items[i]));
+
+		int total_slab_bytes = 0;
+		for (struct slab *slab = set.slab; slab; slab = slab->prev)
+			total_slab_bytes += slab->cursor;
+		assert(total_slab_bytes == set.live_bytes + set.dead_bytes);
+		assert(total_slab_bytes < 64 * 1024);
+		destroy(&set);
+	}
+
 	{
 		// Potential pathological case: create a bunch of items and then delete them 
 		// to leave tombstones, then lookup each item. If we don't clean tombstones this is O(n^2).
@@ -301,6 +365,24 @@ int main(void) {
 		destroy(&set);
 	}
 
+	{
+		// Growing moves the strings to a new slab, and the old slots and slabs go back with the size
+		// they were allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct set set = { 0 };
+		set.allocator = &callbacks;
+		for (int i = 0; i < 20000; ++i)
+			add(&set, items[i]);
+		assert(allocated > (size_t)set.capacity * sizeof set.items[0]);
+		for (int i = 0; i < 15000; ++i)
+			remove(&set, items[i]);
+		for (int i = 0; i < 20000; ++i)
+			assert(contains(set, items[i]) == (i >= 15000));
+		destroy(&set);
+		assert(!allocated && set.allocator == &callbacks);
+	}
+
 	{
 		// This shouldn't leak.
 		for (int i = 0; i < 10000; ++i) {
@@ -1,10 +1,30 @@
 #include <string.h> // strlen, memcpy
 #include <stdlib.h> // malloc, free
 
+// Where the slabs come from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
 #define SLAB_SIZE (64*1024)
 
 struct slab {
 	struct slab *prev;
+	const struct allocator_callbacks *allocator; // Where this slab came from, and where the next one comes from.
 	char *buffer;
 	int capacity;
 	int cursor;
@@ -14,8 +34,9 @@ char *allocate(struct slab **slab, int size) {
 	int remaining = (*slab)->capacity - (*slab)->cursor;
 	if (remaining < size) {
 		int capacity = SLAB_SIZE * ((size + SLAB_SIZE + 1) / SLAB_SIZE);
-		struct slab *next = malloc(sizeof next[0] + capacity);
+		struct slab *next = allocate_memory((*slab)->allocator, sizeof next[0] + (size_t)capacity);
 		next->prev = *slab;
+		next->allocator = (*slab)->allocator;
 		next->buffer = (char *)(next + 1);
 		next->capacity = capacity;
 		next->cursor = 0;
@@ -37,7 +58,7 @@ void deallocate_all(struct slab **slab) {
 	for (;;) {
 		struct slab *prev = (*slab)->prev;
 		if ((*slab)->capacity)
-			free(*slab);
+			deallocate_memory((*slab)->allocator, *slab, sizeof(struct slab) + (size_t)(*slab)->capacity);
 		if (!prev)
 			return;
 		*slab = prev;
@@ -45,6 +66,15 @@ void deallocate_all(struct slab **slab) {
 }
 
 #include <assert.h>
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	struct slab *slab = &(struct slab) { 0 };
 	assert(strcmp(copy_string(&slab, "Hello, sailor!"), "Hello, sailor!") == 0);
@@ -59,6 +89,19 @@ int main(void) {
 	deallocate_all(&slab);
 	assert(!slab->prev);
 
+	// Slabs can come from somewhere else, set on the first one.
+	size_t allocated = 0;
+	struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+	slab = &(struct slab) { .allocator = &callbacks };
+	for (int i = 0; i < 10000; ++i)
+		copy_string(&slab, "ABCDEFGHIJKLMOP");
+	assert(allocated == 3 * (sizeof(struct slab) + SLAB_SIZE));
+	assert(strcmp(copy_string(&slab, large_string), large_string) == 0);
+	assert(allocated == 4 * sizeof(struct slab) + 6 * SLAB_SIZE);
+	deallocate_all(&slab);
+	assert(!allocated);
+	free(large_string);
+
 	// This shouldn't leak.
 	for (int i = 0; i < 10000; ++i) {
 		slab = &(struct slab) { 0 };
@@ -1,13 +1,48 @@
 #include <stdlib.h> // malloc, free
-#include <string.h> // strlen, strcmp, memcpy, memset
+#include <string.h> // memcmp, memcpy, memset
+
+// Where a table and its string slabs get their memory from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+#define INLINE_CAPACITY 23 // Strings up to this length are stored directly in the slot, longer ones go in the slab.
+
+// Each slot is exactly 64 bytes, so a lookup of a short key only touches a single cache line.
+// The full key hash is cached so that we only compare strings when the hashes match.
+struct slot {
+	unsigned long long hash; // 0 if the slot is empty, 1 if it's a tombstone.
+	int key_length;
+	int val_length;
+	union string {
+		char chars[INLINE_CAPACITY + 1]; // Null terminated, used if length <= INLINE_CAPACITY.
+		char *pointer; // Points into the slab, used if length > INLINE_CAPACITY.
+	} key, val;
+};
 
 struct table {
-	char **keys;
-	char **vals;
+	struct slot *slots;
 	struct slab *slab;
 	int count;
 	int capacity;
 	int num_tombstones;
+	int live_bytes; // Slab bytes used by strings still in the table.
+	int dead_bytes; // Slab bytes used by strings that were removed or overwritten.
+	const struct allocator_callbacks *allocator; // Set before adding anything, NULL means malloc.
 };
 
 struct slab {
@@ -19,20 +54,23 @@ struct slab {
 
 #define TOMBSTONE 1
 
-unsigned long long hash_string(const char *string) {
+unsigned long long hash_string(const char *string, int *length) {
 	unsigned long long hash = 14695981039346656037u;
-	for (int i = 0; string[i]; ++i)
+	int i;
+	for (i = 0; string[i]; ++i)
 		hash = (hash ^ string[i]) * 1099511628211u;
+	*length = i;
+	hash += (hash <= TOMBSTONE) ? 2 : 0;
 	return hash;
 }
 
-char *copy_string(struct slab **slab, const char *string) {
-	int size = 1 + (int)strlen(string);
+char *copy_string(const struct allocator_callbacks *allocator, struct slab **slab, const char *string, int length) {
+	int size = 1 + length;
 	if ((*slab)->capacity - (*slab)->cursor < size) {
 		int new_capacity = 1024;
 		while (new_capacity < size)
 			new_capacity *= 2;
-		struct slab *new_slab = malloc(sizeof new_slab[0] + new_capacity);
+		struct slab *new_slab = allocate_memory(allocator, sizeof new_slab[0] + (size_t)new_capacity);
 		new_slab->capacity = new_capacity;
 		new_slab->cursor = 0;
 		new_slab->prev = *slab;
@@ -44,6 +82,33 @@ char *copy_string(struct slab **slab, const char *string) {
 	return copy;
 }
 
+const char *string_chars(const union string *string, int length) {
+	return length <= INLINE_CAPACITY ? string->chars : string->pointer;
+}
+
+int slab_size(int length) {
+	return length <= INLINE_CAPACITY ? 0 : length + 1;
+}
+
+void store_string(struct table *table, union string *string, const char *chars, int length) {
+	if (length <= INLINE_CAPACITY)
+		memcpy(string->chars, chars, (size_t)length + 1);
+	else
+		string->pointer = copy_string(table->allocator, &table->slab, chars, length);
+}
+
+// Frees the slabs that were added after resizing, and then the slots along with the first slab.
+void free_memory(struct table *table) {
+	struct slab *slab = table->slab;
+	while (slab && slab->prev) {
+		struct slab *prev = slab->prev;
+		deallocate_memory(table->allocator, slab, sizeof slab[0] + (size_t)slab->capacity);
+		slab = prev;
+	}
+	if (table->slots)
+		deallocate_memory(table->allocator, table->slots, (size_t)table->capacity * sizeof table->slots[0] + sizeof slab[0] + (size_t)slab->capacity);
+}
+
 void resize(struct table *table, int capacity) {
 	if (capacity <= table->count)
 		capacity = table->count + 1;
@@ -52,50 +117,44 @@ void resize(struct table *table, int capacity) {
 	for (pow2 = 0; (1 << pow2) < capacity; ++pow2);
 	capacity = 1 << pow2;
 
-	int total_string_size = 0;
-	for (struct slab *slab = table->slab; slab; slab = slab->prev)
-		total_string_size += slab->cursor;
-
+	// Only live strings get copied over, so this also compacts the slab.
 	int first_slab_capacity = 1024;
-	while (first_slab_capacity < total_string_size)
+	while (first_slab_capacity < table->live_bytes)
 		first_slab_capacity *= 2;
 
-	void *new_memory = malloc(capacity * (sizeof table->keys[0] + sizeof table->vals[0]) + sizeof table->slab[0] + first_slab_capacity);
-	char **new_keys = new_memory;
-	char **new_vals = new_keys + capacity;
-	memset(new_keys, 0, (size_t)capacity * sizeof new_keys[0]);
-	struct slab *new_slab = (struct slab *)(new_vals + capacity);
+	void *new_memory = allocate_memory(table->allocator, (size_t)capacity * sizeof table->slots[0] + sizeof table->slab[0] + (size_t)first_slab_capacity);
+	struct slot *new_slots = new_memory;
+	for (int i = 0; i < capacity; ++i)
+		new_slots[i].hash = 0;
+	struct slab *new_slab = (struct slab *)(new_slots + capacity);
 	new_slab->prev = NULL;
 	new_slab->capacity = first_slab_capacity;
 	new_slab->cursor = 0;
 
 	unsigned mask = capacity - 1;
 	for (int i = 0; i < table->capacity; ++i) {
-		if ((size_t)table->keys[i] > TOMBSTONE) {
-			char *key = copy_string(&new_slab, table->keys[i]);
-			char *val = copy_string(&new_slab, table->vals[i]);
-			unsigned long long hash = hash_string(key);
-			for (unsigned j = (unsigned)hash & mask;; j = (j + 1) & mask) {
-				if (!new_keys[j]) {
-					new_keys[j] = key;
-					new_vals[j] = val;
+		struct slot *slot = &table->slots[i];
+		if (slot->hash > TOMBSTONE) {
+			for (unsigned j = (unsigned)slot->hash & mask;; j = (j + 1) & mask) {
+				if (!new_slots[j].hash) {
+					// The hash is cached so there's no need to rehash, and short strings just get copied along with the slot.
+					new_slots[j] = *slot;
+					if (slot->key_length > INLINE_CAPACITY)
+						new_slots[j].key.pointer = copy_string(table->allocator, &new_slab, slot->key.pointer, slot->key_length);
+					if (slot->val_length > INLINE_CAPACITY)
+						new_slots[j].val.pointer = copy_string(table->allocator, &new_slab, slot->val.pointer, slot->val_length);
 					break;
 				}
 			}
 		}
 	}
 
-	for (struct slab *slab = table->slab; slab && slab->prev;) {
-		struct slab *prev = slab->prev;
-		free(slab);
-		slab = prev;
-	}
-	free(table->keys); // This also frees the values, metadata, and slab.
-	table->keys = new_keys;
-	table->vals = new_vals;
+	free_memory(table);
+	table->slots = new_slots;
 	table->slab = new_slab;
 	table->capacity = capacity;
 	table->num_tombstones = 0;
+	table->dead_bytes = 0;
 }
 
 void reserve(struct table *table, int min_capacity) {
@@ -107,41 +166,67 @@ void reserve(struct table *table, int min_capacity) {
 	}
 }
 
+void collect_garbage(struct table *table) {
+	// Compact once most of the slab is dead. Compaction is O(capacity) so we also wait for at least
+	// that many dead bytes, which keeps the amortized cost per removed byte constant.
+	if (8 * table->num_tombstones > table->capacity || (table->dead_bytes > table->live_bytes && table->dead_bytes > table->capacity))
+		resize(table, table->capacity); // Get rid of tombstones and dead strings.
+}
+
 void add(struct table *table, const char *key, const char *val) {
 	reserve(table, table->count + 1);
-	unsigned long long hash = hash_string(key);
+	int key_length;
+	int val_length = (int)strlen(val);
+	unsigned long long hash = hash_string(key, &key_length);
 	unsigned mask = (unsigned)table->capacity - 1;
 	unsigned index = (unsigned)-1;
 	for (unsigned i = (unsigned)hash & mask;; i = (i + 1) & mask) {
-		if (!table->keys[i]) {
+		struct slot *slot = &table->slots[i];
+		if (!slot->hash) {
 			index = min(index, i);
 			break;
 		}
-		if (table->keys[i] == (void *)TOMBSTONE)
+		if (slot->hash == TOMBSTONE)
 			index = min(index, i);
-		else if (strcmp(table->keys[i], key) == 0) {
-			table->vals[i] = copy_string(&table->slab, val);
+		else if (slot->hash == hash && slot->key_length == key_length && memcmp(string_chars(&slot->key, key_length), key, (size_t)key_length) == 0) {
+			table->dead_bytes += slab_size(slot->val_length);
+			table->live_bytes += slab_size(val_length) - slab_size(slot->val_length);
+			slot->val_length = val_length;
+			store_string(table, &slot->val, val, val_length);
+			collect_garbage(table);
 			return;
 		}
 	}
+	struct slot *slot = &table->slots[index];
+	if (slot->hash == TOMBSTONE)
+		table->num_tombstones--;
 	table->count++;
-	table->keys[index] = copy_string(&table->slab, key);
-	table->vals[index] = copy_string(&table->slab, val);
+	slot->hash = hash;
+	slot->key_length = key_length;
+	slot->val_length = val_length;
+	table->live_bytes += slab_size(key_length) + slab_size(val_length);
+	store_string(table, &slot->key, key, key_length);
+	store_string(table, &slot->val, val, val_length);
 }
 
 void remove(struct table *table, const char *key) {
 	if (!table->count)
 		return;
 
-	unsigned long long hash = hash_string(key);
+	int key_length;
+	unsigned long long hash = hash_string(key, &key_length);
 	unsigned mask = (unsigned)table->capacity - 1;
-	for (unsigned i = (unsigned)hash & mask; table->keys[i]; i = (i + 1) & mask) {
-		if (table->keys[i] != (void *)TOMBSTONE && strcmp(table->keys[i], key) == 0) {
-			table->keys[i] = (void *)TOMBSTONE;
+	for (unsigned i = (unsigned)hash & mask; table->slots[i].hash; i = (i + 1) & mask) {
+		struct slot *slot = &table->slots[i];
+		if (slot->hash == hash && slot->key_length == key_length && memcmp(string_chars(&slot->key, key_length), key, (size_t)key_length) == 0) {
+			int size = slab_size(slot->key_length) + slab_size(slot->val_length);
+			slot->hash = TOMBSTONE;
 			table->count--;
 			table->num_tombstones++;
-			if (8 * table->num_tombstones > table->capacity)
-				resize(table, table->capacity); // Get rid of tombstones.
+			table->live_bytes -= size;
+			table->dead_bytes += size;
+			collect_garbage(table);
+			return;
 		}
 	}
 }
@@ -150,40 +235,57 @@ const char *get(struct table table, const char *key) {
 	if (!table.count)
 		return NULL;
 
-	unsigned long long hash = hash_string(key);
+	int key_length;
+	unsigned long long hash = hash_string(key, &key_length);
 	unsigned mask = (unsigned)table.capacity - 1;
-	for (unsigned i = (unsigned)hash & mask; table.keys[i]; i = (i + 1) & mask)
-		if (table.keys[i] != (void *)TOMBSTONE && strcmp(table.keys[i], key) == 0)
-			return table.vals[i];
+	for (unsigned i = (unsigned)hash & mask; table.slots[i].hash; i = (i + 1) & mask) {
+		struct slot *slot = &table.slots[i];
+		if (slot->hash == hash && slot->key_length == key_length && memcmp(string_chars(&slot->key, key_length), key, (size_t)key_length) == 0)
+			return string_chars(&slot->val, slot->val_length);
+	}
 
 	return NULL;
 }
 
+const char *key_at(struct table table, int index) {
+	return string_chars(&table.slots[index].key, table.slots[index].key_length);
+}
+
+const char *val_at(struct table table, int index) {
+	return string_chars(&table.slots[index].val, table.slots[index].val_length);
+}
+
 int first_index(struct table table) {
 	for (int i = 0; i < table.capacity; ++i)
-		if ((size_t)table.keys[i] > TOMBSTONE)
+		if (table.slots[i].hash > TOMBSTONE)
 			return i;
 	return -1;
 }
 
 int next_index(struct table table, int index) {
 	for (int i = index + 1; i < table.capacity; ++i)
-		if ((size_t)table.keys[i] > TOMBSTONE)
+		if (table.slots[i].hash > TOMBSTONE)
 			return i;
 	return -1;
 }
 
 void destroy(struct table *table) {
-	for (struct slab *slab = table->slab; slab && slab->prev;) {
-		struct slab *prev = slab->prev;
-		free(slab);
-		slab = prev;
-	}
-	free(table->keys); // This also frees the values, metadata, and slab.
+	free_memory(table);
+	const struct allocator_callbacks *allocator = table->allocator;
 	memset(table, 0, sizeof table[0]);
+	table->allocator = allocator;
 }
 
 #include <assert.h>
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
 int main(void) {
 	static char keys[1048576][9];
 	static char vals[1048576][9];
@@ -221,13 +323,13 @@ int main(void) {
 
 		int remaining[4] = { 1, 1, 1, 1 };
 		for (int i = first_index(table); i >= 0; i = next_index(table, i)) {
-			char *val = table.vals[i];
+			const char *val = val_at(table, i);
 			remaining[val[3] - '0']--;
 		}
 		assert(remaining[0] == 0 && remaining[1] == 0 && remaining[2] == 0 && remaining[3] == 0);
 
 		destroy(&table);
-		assert(!table.capacity && !table.count && !table.keys && !table.vals && !table.slab);
+		assert(!table.capacity && !table.count && !table.slots && !table.slab);
 	}
 
 	{
@@ -240,8 +342,8 @@ int main(void) {
 		for (int i = 0; i < n; ++i)
 			remaining[i] = 1;
 		for (int i = first_index(table); i >= 0; i = next_index(table, i)) {
-			char *key = table.keys[i];
-			char *val = table.vals[i];
+			const char *key = key_at(table, i);
+			const char *val = val_at(table, i);
 			assert(key[0] == 'k' && val[0] == 'v');
 			++key;
 			++val;
@@ -262,8 +364,8 @@ int main(void) {
 		for (int i = 0; i < n; ++i)
 			remaining[i] = 1;
 		for (int i = first_index(table); i >= 0; i = next_index(table, i)) {
-			char *key = table.keys[i];
-			char *val = table.vals[i];
+			const char *key = key_at(table, i);
+			const char *val = val_at(table, i);
 			assert(key[0] == 'k' && val[0] == 'v');
 			++key;
 			++val;
@@ -287,8 +389,8 @@ int main(void) {
 		for (int i = 0; i < n; ++i)
 			remaining[i] = 1;
 		for (int i = first_index(table); i >= 0; i = next_index(table, i)) {
-			char *key = table.keys[i];
-			char *val = table.vals[i];
+			const char *key = key_at(table, i);
+			const char *val = val_at(table, i);
 			assert(key[0] == 'k' && val[0] == 'v');
 			++key;
 			++val;
@@ -306,6 +408,76 @@ int main(void) {
 		destroy(&table);
 	}
 
+	{
+		// Keys and values longer than INLINE_CAPACITY go in the slab, shorter ones are stored inline.
+		const char *long_key = "Access-Control-Allow-Credentials";
+		const char *long_val = "This value is definitely too long to fit inline";
+		struct table table = { 0 };
+		add(&table, "Host", long_val);
+		add(&table, long_key, "true");
+		add(&table, "12345678901234567890123", "23 characters, fits inline");
+		add(&table, "123456789012345678901234", "24 characters, goes in the slab");
+		assert(strcmp(get(table, "Host"), long_val) == 0);
+		assert(strcmp(get(table, long_key), "true") == 0);
+		assert(strcmp(get(table, "12345678901234567890123"), "23 characters, fits inline") == 0);
+		assert(strcmp(get(table, "123456789012345678901234"), "24 characters, goes in the slab") == 0);
+		assert(!get(table, "Access-Control-Allow-Credential"));
+		assert(!get(table, "1234567890123456789012"));
+
+		add(&table, "Host", "short");
+		add(&table, long_key, long_val);
+		assert(strcmp(get(table, "Host"), "short") == 0);
+		assert(strcmp(get(table, long_key), long_val) == 0);
+
+		for (int i = 0; i < 1000; ++i) // Force a few resizes.
+			add(&table, keys[i], long_val);
+		assert(strcmp(get(table, "Host"), "short") == 0);
+		assert(strcmp(get(table, long_key), long_val) == 0);
+		assert(strcmp(get(table, "123456789012345678901234"), "24 characters, goes in the slab") == 0);
+		for (int i = 0; i < 1000; ++i)
+			assert(strcmp(get(table, keys[i]), long_val) == 0);
+
+		remove(&table, long_key);
+		assert(!get(table, long_key));
+		assert(table.count == 1003);
+		destroy(&table);
+	}
+
+	{
+		// Overwriting and removing long strings shouldn't grow the slab forever.
+		const char *long_vals[2] = {
+			"This value is definitely too long to fit inline",
+			"And so is this one, it also needs to go in the slab",
+		};
+		int long_size = 1 + (int)strlen(long_vals[0]);
+		struct table table = { 0 };
+		add(&table, "Key", long_vals[0]);
+		assert(table.live_bytes == long_size && table.dead_bytes == 0);
+		add(&table, "Key", "short");
+		assert(table.live_bytes == 0 && table.dead_bytes == long_size);
+
+		for (int i = 0; i < 1000000; ++i) {
+			add(&table, "Key", long_vals[i % 2]);
+			add(&table, keys[i % 100], long_vals[i % 2]);
+			if (i % 3 == 0)
+				remove(&table, keys[i % 100]);
+		}
+		assert(strcmp(get(table, "Key"), long_vals[1]) == 0);
+
+		int expected_live = 0;
+		for (int i = first_index(table); i >= 0; i = next_index(table, i))
+			expected_live += 1 + (int)strlen(val_at(table, i));
+		assert(table.live_bytes == expected_live);
+		assert(table.dead_bytes <= table.live_bytes || table.dead_bytes <= table.capacity);
+
+		int total_slab_bytes = 0;
+		for (struct slab *slab = table.slab; slab; slab = slab->prev)
+			total_slab_bytes += slab->cursor;
+		assert(total_slab_bytes == table.live_bytes + table.dead_bytes);
+		assert(total_slab_bytes < 64 * 1024);
+		destroy(&table);
+	}
+
 	{
 		// Potential pathological case: create a bunch of items and then delete them 
 		// to leave tombstones, then lookup each item. If we don't clean tombstones this is O(n^2).
@@ -321,6 +493,28 @@ int main(void) {
 		destroy(&table);
 	}
 
+	{
+		// Long strings make extra slabs on top of the slots, and overwriting them makes the table
+		// compact itself. All of it goes back with the size it was allocated with.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct table table = { 0 };
+		table.allocator = &callbacks;
+		const char *long_val = "This value is definitely too long to fit inline";
+		for (int i = 0; i < 10000; ++i)
+			add(&table, keys[i], long_val);
+		assert(allocated > (size_t)table.capacity * sizeof table.slots[0] + 10000 * strlen(long_val));
+		for (int round = 0; round < 3; ++round)
+			for (int i = 0; i < 10000; ++i)
+				add(&table, keys[i], i % 2 ? vals[i] : long_val);
+		for (int i = 0; i < 5000; ++i)
+			remove(&table, keys[i]);
+		for (int i = 0; i < 10000; ++i)
+			assert(i < 5000 ? !get(table, keys[i]) : strcmp(get(table, keys[i]), i % 2 ? vals[i] : long_val) == 0);
+		destroy(&table);
+		assert(!allocated && table.allocator == &callbacks);
+	}
+
 	{
 		// This shouldn't leak.
 		for (int i = 0; i < 10000; ++i) {
@@ -0,0 +1,1009 @@
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy, memmove, memset, strlen
+#include <stdint.h> // uintptr_t
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// String to string map that keeps its keys in order, for when string_table.c isn't enough: it can
+// find the longest key that is a prefix of a string (routing "/api/users/42" to "/api/users/") and
+// enumerate all keys that start with a prefix. It's an adaptive radix tree, see "The Adaptive Radix
+// Tree: ARTful Indexing for Main-Memory Databases" by Leis et al. Inner nodes branch on one byte and
+// come in four sizes (4, 16, 48 and 256 children) so sparse nodes stay small, and chains of nodes with
+// a single child are collapsed into a prefix stored in the node below. Lookups never hash or compare
+// the whole key until they reach a leaf.
+//
+// Keys include their null terminator, so no key is a prefix of another and every key ends in a leaf.
+// Leaves hold the key inline and point to the value, and both live in a slab like in string_table.c.
+
+// Where the nodes and slabs come from, the same callbacks as hash_table.c.
+struct allocator_callbacks {
+	void *(*allocate)(void *context, size_t size, int alignment);
+	void (*deallocate)(void *context, void *block, size_t size);
+	void *(*reallocate)(void *context, void *block, size_t old_size, size_t new_size, int alignment); // Optional.
+	void *context;
+};
+
+void *allocate_memory(const struct allocator_callbacks *allocator, size_t size) {
+	return allocator ? allocator->allocate(allocator->context, size, 16) : malloc(size);
+}
+
+void deallocate_memory(const struct allocator_callbacks *allocator, void *block, size_t size) {
+	if (!allocator)
+		free(block);
+	else if (block && allocator->deallocate)
+		allocator->deallocate(allocator->context, block, size);
+}
+
+#define MAX_PREFIX_LENGTH 10 // Longer prefixes only store this many bytes, the rest is read from a leaf.
+
+enum { NODE4, NODE16, NODE48, NODE256 };
+
+struct node {
+	unsigned char type;
+	unsigned short num_children;
+	int prefix_length;
+	unsigned char prefix[MAX_PREFIX_LENGTH];
+};
+
+// Children are either nodes or leaves with the lowest bit of the pointer set.
+struct node4 {
+	struct node node;
+	unsigned char keys[4]; // Sorted.
+	void *children[4];
+};
+
+struct node16 {
+	struct node node;
+	unsigned char keys[16]; // Sorted.
+	void *children[16];
+};
+
+struct node48 {
+	struct node node;
+	unsigned char child_index[256]; // 0 if there's no child, otherwise its index + 1.
+	void *children[48];
+};
+
+struct node256 {
+	struct node node;
+	void *children[256];
+};
+
+struct leaf {
+	const char *val; // In the slab.
+	int key_length;
+	int val_length;
+	char key[]; // Null terminated.
+};
+
+struct trie {
+	void *root;
+	struct slab *slab;
+	int count;
+	int node_bytes; // Memory used by inner nodes.
+	int live_bytes; // Slab bytes used by leaves and values still in the trie.
+	int dead_bytes; // Slab bytes used by leaves and values that were removed or overwritten.
+	const struct allocator_callbacks *allocator; // Set before adding anything, NULL means malloc.
+};
+
+struct slab {
+	struct slab *prev;
+	int cursor;
+	int capacity;
+	// Memory comes right after this.
+};
+
+int count_trailing_zeros(unsigned x) {
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+int is_leaf(const void *child) {
+	return (uintptr_t)child & 1;
+}
+
+struct leaf *as_leaf(const void *child) {
+	return (struct leaf *)((uintptr_t)child - 1);
+}
+
+void *tag_leaf(struct leaf *leaf) {
+	return (char *)leaf + 1;
+}
+
+// Sizes in the slab are rounded up so that leaves stay aligned.
+int slab_size(int length) {
+	return (length + 1 + 7) & ~7;
+}
+
+int leaf_size(int key_length) {
+	return (int)sizeof(struct leaf) + slab_size(key_length);
+}
+
+char *allocate_bytes(const struct allocator_callbacks *allocator, struct slab **slab, int size) {
+	if (!*slab || (*slab)->capacity - (*slab)->cursor < size) {
+		int new_capacity = 1024;
+		if (*slab && (*slab)->capacity < 64 * 1024)
+			new_capacity = 2 * (*slab)->capacity;
+		else if (*slab)
+			new_capacity = (*slab)->capacity;
+		while (new_capacity < size)
+			new_capacity *= 2;
+		struct slab *new_slab = allocate_memory(allocator, sizeof new_slab[0] + (size_t)new_capacity);
+		new_slab->capacity = new_capacity;
+		new_slab->cursor = 0;
+		new_slab->prev = *slab;
+		*slab = new_slab;
+	}
+	char *memory = (char *)(*slab + 1) + (*slab)->cursor;
+	(*slab)->cursor += size;
+	return memory;
+}
+
+const char *copy_val(const struct allocator_callbacks *allocator, struct slab **slab, const char *val, int val_length) {
+	char *copy = allocate_bytes(allocator, slab, slab_size(val_length));
+	memcpy(copy, val, (size_t)val_length + 1);
+	return copy;
+}
+
+struct leaf *copy_leaf(const struct allocator_callbacks *allocator, struct slab **slab, const char *key, int key_length, const char *val, int val_length) {
+	struct leaf *leaf = (struct leaf *)allocate_bytes(allocator, slab, leaf_size(key_length));
+	leaf->key_length = key_length;
+	leaf->val_length = val_length;
+	memcpy(leaf->key, key, (size_t)key_length + 1);
+	leaf->val = copy_val(allocator, slab, val, val_length);
+	return leaf;
+}
+
+void free_slabs(const struct allocator_callbacks *allocator, struct slab *slab) {
+	while (slab) {
+		struct slab *prev = slab->prev;
+		deallocate_memory(allocator, slab, sizeof slab[0] + (size_t)slab->capacity);
+		slab = prev;
+	}
+}
+
+int node_size(int type) {
+	switch (type) {
+	case NODE4: return sizeof(struct node4);
+	case NODE16: return sizeof(struct node16);
+	case NODE48: return sizeof(struct node48);
+	default: return sizeof(struct node256);
+	}
+}
+
+struct node *new_node(struct trie *trie, int type) {
+	struct node *node = allocate_memory(trie->allocator, (size_t)node_size(type));
+	memset(node, 0, (size_t)node_size(type));
+	node->type = (unsigned char)type;
+	trie->node_bytes += node_size(type);
+	return node;
+}
+
+// Makes a node of a different size with the same prefix, without children.
+struct node *replace_node(struct trie *trie, const struct node *node, int type) {
+	struct node *new = new_node(trie, type);
+	new->prefix_length = node->prefix_length;
+	memcpy(new->prefix, node->prefix, sizeof node->prefix);
+	return new;
+}
+
+void free_node(struct trie *trie, struct node *node) {
+	trie->node_bytes -= node_size(node->type);
+	deallocate_memory(trie->allocator, node, (size_t)node_size(node->type));
+}
+
+// The sorted keys and children of a node4 or node16.
+unsigned char *small_keys(struct node *node) {
+	return node->type == NODE4 ? ((struct node4 *)node)->keys : ((struct node16 *)node)->keys;
+}
+
+void **small_children(struct node *node) {
+	return node->type == NODE4 ? ((struct node4 *)node)->children : ((struct node16 *)node)->children;
+}
+
+int find_byte16(const unsigned char keys[16], int count, unsigned char byte) {
+#ifdef HAVE_SSE2
+	__m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128((const __m128i *)keys));
+	unsigned mask = (unsigned)_mm_movemask_epi8(matches) & ((1u << count) - 1);
+	return mask ? count_trailing_zeros(mask) : -1;
+#else
+	for (int i = 0; i < count; ++i)
+		if (keys[i] == byte)
+			return i;
+	return -1;
+#endif
+}
+
+void **find_child(struct node *node, unsigned char byte) {
+	switch (node->type) {
+	case NODE4: {
+		struct node4 *node4 = (struct node4 *)node;
+		for (int i = 0; i < node->num_children; ++i)
+			if (node4->keys[i] == byte)
+				return &node4->children[i];
+		return NULL;
+	}
+	case NODE16: {
+		struct node16 *node16 = (struct node16 *)node;
+		int i = find_byte16(node16->keys, node->num_children, byte);
+		return i < 0 ? NULL : &node16->children[i];
+	}
+	case NODE48: {
+		struct node48 *node48 = (struct node48 *)node;
+		int i = node48->child_index[byte];
+		return i ? &node48->children[i - 1] : NULL;
+	}
+	default: {
+		struct node256 *node256 = (struct node256 *)node;
+		return node256->children[byte] ? &node256->children[byte] : NULL;
+	}
+	}
+}
+
+const struct leaf *minimum_leaf(const void *child) {
+	while (!is_leaf(child)) {
+		struct node *node = (struct node *)child;
+		if (node->type == NODE4 || node->type == NODE16)
+			child = small_children(node)[0];
+		else if (node->type == NODE48) {
+			struct node48 *node48 = (struct node48 *)node;
+			int i = 0;
+			while (!node48->child_index[i])
+				++i;
+			child = node48->children[node48->child_index[i] - 1];
+		} else {
+			struct node256 *node256 = (struct node256 *)node;
+			int i = 0;
+			while (!node256->children[i])
+				++i;
+			child = node256->children[i];
+		}
+	}
+	return as_leaf(child);
+}
+
+// Returns how many bytes of the node's prefix match the key from depth, up to the end of the key.
+int prefix_mismatch(const struct node *node, const char *key, int size, int depth) {
+	int max = node->prefix_length < size - depth ? node->prefix_length : size - depth;
+	int i = 0;
+	for (; i < max && i < MAX_PREFIX_LENGTH; ++i)
+		if (node->prefix[i] != (unsigned char)key[depth + i])
+			return i;
+	if (i < max) {
+		const struct leaf *leaf = minimum_leaf(node);
+		for (; i < max; ++i)
+			if (leaf->key[depth + i] != key[depth + i])
+				return i;
+	}
+	return i;
+}
+
+// Only checks the stored bytes of the prefix, so callers must compare the whole key once they reach a leaf.
+int prefix_matches(const struct node *node, const char *key, int size, int depth) {
+	if (depth + node->prefix_length >= size)
+		return 0;
+	int length = node->prefix_length < MAX_PREFIX_LENGTH ? node->prefix_length : MAX_PREFIX_LENGTH;
+	return memcmp(node->prefix, key + depth, (size_t)length) == 0;
+}
+
+int leaf_matches(const struct leaf *leaf, const char *key, int key_length) {
+	return leaf->key_length == key_length && memcmp(leaf->key, key, (size_t)key_length) == 0;
+}
+
+void add_child(struct trie *trie, void **ref, unsigned char byte, void *child) {
+	struct node *node = *ref;
+	if (node->type == NODE4 || node->type == NODE16) {
+		int n = node->num_children;
+		unsigned char *keys = small_keys(node);
+		void **children = small_children(node);
+		if (n < (node->type == NODE4 ? 4 : 16)) {
+			int i = 0;
+			while (i < n && keys[i] < byte)
+				++i;
+			memmove(keys + i + 1, keys + i, (size_t)(n - i));
+			memmove(children + i + 1, children + i, (size_t)(n - i) * sizeof children[0]);
+			keys[i] = byte;
+			children[i] = child;
+			node->num_children++;
+			return;
+		}
+		struct node *grown = replace_node(trie, node, node->type == NODE4 ? NODE16 : NODE48);
+		grown->num_children = (unsigned short)n;
+		if (grown->type == NODE16) {
+			memcpy(((struct node16 *)grown)->keys, keys, (size_t)n);
+			memcpy(((struct node16 *)grown)->children, children, (size_t)n * sizeof children[0]);
+		} else {
+			struct node48 *node48 = (struct node48 *)grown;
+			for (int i = 0; i < n; ++i) {
+				node48->child_index[keys[i]] = (unsigned char)(i + 1);
+				node48->children[i] = children[i];
+			}
+		}
+		free_node(trie, node);
+		*ref = grown;
+		add_child(trie, ref, byte, child);
+	} else if (node->type == NODE48) {
+		struct node48 *node48 = (struct node48 *)node;
+		if (node->num_children < 48) {
+			int i = 0;
+			while (node48->children[i])
+				++i;
+			node48->children[i] = child;
+			node48->child_index[byte] = (unsigned char)(i + 1);
+			node->num_children++;
+			return;
+		}
+		struct node256 *node256 = (struct node256 *)replace_node(trie, node, NODE256);
+		node256->node.num_children = 48;
+		for (int i = 0; i < 256; ++i)
+			if (node48->child_index[i])
+				node256->children[i] = node48->children[node48->child_index[i] - 1];
+		free_node(trie, node);
+		*ref = node256;
+		add_child(trie, ref, byte, child);
+	} else {
+		((struct node256 *)node)->children[byte] = child;
+		node->num_children++;
+	}
+}
+
+// Removes the child from the node, and shrinks the node if it's getting empty. Node sizes only
+// shrink some way below where they grow, so adding and removing the same key doesn't thrash.
+void remove_child(struct trie *trie, void **ref, unsigned char byte, void **child) {
+	struct node *node = *ref;
+	if (node->type == NODE4 || node->type == NODE16) {
+		unsigned char *keys = small_keys(node);
+		void **children = small_children(node);
+		int i = (int)(child - children);
+		int n = --node->num_children;
+		memmove(keys + i, keys + i + 1, (size_t)(n - i));
+		memmove(children + i, children + i + 1, (size_t)(n - i) * sizeof children[0]);
+		if (node->type == NODE16 && n == 3) {
+			struct node4 *node4 = (struct node4 *)replace_node(trie, node, NODE4);
+			node4->node.num_children = (unsigned short)n;
+			memcpy(node4->keys, keys, (size_t)n);
+			memcpy(node4->children, children, (size_t)n * sizeof children[0]);
+			free_node(trie, node);
+			*ref = node4;
+		} else if (node->type == NODE4 && n == 1) {
+			// Collapse the node into its only child, whose prefix becomes ours + the child's byte + its own.
+			void *only = children[0];
+			if (!is_leaf(only)) {
+				struct node *below = only;
+				int length = node->prefix_length;
+				if (length < MAX_PREFIX_LENGTH)
+					node->prefix[length++] = keys[0];
+				if (length < MAX_PREFIX_LENGTH) {
+					int remaining = MAX_PREFIX_LENGTH - length;
+					memcpy(node->prefix + length, below->prefix, (size_t)(below->prefix_length < remaining ? below->prefix_length : remaining));
+				}
+				below->prefix_length += node->prefix_length + 1;
+				memcpy(below->prefix, node->prefix, MAX_PREFIX_LENGTH);
+			}
+			free_node(trie, node);
+			*ref = only;
+		}
+	} else if (node->type == NODE48) {
+		struct node48 *node48 = (struct node48 *)node;
+		node48->children[node48->child_index[byte] - 1] = NULL;
+		node48->child_index[byte] = 0;
+		if (--node->num_children == 12) {
+			struct node16 *node16 = (struct node16 *)replace_node(trie, node, NODE16);
+			int n = 0;
+			for (int i = 0; i < 256; ++i) {
+				if (node48->child_index[i]) {
+					node16->keys[n] = (unsigned char)i;
+					node16->children[n++] = node48->children[node48->child_index[i] - 1];
+				}
+			}
+			node16->node.num_children = (unsigned short)n;
+			free_node(trie, node);
+			*ref = node16;
+		}
+	} else {
+		struct node256 *node256 = (struct node256 *)node;
+		node256->children[byte] = NULL;
+		if (--node->num_children == 37) {
+			struct node48 *node48 = (struct node48 *)replace_node(trie, node, NODE48);
+			int n = 0;
+			for (int i = 0; i < 256; ++i) {
+				if (node256->children[i]) {
+					node48->children[n] = node256->children[i];
+					node48->child_index[i] = (unsigned char)++n;
+				}
+			}
+			node48->node.num_children = (unsigned short)n;
+			free_node(trie, node);
+			*ref = node48;
+		}
+	}
+}
+
+void *new_leaf(struct trie *trie, const char *key, int key_length, const char *val, int val_length) {
+	trie->count++;
+	trie->live_bytes += leaf_size(key_length) + slab_size(val_length);
+	return tag_leaf(copy_leaf(trie->allocator, &trie->slab, key, key_length, val, val_length));
+}
+
+void insert(struct trie *trie, void **ref, const char *key, int key_length, int depth, const char *val, int val_length) {
+	int size = key_length + 1;
+	if (!*ref) {
+		*ref = new_leaf(trie, key, key_length, val, val_length);
+		return;
+	}
+
+	if (is_leaf(*ref)) {
+		struct leaf *leaf = as_leaf(*ref);
+		if (leaf_matches(leaf, key, key_length)) {
+			trie->dead_bytes += slab_size(leaf->val_length);
+			trie->live_bytes += slab_size(val_length) - slab_size(leaf->val_length);
+			leaf->val = copy_val(trie->allocator, &trie->slab, val, val_length);
+			leaf->val_length = val_length;
+			return;
+		}
+		// Both keys are null terminated and different, so they differ at or before the end of the shorter one.
+		int i = depth;
+		while (leaf->key[i] == key[i])
+			++i;
+		struct node *node = new_node(trie, NODE4);
+		node->prefix_length = i - depth;
+		memcpy(node->prefix, key + depth, (size_t)(i - depth < MAX_PREFIX_LENGTH ? i - depth : MAX_PREFIX_LENGTH));
+		void *old = *ref;
+		*ref = node;
+		add_child(trie, ref, (unsigned char)leaf->key[i], old);
+		add_child(trie, ref, (unsigned char)key[i], new_leaf(trie, key, key_length, val, val_length));
+		return;
+	}
+
+	struct node *node = *ref;
+	if (node->prefix_length) {
+		int matched = prefix_mismatch(node, key, size, depth);
+		if (matched < node->prefix_length) {
+			// Split the prefix, with a new node for the part that matched.
+			struct node *parent = new_node(trie, NODE4);
+			parent->prefix_length = matched;
+			memcpy(parent->prefix, node->prefix, (size_t)(matched < MAX_PREFIX_LENGTH ? matched : MAX_PREFIX_LENGTH));
+			unsigned char byte;
+			if (node->prefix_length <= MAX_PREFIX_LENGTH) {
+				byte = node->prefix[matched];
+				node->prefix_length -= matched + 1;
+				memmove(node->prefix, node->prefix + matched + 1, (size_t)node->prefix_length);
+			} else {
+				const struct leaf *leaf = minimum_leaf(node);
+				byte = (unsigned char)leaf->key[depth + matched];
+				node->prefix_length -= matched + 1;
+				memcpy(node->prefix, leaf->key + depth + matched + 1, (size_t)(node->prefix_length < MAX_PREFIX_LENGTH ? node->prefix_length : MAX_PREFIX_LENGTH));
+			}
+			*ref = parent;
+			add_child(trie, ref, byte, node);
+			add_child(trie, ref, (unsigned char)key[depth + matched], new_leaf(trie, key, key_length, val, val_length));
+			return;
+		}
+		depth += node->prefix_length;
+	}
+
+	unsigned char byte = (unsigned char)key[depth];
+	void **child = find_child(node, byte);
+	if (child)
+		insert(trie, child, key, key_length, depth + 1, val, val_length);
+	else
+		add_child(trie, ref, byte, new_leaf(trie, key, key_length, val, val_length));
+}
+
+void move_leaves(const struct allocator_callbacks *allocator, void **ref, struct slab **slab) {
+	if (is_leaf(*ref)) {
+		const struct leaf *leaf = as_leaf(*ref);
+		*ref = tag_leaf(copy_leaf(allocator, slab, leaf->key, leaf->key_length, leaf->val, leaf->val_length));
+		return;
+	}
+	struct node *node = *ref;
+	if (node->type == NODE4 || node->type == NODE16) {
+		for (int i = 0; i < node->num_children; ++i)
+			move_leaves(allocator, &small_children(node)[i], slab);
+	} else {
+		void **children = node->type == NODE48 ? ((struct node48 *)node)->children : ((struct node256 *)node)->children;
+		for (int i = 0; i < (node->type == NODE48 ? 48 : 256); ++i)
+			if (children[i])
+				move_leaves(allocator, &children[i], slab);
+	}
+}
+
+void collect_garbage(struct trie *trie) {
+	// Copy the live leaves to a new slab once most of it is dead, like string_table.c does when it resizes.
+	if (trie->dead_bytes > trie->live_bytes && trie->dead_bytes > 4096) {
+		struct slab *slab = NULL;
+		if (trie->root)
+			move_leaves(trie->allocator, &trie->root, &slab);
+		free_slabs(trie->allocator, trie->slab);
+		trie->slab = slab;
+		trie->dead_bytes = 0;
+	}
+}
+
+void add(struct trie *trie, const char *key, const char *val) {
+	insert(trie, &trie->root, key, (int)strlen(key), 0, val, (int)strlen(val));
+	collect_garbage(trie);
+}
+
+void remove(struct trie *trie, const char *key) {
+	int key_length = (int)strlen(key);
+	int size = key_length + 1;
+	void **ref = &trie->root;
+	struct leaf *leaf = NULL;
+	if (!*ref)
+		return;
+	if (is_leaf(*ref)) {
+		leaf = as_leaf(*ref);
+		if (!leaf_matches(leaf, key, key_length))
+			return;
+		*ref = NULL;
+	} else {
+		for (int depth = 0;;) {
+			struct node *node = *ref;
+			if (node->prefix_length) {
+				if (!prefix_matches(node, key, size, depth))
+					return;
+				depth += node->prefix_length;
+			}
+			unsigned char byte = (unsigned char)key[depth];
+			void **child = find_child(node, byte);
+			if (!child)
+				return;
+			if (is_leaf(*child)) {
+				leaf = as_leaf(*child);
+				if (!leaf_matches(leaf, key, key_length))
+					return;
+				remove_child(trie, ref, byte, child);
+				break;
+			}
+			ref = child;
+			depth++;
+		}
+	}
+	int size_in_slab = leaf_size(leaf->key_length) + slab_size(leaf->val_length);
+	trie->count--;
+	trie->live_bytes -= size_in_slab;
+	trie->dead_bytes += size_in_slab;
+	collect_garbage(trie);
+}
+
+const char *get(struct trie trie, const char *key) {
+	int key_length = (int)strlen(key);
+	int size = key_length + 1;
+	void *child = trie.root;
+	for (int depth = 0; child && !is_leaf(child); ++depth) {
+		struct node *node = child;
+		if (node->prefix_length) {
+			if (!prefix_matches(node, key, size, depth))
+				return NULL;
+			depth += node->prefix_length;
+		}
+		void **next = find_child(node, (unsigned char)key[depth]);
+		child = next ? *next : NULL;
+	}
+	if (child && leaf_matches(as_leaf(child), key, key_length))
+		return as_leaf(child)->val;
+	return NULL;
+}
+
+int leaf_is_prefix(const struct leaf *leaf, const char *string, int length) {
+	return leaf->key_length <= length && memcmp(leaf->key, string, (size_t)leaf->key_length) == 0;
+}
+
+// Returns the value of the longest key that the string starts with, or NULL if there is none. If
+// key_length isn't NULL it's set to the length of that key.
+const char *longest_prefix(struct trie trie, const char *string, int *key_length) {
+	int length = (int)strlen(string);
+	const struct leaf *best = NULL;
+	void *child = trie.root;
+	for (int depth = 0; child && !is_leaf(child); ++depth) {
+		struct node *node = child;
+		if (node->prefix_length) {
+			if (!prefix_matches(node, string, length + 1, depth)) {
+				child = NULL;
+				break;
+			}
+			depth += node->prefix_length;
+		}
+		// A key that ends here is under the null terminator, and it's longer than any we've seen so far.
+		void **terminator = find_child(node, 0);
+		if (terminator && leaf_is_prefix(as_leaf(*terminator), string, length))
+			best = as_leaf(*terminator);
+		void **next = depth < length ? find_child(node, (unsigned char)string[depth]) : NULL;
+		child = next ? *next : NULL;
+	}
+	if (child && leaf_is_prefix(as_leaf(child), string, length))
+		best = as_leaf(child);
+	if (key_length)
+		*key_length = best ? best->key_length : 0;
+	return best ? best->val : NULL;
+}
+
+int visit_subtree(const void *child, int(*visitor)(void *context, const char *key, const char *val), void *context) {
+	if (is_leaf(child))
+		return visitor(context, as_leaf(child)->key, as_leaf(child)->val);
+	struct node *node = (struct node *)child;
+	if (node->type == NODE4 || node->type == NODE16) {
+		for (int i = 0; i < node->num_children; ++i)
+			if (visit_subtree(small_children(node)[i], visitor, context))
+				return 1;
+	} else if (node->type == NODE48) {
+		struct node48 *node48 = (struct node48 *)node;
+		for (int i = 0; i < 256; ++i)
+			if (node48->child_index[i] && visit_subtree(node48->children[node48->child_index[i] - 1], visitor, context))
+				return 1;
+	} else {
+		struct node256 *node256 = (struct node256 *)node;
+		for (int i = 0; i < 256; ++i)
+			if (node256->children[i] && visit_subtree(node256->children[i], visitor, context))
+				return 1;
+	}
+	return 0;
+}
+
+// Calls the visitor for every key that starts with the prefix, in strcmp order. If the visitor
+// returns nonzero it stops there.
+void visit_prefix(struct trie trie, const char *prefix, int(*visitor)(void *context, const char *key, const char *val), void *context) {
+	int length = (int)strlen(prefix);
+	void *child = trie.root;
+	for (int depth = 0; child && !is_leaf(child); ++depth) {
+		struct node *node = child;
+		if (node->prefix_length) {
+			int matched = prefix_mismatch(node, prefix, length, depth);
+			if (depth + matched == length)
+				break; // The prefix ends inside the node's prefix, so everything below matches.
+			if (matched < node->prefix_length)
+				return;
+			depth += node->prefix_length;
+		}
+		if (depth == length)
+			break;
+		void **next = find_child(node, (unsigned char)prefix[depth]);
+		child = next ? *next : NULL;
+	}
+	if (!child || (is_leaf(child) && memcmp(as_leaf(child)->key, prefix, (size_t)length) != 0))
+		return;
+	visit_subtree(child, visitor, context);
+}
+
+void free_subtree(struct trie *trie, void *child) {
+	if (is_leaf(child))
+		return;
+	struct node *node = child;
+	if (node->type == NODE4 || node->type == NODE16) {
+		for (int i = 0; i < node->num_children; ++i)
+			free_subtree(trie, small_children(node)[i]);
+	} else {
+		void **children = node->type == NODE48 ? ((struct node48 *)node)->children : ((struct node256 *)node)->children;
+		for (int i = 0; i < (node->type == NODE48 ? 48 : 256); ++i)
+			if (children[i])
+				free_subtree(trie, children[i]);
+	}
+	free_node(trie, node);
+}
+
+void destroy(struct trie *trie) {
+	if (trie->root)
+		free_subtree(trie, trie->root);
+	free_slabs(trie->allocator, trie->slab);
+	const struct allocator_callbacks *allocator = trie->allocator;
+	memset(trie, 0, sizeof trie[0]);
+	trie->allocator = allocator;
+}
+
+#include <assert.h>
+struct collected {
+	const char *keys[64];
+	int count;
+	int limit;
+};
+int collect(void *context, const char *key, const char *val) {
+	struct collected *collected = context;
+	(void)val;
+	collected->keys[collected->count++] = key;
+	return collected->count == collected->limit;
+}
+struct ordered {
+	const char *previous;
+	int count;
+};
+int check_order(void *context, const char *key, const char *val) {
+	struct ordered *ordered = context;
+	(void)val;
+	assert(!ordered->previous || strcmp(ordered->previous, key) < 0);
+	ordered->previous = key;
+	ordered->count++;
+	return 0;
+}
+void *counting_allocate(void *context, size_t size, int alignment) {
+	(void)alignment;
+	*(size_t *)context += size;
+	return malloc(size);
+}
+void counting_deallocate(void *context, void *block, size_t size) {
+	*(size_t *)context -= size;
+	free(block);
+}
+int main(void) {
+	{
+		struct trie trie = { 0 };
+		assert(!get(trie, ""));
+		assert(!get(trie, "a"));
+		assert(!longest_prefix(trie, "a", NULL));
+		struct collected collected = { 0 };
+		visit_prefix(trie, "", collect, &collected);
+		assert(!collected.count);
+		remove(&trie, "a");
+		destroy(&trie);
+	}
+
+	{
+		struct trie trie = { 0 };
+		add(&trie, "a", "1");
+		assert(strcmp(get(trie, "a"), "1") == 0);
+		add(&trie, "ab", "2");
+		add(&trie, "", "0");
+		add(&trie, "abc", "3");
+		add(&trie, "b", "4");
+		assert(trie.count == 5);
+		assert(strcmp(get(trie, ""), "0") == 0);
+		assert(strcmp(get(trie, "a"), "1") == 0);
+		assert(strcmp(get(trie, "ab"), "2") == 0);
+		assert(strcmp(get(trie, "abc"), "3") == 0);
+		assert(strcmp(get(trie, "b"), "4") == 0);
+		assert(!get(trie, "abcd") && !get(trie, "c") && !get(trie, "ba"));
+		add(&trie, "ab", "two");
+		assert(trie.count == 5 && strcmp(get(trie, "ab"), "two") == 0);
+
+		remove(&trie, "ab");
+		assert(trie.count == 4 && !get(trie, "ab"));
+		assert(strcmp(get(trie, "abc"), "3") == 0);
+		remove(&trie, "ab");
+		remove(&trie, "abcd");
+		assert(trie.count == 4);
+		remove(&trie, "");
+		remove(&trie, "a");
+		remove(&trie, "abc");
+		remove(&trie, "b");
+		assert(!trie.count && !trie.root && !trie.node_bytes);
+		destroy(&trie);
+	}
+
+	{
+		// Routing, with prefixes longer than what fits in a node.
+		struct trie trie = { 0 };
+		add(&trie, "/", "root");
+		add(&trie, "/api/", "api");
+		add(&trie, "/api/v1/organizations/", "organizations");
+		add(&trie, "/api/v1/organizations/settings/", "settings");
+		add(&trie, "/api/v1/users/", "users");
+		add(&trie, "/static/", "static");
+		int length;
+		assert(strcmp(longest_prefix(trie, "/api/v1/users/42", &length), "users") == 0 && length == 14);
+		assert(strcmp(longest_prefix(trie, "/api/v1/users/", &length), "users") == 0 && length == 14);
+		assert(strcmp(longest_prefix(trie, "/api/v1/users", &length), "api") == 0 && length == 5);
+		assert(strcmp(longest_prefix(trie, "/api/v1/organizations/settings/billing", NULL), "settings") == 0);
+		assert(strcmp(longest_prefix(trie, "/api/v1/organizations/setting", NULL), "organizations") == 0);
+		assert(strcmp(longest_prefix(trie, "/api/v2/organizations/", NULL), "api") == 0);
+		assert(strcmp(longest_prefix(trie, "/index.html", NULL), "root") == 0);
+		assert(strcmp(longest_prefix(trie, "/static/app.js", NULL), "static") == 0);
+		assert(!longest_prefix(trie, "api/", &length) && length == 0);
+		assert(!longest_prefix(trie, "", NULL));
+
+		struct collected collected = { 0 };
+		visit_prefix(trie, "/api/v1/", collect, &collected);
+		assert(collected.count == 3);
+		assert(strcmp(collected.keys[0], "/api/v1/organizations/") == 0);
+		assert(strcmp(collected.keys[1], "/api/v1/organizations/settings/") == 0);
+		assert(strcmp(collected.keys[2], "/api/v1/users/") == 0);
+		collected.count = 0;
+		visit_prefix(trie, "/api/v1/org", collect, &collected); // Ends in the middle of a long prefix.
+		assert(collected.count == 2);
+		collected.count = 0;
+		visit_prefix(trie, "/api/v1/orgs", collect, &collected);
+		assert(collected.count == 0);
+		visit_prefix(trie, "/static/", collect, &collected);
+		assert(collected.count == 1 && strcmp(collected.keys[0], "/static/") == 0);
+		collected.count = 0;
+		collected.limit = 2;
+		visit_prefix(trie, "", collect, &collected);
+		assert(collected.count == 2 && strcmp(collected.keys[0], "/") == 0 && strcmp(collected.keys[1], "/api/") == 0);
+
+		// Splitting and collapsing long prefixes.
+		remove(&trie, "/api/v1/users/");
+		assert(strcmp(longest_prefix(trie, "/api/v1/users/42", NULL), "api") == 0);
+		assert(strcmp(get(trie, "/api/v1/organizations/settings/"), "settings") == 0);
+		add(&trie, "/api/v1/organizations/settings/x", "x");
+		remove(&trie, "/api/v1/organizations/");
+		remove(&trie, "/api/");
+		assert(strcmp(get(trie, "/api/v1/organizations/settings/x"), "x") == 0);
+		assert(strcmp(longest_prefix(trie, "/api/v1/organizations/settings/y", NULL), "settings") == 0);
+		assert(trie.count == 4);
+		destroy(&trie);
+	}
+
+	{
+		// Every node size, growing and shrinking.
+		struct trie trie = { 0 };
+		char key[3] = { 'x', 0, 0 };
+		for (int i = 1; i < 256; ++i) {
+			key[1] = (char)i;
+			add(&trie, key, key);
+		}
+		assert(trie.count == 255);
+		for (int i = 1; i < 256; ++i) {
+			key[1] = (char)i;
+			assert(strcmp(get(trie, key), key) == 0);
+		}
+		struct ordered ordered = { 0 };
+		visit_prefix(trie, "x", check_order, &ordered);
+		assert(ordered.count == 255);
+		for (int i = 255; i > 0; --i) {
+			key[1] = (char)i;
+			remove(&trie, key);
+			assert(!get(trie, key));
+			if (i > 1) {
+				key[1] = (char)(i - 1);
+				assert(strcmp(get(trie, key), key) == 0);
+			}
+		}
+		assert(!trie.count && !trie.root && !trie.node_bytes);
+		destroy(&trie);
+	}
+
+	{
+		static char keys[200000][12];
+		int n = sizeof keys / sizeof keys[0];
+		for (int i = 0; i < n; ++i) {
+			// Sparse at the top and dense at the bottom, like paths.
+			int x = i;
+			keys[i][0] = '/';
+			keys[i][1] = (char)('a' + x % 7);
+			keys[i][2] = '/';
+			for (int j = 0; j < 6; ++j) {
+				keys[i][8 - j] = (char)('0' + x % 10);
+				x /= 10;
+			}
+			keys[i][9] = 0;
+		}
+		struct trie trie = { 0 };
+		for (int i = 0; i < n; ++i)
+			add(&trie, keys[i], keys[i] + 3);
+		assert(trie.count == n);
+		for (int i = 0; i < n; ++i)
+			assert(strcmp(get(trie, keys[i]), keys[i] + 3) == 0);
+		struct ordered ordered = { 0 };
+		visit_prefix(trie, "", check_order, &ordered);
+		assert(ordered.count == n);
+		ordered = (struct ordered) { 0 };
+		visit_prefix(trie, "/c/0012", check_order, &ordered);
+		int expected = 0;
+		for (int i = 1200; i < 1300; ++i)
+			expected += i % 7 == 2;
+		assert(ordered.count == expected);
+
+		for (int i = 0; i < n; i += 2)
+			remove(&trie, keys[i]);
+		assert(trie.count == n / 2);
+		for (int i = 0; i < n; ++i)
+			assert(!get(trie, keys[i]) == !(i % 2));
+		for (int i = 0; i < n; i += 2)
+			add(&trie, keys[i], "again");
+		for (int i = 0; i < n; ++i)
+			assert(strcmp(get(trie, keys[i]), i % 2 ? keys[i] + 3 : "again") == 0);
+		for (int i = 0; i < n; ++i)
+			remove(&trie, keys[i]);
+		assert(!trie.count && !trie.root && !trie.node_bytes);
+		destroy(&trie);
+	}
+
+	{
+		// Random keys with lots of shared prefixes, checked against a plain array.
+		static char keys[3000][8];
+		static int present[3000];
+		int n = sizeof keys / sizeof keys[0];
+		unsigned long long seed = 99;
+		for (int i = 0; i < n; ++i) {
+			for (;;) {
+				seed = seed * 6364136223846793005u + 1442695040888963407u;
+				int length = (int)(seed >> 61);
+				for (int j = 0; j < length; ++j) {
+					seed = seed * 6364136223846793005u + 1442695040888963407u;
+					keys[i][j] = "ab/\xff"[seed >> 62];
+				}
+				keys[i][length] = 0;
+				int duplicate = 0;
+				for (int j = 0; j < i && !duplicate; ++j)
+					duplicate = strcmp(keys[i], keys[j]) == 0;
+				if (!duplicate)
+					break;
+			}
+		}
+
+		struct trie trie = { 0 };
+		int num_present = 0;
+		for (int round = 0; round < 200000; ++round) {
+			seed = seed * 6364136223846793005u + 1442695040888963407u;
+			int i = (int)((seed >> 33) % (unsigned)n);
+			if ((seed >> 20) % 2) {
+				num_present += !present[i];
+				present[i] = 1;
+				add(&trie, keys[i], keys[i]);
+			} else {
+				num_present -= present[i];
+				present[i] = 0;
+				remove(&trie, keys[i]);
+			}
+			assert(trie.count == num_present);
+			if (round % 20000 == 0) {
+				for (int j = 0; j < n; ++j) {
+					assert(!get(trie, keys[j]) == !present[j]);
+					// The longest prefix is the longest present key that the string starts with.
+					int expected = -1;
+					for (int k = 0; k < n; ++k)
+						if (present[k] && strncmp(keys[j], keys[k], strlen(keys[k])) == 0 && (expected < 0 || strlen(keys[k]) > strlen(keys[expected])))
+							expected = k;
+					const char *found = longest_prefix(trie, keys[j], NULL);
+					assert(expected < 0 ? !found : strcmp(found, keys[expected]) == 0);
+				}
+				struct ordered ordered = { 0 };
+				visit_prefix(trie, "", check_order, &ordered);
+				assert(ordered.count == num_present);
+			}
+		}
+		destroy(&trie);
+	}
+
+	{
+		// Nodes and slabs come from the allocator, and go back with the size they were allocated with,
+		// also when the leaves get moved to a new slab.
+		size_t allocated = 0;
+		struct allocator_callbacks callbacks = { counting_allocate, counting_deallocate, NULL, &allocated };
+		struct trie trie = { 0 };
+		trie.allocator = &callbacks;
+		static char keys[5000][8];
+		for (int i = 0; i < 5000; ++i) {
+			keys[i][0] = 'k';
+			for (int j = 0, x = i; j < 4; ++j, x /= 10)
+				keys[i][4 - j] = (char)('0' + x % 10);
+			add(&trie, keys[i], keys[i]);
+		}
+		assert(allocated > (size_t)trie.node_bytes + (size_t)trie.live_bytes);
+		for (int i = 0; i < 4900; ++i)
+			remove(&trie, keys[i]);
+		for (int i = 4900; i < 5000; ++i)
+			assert(strcmp(get(trie, keys[i]), keys[i]) == 0);
+		destroy(&trie);
+		assert(!allocated && trie.allocator == &callbacks);
+	}
+
+	{
+		// This shouldn't leak.
+		static char keys[1000][8];
+		for (int i = 0; i < 1000; ++i) {
+			keys[i][0] = 'k';
+			for (int j = 0; j < 4; ++j)
+				keys[i][4 - j] = (char)('0' + (i >> (2 * j)) % 4);
+			keys[i][5] = 0;
+		}
+		for (int i = 0; i < 1000; ++i) {
+			struct trie trie = { 0 };
+			for (int j = 0; j < 1000; ++j)
+				add(&trie, keys[j], "value");
+			for (int j = 0; j < 500; ++j)
+				remove(&trie, keys[j]);
+			destroy(&trie);
+		}
+	}
+}
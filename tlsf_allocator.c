@@ -1,29 +1,56 @@
 // O(1) allocation and deallocation
-// 1/32 memory wasted on average, good-fit
-// 4 byte header
-// 32/16 byte min allocation on 64/32-bit
+// 1/(2*SECOND_LEVEL_COUNT) memory wasted on average, good-fit
+// size_t header, so heaps and blocks can be bigger than 4 GB
+// 32 byte min allocation
 // can be expanded at runtime
+// aligned_allocate for alignments above ALIGNMENT
+// optional per-thread caches of small blocks in front of a locked, shared heap
+// optional pools mapped from the OS on demand, and given back when they're free
 
-#include <stdint.h> // intptr_t
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise when compiling with -std=c11
+#endif
+#include <stddef.h> // size_t, ptrdiff_t
+#include <stdint.h> // uintptr_t, uint64_t
 #include <string.h> // memcpy
 #include <assert.h>
 
-#define ALIGNMENT 4 // only 4, 8, or 16 allowed
-#define FREE_BIT (1 << 0)
-#define PREV_FREE_BIT (1 << 1)
+#define ALIGNMENT 16 // only 16, 32, or 64 allowed
+#define SECOND_LEVEL_LOG2 2 // each power of 2 size range is split into this many slots, up to 5
+#define SECOND_LEVEL_COUNT (1 << SECOND_LEVEL_LOG2)
+#define FIRST_LEVEL_COUNT 64
+#define FREE_BIT ((size_t)1 << 0)
+#define PREV_FREE_BIT ((size_t)1 << 1)
 #define SIZE_MASK (~(FREE_BIT | PREV_FREE_BIT))
+#ifndef TRACK_CALL_SITES
+#define TRACK_CALL_SITES 0 // build with -DTRACK_CALL_SITES=1 to count allocations per call site, see site_allocate
+#endif
+#define NUM_CALL_SITES 256
 
 struct node {
 	struct node *prevnode; // this is actually at the end of the *previous* node's block, only valid if previous node is free
-	int size; // includes size of node, last 2 bits of the are used as bitfields: FREE_BIT | PREV_FREE_BIT
+	size_t size; // includes size of node, last 2 bits of the are used as bitfields: FREE_BIT | PREV_FREE_BIT
 	struct node *next; // only valid if node is free
 	struct node *prev; // only valid if node is free
 };
 
+struct call_site {
+	const char *file; // NULL if the entry is unused
+	int line;
+	size_t num_allocations;
+	size_t num_failures;
+	size_t requested_bytes;
+	size_t size_histogram[FIRST_LEVEL_COUNT]; // by floorlog2 of the requested size, zero sizes go in 0
+};
+
 struct heap {
-	int listmap;
-	int slotmaps[32];
-	struct node freelists[32][4];
+	uint64_t listmap;
+	uint32_t slotmaps[FIRST_LEVEL_COUNT];
+	struct node freelists[FIRST_LEVEL_COUNT][SECOND_LEVEL_COUNT];
+#if TRACK_CALL_SITES
+	struct call_site sites[NUM_CALL_SITES];
+	int num_sites;
+#endif
 };
 
 void *node2block(struct node *n) {
@@ -36,29 +63,42 @@ struct node *nextnode(struct node *n) {
 	return (struct node *)((char *)n + (n->size & SIZE_MASK));
 }
 
-int findfirstset(int x) {
-	// _BitScanForward(&i, x) on msvc, __builtin_ffs(x) - 1 on gcc/clang
-	for (int i = 0; i < 32; ++i)
-		if (x & (1 << i))
+int findfirstset(uint64_t x) {
+	if (!x)
+		return -1;
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	// _BitScanForward64(&i, x) on msvc
+	for (int i = 0; i < 64; ++i)
+		if (x & ((uint64_t)1 << i))
 			return i;
 	return -1;
+#endif
 }
-int floorlog2(int x) {
-	// _BitScanReverse(&i, x) on msvc, __builtin_fls(x) - 1 on gcc/clang
-	for (int i = 31; i >= 0; --i)
-		if (x & (1 << i))
+int floorlog2(uint64_t x) {
+	if (!x)
+		return -1;
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(x);
+#else
+	// _BitScanReverse64(&i, x) on msvc
+	for (int i = 63; i >= 0; --i)
+		if (x & ((uint64_t)1 << i))
 			return i;
 	return -1;
+#endif
 }
 
-void findslot(int size, int *listid, int *slotid) {
+void findslot(size_t size, int *listid, int *slotid) {
+	size &= SIZE_MASK;
 	int log2 = floorlog2(size);
-	int pow2 = 1 << log2;
-	int left = size - pow2;
+	size_t pow2 = (size_t)1 << log2;
+	size_t left = size - pow2;
 	(*listid) = log2;
-	(*slotid) = left >> (log2 - 2); // (4 * left) / pow2
+	(*slotid) = (int)(left >> (log2 - SECOND_LEVEL_LOG2)); // (SECOND_LEVEL_COUNT * left) / pow2
 }
-void add(struct heap *heap, struct node *node, int size) {
+void add(struct heap *heap, struct node *node, size_t size) {
 	// mark the node as free
 	assert((size & SIZE_MASK) > 0);
 	node->size = size | FREE_BIT;
@@ -80,15 +120,15 @@ void add(struct heap *heap, struct node *node, int size) {
 	list->next = node;
 
 	// mark the list and slot as full
-	heap->listmap |= (1 << listid);
-	heap->slotmaps[listid] |= (1 << slotid);
+	heap->listmap |= ((uint64_t)1 << listid);
+	heap->slotmaps[listid] |= (1u << slotid);
 }
 void remove(struct heap *heap, struct node *node) {
 	// find where the node goes
 	int listid, slotid;
 	findslot(node->size, &listid, &slotid);
 	struct node *list = &heap->freelists[listid][slotid];
-	int *slotmap = &heap->slotmaps[listid];
+	uint32_t *slotmap = &heap->slotmaps[listid];
 
 	// remove the node from the freelist
 	assert(node->size & FREE_BIT);
@@ -98,20 +138,22 @@ void remove(struct heap *heap, struct node *node) {
 
 	// if the slot becomes empty, clear it's bitmap bit
 	if (list->next == list)
-		(*slotmap) &= ~(1 << slotid);
+		(*slotmap) &= ~(1u << slotid);
 
 	// and if the list becomes empty, clear it's bitmap bit too
 	if (!(*slotmap))
-		heap->listmap &= ~(1 << listid);
+		heap->listmap &= ~((uint64_t)1 << listid);
 
 	struct node *next = nextnode(node);
 	assert(next->size & PREV_FREE_BIT);
 	next->size &= ~PREV_FREE_BIT;
 }
 
-void grow(struct heap *heap, void *memory, int size) {
-	assert(size > sizeof(struct node));
-	assert(size % sizeof(struct node) == 0);
+// memory has to be aligned to ALIGNMENT, and size a multiple of it
+void grow(struct heap *heap, void *memory, size_t size) {
+	assert(size > sizeof(struct node) + ALIGNMENT);
+	assert(size % ALIGNMENT == 0);
+	assert((uintptr_t)memory % ALIGNMENT == 0);
 
 	// carve out a sentinel node with just the size flags at the end
 	struct node *sentinel = block2node((char *)memory + size);
@@ -126,65 +168,86 @@ void initialize(struct heap *heap) {
 	memset(heap, 0, sizeof(struct heap));
 
 	// clear freelists
-	for (int i = 0; i < 32; ++i) {
-		for (int j = 0; j < 4; ++j) {
+	for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+		for (int j = 0; j < SECOND_LEVEL_COUNT; ++j) {
 			struct node *list = &heap->freelists[i][j];
 			list->next = list;
 			list->prev = list;
 		}
 	}
 }
-void *allocate(struct heap *heap, int size) {
-	assert(size >= 0); // you could clamp to 0, or return NULL
-
+size_t needed_size(size_t size) {
 	// need extra space for size and to align allocation
-	int needed = size + ALIGNMENT;
+	size_t needed = size + ALIGNMENT;
 	if (needed < sizeof(struct node))
 		needed = sizeof(struct node);
 
 	// align up
-	needed = (needed + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	return (needed + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+// gives back the end of an allocated node past needed, merging it with the next node if that's free
+void trim(struct heap *heap, struct node *node, size_t needed) {
+	size_t excess = (node->size & SIZE_MASK) - needed;
+	if (excess >= sizeof(struct node)) {
+		node->size -= excess;
+		struct node *left = nextnode(node);
+		left->size = excess;
+		// merge with next free node
+		struct node *next = nextnode(left);
+		if (next->size & FREE_BIT) {
+			remove(heap, next);
+			left->size += (next->size & SIZE_MASK);
+		}
+		add(heap, left, left->size);
+	}
+}
+void *allocate(struct heap *heap, size_t size) {
+	if (size > SIZE_MASK / 2)
+		return 0; // out of memory
+	size_t needed = needed_size(size);
 
 	// first check the exact size range for the needed amount
 	// special findslot that rounds up instead of down
 	int log2 = floorlog2(needed);
-	int pow2 = 1 << log2;
-	int left = needed - pow2;
+	size_t pow2 = (size_t)1 << log2;
+	size_t left = needed - pow2;
 	int listid = log2;
-	int slotid = left >> (log2 - 2); // (4 * left / pow2)
-	if (left) {
+	int slotid = (int)(left >> (log2 - SECOND_LEVEL_LOG2)); // (SECOND_LEVEL_COUNT * left / pow2)
+	if (left & ((pow2 >> SECOND_LEVEL_LOG2) - 1)) {
 		++slotid;
-		if (slotid == 4) {
+		if (slotid == SECOND_LEVEL_COUNT) {
 			slotid = 0;
 			++listid;
 		}
 	}
 
-	int slotmask = ~((1 << slotid) - 1);
-	if (!(heap->slotmaps[listid] & slotmask)) {
+	uint32_t slotmask = ~((1u << slotid) - 1);
+	if (listid < FIRST_LEVEL_COUNT && !(heap->slotmaps[listid] & slotmask)) {
 		// the best fitting size range is empty so don't consider it
 		++listid;
 		slotmask = 0xFFFFFFFF;
 	}
+	if (listid >= FIRST_LEVEL_COUNT)
+		return 0; // out of memory
 
 	// find first free node big enough to hold the allocation
-	int listmask = ~((1 << listid) - 1);
-	int listmap = heap->listmap & listmask;
+	uint64_t listmask = ~(((uint64_t)1 << listid) - 1);
+	uint64_t listmap = heap->listmap & listmask;
 	listid = findfirstset(listmap);
 	if (listid < 0)
 		return 0; // out of memory
 
-	int slotmap = heap->slotmaps[listid] & slotmask;
+	uint32_t slotmap = heap->slotmaps[listid] & slotmask;
 	slotid = findfirstset(slotmap);
 
 	// remove the node from the freelist
 	struct node *list = &heap->freelists[listid][slotid];
 	struct node *node = list->next;
-	assert(node->size >= needed);
+	assert((node->size & SIZE_MASK) >= needed);
 	remove(heap, node);
 
 	// trim the excess off
-	int excess = node->size - needed;
+	size_t excess = (node->size & SIZE_MASK) - needed;
 	if (excess >= sizeof(struct node)) {
 		node->size -= excess;
 		struct node *leftover = nextnode(node);
@@ -193,6 +256,39 @@ void *allocate(struct heap *heap, int size) {
 
 	return node2block(node);
 }
+// alignment has to be a power of 2, anything up to ALIGNMENT is the same as allocate
+void *aligned_allocate(struct heap *heap, size_t size, size_t alignment) {
+	assert(alignment && !(alignment & (alignment - 1)));
+	if (alignment <= ALIGNMENT)
+		return allocate(heap, size);
+
+	// the gap in front of the aligned block has to be big enough to be a free node of its own
+	char *block = allocate(heap, size + alignment + sizeof(struct node));
+	if (!block)
+		return 0; // out of memory
+
+	struct node *node = block2node(block);
+	size_t gap = (alignment - (uintptr_t)block % alignment) % alignment;
+	if (gap && gap < sizeof(struct node))
+		gap += alignment;
+	if (gap) {
+		struct node *aligned = (struct node *)((char *)node + gap);
+		aligned->size = (node->size & SIZE_MASK) - gap;
+		if (node->size & PREV_FREE_BIT) {
+			// give the gap to the free node in front
+			struct node *prev = node->prevnode;
+			remove(heap, prev);
+			add(heap, prev, (prev->size & SIZE_MASK) + gap);
+		} else {
+			add(heap, node, gap);
+		}
+		node = aligned;
+	}
+
+	trim(heap, node, needed_size(size));
+	return node2block(node);
+}
+
 void deallocate(struct heap *heap, void *block) {
 	if (!block)
 		return;
@@ -226,27 +322,19 @@ void deallocate(struct heap *heap, void *block) {
 
 	add(heap, node, node->size);
 }
-void *reallocate(struct heap *heap, void *block, int size) {
-	// you could clamp to 0, or return NULL
-	assert(size >= 0);
-
+void *reallocate(struct heap *heap, void *block, size_t size) {
 	if (!block)
 		return allocate(heap, size);
 	if (!size) {
 		deallocate(heap, block);
 		return 0;
 	}
+	if (size > SIZE_MASK / 2)
+		return 0; // out of memory
 
 	struct node *node = block2node(block);
 	assert(!(node->size & FREE_BIT)); // use after free
-
-	// need extra space for size and to align allocation
-	int needed = size + ALIGNMENT;
-	if (needed < sizeof(struct node))
-		needed = sizeof(struct node);
-
-	// align up
-	needed = (needed + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	size_t needed = needed_size(size);
 
 	if (needed > (node->size & SIZE_MASK)) {
 		// we need to grow, try expanding into the next block if it's free
@@ -258,7 +346,7 @@ void *reallocate(struct heap *heap, void *block, int size) {
 			void *copy = allocate(heap, size);
 			if (!copy)
 				return 0; // out of memory
-			memcpy(copy, block, (size_t)(node->size & SIZE_MASK) - ALIGNMENT);
+			memcpy(copy, block, (node->size & SIZE_MASK) - ALIGNMENT);
 			deallocate(heap, block);
 			return copy;
 		}
@@ -269,45 +357,381 @@ void *reallocate(struct heap *heap, void *block, int size) {
 	}
 
 	// trim off any excess
-	int excess = (node->size & SIZE_MASK) - needed;
-	if (excess >= sizeof(struct node)) {
-		node->size -= excess;
-		struct node *left = nextnode(node);
-		left->size = excess;
-		// merge with next free node
-		struct node *next = nextnode(left);
-		if (next->size & FREE_BIT) {
-			remove(heap, next);
-			left->size += (next->size & SIZE_MASK);
+	trim(heap, node, needed);
+	return block;
+}
+
+// Memory from the OS: an os_heap maps pools of at least pool_size bytes when it runs out, and
+// gives fully free pools back. Up to retain_bytes of free pools stay mapped, so a workload that
+// goes up and down doesn't map and unmap all the time, but their pages are still dropped, so
+// they don't count towards the resident size. All memory has to come from os_allocate, mixing
+// in grow isn't supported, because the sentinel at the end of each pool points to its pool.
+#if defined(_WIN32)
+#include <Windows.h> // VirtualAlloc, VirtualFree
+#else
+#include <sys/mman.h> // mmap, munmap, madvise
+#include <unistd.h> // sysconf
+#endif
+
+struct os_pool {
+	struct os_pool *prev;
+	struct os_pool *next;
+	struct node *root;
+	size_t size; // of the whole mapping, including this header
+};
+
+struct os_heap {
+	struct heap heap;
+	struct os_pool *pools;
+	size_t pool_size;
+	size_t retain_bytes;
+	size_t mapped_bytes;
+	int num_pools;
+};
+
+#define OS_POOL_HEADER_SIZE ((sizeof(struct os_pool) + sizeof(struct node *) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+size_t os_page_size(void) {
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+void *os_map(size_t size) {
+#if defined(_WIN32)
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return memory == MAP_FAILED ? NULL : memory;
+#endif
+}
+void os_unmap(void *memory, size_t size) {
+#if defined(_WIN32)
+	(void)size;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+// the pages stay mapped, but the OS can take them back, and they read as zeroes afterwards
+void os_drop_pages(void *memory, size_t size) {
+#if defined(_WIN32)
+	VirtualAlloc(memory, size, MEM_RESET, PAGE_READWRITE);
+#else
+	madvise(memory, size, MADV_DONTNEED);
+#endif
+}
+
+void initialize_os_heap(struct os_heap *os, size_t pool_size, size_t retain_bytes) {
+	initialize(&os->heap);
+	os->pools = NULL;
+	os->pool_size = pool_size;
+	os->retain_bytes = retain_bytes;
+	os->mapped_bytes = 0;
+	os->num_pools = 0;
+}
+
+struct os_pool *map_pool(struct os_heap *os, size_t size) {
+	// room for the block even after allocate rounds it up to the next slot, plus the sentinel
+	size_t needed = needed_size(size);
+	size_t page = os_page_size();
+	size_t map_size = OS_POOL_HEADER_SIZE + needed + (needed >> SECOND_LEVEL_LOG2) + 2 * sizeof(struct node);
+	if (map_size < os->pool_size)
+		map_size = os->pool_size;
+	map_size = (map_size + page - 1) & ~(page - 1);
+
+	struct os_pool *pool = os_map(map_size);
+	if (!pool)
+		return NULL;
+	pool->size = map_size;
+	pool->prev = NULL;
+	pool->next = os->pools;
+	if (os->pools)
+		os->pools->prev = pool;
+	os->pools = pool;
+	os->mapped_bytes += map_size;
+	os->num_pools++;
+
+	char *memory = (char *)pool + OS_POOL_HEADER_SIZE;
+	size_t memory_size = map_size - OS_POOL_HEADER_SIZE;
+	grow(&os->heap, memory, memory_size);
+	pool->root = (struct node *)(memory - sizeof(struct node *));
+	block2node(memory + memory_size)->next = (struct node *)pool; // the sentinel is never free, so next is ours
+	return pool;
+}
+void unmap_pool(struct os_heap *os, struct os_pool *pool) {
+	remove(&os->heap, pool->root);
+	if (pool->prev)
+		pool->prev->next = pool->next;
+	else
+		os->pools = pool->next;
+	if (pool->next)
+		pool->next->prev = pool->prev;
+	os->mapped_bytes -= pool->size;
+	os->num_pools--;
+	os_unmap(pool, pool->size);
+}
+int pool_is_free(struct os_pool *pool) {
+	return (pool->root->size & FREE_BIT) && !(nextnode(pool->root)->size & SIZE_MASK);
+}
+
+void *os_allocate(struct os_heap *os, size_t size) {
+	void *block = allocate(&os->heap, size);
+	if (!block && map_pool(os, size))
+		block = allocate(&os->heap, size);
+	return block;
+}
+void os_deallocate(struct os_heap *os, void *block) {
+	if (!block)
+		return;
+
+	// after merging, the free node starts at the previous node if that was free
+	struct node *node = block2node(block);
+	if (node->size & PREV_FREE_BIT)
+		node = node->prevnode;
+	deallocate(&os->heap, block);
+
+	struct node *next = nextnode(node);
+	if (next->size & SIZE_MASK)
+		return; // not the end of a pool
+	struct os_pool *pool = (struct os_pool *)next->next;
+	if (pool->root != node)
+		return; // not the whole pool
+
+	// the pool is completely free, drop its pages but keep the node headers at both ends
+	size_t page = os_page_size();
+	uintptr_t first = ((uintptr_t)(node + 1) + page - 1) & ~(uintptr_t)(page - 1);
+	uintptr_t last = (uintptr_t)next & ~(uintptr_t)(page - 1);
+	if (first < last)
+		os_drop_pages((void *)first, last - first);
+
+	// and give back the free pools that don't fit in retain_bytes, starting with the oldest
+	size_t free_bytes = 0;
+	struct os_pool *oldest = os->pools;
+	while (oldest->next)
+		oldest = oldest->next;
+	for (struct os_pool *p = os->pools; p; p = p->next)
+		if (pool_is_free(p))
+			free_bytes += p->size;
+	for (struct os_pool *p = oldest; p && free_bytes > os->retain_bytes;) {
+		struct os_pool *prev = p->prev;
+		if (pool_is_free(p)) {
+			free_bytes -= p->size;
+			unmap_pool(os, p);
 		}
-		add(heap, left, left->size);
+		p = prev;
+	}
+}
+void *os_reallocate(struct os_heap *os, void *block, size_t size) {
+	if (!block)
+		return os_allocate(os, size);
+	if (!size) {
+		os_deallocate(os, block);
+		return 0;
+	}
+
+	void *result = reallocate(&os->heap, block, size);
+	if (!result) {
+		// reallocate leaves the block alone when it runs out of memory
+		result = os_allocate(os, size);
+		if (!result)
+			return 0; // out of memory
+		size_t old_size = (block2node(block)->size & SIZE_MASK) - ALIGNMENT;
+		memcpy(result, block, old_size < size ? old_size : size);
+		os_deallocate(os, block);
+	}
+	return result;
+}
+void destroy_os_heap(struct os_heap *os) {
+	while (os->pools) {
+		struct os_pool *next = os->pools->next;
+		os_unmap(os->pools, os->pools->size);
+		os->pools = next;
 	}
+	initialize_os_heap(os, os->pool_size, os->retain_bytes);
+}
+
+// Thread caching: one heap shared by all threads behind a lock, and a cache per thread of small
+// blocks sorted into size classes. Small allocations come from the cache without locking, and
+// the cache refills and flushes a batch at a time. A block freed on a different thread than the
+// one that allocated it goes into the freeing thread's cache, so nothing has to be sent back.
+// Caches that grow too big flush back to the shared heap, which is where blocks moving from a
+// producer thread to a consumer thread end up.
+#include <threads.h> // mtx_t
 
+#define SIZE_CLASS_STEP 16
+#define NUM_SIZE_CLASSES 32 // Sizes up to 512 bytes get cached.
+#define MAX_CACHED_SIZE (SIZE_CLASS_STEP * NUM_SIZE_CLASSES)
+#define UNCACHED_CLASS -1
+
+struct shared_heap {
+	struct heap heap;
+	mtx_t lock;
+};
+
+struct cached_block {
+	struct cached_block *next;
+};
+
+struct thread_cache {
+	struct shared_heap *shared;
+	struct cached_block *lists[NUM_SIZE_CLASSES];
+	int counts[NUM_SIZE_CLASSES];
+};
+
+// Cached blocks start with their size class, taking up ALIGNMENT bytes. The node size can't be
+// used without the lock, other threads flip its PREV_FREE_BIT when they free a neighbour.
+void *tag_block(void *block, int size_class) {
+	*(int *)block = size_class;
+	return (char *)block + ALIGNMENT;
+}
+void *untag_block(void *block, int *size_class) {
+	block = (char *)block - ALIGNMENT;
+	*size_class = *(int *)block;
 	return block;
 }
 
+void initialize_shared(struct shared_heap *shared) {
+	initialize(&shared->heap);
+	mtx_init(&shared->lock, mtx_plain);
+}
+void grow_shared(struct shared_heap *shared, void *memory, size_t size) {
+	mtx_lock(&shared->lock);
+	grow(&shared->heap, memory, size);
+	mtx_unlock(&shared->lock);
+}
+void initialize_cache(struct thread_cache *cache, struct shared_heap *shared) {
+	memset(cache, 0, sizeof(struct thread_cache));
+	cache->shared = shared;
+}
+
+// How many blocks of a size class move between the cache and the shared heap at a time.
+int batch_size(int size_class) {
+	int batch = 4096 / ((size_class + 1) * SIZE_CLASS_STEP);
+	return batch < 4 ? 4 : batch > 64 ? 64 : batch;
+}
+
+void flush_class(struct thread_cache *cache, int size_class, int num_blocks) {
+	mtx_lock(&cache->shared->lock);
+	for (int i = 0; i < num_blocks && cache->lists[size_class]; ++i) {
+		struct cached_block *block = cache->lists[size_class];
+		cache->lists[size_class] = block->next;
+		cache->counts[size_class]--;
+		deallocate(&cache->shared->heap, block);
+	}
+	mtx_unlock(&cache->shared->lock);
+}
+// Gives everything in the cache back to the shared heap. Call this before a thread exits.
+void flush_cache(struct thread_cache *cache) {
+	for (int i = 0; i < NUM_SIZE_CLASSES; ++i)
+		flush_class(cache, i, cache->counts[i]);
+}
+
+void *cached_allocate(struct thread_cache *cache, size_t size) {
+	if (size > MAX_CACHED_SIZE) {
+		mtx_lock(&cache->shared->lock);
+		void *block = allocate(&cache->shared->heap, size + ALIGNMENT);
+		mtx_unlock(&cache->shared->lock);
+		return block ? tag_block(block, UNCACHED_CLASS) : 0;
+	}
+
+	int size_class = size ? (int)((size - 1) / SIZE_CLASS_STEP) : 0;
+	if (!cache->lists[size_class]) {
+		// Refill a batch at a time, so the lock is taken once per batch.
+		int batch = batch_size(size_class);
+		int block_size = (size_class + 1) * SIZE_CLASS_STEP + ALIGNMENT;
+		mtx_lock(&cache->shared->lock);
+		for (int i = 0; i < batch; ++i) {
+			struct cached_block *block = allocate(&cache->shared->heap, block_size);
+			if (!block)
+				break;
+			block->next = cache->lists[size_class];
+			cache->lists[size_class] = block;
+			cache->counts[size_class]++;
+		}
+		mtx_unlock(&cache->shared->lock);
+		if (!cache->lists[size_class])
+			return 0; // out of memory
+	}
+
+	struct cached_block *block = cache->lists[size_class];
+	cache->lists[size_class] = block->next;
+	cache->counts[size_class]--;
+	return tag_block(block, size_class);
+}
+void cached_deallocate(struct thread_cache *cache, void *block) {
+	if (!block)
+		return;
+
+	int size_class;
+	struct cached_block *cached = untag_block(block, &size_class);
+	if (size_class == UNCACHED_CLASS) {
+		mtx_lock(&cache->shared->lock);
+		deallocate(&cache->shared->heap, cached);
+		mtx_unlock(&cache->shared->lock);
+		return;
+	}
+
+	assert(size_class >= 0 && size_class < NUM_SIZE_CLASSES); // corruption, or not from a cache
+	cached->next = cache->lists[size_class];
+	cache->lists[size_class] = cached;
+	if (++cache->counts[size_class] >= 2 * batch_size(size_class))
+		flush_class(cache, size_class, batch_size(size_class));
+}
+void *cached_reallocate(struct thread_cache *cache, void *block, size_t size) {
+	if (!block)
+		return cached_allocate(cache, size);
+	if (!size) {
+		cached_deallocate(cache, block);
+		return 0;
+	}
+
+	int size_class;
+	void *tagged = untag_block(block, &size_class);
+	if (size_class == UNCACHED_CLASS && size > MAX_CACHED_SIZE) {
+		mtx_lock(&cache->shared->lock);
+		tagged = reallocate(&cache->shared->heap, tagged, size + ALIGNMENT);
+		mtx_unlock(&cache->shared->lock);
+		return tagged ? (char *)tagged + ALIGNMENT : 0;
+	}
+
+	int new_class = size ? (int)((size - 1) / SIZE_CLASS_STEP) : 0;
+	if (size_class == new_class)
+		return block;
+	void *copy = cached_allocate(cache, size);
+	if (!copy)
+		return 0; // out of memory
+	size_t old_size = size_class == UNCACHED_CLASS ? MAX_CACHED_SIZE : (size_t)(size_class + 1) * SIZE_CLASS_STEP;
+	memcpy(copy, block, old_size < size ? old_size : size);
+	cached_deallocate(cache, block);
+	return copy;
+}
+
 void verify(struct heap *heap) {
 	// if a slotmap isn't empty the corresponding listmap bit should be set
-	for (int i = 0; i < 32; ++i) {
+	for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
 		int slotmap = heap->slotmaps[i] != 0;
-		int listmap = (heap->listmap & (1 << i)) != 0;
+		int listmap = (heap->listmap & ((uint64_t)1 << i)) != 0;
 		assert(slotmap == listmap);
 	}
 
 	// the bitmaps should correspond to which freelists are empty
-	for (int i = 0; i < 32; ++i) {
-		int slotmap = heap->slotmaps[i];
-		for (int j = 0; j < 4; ++j) {
+	for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+		uint32_t slotmap = heap->slotmaps[i];
+		for (int j = 0; j < SECOND_LEVEL_COUNT; ++j) {
 			struct node *list = &heap->freelists[i][j];
-			if (slotmap & (1 << j)) {
+			if (slotmap & (1u << j)) {
 				assert(list->next != list);
 				assert(list->prev != list);
 			}
 		}
 	}
 
-	for (int i = 0; i < 32; ++i) {
-		for (int j = 0; j < 4; ++j) {
+	for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+		for (int j = 0; j < SECOND_LEVEL_COUNT; ++j) {
 			struct node *list = &heap->freelists[i][j];
 			for (struct node *node = list->next; node != list; node = node->next) {
 				// every node in the freelist should be free
@@ -316,6 +740,11 @@ void verify(struct heap *heap) {
 				// free nodes cannot be empty
 				assert(node->size & SIZE_MASK);
 
+				// and they have to be in the list for their size
+				int listid, slotid;
+				findslot(node->size, &listid, &slotid);
+				assert(listid == i && slotid == j);
+
 				// the next node needs to know if we're free
 				struct node *next = nextnode(node);
 				assert(next->size & PREV_FREE_BIT);
@@ -333,6 +762,112 @@ void verify(struct heap *heap) {
 		}
 	}
 }
+// Statistics about the free blocks, from the freelists, so the cost depends on how many free
+// blocks there are. A heap with plenty of free bytes but a small largest_free_block is
+// fragmented, and will fail big allocations.
+struct heap_stats {
+	size_t free_bytes;
+	size_t num_free_blocks;
+	size_t largest_free_block; // usable bytes, the biggest allocation that can still succeed is a bit smaller because of rounding
+	double fragmentation; // 1 - largest / free, 0 when the free memory is in one piece
+	size_t free_bytes_per_bin[FIRST_LEVEL_COUNT][SECOND_LEVEL_COUNT];
+	size_t free_blocks_per_bin[FIRST_LEVEL_COUNT][SECOND_LEVEL_COUNT];
+};
+void get_heap_stats(struct heap *heap, struct heap_stats *stats) {
+	memset(stats, 0, sizeof(struct heap_stats));
+	for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+		if (!(heap->listmap & ((uint64_t)1 << i)))
+			continue;
+		for (int j = 0; j < SECOND_LEVEL_COUNT; ++j) {
+			struct node *list = &heap->freelists[i][j];
+			for (struct node *node = list->next; node != list; node = node->next) {
+				size_t usable = (node->size & SIZE_MASK) - ALIGNMENT;
+				stats->free_bytes_per_bin[i][j] += usable;
+				stats->free_blocks_per_bin[i][j]++;
+				stats->free_bytes += usable;
+				stats->num_free_blocks++;
+				if (usable > stats->largest_free_block)
+					stats->largest_free_block = usable;
+			}
+		}
+	}
+	if (stats->free_bytes)
+		stats->fragmentation = 1.0 - (double)stats->largest_free_block / (double)stats->free_bytes;
+}
+
+// Calls visit for every block in a region that was passed to grow, in address order, free
+// blocks included. Sizes are usable bytes. Nothing may be allocated or freed during the walk.
+typedef void heap_visitor(void *context, void *block, size_t size, int is_free);
+void walk_heap(void *memory, size_t size, heap_visitor *visit, void *context) {
+	struct node *node = (struct node *)((char *)memory - sizeof(struct node *));
+	struct node *sentinel = block2node((char *)memory + size);
+	for (; node != sentinel; node = nextnode(node)) {
+		assert(node->size & SIZE_MASK); // corruption, ran past the sentinel
+		visit(context, node2block(node), (node->size & SIZE_MASK) - ALIGNMENT, (node->size & FREE_BIT) != 0);
+	}
+}
+void walk_os_heap(struct os_heap *os, heap_visitor *visit, void *context) {
+	for (struct os_pool *pool = os->pools; pool; pool = pool->next)
+		walk_heap((char *)pool + OS_POOL_HEADER_SIZE, pool->size - OS_POOL_HEADER_SIZE, visit, context);
+}
+
+// A visitor for walk_heap that sorts blocks by floorlog2 of their size, one histogram for the
+// blocks in use and one for the free ones. Long runs of small free blocks between used ones are
+// what fragmentation looks like.
+struct size_histogram {
+	size_t used_blocks[FIRST_LEVEL_COUNT];
+	size_t used_bytes[FIRST_LEVEL_COUNT];
+	size_t free_blocks[FIRST_LEVEL_COUNT];
+	size_t free_bytes[FIRST_LEVEL_COUNT];
+};
+void add_to_histogram(void *context, void *block, size_t size, int is_free) {
+	(void)block;
+	struct size_histogram *histogram = context;
+	int log2 = size ? floorlog2(size) : 0;
+	if (is_free) {
+		histogram->free_blocks[log2]++;
+		histogram->free_bytes[log2] += size;
+	} else {
+		histogram->used_blocks[log2]++;
+		histogram->used_bytes[log2] += size;
+	}
+}
+
+// Counts allocations per call site when TRACK_CALL_SITES is on, and is just allocate otherwise.
+// Sites are told apart by the address of __FILE__ and the line, and once all NUM_CALL_SITES are
+// taken, new sites go uncounted.
+#if TRACK_CALL_SITES
+#define site_allocate(heap, size) allocate_at((heap), (size), __FILE__, __LINE__)
+struct call_site *find_call_site(struct heap *heap, const char *file, int line) {
+	uint64_t hash = ((uint64_t)(uintptr_t)file ^ (uint64_t)line * 0x9E3779B97F4A7C15ull) * 0xFF51AFD7ED558CCDull;
+	for (int i = 0; i < NUM_CALL_SITES; ++i) {
+		struct call_site *site = &heap->sites[(hash + (uint64_t)i) % NUM_CALL_SITES];
+		if (site->file == file && site->line == line)
+			return site;
+		if (!site->file) {
+			site->file = file;
+			site->line = line;
+			heap->num_sites++;
+			return site;
+		}
+	}
+	return NULL;
+}
+void *allocate_at(struct heap *heap, size_t size, const char *file, int line) {
+	void *block = allocate(heap, size);
+	struct call_site *site = find_call_site(heap, file, line);
+	if (site) {
+		site->num_allocations++;
+		site->num_failures += !block;
+		site->requested_bytes += size;
+		site->size_histogram[size ? floorlog2(size) : 0]++;
+	}
+	return block;
+}
+#else
+#define site_allocate(heap, size) allocate((heap), (size))
+#endif
+
 int equal(char *bytes, char value, int count) {
 	assert(bytes);
 	for (int i = 0; i < count; ++i)
@@ -341,11 +876,75 @@ int equal(char *bytes, char value, int count) {
 	return 1;
 }
 
+// Threads allocate and free blocks of mixed sizes through their caches, and hand some blocks to
+// each other through a mailbox, so they get freed on a different thread than they came from.
+#include <stdatomic.h>
+#include <stdlib.h> // malloc, free
+#define NUM_TEST_THREADS 4
+#define MAILBOX_SIZE 64
+struct cache_test {
+	struct shared_heap *shared;
+	_Atomic(char *) mailbox[MAILBOX_SIZE];
+};
+struct cache_test_thread {
+	struct cache_test *test;
+	unsigned seed;
+};
+void fill(char *block, int size) {
+	memcpy(block, &size, sizeof size);
+	memset(block + sizeof size, (char)size, (size_t)size - sizeof size);
+}
+void check(char *block) {
+	int size;
+	memcpy(&size, block, sizeof size);
+	assert(equal(block + sizeof size, (char)size, size - (int)sizeof size));
+}
+int cache_test_thread(void *arg) {
+	struct cache_test_thread *thread = arg;
+	struct cache_test *test = thread->test;
+	struct thread_cache cache;
+	initialize_cache(&cache, test->shared);
+
+	char *blocks[64] = { 0 };
+	for (int i = 0; i < 100000; ++i) {
+		thread->seed = thread->seed * 1103515245 + 12345;
+		unsigned r = thread->seed >> 8;
+		int slot = r % 64;
+		if (blocks[slot]) {
+			check(blocks[slot]);
+			if (r & 0x100) {
+				// Swap with the mailbox, whatever comes out was allocated on another thread.
+				blocks[slot] = atomic_exchange(&test->mailbox[(r >> 9) % MAILBOX_SIZE], blocks[slot]);
+				if (!blocks[slot])
+					continue;
+				check(blocks[slot]);
+			}
+			cached_deallocate(&cache, blocks[slot]);
+			blocks[slot] = NULL;
+		} else {
+			int size = (r >> 12) % 4 ? 8 + (r >> 14) % 200 : 8 + (r >> 14) % 1000;
+			blocks[slot] = cached_allocate(&cache, size);
+			assert(blocks[slot]);
+			fill(blocks[slot], size);
+			if (r & 0x200) {
+				int bigger = size + (int)((r >> 20) % 300);
+				blocks[slot] = cached_reallocate(&cache, blocks[slot], bigger);
+				check(blocks[slot]);
+				fill(blocks[slot], bigger);
+			}
+		}
+	}
+	for (int i = 0; i < 64; ++i)
+		cached_deallocate(&cache, blocks[i]);
+	flush_cache(&cache);
+	return 0;
+}
+
 int main(void) {
 	struct heap heap;
 	initialize(&heap);
 
-	static char memory[1024];
+	static _Alignas(ALIGNMENT) char memory[2048]; // big enough for the tests below with any ALIGNMENT and SECOND_LEVEL_LOG2
 	grow(&heap, memory, sizeof memory);
 
 	char *a = allocate(&heap, 256); verify(&heap); memset(a, 1, 256);
@@ -411,7 +1010,7 @@ int main(void) {
 
 	// grow
 
-	static char extra[1024];
+	static _Alignas(ALIGNMENT) char extra[2048];
 	grow(&heap, extra, sizeof extra);
 	char *y = NULL;
 
@@ -465,4 +1064,202 @@ int main(void) {
 	x = reallocate(&heap, x, 0);
 	y = reallocate(&heap, y, 0);
 	verify(&heap);
+	// thread caches
+	{
+		static struct shared_heap shared;
+		initialize_shared(&shared);
+		static _Alignas(ALIGNMENT) char shared_memory[1 << 22];
+		grow_shared(&shared, shared_memory, sizeof shared_memory);
+
+		struct cache_test test = { .shared = &shared };
+		struct cache_test_thread threads[NUM_TEST_THREADS];
+		thrd_t handles[NUM_TEST_THREADS];
+		for (int t = 0; t < NUM_TEST_THREADS; ++t) {
+			threads[t].test = &test;
+			threads[t].seed = (unsigned)t * 7919 + 1;
+			thrd_create(&handles[t], cache_test_thread, &threads[t]);
+		}
+		for (int t = 0; t < NUM_TEST_THREADS; ++t)
+			thrd_join(handles[t], NULL);
+
+		struct thread_cache cache;
+		initialize_cache(&cache, &shared);
+		for (int i = 0; i < MAILBOX_SIZE; ++i) {
+			char *block = atomic_load(&test.mailbox[i]);
+			if (block) {
+				check(block);
+				cached_deallocate(&cache, block);
+			}
+		}
+		flush_cache(&cache);
+		verify(&shared.heap);
+
+		// Everything went back, so the heap has merged back into a single free node.
+		int num_free = 0;
+		for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+			for (int j = 0; j < SECOND_LEVEL_COUNT; ++j) {
+				struct node *list = &shared.heap.freelists[i][j];
+				for (struct node *node = list->next; node != list; node = node->next) {
+					assert((node->size & SIZE_MASK) == sizeof shared_memory - ALIGNMENT);
+					++num_free;
+				}
+			}
+		}
+		assert(num_free == 1);
+		mtx_destroy(&shared.lock);
+	}
+
+	// aligned allocations
+	{
+		struct heap aligned_heap;
+		initialize(&aligned_heap);
+		static _Alignas(ALIGNMENT) char aligned_memory[1 << 16];
+		grow(&aligned_heap, aligned_memory, sizeof aligned_memory);
+
+		char *blocks[64];
+		for (int k = 0; k < 64; ++k) {
+			size_t alignment = (size_t)1 << (k % 10);
+			blocks[k] = aligned_allocate(&aligned_heap, (size_t)k * 7, alignment); verify(&aligned_heap);
+			assert(blocks[k] && (uintptr_t)blocks[k] % alignment == 0);
+			memset(blocks[k], k, (size_t)k * 7);
+		}
+		for (int k = 0; k < 64; k += 2) {
+			assert(equal(blocks[k], (char)k, k * 7));
+			deallocate(&aligned_heap, blocks[k]); verify(&aligned_heap);
+		}
+		for (int k = 0; k < 64; k += 2) {
+			blocks[k] = aligned_allocate(&aligned_heap, 100, 4096); verify(&aligned_heap);
+			if (!blocks[k])
+				break; // only so many 4 KB boundaries
+			assert((uintptr_t)blocks[k] % 4096 == 0);
+			memset(blocks[k], k, 100);
+		}
+		for (int k = 1; k < 64; k += 2)
+			assert(equal(blocks[k], (char)k, k * 7));
+	}
+
+	// statistics and heap walks
+	{
+		struct heap walked;
+		initialize(&walked);
+		static _Alignas(ALIGNMENT) char walked_memory[1 << 16];
+		grow(&walked, walked_memory, sizeof walked_memory);
+
+		struct heap_stats stats;
+		get_heap_stats(&walked, &stats);
+		assert(stats.num_free_blocks == 1 && stats.fragmentation == 0);
+		assert(stats.largest_free_block == stats.free_bytes);
+
+		// free every other block, so the free memory is in lots of small pieces
+		char *blocks[100];
+		for (int k = 0; k < 100; ++k)
+			blocks[k] = site_allocate(&walked, 200);
+		for (int k = 0; k < 100; k += 2)
+			deallocate(&walked, blocks[k]);
+		get_heap_stats(&walked, &stats);
+		assert(stats.num_free_blocks == 51); // and the rest at the end
+		assert(stats.largest_free_block > 200 && stats.largest_free_block < stats.free_bytes);
+		assert(stats.fragmentation > 0);
+
+		size_t binned = 0;
+		for (int i = 0; i < FIRST_LEVEL_COUNT; ++i)
+			for (int j = 0; j < SECOND_LEVEL_COUNT; ++j)
+				binned += stats.free_blocks_per_bin[i][j];
+		assert(binned == stats.num_free_blocks);
+
+		// the walk sees the same free memory as the freelists
+		struct size_histogram histogram = { 0 };
+		walk_heap(walked_memory, sizeof walked_memory, add_to_histogram, &histogram);
+		size_t used_blocks = 0, free_blocks = 0, free_bytes = 0;
+		for (int i = 0; i < FIRST_LEVEL_COUNT; ++i) {
+			used_blocks += histogram.used_blocks[i];
+			free_blocks += histogram.free_blocks[i];
+			free_bytes += histogram.free_bytes[i];
+		}
+		assert(used_blocks == 50 && histogram.used_blocks[floorlog2(needed_size(200) - ALIGNMENT)] == 50);
+		assert(free_blocks == stats.num_free_blocks && free_bytes == stats.free_bytes);
+
+#if TRACK_CALL_SITES
+		int num_sites = 0;
+		for (int i = 0; i < NUM_CALL_SITES; ++i) {
+			struct call_site *site = &walked.sites[i];
+			if (site->file) {
+				++num_sites;
+				assert(site->num_allocations == 100 && !site->num_failures);
+				assert(site->requested_bytes == 100 * 200 && site->size_histogram[floorlog2(200)] == 100);
+			}
+		}
+		assert(num_sites == 1 && walked.num_sites == 1);
+		assert(!site_allocate(&walked, 1 << 20));
+		assert(walked.num_sites == 2);
+#endif
+	}
+
+	// pools from the OS
+	{
+		struct os_heap os;
+		initialize_os_heap(&os, 1 << 20, 2 << 20);
+		static char *blocks[100];
+		for (int k = 0; k < 100; ++k) {
+			blocks[k] = os_allocate(&os, 100 * 1024); verify(&os.heap);
+			assert(blocks[k]);
+			memset(blocks[k], k, 100 * 1024);
+		}
+		assert(os.num_pools >= 10 && os.mapped_bytes >= 100 * 100 * 1024);
+		struct size_histogram pool_histogram = { 0 };
+		walk_os_heap(&os, add_to_histogram, &pool_histogram);
+		assert(pool_histogram.used_blocks[floorlog2(needed_size(100 * 1024) - ALIGNMENT)] == 100);
+
+		// a block bigger than pool_size gets a pool of its own
+		char *big = os_allocate(&os, 5 << 20); verify(&os.heap);
+		assert(big);
+		memset(big, 'b', 5 << 20);
+		big = os_reallocate(&os, big, 9 << 20); verify(&os.heap);
+		assert(equal(big, 'b', 5 << 20));
+		os_deallocate(&os, big); verify(&os.heap);
+
+		for (int k = 0; k < 100; k += 2) {
+			assert(equal(blocks[k], (char)k, 100 * 1024));
+			os_deallocate(&os, blocks[k]); verify(&os.heap);
+		}
+		for (int k = 1; k < 100; k += 2) {
+			assert(equal(blocks[k], (char)k, 100 * 1024));
+			os_deallocate(&os, blocks[k]); verify(&os.heap);
+		}
+		// everything is free, only retain_bytes worth of pools are still mapped
+		assert(os.mapped_bytes <= os.retain_bytes && os.num_pools >= 1);
+
+		// the retained pools get used again, without mapping more
+		size_t mapped = os.mapped_bytes;
+		char *again = os_allocate(&os, 100 * 1024); verify(&os.heap);
+		assert(again && os.mapped_bytes == mapped);
+		memset(again, 'a', 100 * 1024);
+		os_deallocate(&os, again); verify(&os.heap);
+		destroy_os_heap(&os);
+		assert(!os.mapped_bytes && !os.num_pools);
+	}
+
+	// sizes that don't fit in 32 bits, the memory is only reserved, not touched
+	if (sizeof(size_t) == 8) {
+		size_t size = (size_t)6 << 30;
+		char *memory = malloc(size);
+		if (memory) {
+			struct heap big_heap;
+			initialize(&big_heap);
+			grow(&big_heap, memory + (ALIGNMENT - (uintptr_t)memory % ALIGNMENT) % ALIGNMENT, size - ALIGNMENT);
+			char *a = allocate(&big_heap, (size_t)5 << 30); verify(&big_heap);
+			char *b = allocate(&big_heap, (size_t)512 << 20); verify(&big_heap);
+			char *c = allocate(&big_heap, (size_t)1 << 30); verify(&big_heap);
+			assert(a && b && !c);
+			assert(b - a >= ((ptrdiff_t)5 << 30));
+			a[((size_t)5 << 30) - 1] = 'a';
+			b[0] = 'b';
+			deallocate(&big_heap, a); verify(&big_heap);
+			c = allocate(&big_heap, (size_t)1 << 30); verify(&big_heap);
+			assert(c == a);
+			deallocate(&big_heap, b); verify(&big_heap);
+			deallocate(&big_heap, c); verify(&big_heap);
+			free(memory);
+		}
+	}
 }